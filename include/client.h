@@ -3,6 +3,10 @@
 
 #include "queue.h"
 #include "types.h"
+#include "user.h"
+#include "response_map.h"
+#include "scheduler.h"
+#include "wire.h"
 
 typedef struct {
 	int socket_fd;
@@ -10,7 +14,43 @@ typedef struct {
 	Queue *client_queue; // queue of ClientInfo pointers
 } ClientThreadArg;
 
+typedef enum {
+	PARSE_TASK,    // a task was created and must be queued
+	PARSE_QUIT,    // client asked to close the connection
+	PARSE_IGNORED, // unknown command, nothing to do
+	PARSE_NOMEM,   // task allocation failed
+	PARSE_INVALID  // arguments (or a frame's fields) that don't fit the command
+} ParseResult;
+
 void *client_thread_main(void *arg);
 
+// Parse one protocol line into a newly allocated Task
+Task *client_parse_command(const char *line, ClientInfo client, ParseResult *result);
+
+// Parse one binary request frame into a newly allocated Task
+Task *client_parse_frame(const WireRequest *req, ClientInfo client, ParseResult *result);
+
+// Hand bytes buffered past a data-phase command over to the worker, which
+// reads them before the socket. Sets *taken to how many belong to the
+// command's data; false if out of memory.
+bool client_stash_data(ResponseQueueEntry *entry, const Task *task,
+                       const char *buf, size_t avail, size_t *taken);
+
+// Admission control, run before a parsed task is queued. Uploads reserve
+// their declared size against the user's quota here, so an over-quota
+// upload is refused before any of its data is sent. On false, err holds the
+// reply and the task must be dropped.
+bool client_admit_task(UserStore *store, Task *task, char *err, size_t errlen);
+
+// Undo client_admit_task() for a task that will never run
+void client_release_task(UserStore *store, Task *task);
+
+// Queue an admitted task for the workers. Unless it returns SCHED_QUEUED,
+// err holds the reply ("busy retry_after=<ms>" when the queue is
+// saturated), the task's reservation has been released and the caller
+// must drop it.
+SchedSubmit client_submit_task(UserStore *store, Scheduler *sched, Task *task,
+                               char *err, size_t errlen);
+
 #endif
 
@@ -0,0 +1,21 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Self-contained compressor producing the LZ4 block format: a greedy
+// single-pass matcher, fast enough to run inline on the upload path.
+
+// Worst-case compressed size for n input bytes
+#define LZ4_COMPRESS_BOUND(n) ((n) + (n) / 255 + 16)
+
+// Compress n bytes of src into dst. Returns the compressed size, or 0 when
+// the result would not fit in cap (callers then store the data raw).
+size_t lz4_compress(const unsigned char *src, size_t n, unsigned char *dst, size_t cap);
+
+// Decompress one block. Returns the decompressed size, or -1 if the input is
+// malformed or would overflow cap.
+ssize_t lz4_decompress(const unsigned char *src, size_t n, unsigned char *dst, size_t cap);
+
+#endif // COMPRESS_H
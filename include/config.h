@@ -2,6 +2,8 @@
 #define CONFIG_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include "priority.h"
 
 // Initialize configuration from file
 void config_init(const char *config_file);
@@ -15,4 +17,63 @@ const char *config_get_storage_path(void);
 // Get the database filename for persistent storage
 const char *config_get_database_file(void);
 
+// Check if connections should be served by the epoll reactor instead of
+// the blocking one-client-per-thread pool
+bool config_use_reactor(void);
+
+// Get the number of reactor I/O threads (only used in reactor mode)
+int config_get_io_threads(void);
+
+// Get the runtime log level (one of the LOG_LEVEL_* values in log.h)
+int config_get_log_level(void);
+
+// Get the codec new uploads are stored with (a CodecId from crypto.h).
+// Existing files keep the codec recorded in their header.
+int config_get_file_codec(void);
+
+// Check if new uploads are compressed (LZ4 chunks) before the codec runs
+bool config_compress_files(void);
+
+// Get the storage quota given to new users, in bytes
+size_t config_get_user_quota_bytes(void);
+
+// Get the number of worker threads
+int config_get_worker_threads(void);
+
+// Get how many requests a pipelined connection may have in flight
+// (capped at PIPELINE_MAX_DEPTH)
+int config_get_pipeline_depth(void);
+
+// Get how long a queued task waits before it is promoted one priority
+// level (0 disables aging)
+unsigned config_get_queue_aging_ms(void);
+
+// Get how many tasks of a priority level may be queued (0: unbounded)
+unsigned config_get_queue_capacity(TaskPriority priority);
+
+// Get the queue wait above which admission control starts shedding load
+// (0 disables the adaptive limit)
+unsigned config_get_queue_target_ms(void);
+
+// Get how long waits must stay above the target before the adaptive limit
+// is cut, and how often it may change
+unsigned config_get_queue_interval_ms(void);
+
+// Get how many bytes each user may take per round within a priority level
+size_t config_get_queue_quantum_bytes(void);
+
+// Get how many users may have a fair-share flow of their own at once
+unsigned config_get_queue_max_user_flows(void);
+
+// Get how long a request may wait for a worker before it is answered with
+// "Request timed out" and dropped (0: no deadline)
+unsigned config_get_request_timeout_ms(void);
+
+// Get the file metrics are written to in the Prometheus text format
+// ("" disables the dump)
+const char *config_get_metrics_file(void);
+
+// Get how often the metrics file is rewritten (0 disables the dump)
+unsigned config_get_metrics_interval_ms(void);
+
 #endif // CONFIG_H
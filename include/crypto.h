@@ -2,6 +2,58 @@
 #define CRYPTO_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// At-rest codecs. The numeric ids are stored in file headers; never reuse one.
+typedef enum {
+    CODEC_NONE = 0,         // stored as-is
+    CODEC_XOR = 1,          // legacy fixed-key XOR
+    CODEC_CHACHA20 = 2      // ChaCha20 (RFC 8439) with a per-file nonce
+} CodecId;
+
+#define CODEC_NONCE_LEN 12
+#define CODEC_KEY_LEN 32
+
+// Per-file codec parameters, as recorded in the file header
+typedef struct {
+    CodecId id;
+    unsigned char nonce[CODEC_NONCE_LEN];
+} CodecParams;
+
+// Stored files were historically encoded in independent 8 KiB chunks, so the
+// XOR key restarts every CRYPTO_XOR_BLOCK bytes of the file. The in-place API
+// follows the same layout for any chunk size the caller uses.
+#define CRYPTO_XOR_BLOCK 8192
+
+// Load the server's 256-bit ChaCha20 key from key_path, creating it with
+// fresh random bytes (mode 0600) on first start.
+bool crypto_load_key(const char *key_path, char *err, size_t errlen);
+
+// Map a config name ("none", "xor", "chacha20") to a codec id; -1 if unknown
+int codec_from_name(const char *name);
+
+// Config name of a codec, or NULL for ids this build doesn't know
+const char *codec_name(int id);
+
+// Prepare parameters for a new file: picks a random nonce when the codec
+// needs one. Fails if the codec needs the key and none is loaded.
+bool codec_init(CodecParams *params, CodecId id, char *err, size_t errlen);
+
+// Encode or decode len bytes in place; every codec is a stream cipher, so
+// both directions are the same operation. offset is the position of buf[0]
+// in the file data, so a file can be processed (or read back from any
+// point) in chunks of any size.
+void codec_apply(const CodecParams *params, unsigned char *buf, size_t len, uint64_t offset);
+
+// Encode len bytes in place with the legacy XOR codec; see codec_apply
+void encode_in_place(unsigned char *buf, size_t len, size_t offset);
+
+// Decode len bytes in place; see encode_in_place
+void decode_in_place(unsigned char *buf, size_t len, size_t offset);
+
+// Name of the SIMD kernels picked for this CPU ("avx2", "sse2" or "scalar")
+const char *crypto_kernel_name(void);
 
 // Encode data - returns newly allocated buffer that must be freed by caller
 unsigned char *encode_data(const unsigned char *data, size_t len, size_t *out_len);
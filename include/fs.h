@@ -3,13 +3,143 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
 #include "user.h"
+#include "crypto.h"
 
-bool fs_upload(UserStore *store, const char *user, const char *dst_relpath, const char *tmp_src, size_t size, char *err, size_t errlen);
-bool fs_download_path(UserStore *store, const char *user, const char *relpath, char *out_path, size_t out_len, char *err, size_t errlen);
-bool fs_delete(UserStore *store, const char *user, const char *relpath, char *err, size_t errlen);
-// Writes listing into buffer separated by \n
-bool fs_list(UserStore *store, const char *user, char *buf, size_t buflen, char *err, size_t errlen);
+// Size of the bounded buffer used to stream file data
+#define FS_IO_CHUNK 65536
+
+// Source of upload data: returns bytes read, 0 on EOF, -1 on error
+typedef ssize_t (*FsReadFn)(void *ctx, void *buf, size_t len);
+
+// An upload that has been received but is not visible yet
+typedef struct {
+    char tmp_path[560];
+    char dst_path[512];
+} FsPendingUpload;
+
+// Store exactly size bytes pulled from read_fn in a hidden file of its own
+// next to dst_relpath. Uploads of the same path never share a temp file, so
+// nothing needs to be locked while the data arrives; fs_upload_commit then
+// moves the file into place.
+bool fs_upload(UserStore *store, const char *user, const char *dst_relpath, size_t size,
+               FsReadFn read_fn, void *read_ctx, FsPendingUpload *up, char *err, size_t errlen);
+// Replace the destination with a received upload. *replaced gets the size
+// of the file it overwrote (0 if there was none). The temp file is removed
+// if this fails.
+bool fs_upload_commit(FsPendingUpload *up, uint64_t *replaced, char *err, size_t errlen);
+
+// Resumable uploads. A session is started with the file's total size and
+// filled in parts; the committed offset is kept on disk, so it survives
+// dropped connections and restarts. Data is committed in whole chunks: a
+// part that stops mid-chunk (other than at the end of the file) commits up
+// to the last chunk boundary, and the client resends from there.
+#define FS_UPLOAD_ID_LEN 16
+
+typedef struct {
+    uint64_t committed; // bytes stored so far; the next part starts here
+    uint64_t size;      // total file size
+    uint64_t replaced;  // once finished: size of the file it overwrote
+    char relpath[256];  // where the file goes
+} FsUploadState;
+
+bool fs_upload_start(UserStore *store, const char *user, const char *dst_relpath, size_t size,
+                     char id[FS_UPLOAD_ID_LEN + 1], char *err, size_t errlen);
+bool fs_upload_status(UserStore *store, const char *user, const char *id,
+                      FsUploadState *state, char *err, size_t errlen);
+// Store length bytes pulled from read_fn at offset, which must be the
+// committed offset. Parts of one session are serialized by a lock on its
+// state file, so two connections can't interleave their chunks.
+bool fs_upload_resume(UserStore *store, const char *user, const char *id, size_t offset, size_t length,
+                      FsReadFn read_fn, void *read_ctx, FsUploadState *state, char *err, size_t errlen);
+// Move a complete session's file to state->relpath and end the session
+bool fs_upload_finish(UserStore *store, const char *user, const char *id,
+                      FsUploadState *state, char *err, size_t errlen);
+// End a session without storing its file; *size gets the size it was
+// started with
+bool fs_upload_abort(UserStore *store, const char *user, const char *id, uint64_t *size,
+                     char *err, size_t errlen);
+
+// A stored file being streamed back to a client
+typedef struct {
+    int fd;
+    CodecParams codec;  // from the file header, or legacy XOR
+    off_t data_offset;  // where file data starts in fd (after the header)
+    size_t size;        // plaintext length of the file
+    size_t offset;      // bytes already returned by fs_download_read
+    bool identity;      // stored as-is: the data can be sent with sendfile
+    // Compressed files only: the chunk index and decode buffers
+    bool compressed;
+    size_t chunk_size;      // plaintext bytes per chunk (the last may be short)
+    size_t nchunks;
+    uint64_t *chunk_off;    // offset of each stored chunk within the data
+    uint32_t *chunk_len;    // stored length, FS_CHUNK_RAW if not compressed
+    unsigned char *stored;  // one chunk as read from disk
+    unsigned char *plain;   // one decompressed chunk
+    size_t plain_chunk;     // which chunk plain holds, SIZE_MAX if none
+} FsDownload;
+
+// Chunk index flag: the chunk didn't shrink and is stored uncompressed
+#define FS_CHUNK_RAW 0x80000000u
+
+bool fs_download_open(UserStore *store, const char *user, const char *relpath,
+                      FsDownload *dl, char *err, size_t errlen);
+// Read and decode up to len next bytes of the file into buf. Returns bytes
+// produced (compressed files stop at a chunk boundary), 0 at end of file,
+// -1 on error.
+ssize_t fs_download_read(FsDownload *dl, void *buf, size_t len);
+// Make the next fs_download_read start at offset (at most dl->size). Only
+// the chunk holding offset is decoded, not the data before it.
+bool fs_download_seek(FsDownload *dl, size_t offset);
+void fs_download_close(FsDownload *dl);
+// *freed gets the size of the deleted file
+bool fs_delete(UserStore *store, const char *user, const char *relpath, uint64_t *freed,
+               char *err, size_t errlen);
+
+// Columns a listing can add after each file name, in this order
+#define FS_LIST_SIZE  0x1   // plaintext size in bytes
+#define FS_LIST_MTIME 0x2   // last modification, seconds since the epoch
+#define FS_LIST_CODEC 0x4   // "<codec> <compression> <ratio>", e.g. "chacha20 lz4 3.52x"
+// Columns of a LIST that doesn't ask for any
+#define FS_LIST_DEFAULT (FS_LIST_SIZE | FS_LIST_CODEC)
+// Longest listing line: a name and every column
+#define FS_LIST_LINE_MAX 384
+// Bytes of directory entries read per getdents64 call
+#define FS_LIST_BATCH 32768
+
+// Parse a comma-separated column list such as "size,mtime"; "name" asks
+// for names only. False if a column is unknown.
+bool fs_list_parse_fields(const char *spec, unsigned *fields);
+
+// A user's directory being listed. Entries are read straight from the
+// kernel in getdents64 batches and formatted as they go, so memory stays
+// the same however many files there are. size and codec open each file to
+// read its header, mtime stats it; names alone touch only the directory.
+typedef struct {
+    int fd;                 // the directory
+    unsigned fields;        // FS_LIST_* columns
+    uint64_t cursor;        // resumes the listing after the last entry read
+    size_t pos, len;        // unread entries in batch
+    bool eof;
+    unsigned char batch[FS_LIST_BATCH];
+} FsList;
+
+// Start listing user's files after cursor, 0 for the beginning. A cursor
+// is the directory offset of an entry from an earlier listing: later pages
+// carry on from there without rescanning, and files added or removed in
+// between don't make a page repeat or skip the others.
+bool fs_list_open(UserStore *store, const char *user, uint64_t cursor, unsigned fields,
+                  FsList *ls, char *err, size_t errlen);
+// Write up to max entries into buf, one line each ("name[ columns]\n");
+// a line is never split, and buf must have room for FS_LIST_LINE_MAX.
+// Returns bytes written, 0 once the directory is exhausted (or max is 0),
+// -1 on error. *count gets the number of entries.
+ssize_t fs_list_read(FsList *ls, char *buf, size_t len, size_t max, size_t *count);
+// Set *more if entries are left after the ones read so far; false on error
+bool fs_list_more(FsList *ls, bool *more);
+void fs_list_close(FsList *ls);
 
 #endif
 
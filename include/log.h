@@ -0,0 +1,67 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdatomic.h>
+
+// Log levels, lowest (most verbose) first
+#define LOG_LEVEL_TRACE 0
+#define LOG_LEVEL_DEBUG 1
+#define LOG_LEVEL_INFO  2
+#define LOG_LEVEL_WARN  3
+#define LOG_LEVEL_ERROR 4
+#define LOG_LEVEL_OFF   5
+
+// Call sites below this level are removed by the preprocessor. Release
+// builds of the server pass -DLOG_COMPILE_LEVEL=LOG_LEVEL_DEBUG so trace
+// logging on the queue and worker hot paths costs nothing at all.
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_TRACE
+#endif
+
+// Current runtime threshold; read on every call site that survived compilation
+extern atomic_int log_runtime_level;
+
+// Start the background flusher. Messages logged before this (or after
+// log_shutdown) are written synchronously.
+void log_init(int level);
+
+// Flush everything still buffered, stop the flusher and free the rings
+void log_shutdown(void);
+
+void log_set_level(int level);
+
+// Parse "trace", "debug", "info", "warn", "error" or "off"; -1 if unknown
+int log_level_from_string(const char *name);
+
+// Format a record into the calling thread's ring buffer. Never blocks: when
+// the ring is full the record is dropped and counted.
+void log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#define LOG_AT(level, ...) \
+    do { \
+        if ((level) >= atomic_load_explicit(&log_runtime_level, memory_order_relaxed)) \
+            log_write((level), __VA_ARGS__); \
+    } while (0)
+
+#if LOG_COMPILE_LEVEL <= LOG_LEVEL_TRACE
+#define LOG_TRACE(...) LOG_AT(LOG_LEVEL_TRACE, __VA_ARGS__)
+#else
+#define LOG_TRACE(...) ((void)0)
+#endif
+
+#if LOG_COMPILE_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) ((void)0)
+#endif
+
+#if LOG_COMPILE_LEVEL <= LOG_LEVEL_INFO
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) ((void)0)
+#endif
+
+#define LOG_WARN(...)  LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+#endif // LOG_H
@@ -0,0 +1,74 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "types.h"
+
+// In-process metrics registry. Each thread that records gets its own shard
+// of counters and histograms, written only by that thread with relaxed
+// atomics, so recording takes no lock and shares no cache line; readers
+// sum the shards. Histograms are log-linear, as HdrHistogram: 16 buckets
+// per power of two of microseconds, so a bucket is at most 1/16 as wide as
+// the values in it.
+
+typedef enum {
+    METRIC_UPLOAD_BYTES,     // file data received
+    METRIC_DOWNLOAD_BYTES,   // file data sent
+    METRIC_WORKER_BUSY_NS,   // time workers spent running tasks
+    METRIC_TASKS_DROPPED,    // cancelled or expired before they ran
+    METRIC_COUNTER_COUNT // Keep this last
+} MetricCounter;
+
+typedef enum {
+    METRIC_QUEUE_WAIT,       // from submit until a worker takes the task
+    METRIC_SERVICE,          // worker time, one histogram per CommandType
+    METRIC_HISTOGRAM_COUNT = METRIC_SERVICE + CMD_COUNT
+} MetricHistogram;
+
+// Growable text buffer the exposition is rendered into
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+    bool failed;             // an allocation failed; the text is incomplete
+} MetricsText;
+
+// Appends more series to a rendering (gauges read from other modules)
+typedef void (*MetricsCollect)(void *ctx, MetricsText *out);
+
+// Add n to a counter of the calling thread's shard
+void metrics_add(MetricCounter counter, uint64_t n);
+
+// Record a duration in nanoseconds
+void metrics_observe(MetricHistogram hist, uint64_t ns);
+
+// Register a collector run on every rendering. file_only collectors are
+// left out of the STATS reply (per-user series, say) and only go to the
+// metrics file. Returns false if the registry is full.
+bool metrics_add_collector(MetricsCollect collect, void *ctx, bool file_only);
+
+void metrics_text_init(MetricsText *text);
+void metrics_text_free(MetricsText *text);
+void metrics_printf(MetricsText *text, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// Append value as a quoted label value, escaped as the text format requires
+void metrics_print_label(MetricsText *text, const char *value);
+
+// Render every metric in the Prometheus text format; with file set, the
+// file_only collectors too. Returns false if memory ran out.
+bool metrics_render(MetricsText *out, bool file);
+
+// Rewrite path with a fresh rendering every interval_ms from a background
+// thread. The file is replaced atomically, so a scraper never reads half of it.
+bool metrics_start_dump(const char *path, unsigned interval_ms);
+
+// Write one last rendering and stop the dump thread. Collectors must still
+// be valid until this returns.
+void metrics_stop_dump(void);
+
+// Free every shard; no thread may record afterwards
+void metrics_shutdown(void);
+
+#endif // METRICS_H
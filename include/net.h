@@ -0,0 +1,43 @@
+#ifndef NET_H
+#define NET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// How long a worker waits for a stalled peer during a data phase
+#define NET_IO_TIMEOUT_MS 30000
+
+// Input buffer of a connection served by a client thread
+#define NET_READER_SIZE 4096
+
+// Buffered reader for a blocking socket. Each refill is one read() of as
+// much as the peer has sent, and requests are parsed in place from buf.
+typedef struct {
+    int fd;
+    size_t start;   // first unconsumed byte
+    size_t end;     // end of buffered data
+    bool eof;
+    char buf[NET_READER_SIZE + 1]; // one spare byte to terminate a line
+} NetReader;
+
+void net_reader_init(NetReader *r, int fd);
+
+// Read more data behind what is buffered, moving it to the front first.
+// False on EOF or error (eof is set) or when the buffer is full.
+bool net_reader_fill(NetReader *r);
+
+// Write the whole buffer to a socket. Works on blocking and non-blocking
+// (reactor-owned) sockets alike by waiting for POLLOUT on EAGAIN.
+bool net_write_all(int fd, const void *buf, size_t len);
+
+// Send len bytes of in_fd, starting at *offset, with sendfile(2) so the
+// data goes from the page cache to the socket without a user-space copy.
+// *offset is advanced past everything sent.
+bool net_sendfile(int fd, int in_fd, off_t *offset, size_t len);
+
+// Read up to len bytes, waiting up to timeout_ms for data on non-blocking
+// sockets. Returns bytes read, 0 on EOF and -1 on error or timeout.
+ssize_t net_read(int fd, void *buf, size_t len, int timeout_ms);
+
+#endif // NET_H
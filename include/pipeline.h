@@ -0,0 +1,87 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "types.h"
+
+// Most requests one pipelined connection may have in flight
+#define PIPELINE_MAX_DEPTH 64
+
+// Per-connection request accounting, shared by the reactor and the
+// threaded client loop. A fresh connection speaks the classic protocol:
+// one request at a time, untagged replies. After `PIPELINE` every request
+// line starts with a numeric id, up to depth requests run at once, and each
+// reply line is prefixed with its request's id. Replies leave in request
+// order when ordered, otherwise as they complete.
+//
+// Commands with a data phase (UPLOAD, UPLOAD_RESUME, DOWNLOAD) have the
+// worker use the socket directly, so they run alone: they wait for every
+// earlier reply to be written, and nothing else starts until they finish.
+typedef struct {
+    bool tagged;            // PIPELINE was given
+    bool ordered;
+    bool streaming;         // a data-phase request owns the socket
+    bool binary;            // BINARY was given: requests and replies are frames
+    unsigned depth;
+    unsigned inflight;      // requests whose reply hasn't been taken yet
+    uint64_t next_seq;      // given to the next request
+    uint64_t next_reply;    // ordered: seq of the next reply to take
+    // Completed replies not taken yet. Ordered: slot seq % PIPELINE_MAX_DEPTH;
+    // unordered: a FIFO starting at held_head.
+    Response *held[PIPELINE_MAX_DEPTH];
+    size_t held_head;
+    size_t held_count;
+} Pipeline;
+
+// Classic protocol: depth 1, untagged, in order
+void pipeline_init(Pipeline *p);
+
+// Free replies that were never taken
+void pipeline_clear(Pipeline *p);
+
+// Recognize `PIPELINE [ordered|unordered]` (unordered by default)
+bool pipeline_is_command(const char *line, bool *ordered);
+
+// Switch to tagged mode with up to depth requests in flight. Only allowed
+// once, with nothing in flight; on false, err holds the reply.
+bool pipeline_enable(Pipeline *p, bool ordered, unsigned depth, char *err, size_t errlen);
+
+// Answer BINARY with `OK binary <version>`, still in text, and switch to
+// the binary protocol, keeping the pipeline's depth and order. Only allowed
+// with nothing in flight; on false, err holds the reply.
+bool pipeline_set_binary(Pipeline *p, const char *tag, char *err, size_t errlen);
+
+// Room for another request (of any kind)
+bool pipeline_has_room(const Pipeline *p);
+
+// True if task can start now: data-phase commands also need every earlier
+// request answered
+bool pipeline_can_start(const Pipeline *p, const Task *task);
+
+// Split a tagged line into its tag ("<id> ") and the command after it
+bool pipeline_split_tag(const char *line, char tag[REQUEST_TAG_LEN], const char **command);
+
+// Account for a request about to be handed to the workers
+void pipeline_submit(Pipeline *p, Task *task, const char *tag);
+
+// Queue a reply the connection produces itself (a parse or admission
+// error), behind earlier replies when ordered. False if out of memory.
+bool pipeline_reply(Pipeline *p, const char *tag, ResponseStatus status, const char *msg);
+
+// Answer a submitted task that never reached a worker (refused by the
+// scheduler) with an error. False if out of memory.
+bool pipeline_refuse(Pipeline *p, const Task *task, const char *msg);
+
+// A worker's reply arrived
+void pipeline_complete(Pipeline *p, Response *r);
+
+// Next reply to write, or NULL; the caller frees it
+Response *pipeline_next(Pipeline *p);
+
+// Format r as it goes on the wire: a text line or a frame. RESP_SENT
+// replies were already written by the worker and format to nothing.
+size_t pipeline_format(const Response *r, char *buf, size_t len);
+
+#endif // PIPELINE_H
@@ -0,0 +1,38 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// Fixed-size object pools for the request path. Every thread allocates
+// from its own slab cache without locks. An object freed by another thread
+// is pushed onto its owner's lock-free remote list, which the owner takes
+// back in one exchange when its local list runs dry. A cache outlives its
+// thread and is adopted by the next thread that needs one.
+//
+// Building with -DPOOL_USE_MALLOC turns pools into plain calloc/free, so
+// Valgrind and ASan see every object.
+typedef struct Pool Pool;
+
+Pool *pool_create(const char *name, size_t obj_size);
+
+// Log the pool's hit rate and footprint, then free it. Every thread that
+// used it must have stopped, and no object may still be in use.
+void pool_destroy(Pool *pool);
+
+// A zeroed object, or NULL when out of memory
+void *pool_alloc(Pool *pool);
+
+// Return obj (NULL is ignored); any thread may free any object
+void pool_free(Pool *pool, void *obj);
+
+// Pools for Task, Response and ClientInfo, created by pools_init() before
+// any server thread starts and destroyed after they have all exited
+extern Pool *g_task_pool;
+extern Pool *g_response_pool;
+extern Pool *g_client_info_pool;
+
+bool pools_init(void);
+void pools_destroy(void);
+
+#endif // POOL_H
@@ -3,47 +3,151 @@
 
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include "types.h"
 
-// Priority queue node
+// Longest flow key (a user name) kept, terminator included
+#define QUEUE_FLOW_KEY_LEN 64
+// Bytes a flow may take per round unless queue_set_quantum() says otherwise
+#define QUEUE_DEFAULT_QUANTUM (64 * 1024)
+// Keyed flows that may exist at once unless queue_set_max_flows() says otherwise
+#define QUEUE_DEFAULT_MAX_FLOWS 4096
+
+// Queued item, the monotonic time it was pushed (for aging and admission
+// control) and its cost in bytes (for fairness)
 typedef struct {
     void *data;
-    TaskPriority priority;
+    uint64_t enqueued_ns;
+    size_t cost;
 } PriorityItem;
 
+// FIFO ring of items
+typedef struct {
+    PriorityItem *items;
+    size_t head;         // Index of the oldest item
+    size_t count;
+    size_t capacity;     // Zero or a power of two
+} PriorityRing;
+
+// One sender's items within a priority level. Flows take turns by deficit
+// round robin: each round a flow may take up to a quantum of bytes. A keyed
+// flow exists only while it has items queued or owes bytes.
+typedef struct QueueFlow {
+    char key[QUEUE_FLOW_KEY_LEN];  // "" for items pushed without a key
+    TaskPriority priority;
+    PriorityRing ring;
+    int64_t deficit;     // Bytes left this round; negative after a large item
+    int state;           // Idle, or on the level's new or old list
+    struct QueueFlow *next;       // On that list
+    struct QueueFlow *hash_next;
+    uint64_t served;     // Items taken out
+    uint64_t served_bytes;
+} QueueFlow;
+
+typedef struct {
+    QueueFlow *head;
+    QueueFlow *tail;
+} FlowList;
+
+// A priority level. Flows that just became active wait on new_flows and
+// go before the old ones, so a sender with a request or two is not queued
+// behind one with a backlog (as in fq_codel).
+typedef struct {
+    QueueFlow shared;    // Items pushed without a flow key
+    FlowList new_flows;
+    FlowList old_flows;
+    size_t active;       // Flows on either list
+    size_t count;        // Items across the level's flows
+    size_t limit;        // Most items the level may hold; 0: unbounded
+} PriorityLevel;
+
 typedef struct Queue {
-    PriorityItem *items;  // Array to store heap elements
-    size_t size;         // Current number of elements
-    size_t capacity;     // Maximum capacity of the queue
+    PriorityLevel levels[PRIORITY_COUNT];
+    QueueFlow **buckets; // Keyed flows, by key and level
+    size_t nbuckets;     // Zero or a power of two
+    size_t nflows;
+    size_t max_flows;
+    size_t quantum;
+    size_t size;         // Items across all levels
+    uint64_t aging_ns;   // Wait that raises an item one level; 0 disables aging
     bool closed;
     pthread_mutex_t mutex;
     pthread_cond_t not_empty;
 } Queue;
 
-typedef struct ResponseQueueEntry {
-	int client_id;
-	Queue queue;
-	pthread_mutex_t mutex;
-	pthread_cond_t response_available;
-} ResponseQueueEntry;
+// Per-flow counters, from queue_flow_stats()
+typedef struct {
+    char key[QUEUE_FLOW_KEY_LEN];
+    TaskPriority priority;
+    size_t queued;
+    uint64_t served;
+    uint64_t served_bytes;
+} QueueFlowStats;
 
-// Initialize a priority queue
+// Initialize a priority queue (aging disabled)
 void queue_init(Queue *q);
 
+// Let waiting items climb one priority level per aging_ms waited, so LOW
+// tasks are not starved by a steady stream of HIGH ones. 0 disables aging.
+void queue_set_aging(Queue *q, unsigned aging_ms);
+
+// Bytes each flow may take per round (QUEUE_DEFAULT_QUANTUM by default)
+void queue_set_quantum(Queue *q, size_t quantum);
+
+// Most keyed flows at once (QUEUE_DEFAULT_MAX_FLOWS by default); items for
+// further keys go to their level's shared flow
+void queue_set_max_flows(Queue *q, size_t max_flows);
+
+// Cap how many items each priority level holds (0: unbounded, the
+// default). A push to a full level is refused with QUEUE_FULL.
+void queue_set_limits(Queue *q, const unsigned limits[PRIORITY_COUNT]);
+
 // Close the queue (no more items can be added)
 void queue_close(Queue *q);
 
 // Destroy the queue and free resources
 void queue_destroy(Queue *q);
 
+typedef enum {
+    QUEUE_PUSHED,
+    QUEUE_FULL,      // the level, or the whole queue, is at its limit
+    QUEUE_CLOSED     // closed, or out of memory
+} QueuePush;
+
 // Push an item with priority into the queue
 // Returns true on success, false on failure
 bool queue_push(Queue *q, void *item, TaskPriority priority);
 
-// Pop the highest priority item from the queue
+// Push unless the item's level is full or the queue already holds max_size
+// items (0: no overall limit). The item joins the flow named key within its
+// level (NULL, or no room for another flow: the level's shared flow) and
+// costs cost bytes of its turn.
+QueuePush queue_push_bounded(Queue *q, void *item, TaskPriority priority, size_t max_size,
+                             const char *key, size_t cost);
+
+// Adjust a flow's cost once an item's real size is known, e.g. a download
+// of a whole file. extra may be negative. key is the one the item was
+// pushed with; a flow that went away meanwhile is brought back to owe it.
+void queue_charge(Queue *q, TaskPriority priority, const char *key, int64_t extra);
+
+// Pop the highest priority item from the queue. Within a level flows take
+// turns by deficit round robin, FIFO within a flow.
 // Returns NULL if queue is closed and empty
 void *queue_pop(Queue *q);
 
+// Pop up to max items in priority order without blocking, but no more
+// than a 1/shares share of what is queued (always at least one when the
+// queue isn't empty). Returns how many were stored in items.
+size_t queue_try_pop_batch(Queue *q, void **items, size_t max, unsigned shares);
+
+// Monotonic time the longest-waiting of the items each level would hand
+// out next was pushed; 0 if empty
+uint64_t queue_oldest_ns(Queue *q);
+
+// Copy up to max flows' counters into out, keyed flows only. Returns how
+// many flows there are. Counters start over when a flow is freed.
+size_t queue_flow_stats(Queue *q, QueueFlowStats *out, size_t max);
+
 // Get the current size of the queue
 unsigned queue_size(Queue *q);
 
@@ -52,4 +156,3 @@ unsigned queue_size(Queue *q);
 void *queue_peek(Queue *q);
 
 #endif
-
@@ -0,0 +1,23 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "response_map.h"
+#include "types.h"
+
+struct ServerState;
+
+// Opaque epoll connection engine: a few I/O threads multiplex every client
+// socket and feed parsed commands into the server's task scheduler.
+typedef struct Reactor Reactor;
+
+// Start io_threads epoll loops for the given server
+Reactor *reactor_create(struct ServerState *server, int io_threads);
+
+// Hand an accepted socket to one of the I/O threads. The client's response
+// queue entry must already be registered in the server's response map.
+bool reactor_add_client(Reactor *reactor, int fd, int client_id, ResponseQueueEntry *entry);
+
+// Stop all I/O threads, close their connections and free the reactor
+void reactor_destroy(Reactor *reactor);
+
+#endif // REACTOR_H
@@ -0,0 +1,74 @@
+#ifndef RESPONSE_MAP_H
+#define RESPONSE_MAP_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "queue.h"
+
+// Per-client response channel. Entries are reference counted: the map owns
+// one reference and every response_map_get() adds one, so a worker that
+// looked an entry up can keep using it after the client deregisters.
+typedef struct ResponseQueueEntry {
+	int client_id;
+	Queue queue;
+	pthread_mutex_t mutex;
+	pthread_cond_t response_available;
+	// Optional completion hook, called with mutex held after a response is
+	// queued. Used by the reactor to wake the I/O thread owning the client.
+	void (*notify)(void *ctx, int client_id);
+	void *notify_ctx;
+	// Bytes the connection had already read past an UPLOAD command line.
+	// Handed to the worker, which consumes them before reading the socket.
+	unsigned char *stash;
+	size_t stash_len;
+	size_t stash_off;
+	// Cancellation token for the connection's tasks: requests with a lower
+	// seq were abandoned, all of them once the client is gone (UINT64_MAX)
+	_Atomic uint64_t cancel_before;
+	atomic_int refs;
+	struct ResponseQueueEntry *next; // bucket chain
+} ResponseQueueEntry;
+
+// Sharded hash map from client_id to ResponseQueueEntry. Each shard has its
+// own lock, so lookups for different clients rarely contend.
+typedef struct ResponseMap ResponseMap;
+
+ResponseMap *response_map_create(void);
+
+// Free the map and every entry still registered in it
+void response_map_destroy(ResponseMap *map);
+
+// Create and register a channel for client_id. The returned pointer is
+// borrowed from the map's reference and stays valid until the caller
+// removes the client with response_map_remove().
+ResponseQueueEntry *response_map_register(ResponseMap *map, int client_id);
+
+// Find a client's channel and take a reference on it; NULL if not registered.
+// Every successful lookup must be paired with response_map_put().
+ResponseQueueEntry *response_map_get(ResponseMap *map, int client_id);
+
+// Take another reference on an entry the caller already holds
+ResponseQueueEntry *response_map_ref(ResponseQueueEntry *entry);
+
+// Drop a reference taken by response_map_get() or response_map_ref()
+void response_map_put(ResponseQueueEntry *entry);
+
+// Abandon the client's requests with a seq below before; workers skip
+// them. Never moves backwards.
+void response_map_cancel(ResponseQueueEntry *entry, uint64_t before);
+
+// True if the request numbered seq was abandoned
+bool response_map_cancelled(ResponseQueueEntry *entry, uint64_t seq);
+
+// Unregister a client: cancel its requests, close its queue, wake any
+// waiter and drop the map's reference. Returns false if the client was not
+// registered.
+bool response_map_remove(ResponseMap *map, int client_id);
+
+// Number of registered clients
+size_t response_map_size(ResponseMap *map);
+
+#endif // RESPONSE_MAP_H
@@ -0,0 +1,83 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdbool.h>
+#include "types.h"
+#include "queue.h"
+
+// Work-stealing task scheduler. Client threads and the reactor submit
+// tasks to a shared injection queue: priority levels with aging, and
+// within a level deficit round robin across users, so one user's backlog
+// doesn't hold up everyone else's requests. A task costs its data bytes
+// plus SCHED_REQUEST_COST, so one large upload weighs as much as many small
+// requests. Each worker owns a small deque: when it runs dry it moves a
+// share of the injection queue into it in priority order, and an idle
+// worker steals from a random victim's deque before parking. Workers sleep
+// on one condition variable and each submit wakes at most one of them.
+//
+// Admission control bounds the injection queue: each priority level has a
+// fixed capacity, and an adaptive limit on the whole queue follows the
+// time tasks wait (as CoDel does). While waits stay above the target the
+// limit is cut to half the queue once per interval; the first short wait
+// after that lifts it again. LOW tasks may fill half the limit, NORMAL
+// three quarters and HIGH all of it, so load is shed from the bottom up.
+typedef struct Scheduler Scheduler;
+
+// What a request without data counts for, in bytes, when users take turns
+#define SCHED_REQUEST_COST 4096
+
+typedef struct {
+    size_t queued;     // tasks in the injection queue
+    size_t limit;      // adaptive admission limit (0: unbounded)
+    size_t refused;    // tasks refused by admission control so far
+    int workers;
+} SchedulerStats;
+
+typedef enum {
+    SCHED_QUEUED,
+    SCHED_BUSY,      // refused by admission control; retry later
+    SCHED_CLOSED     // shutting down
+} SchedSubmit;
+
+// nworkers deques; aging_ms as in queue_set_aging()
+Scheduler *scheduler_create(int nworkers, unsigned aging_ms);
+
+// Log per-worker counters and free the scheduler; workers must have exited
+void scheduler_destroy(Scheduler *s);
+
+// Bound the injection queue: capacity per priority level (0: unbounded),
+// the wait target that drives the adaptive limit (0 disables it) and the
+// interval waits must stay above it before the limit is cut
+void scheduler_set_admission(Scheduler *s, const unsigned capacity[PRIORITY_COUNT],
+                             unsigned target_ms, unsigned interval_ms);
+
+// Bytes each user may take per round within a priority level
+void scheduler_set_quantum(Scheduler *s, size_t quantum);
+
+// Most users with a fair-share flow of their own at once
+void scheduler_set_max_flows(Scheduler *s, size_t max_flows);
+
+// Queue a task from any thread. When it is refused with SCHED_BUSY,
+// *retry_after_ms says how long the client should back off.
+SchedSubmit scheduler_submit(Scheduler *s, Task *task, unsigned *retry_after_ms);
+
+// Charge a task's user for the data it actually moved, once known (a
+// download of a whole file is queued at the request cost alone)
+void scheduler_charge(Scheduler *s, const Task *task, size_t bytes);
+
+// Per-user queue depth and bytes served, per priority level: up to max
+// entries in out. Returns how many there are.
+size_t scheduler_user_stats(Scheduler *s, QueueFlowStats *out, size_t max);
+
+// Current queue depth, admission limit and refusal count
+void scheduler_stats(Scheduler *s, SchedulerStats *out);
+
+// Refuse new tasks and wake every worker; queued tasks still run
+void scheduler_close(Scheduler *s);
+
+// Next task for worker `worker` (0 .. nworkers-1), blocking while there is
+// none; its queue wait is recorded and start_ns set. Returns NULL once the
+// scheduler is closed and drained.
+Task *scheduler_next(Scheduler *s, int worker);
+
+#endif // SCHEDULER_H
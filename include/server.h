@@ -2,15 +2,16 @@
 #define SERVER_H
 
 #include <signal.h>
-#include "queue.h"
+#include "scheduler.h"
+#include "response_map.h"
 #include "types.h"
 #include "user.h"
 
-// ResponseQueueEntry is defined in queue.h
+// ResponseQueueEntry is defined in response_map.h
 
 typedef struct ServerState {
-	Queue task_queue;
-	Queue response_map;
+	Scheduler *scheduler;
+	ResponseMap *response_map;
 	UserStore *user_store;
 	int listen_fd;
 	volatile sig_atomic_t running;
@@ -18,5 +19,8 @@ typedef struct ServerState {
 
 void server_run(unsigned port, int client_threads, int worker_threads);
 
+// Remove a client's response queue entry from the response map and free it
+void deregister_client_response_queue(ServerState *server, int client_id);
+
 #endif
 
@@ -3,9 +3,15 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
 #include "priority.h"
 
+struct ResponseQueueEntry;
+
+// Room for a pipelined request's tag, "<id> " with a 64-bit decimal id
+#define REQUEST_TAG_LEN 24
+
 typedef enum {
 	CMD_UNKNOWN = 0,
 	CMD_UPLOAD,
@@ -14,7 +20,13 @@ typedef enum {
 	CMD_LIST,
 	CMD_SIGNUP,
 	CMD_LOGIN,
-	CMD_QUIT
+	CMD_QUIT,
+	CMD_UPLOAD_START,
+	CMD_UPLOAD_STATUS,
+	CMD_UPLOAD_RESUME,
+	CMD_STATS,
+	CMD_UPLOAD_ABORT,
+	CMD_COUNT // Keep this last
 } CommandType;
 
 typedef struct {
@@ -27,31 +39,60 @@ typedef struct Task {
     ClientInfo client;
     char username[64];
     char password[64];
-    char path[256];
-    char tmpfile[256]; // for uploads
-    size_t size;
+    char path[256]; // file path, or the upload id for UPLOAD_STATUS/RESUME/ABORT
+    size_t size; // upload: number of data bytes following the command;
+                 // download: bytes wanted (0 = to the end); LIST: most entries (0 = all)
+    size_t offset; // ranged download / resumed upload: first byte; LIST: cursor
+    bool ranged; // download: an offset was given
+    unsigned list_fields; // LIST: FS_LIST_* columns after each name
+    size_t reserved; // quota bytes reserved at admission, settled by the worker
     TaskPriority priority; // Task priority
-    struct timespec enqueue_time; // When the task was added to the queue
+    bool own_flow; // an authenticated user's task: queued in the user's own fair-share flow
+    uint64_t enqueue_ns; // CLOCK_MONOTONIC, when the task was submitted to the scheduler
+    uint64_t start_ns; // CLOCK_MONOTONIC, when a worker took it
+    uint64_t seq; // position among the connection's requests
+    char tag[REQUEST_TAG_LEN]; // pipelined: "<id> ", echoed before every reply line; else ""
+    bool binary; // the connection speaks the binary protocol (wire.h)
+    struct ResponseQueueEntry *conn; // the connection's channel (referenced), whose
+                                     // cancel_before says if the task was abandoned
+    uint64_t deadline_ns; // CLOCK_MONOTONIC; a task not started by then is dropped (0: none)
 } Task;
 
 // Function to create a new task with priority
 Task* task_create(CommandType type, ClientInfo client, const char *username, 
-                 const char *password, const char *path, const char *tmpfile, 
+                 const char *password, const char *path,
                  size_t size, TaskPriority priority);
 
 // Function to free a task
 void task_free(Task *task);
 
-// Function to compare two tasks for priority queue ordering
-// Returns > 0 if a has higher priority than b
-int task_compare_priority(const void *a, const void *b);
+
+// True if the command's data follows it on the connection (UPLOAD, UPLOAD_RESUME)
+bool task_reads_data(const Task *task);
+
+// True if the worker writes the reply's body (file data, a listing or STATS
+// text) or reads upload data over the connection itself, at the client's
+// pace, so the reply has no fixed deadline
+bool task_streams_data(const Task *task);
+
+// Tie a task to its connection just before it is queued: take a reference
+// on the connection's channel and set the deadline timeout_ms from now
+// (0: none)
+void task_bind(Task *task, struct ResponseQueueEntry *conn, unsigned timeout_ms);
+
+// True if the client abandoned the task: it stopped waiting or went away
+bool task_cancelled(const Task *task);
+
+// True once the task's deadline has passed
+bool task_expired(const Task *task);
 
 // Helper function to convert command type to string
 const char *command_to_string(CommandType type);
 
 typedef enum {
 	RESP_OK=0,
-	RESP_ERR=1
+	RESP_ERR=1,
+	RESP_SENT=2 // worker already wrote the reply on the socket itself
 } ResponseStatus;
 
 typedef struct {
@@ -60,6 +101,9 @@ typedef struct {
 	char message[512];
 	char filepath[256]; // for download
 	size_t size;
+	uint64_t seq; // the request's seq, for in-order delivery
+	char tag[REQUEST_TAG_LEN]; // copied from the request
+	bool binary; // sent as a frame
 } Response;
 
 #endif
@@ -6,10 +6,14 @@
 #include <sqlite3.h>
 #include "priority.h"
 
+typedef enum {
+	USER_LOCK_SHARED,    // reads: LIST, DOWNLOAD
+	USER_LOCK_EXCLUSIVE  // writes: UPLOAD, DELETE
+} UserLockMode;
+
 typedef struct User {
 	char name[64];
 	char pass[64];
-	pthread_mutex_t mutex; // per-user lock
 	TaskPriority priority; // user's priority level
 	size_t used_bytes;
 	size_t quota_bytes;
@@ -28,8 +32,26 @@ UserStore* user_store_create(const char *root);
 void user_store_destroy(UserStore *store);
 bool user_store_signup(UserStore *store, const char *name, const char *pass, size_t quota_bytes, TaskPriority priority);
 bool user_store_login(UserStore *store, const char *name, const char *pass);
-User* user_store_lock_user(UserStore *store, const char *name);
+// Whether name has signed up or logged in successfully since the server
+// started. Only looks at resident records, so it never queries the database.
+bool user_store_authenticated(UserStore *store, const char *name);
+// Find the user's resident record (owned by the store, valid until it is
+// destroyed) and take its per-user lock in mode. File operations hold it
+// shared and lock their file on top; exclusive covers the whole user. No SQL
+// and no allocation once the record is cached.
+User* user_store_lock_user(UserStore *store, const char *name, UserLockMode mode);
 void user_store_unlock_user(User *user);
+// Lock one of the user's files while holding the user lock. Locks are
+// striped by path hash; hold at most one at a time.
+void user_lock_file(User *user, const char *relpath, UserLockMode mode);
+void user_unlock_file(User *user, const char *relpath);
+// Quota accounting. An upload reserves its declared size before any data
+// moves; the reservation fails (err set) if the user doesn't exist or it
+// would go over quota. Once the operation is over, settle releases the
+// reservation and moves usage by the bytes stored and the bytes replaced or
+// deleted. Usage is written back to the database in batches.
+bool user_store_reserve(UserStore *store, const char *name, size_t bytes, char *err, size_t errlen);
+void user_store_settle(UserStore *store, User *user, size_t reserved, size_t added, size_t removed);
 const char* user_store_get_root(UserStore *store);
 TaskPriority user_get_priority(User *user);
 void user_set_priority(User *user, TaskPriority priority);
@@ -0,0 +1,117 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "types.h"
+
+// Binary protocol, negotiated with a `BINARY` text line (replied to in
+// text with `OK binary <version>`). Every message after that is a frame:
+//
+//   0  u8  magic (WIRE_MAGIC)
+//   1  u8  op (WireOp)
+//   2  u16 reserved, 0
+//   4  u32 request id, echoed in every frame that answers the request
+//   8  u64 length of the body that follows
+//
+// all big-endian. A request body is a sequence of fields, each a u16
+// length and that many bytes; numbers are 8-byte fields. Upload data goes
+// in one DATA frame after READY; a download is answered with one DATA
+// frame whose body is the u64 offset, the u64 file size, then the bytes.
+#define WIRE_VERSION 1
+#define WIRE_MAGIC 0xFB
+#define WIRE_HEADER_LEN 16
+// Largest request body: every field of the longest command fits easily
+#define WIRE_MAX_REQUEST 1024
+// Longest text request line, newline included
+#define WIRE_LINE_MAX 512
+
+typedef enum {
+    WIRE_OP_SIGNUP = 1,        // user, password [, priority]
+    WIRE_OP_LOGIN = 2,         // user, password
+    WIRE_OP_UPLOAD = 3,        // user, path, u64 size
+    WIRE_OP_DOWNLOAD = 4,      // user, path [, u64 offset [, u64 length]]
+    WIRE_OP_DELETE = 5,        // user, path
+    WIRE_OP_LIST = 6,          // user [, u64 cursor [, u64 limit [, columns]]]
+    WIRE_OP_QUIT = 7,
+    WIRE_OP_UPLOAD_START = 8,  // user, path, u64 size
+    WIRE_OP_UPLOAD_STATUS = 9, // user, upload id
+    WIRE_OP_UPLOAD_RESUME = 10,// user, upload id, u64 offset, u64 length
+    WIRE_OP_STATS = 11,        // no fields; answered with a DATA frame
+    WIRE_OP_UPLOAD_ABORT = 12, // user, upload id
+    WIRE_OP_DATA = 0x20,       // file data, either direction
+    WIRE_OP_OK = 0x80,         // replies; the body is the message
+    WIRE_OP_ERR = 0x81,
+    WIRE_OP_READY = 0x82
+} WireOp;
+
+typedef struct {
+    uint8_t op;
+    uint32_t id;
+    uint64_t len;
+} WireHeader;
+
+void wire_encode_header(unsigned char *buf, uint8_t op, uint32_t id, uint64_t len);
+
+// Store v big-endian in 8 bytes, as in a download's DATA body
+void wire_put_u64(unsigned char *buf, uint64_t v);
+
+// False unless buf starts with WIRE_MAGIC
+bool wire_decode_header(const unsigned char *buf, WireHeader *h);
+
+typedef enum {
+    WIRE_NEED_MORE,  // no complete request in the buffer yet
+    WIRE_LINE,       // a text line
+    WIRE_FRAME,      // a binary request frame
+    WIRE_BAD_FRAME   // not a request frame; the stream can't be resynchronized
+} WireScan;
+
+// One request found in a connection's input buffer, pointing into it
+typedef struct {
+    size_t consumed;            // bytes the request takes up
+    char *line;                 // WIRE_LINE: NUL-terminated in place
+    char *term;                 // where the terminator went
+    char saved;                 // the byte it overwrote
+    WireHeader hdr;             // WIRE_FRAME
+    const unsigned char *body;  // WIRE_FRAME: hdr.len bytes
+} WireRequest;
+
+// Find the request at the start of buf[0, len) without copying it. A text
+// line is terminated in place, so buf needs one writable byte past len;
+// call wire_restore() once the line has been parsed. Lines longer than
+// WIRE_LINE_MAX are split, and at eof an unterminated line is complete.
+WireScan wire_scan(char *buf, size_t len, bool binary, bool eof, WireRequest *req);
+
+// Put back the byte wire_scan() overwrote to terminate a line
+void wire_restore(WireRequest *req);
+
+// Recognize the `BINARY` negotiation line
+bool wire_is_command(const char *line);
+
+// Binary requests are tagged with their id in decimal, like pipelined text
+// requests, so replies are routed and ordered the same way
+void wire_tag(uint32_t id, char tag[REQUEST_TAG_LEN]);
+uint32_t wire_tag_id(const char *tag);
+
+// Cursor over a request frame's fields
+typedef struct {
+    const unsigned char *p;
+    size_t left;
+} WireFields;
+
+void wire_fields_init(WireFields *f, const WireRequest *req);
+
+bool wire_fields_empty(const WireFields *f);
+
+// Copy the next field into dst as a string. False if there is none, it
+// doesn't fit in cap with its terminator, or it contains a NUL.
+bool wire_field_str(WireFields *f, char *dst, size_t cap);
+
+// Read the next field as a number; false unless it is 8 bytes long
+bool wire_field_u64(WireFields *f, uint64_t *v);
+
+// Format a reply frame: header plus msg. Returns its length.
+size_t wire_format_reply(uint8_t op, uint32_t id, const char *msg, char *buf, size_t len);
+
+#endif // WIRE_H
@@ -1,13 +1,15 @@
 #ifndef WORKER_H
 #define WORKER_H
 
-#include "queue.h"
+#include "scheduler.h"
+#include "response_map.h"
 #include "types.h"
 #include "user.h"
 
 typedef struct {
-	Queue *task_queue; // of Task*
-	Queue *resp_queues; // mapping entries of ResponseQueueEntry*
+	Scheduler *scheduler;
+	int worker_id; // this worker's deque in the scheduler
+	ResponseMap *resp_queues; // client_id -> ResponseQueueEntry
 	UserStore *user_store; // user store instance
 } WorkerPoolArg;
 
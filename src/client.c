@@ -1,6 +1,12 @@
 #include "client.h"
 #include "server.h"
 #include "user.h"
+#include "log.h"
+#include "pool.h"
+#include "pipeline.h"
+#include "config.h"
+#include "net.h"
+#include "fs.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,193 +18,621 @@
 
 extern ServerState *g_server;
 
-// Simple line-based protocol for demo purposes
-static int recv_line(int fd, char *buf, size_t len) {
-	size_t pos = 0;
-	while (pos < len - 1) {
-		char c;
-		ssize_t n = read(fd, &c, 1);
-		if (n <= 0) return (pos > 0) ? (int)pos : -1;
-		if (c == '\n') {
-			buf[pos] = '\0';
-			return (int)pos;
-		}
-		buf[pos++] = c;
-	}
-	buf[pos] = '\0';
-	return (int)pos;
+// Next request on the connection, parsed in place from the reader's
+// buffer; the socket is read only when no complete request is buffered.
+// WIRE_NEED_MORE means the client is gone.
+static WireScan next_request(NetReader *r, bool binary, WireRequest *req) {
+    while (1) {
+        WireScan s = wire_scan(r->buf + r->start, r->end - r->start, binary, r->eof, req);
+        if (s != WIRE_NEED_MORE || r->eof) return s;
+        if (!net_reader_fill(r) && !r->eof) return WIRE_NEED_MORE;
+    }
+}
+
+// SIGNUP's optional priority argument
+static TaskPriority signup_priority(const char *s) {
+    if (strcasecmp(s, "HIGH") == 0) return PRIORITY_HIGH;
+    if (strcasecmp(s, "LOW") == 0) return PRIORITY_LOW;
+    return PRIORITY_NORMAL;
+}
+
+// Parse one protocol line into a Task. Shared by the threaded client loop
+// and the reactor so both engines accept exactly the same commands.
+Task *client_parse_command(const char *line, ClientInfo client, ParseResult *result) {
+    // Default to normal priority
+    TaskPriority priority = PRIORITY_NORMAL;
+    
+    // Create task with default priority
+    Task *task = task_create(CMD_UNKNOWN, client, 
+                           "", "", "", 0, priority);
+    if (!task) {
+        *result = PARSE_NOMEM;
+        return NULL;
+    }
+    // Parse command and set appropriate priority
+    if (strncmp(line, "SIGNUP", 6) == 0) {
+        task->type = CMD_SIGNUP;
+        char priority_str[16] = {0};
+        int parsed = sscanf(line+6, "%63s %63s %15s", task->username, task->password, priority_str);
+        
+        // Set priority based on optional third parameter
+        task->priority = parsed >= 3 ? signup_priority(priority_str) : PRIORITY_NORMAL;
+    } else if (strncmp(line, "LOGIN", 5) == 0) {
+        task->type = CMD_LOGIN;
+        sscanf(line+5, "%63s %63s", task->username, task->password);
+        // Login is a high-priority operation
+        task->priority = PRIORITY_HIGH;
+    } else if (strncmp(line, "UPLOAD_START", 12) == 0) {
+        task->type = CMD_UPLOAD_START;
+        // UPLOAD_START <user> <path> <size>; answers with an upload id
+        sscanf(line+12, "%63s %255s %zu", task->username, task->path, &task->size);
+        task->priority = PRIORITY_NORMAL;
+    } else if (strncmp(line, "UPLOAD_STATUS", 13) == 0) {
+        task->type = CMD_UPLOAD_STATUS;
+        // UPLOAD_STATUS <user> <id>
+        sscanf(line+13, "%63s %255s", task->username, task->path);
+        task->priority = PRIORITY_NORMAL;
+    } else if (strncmp(line, "UPLOAD_ABORT", 12) == 0) {
+        task->type = CMD_UPLOAD_ABORT;
+        // UPLOAD_ABORT <user> <id>; drops the session and its quota charge
+        sscanf(line+12, "%63s %255s", task->username, task->path);
+        task->priority = PRIORITY_NORMAL;
+    } else if (strncmp(line, "UPLOAD_RESUME", 13) == 0) {
+        task->type = CMD_UPLOAD_RESUME;
+        // UPLOAD_RESUME <user> <id> <offset> <length>; like UPLOAD, the
+        // worker answers READY and then reads exactly <length> bytes
+        sscanf(line+13, "%63s %255s %zu %zu", task->username, task->path, &task->offset, &task->size);
+        task->priority = PRIORITY_NORMAL;
+    } else if (strncmp(line, "UPLOAD", 6) == 0) {
+        task->type = CMD_UPLOAD;
+        // UPLOAD <user> <path> <size>; the worker answers READY and then
+        // reads exactly <size> bytes of file data from the connection
+        sscanf(line+6, "%63s %255s %zu", task->username, task->path, &task->size);
+        // Upload can be normal priority
+        task->priority = PRIORITY_NORMAL;
+    } else if (strncmp(line, "DOWNLOAD", 8) == 0) {
+        task->type = CMD_DOWNLOAD;
+        // DOWNLOAD <user> <path> [<offset> [<length>]]
+        int n = sscanf(line+8, "%63s %255s %zu %zu", task->username, task->path, &task->offset, &task->size);
+        task->ranged = (n >= 3);
+        // Download can be normal priority
+        task->priority = PRIORITY_NORMAL;
+    } else if (strncmp(line, "DELETE", 6) == 0) {
+        task->type = CMD_DELETE;
+        sscanf(line+6, "%63s %255s", task->username, task->path);
+        // Delete is a high-priority operation
+        task->priority = PRIORITY_HIGH;
+    } else if (strncmp(line, "LIST", 4) == 0) {
+        task->type = CMD_LIST;
+        // LIST <user> [<cursor> [<limit> [<columns>]]]; the worker streams
+        // the entries after an "OK list" line
+        char columns[64] = "";
+        int n = sscanf(line+4, "%63s %zu %zu %63s", task->username, &task->offset, &task->size, columns);
+        task->list_fields = FS_LIST_DEFAULT;
+        if (n >= 4 && !fs_list_parse_fields(columns, &task->list_fields)) {
+            task_free(task);
+            *result = PARSE_INVALID;
+            return NULL;
+        }
+        // List is a low-priority operation
+        task->priority = PRIORITY_LOW;
+    } else if (strncmp(line, "STATS", 5) == 0) {
+        task->type = CMD_STATS;
+        // STATS; the worker writes the metrics text after an "OK stats <size>" line
+        task->priority = PRIORITY_HIGH;
+    } else if (strncmp(line, "QUIT", 4) == 0) {
+        task_free(task);
+        *result = PARSE_QUIT;
+        return NULL;
+    } else {
+        task_free(task);
+        *result = PARSE_IGNORED;
+        return NULL;
+    }
+    *result = PARSE_TASK;
+    return task;
+}
+
+// Binary requests carry the same arguments as their text lines, as fields,
+// and get the same priorities
+Task *client_parse_frame(const WireRequest *req, ClientInfo client, ParseResult *result) {
+    if (req->hdr.op == WIRE_OP_QUIT) {
+        *result = PARSE_QUIT;
+        return NULL;
+    }
+    Task *task = task_create(CMD_UNKNOWN, client, "", "", "", 0, PRIORITY_NORMAL);
+    if (!task) {
+        *result = PARSE_NOMEM;
+        return NULL;
+    }
+    task->binary = true;
+    WireFields f;
+    wire_fields_init(&f, req);
+    uint64_t a = 0, b = 0;
+    // Every request but STATS starts with the user name
+    bool ok = req->hdr.op == WIRE_OP_STATS ||
+              wire_field_str(&f, task->username, sizeof(task->username));
+    switch (req->hdr.op) {
+    case WIRE_OP_SIGNUP: {
+        char priority_str[16] = "";
+        task->type = CMD_SIGNUP;
+        ok = ok && wire_field_str(&f, task->password, sizeof(task->password)) &&
+             (wire_fields_empty(&f) || wire_field_str(&f, priority_str, sizeof(priority_str)));
+        task->priority = signup_priority(priority_str);
+        break;
+    }
+    case WIRE_OP_LOGIN:
+        task->type = CMD_LOGIN;
+        ok = ok && wire_field_str(&f, task->password, sizeof(task->password));
+        task->priority = PRIORITY_HIGH;
+        break;
+    case WIRE_OP_UPLOAD:
+    case WIRE_OP_UPLOAD_START:
+        task->type = req->hdr.op == WIRE_OP_UPLOAD ? CMD_UPLOAD : CMD_UPLOAD_START;
+        ok = ok && wire_field_str(&f, task->path, sizeof(task->path)) && wire_field_u64(&f, &a);
+        task->size = (size_t)a;
+        break;
+    case WIRE_OP_UPLOAD_STATUS:
+    case WIRE_OP_UPLOAD_ABORT:
+        task->type = req->hdr.op == WIRE_OP_UPLOAD_STATUS ? CMD_UPLOAD_STATUS : CMD_UPLOAD_ABORT;
+        ok = ok && wire_field_str(&f, task->path, sizeof(task->path));
+        break;
+    case WIRE_OP_UPLOAD_RESUME:
+        task->type = CMD_UPLOAD_RESUME;
+        ok = ok && wire_field_str(&f, task->path, sizeof(task->path)) &&
+             wire_field_u64(&f, &a) && wire_field_u64(&f, &b);
+        task->offset = (size_t)a;
+        task->size = (size_t)b;
+        break;
+    case WIRE_OP_DOWNLOAD:
+        task->type = CMD_DOWNLOAD;
+        ok = ok && wire_field_str(&f, task->path, sizeof(task->path));
+        task->ranged = ok && !wire_fields_empty(&f);
+        if (task->ranged) {
+            ok = wire_field_u64(&f, &a) && (wire_fields_empty(&f) || wire_field_u64(&f, &b));
+            task->offset = (size_t)a;
+            task->size = (size_t)b;
+        }
+        break;
+    case WIRE_OP_DELETE:
+        task->type = CMD_DELETE;
+        ok = ok && wire_field_str(&f, task->path, sizeof(task->path));
+        task->priority = PRIORITY_HIGH;
+        break;
+    case WIRE_OP_LIST: {
+        char columns[64] = "";
+        task->type = CMD_LIST;
+        task->list_fields = FS_LIST_DEFAULT;
+        if (ok && !wire_fields_empty(&f)) {
+            ok = wire_field_u64(&f, &a) &&
+                 (wire_fields_empty(&f) || (wire_field_u64(&f, &b) &&
+                  (wire_fields_empty(&f) || (wire_field_str(&f, columns, sizeof(columns)) &&
+                                             fs_list_parse_fields(columns, &task->list_fields)))));
+            task->offset = (size_t)a;
+            task->size = (size_t)b;
+        }
+        task->priority = PRIORITY_LOW;
+        break;
+    }
+    case WIRE_OP_STATS:
+        task->type = CMD_STATS;
+        task->priority = PRIORITY_HIGH;
+        break;
+    default:
+        task_free(task);
+        *result = PARSE_IGNORED;
+        return NULL;
+    }
+    if (!ok || !wire_fields_empty(&f)) {
+        task_free(task);
+        *result = PARSE_INVALID;
+        return NULL;
+    }
+    *result = PARSE_TASK;
+    return task;
+}
+
+bool client_stash_data(ResponseQueueEntry *entry, const Task *task,
+                       const char *buf, size_t avail, size_t *taken) {
+    *taken = 0;
+    if (!task_reads_data(task) || avail == 0) return true;
+    // A binary upload's data comes in a DATA frame
+    size_t want = task->size + (task->binary ? WIRE_HEADER_LEN : 0);
+    size_t n = avail < want ? avail : want;
+    unsigned char *stash = (unsigned char *)malloc(n);
+    if (!stash) return false;
+    memcpy(stash, buf, n);
+    // Only one data-phase command runs at a time, so the slot is free
+    // unless a broken upload left bytes behind. Submitting the task
+    // publishes it to the worker.
+    free(entry->stash);
+    entry->stash = stash;
+    entry->stash_len = n;
+    entry->stash_off = 0;
+    *taken = n;
+    return true;
+}
+
+bool client_admit_task(UserStore *store, Task *task, char *err, size_t errlen) {
+    switch (task->type) {
+    case CMD_UPLOAD:
+    case CMD_UPLOAD_START:
+        // The declared size is held against the quota until the worker
+        // settles it; nothing has been read past the command line yet.
+        // A resumable upload's whole size is charged when it starts, so
+        // its parts need no reservation of their own.
+        if (!user_store_reserve(store, task->username, task->size, err, errlen)) return false;
+        task->reserved = task->size;
+        return true;
+    default:
+        return true;
+    }
+}
+
+void client_release_task(UserStore *store, Task *task) {
+    if (task->reserved == 0) return;
+    User *u = user_store_lock_user(store, task->username, USER_LOCK_SHARED);
+    if (u) {
+        user_store_settle(store, u, task->reserved, 0, 0);
+        user_store_unlock_user(u);
+    }
+    task->reserved = 0;
+}
+
+SchedSubmit client_submit_task(UserStore *store, Scheduler *sched, Task *task,
+                               char *err, size_t errlen) {
+    unsigned retry_after_ms = 0;
+    // Anyone can name any user before logging in, so only users that have
+    // authenticated get a flow of their own; the rest share their level's
+    // single flow
+    task->own_flow = user_store_authenticated(store, task->username);
+    SchedSubmit st = scheduler_submit(sched, task, &retry_after_ms);
+    if (st == SCHED_QUEUED) return st;
+    if (st == SCHED_BUSY) {
+        LOG_DEBUG("[Client] Queue full, refusing %s for client %d",
+                  command_to_string(task->type), task->client.client_id);
+        snprintf(err, errlen, "busy retry_after=%u", retry_after_ms);
+    } else {
+        snprintf(err, errlen, "Server shutting down");
+    }
+    client_release_task(store, task);
+    return st;
+}
+
+// A pipelined connection served by a client thread. This thread only reads
+// and submits requests; workers write the replies from the entry's notify
+// hook, under the entry mutex, as the pipeline releases them.
+typedef struct {
+    int fd;
+    Pipeline pipe;
+    ResponseQueueEntry *entry;
+} PipelinedClient;
+
+// Write every reply the pipeline releases; entry mutex held
+static void pipelined_write_replies(PipelinedClient *pc) {
+    char out[1024];
+    Response *r;
+    while ((r = pipeline_next(&pc->pipe)) != NULL) {
+        size_t n = pipeline_format(r, out, sizeof(out));
+        if (n > 0) net_write_all(pc->fd, out, n);
+        pool_free(g_response_pool, r);
+    }
+    // The reader may be waiting for room
+    pthread_cond_broadcast(&pc->entry->response_available);
+}
+
+// Notify hook, run by a worker with the entry mutex held
+static void pipelined_notify(void *ctx, int client_id) {
+    (void)client_id;
+    PipelinedClient *pc = (PipelinedClient *)ctx;
+    Response *r;
+    while (pc->entry->queue.size > 0 && (r = (Response *)queue_pop(&pc->entry->queue)) != NULL) {
+        pipeline_complete(&pc->pipe, r);
+    }
+    pipelined_write_replies(pc);
+}
+
+static void pipelined_reply(PipelinedClient *pc, const char *tag, ResponseStatus status, const char *msg) {
+    pthread_mutex_lock(&pc->entry->mutex);
+    if (pipeline_reply(&pc->pipe, tag, status, msg)) pipelined_write_replies(pc);
+    pthread_mutex_unlock(&pc->entry->mutex);
+}
+
+// Handle a text line on a connection served by serve_pipelined(). Returns
+// the task it asks for, or NULL once it has been answered here; *quit is
+// set when the client is done.
+static Task *pipelined_line(PipelinedClient *pc, char *line, ClientInfo ci,
+                            char tag[REQUEST_TAG_LEN], bool *quit) {
+    char err[256];
+    const char *cmd = line;
+    bool ordered;
+    if (pc->pipe.tagged && !pipeline_split_tag(line, tag, &cmd)) {
+        pipelined_reply(pc, "", RESP_ERR, "Missing request id");
+        return NULL;
+    }
+    if (pipeline_is_command(cmd, &ordered)) {
+        pthread_mutex_lock(&pc->entry->mutex);
+        bool ok = pipeline_enable(&pc->pipe, ordered, (unsigned)config_get_pipeline_depth(), err, sizeof(err));
+        pthread_mutex_unlock(&pc->entry->mutex);
+        if (ok) {
+            char msg[64];
+            snprintf(msg, sizeof(msg), "pipelined %s %u", ordered ? "ordered" : "unordered", pc->pipe.depth);
+            pipelined_reply(pc, "", RESP_OK, msg);
+        } else {
+            pipelined_reply(pc, tag, RESP_ERR, err);
+        }
+        return NULL;
+    }
+    if (wire_is_command(cmd)) {
+        pthread_mutex_lock(&pc->entry->mutex);
+        bool ok = pipeline_set_binary(&pc->pipe, tag, err, sizeof(err));
+        if (ok) pipelined_write_replies(pc);
+        pthread_mutex_unlock(&pc->entry->mutex);
+        if (!ok) pipelined_reply(pc, tag, RESP_ERR, err);
+        return NULL;
+    }
+    ParseResult pr = PARSE_IGNORED;
+    Task *task = client_parse_command(cmd, ci, &pr);
+    if (pr == PARSE_QUIT) *quit = true;
+    if (pr == PARSE_NOMEM) pipelined_reply(pc, tag, RESP_ERR, "Failed to allocate task");
+    if (pr == PARSE_IGNORED && tag[0]) pipelined_reply(pc, tag, RESP_ERR, "Unknown command");
+    if (pr == PARSE_INVALID) pipelined_reply(pc, tag, RESP_ERR, "Malformed request");
+    return task;
+}
+
+// Serve the rest of a connection that sent PIPELINE or BINARY, starting
+// with that line, which is still in the reader. Returns once the client is
+// gone and every request it made has been answered.
+static void serve_pipelined(NetReader *reader, int client_id, ResponseQueueEntry *entry) {
+    PipelinedClient pc = { .fd = reader->fd, .entry = entry };
+    pipeline_init(&pc.pipe);
+    ClientInfo ci = { client_id, reader->fd };
+    char err[256];
+
+    pthread_mutex_lock(&entry->mutex);
+    entry->notify = pipelined_notify;
+    entry->notify_ctx = &pc;
+    pthread_mutex_unlock(&entry->mutex);
+
+    bool quit = false;
+    while (!quit) {
+        // Don't read on while the pipeline is full or a data phase owns the socket
+        pthread_mutex_lock(&entry->mutex);
+        while (!pipeline_has_room(&pc.pipe)) {
+            pthread_cond_wait(&entry->response_available, &entry->mutex);
+        }
+        pthread_mutex_unlock(&entry->mutex);
+
+        WireRequest req;
+        WireScan scan = next_request(reader, pc.pipe.binary, &req);
+        if (scan == WIRE_NEED_MORE) break;
+        if (scan == WIRE_BAD_FRAME) {
+            pipelined_reply(&pc, "", RESP_ERR, "Bad frame");
+            break;
+        }
+
+        char tag[REQUEST_TAG_LEN] = "";
+        Task *task;
+        if (scan == WIRE_FRAME) {
+            ParseResult pr = PARSE_IGNORED;
+            wire_tag(req.hdr.id, tag);
+            task = client_parse_frame(&req, ci, &pr);
+            if (pr == PARSE_QUIT) quit = true;
+            if (pr == PARSE_NOMEM) pipelined_reply(&pc, tag, RESP_ERR, "Failed to allocate task");
+            if (pr == PARSE_IGNORED) pipelined_reply(&pc, tag, RESP_ERR, "Unknown command");
+            if (pr == PARSE_INVALID) pipelined_reply(&pc, tag, RESP_ERR, "Malformed request");
+        } else {
+            LOG_DEBUG("[Client] Received command: %s", req.line);
+            task = pipelined_line(&pc, req.line, ci, tag, &quit);
+            wire_restore(&req);
+        }
+        reader->start += req.consumed;
+        if (!task) continue;
+
+        if (!client_admit_task(g_server->user_store, task, err, sizeof(err))) {
+            task_free(task);
+            pipelined_reply(&pc, tag, RESP_ERR, err);
+            continue;
+        }
+
+        pthread_mutex_lock(&entry->mutex);
+        // A data-phase command waits until every earlier reply is written
+        while (!pipeline_can_start(&pc.pipe, task)) {
+            pthread_cond_wait(&entry->response_available, &entry->mutex);
+        }
+        pipeline_submit(&pc.pipe, task, tag);
+        pthread_mutex_unlock(&entry->mutex);
+        task_bind(task, entry, config_get_request_timeout_ms());
+
+        size_t taken;
+        bool stashed = client_stash_data(entry, task, reader->buf + reader->start,
+                                         reader->end - reader->start, &taken);
+        reader->start += taken;
+        SchedSubmit st = stashed ? client_submit_task(g_server->user_store, g_server->scheduler,
+                                                      task, err, sizeof(err))
+                                 : SCHED_CLOSED;
+        if (st != SCHED_QUEUED) {
+            // Answer for the task so nothing is left in flight
+            if (!stashed) {
+                client_release_task(g_server->user_store, task);
+                snprintf(err, sizeof(err), "Out of memory");
+            }
+            pthread_mutex_lock(&entry->mutex);
+            bool answered = pipeline_refuse(&pc.pipe, task, err);
+            if (answered) pipelined_write_replies(&pc);
+            pthread_mutex_unlock(&entry->mutex);
+            task_free(task);
+            if (st == SCHED_BUSY && answered) continue;
+            break;
+        }
+    }
+
+    // Unless the client said QUIT, nobody reads the replies still due, so
+    // workers skip those requests. Workers still answering use pc and the
+    // socket.
+    if (!quit) response_map_cancel(entry, UINT64_MAX);
+    pthread_mutex_lock(&entry->mutex);
+    while (pc.pipe.inflight > 0) {
+        pthread_cond_wait(&entry->response_available, &entry->mutex);
+    }
+    entry->notify = NULL;
+    entry->notify_ctx = NULL;
+    pthread_mutex_unlock(&entry->mutex);
+    pipeline_clear(&pc.pipe);
 }
 
 void *client_thread_main(void *arg) {
     ClientThreadArg *cta = (ClientThreadArg *)arg;
-    char line[512];
+    NetReader reader;
+    unsigned timeout_ms = config_get_request_timeout_ms();
     while (1) {
-        printf("[Client Thread %lu] Waiting for client...\n", (unsigned long)pthread_self());
-        fflush(stdout);
+        LOG_TRACE("[Client Thread] Waiting for client...");
         ClientInfo *ci = (ClientInfo *)queue_pop(cta->client_queue);
         if (!ci) break;
         int fd = ci->socket_fd;
         int client_id = ci->client_id;
-        printf("[Client Thread %lu] Got client (fd=%d, client_id=%d)\n", 
-               (unsigned long)pthread_self(), fd, client_id);
-        fflush(stdout);
-        free(ci);
-        while (1) {
-            int r = recv_line(fd, line, sizeof(line));
-            if (r <= 0) break;
+        LOG_DEBUG("[Client Thread] Got client (fd=%d, client_id=%d)", 
+               fd, client_id);
+        pool_free(g_client_info_pool, ci);
+        // Our response channel stays registered until we deregister below
+        ResponseQueueEntry *entry = response_map_get(g_server->response_map, client_id);
+        net_reader_init(&reader, fd);
+        uint64_t next_seq = 0; // numbers this connection's requests
+        while (entry) {
+            WireRequest req;
+            if (next_request(&reader, false, &req) != WIRE_LINE) break;
             
-            printf("[Client] Received command: %s\n", line);
+            bool ordered;
+            if (pipeline_is_command(req.line, &ordered) || wire_is_command(req.line)) {
+                // Served from here on by the pipeline, starting with this line
+                wire_restore(&req);
+                serve_pipelined(&reader, client_id, entry);
+                break;
+            }
             
-            // Default to normal priority
-            TaskPriority priority = PRIORITY_NORMAL;
+            LOG_DEBUG("[Client] Received command: %s", req.line);
             
-            // Create task with default priority
-            Task *task = task_create(CMD_UNKNOWN, (ClientInfo){client_id, fd}, 
-                                   "", "", "", "", 0, priority);
-            if (!task) {
+            ParseResult pr = PARSE_IGNORED;
+            Task *task = client_parse_command(req.line, (ClientInfo){client_id, fd}, &pr);
+            wire_restore(&req);
+            reader.start += req.consumed;
+            if (pr == PARSE_QUIT) break;
+            if (pr == PARSE_NOMEM) {
                 // Handle allocation failure
                 char err_msg[] = "Error: Failed to allocate task\n";
                 write(fd, err_msg, sizeof(err_msg) - 1);
                 continue;
             }
-            // Parse command and set appropriate priority
-            if (strncmp(line, "SIGNUP", 6) == 0) {
-                task->type = CMD_SIGNUP;
-                char priority_str[16] = {0};
-                int parsed = sscanf(line+6, "%63s %63s %15s", task->username, task->password, priority_str);
-                
-                // Set priority based on optional third parameter
-                if (parsed >= 3) {
-                    if (strcasecmp(priority_str, "HIGH") == 0) {
-                        task->priority = PRIORITY_HIGH;
-                    } else if (strcasecmp(priority_str, "LOW") == 0) {
-                        task->priority = PRIORITY_LOW;
-                    } else {
-                        task->priority = PRIORITY_NORMAL;
-                    }
-                } else {
-                    // Default to NORMAL priority if not specified
-                    task->priority = PRIORITY_NORMAL;
-                }
-            } else if (strncmp(line, "LOGIN", 5) == 0) {
-                task->type = CMD_LOGIN;
-                sscanf(line+5, "%63s %63s", task->username, task->password);
-                // Login is a high-priority operation
-                task->priority = PRIORITY_HIGH;
-            } else if (strncmp(line, "UPLOAD", 6) == 0) {
-                task->type = CMD_UPLOAD;
-                sscanf(line+6, "%63s %255s %zu %255s", task->username, task->path, &task->size, task->tmpfile);
-                // Upload can be normal priority
-                task->priority = PRIORITY_NORMAL;
-            } else if (strncmp(line, "DOWNLOAD", 8) == 0) {
-                task->type = CMD_DOWNLOAD;
-                sscanf(line+8, "%63s %255s", task->username, task->path);
-                // Download can be normal priority
-                task->priority = PRIORITY_NORMAL;
-            } else if (strncmp(line, "DELETE", 6) == 0) {
-                task->type = CMD_DELETE;
-                sscanf(line+6, "%63s %255s", task->username, task->path);
-                // Delete is a high-priority operation
-                task->priority = PRIORITY_HIGH;
-            } else if (strncmp(line, "LIST", 4) == 0) {
-                task->type = CMD_LIST;
-                sscanf(line+4, "%63s", task->username);
-                // List is a low-priority operation
-                task->priority = PRIORITY_LOW;
-            } else if (strncmp(line, "QUIT", 4) == 0) {
-                free(task);
-                break;
-            } else {
-                free(task);
+            if (pr == PARSE_INVALID) {
+                char err_msg[] = "ERR Malformed request\n";
+                write(fd, err_msg, sizeof(err_msg) - 1);
                 continue;
             }
-            // Push the task to the worker queue
-            // Push task with its priority
-            printf("[Client] Pushing task: %s (priority: %s, user: %s)\n", 
+            if (!task) continue;
+            
+            char err[256];
+            if (!client_admit_task(g_server->user_store, task, err, sizeof(err))) {
+                char out[300];
+                int n = snprintf(out, sizeof(out), "ERR %s\n", err);
+                write(fd, out, (size_t)n);
+                task_free(task);
+                continue;
+            }
+            size_t taken;
+            if (!client_stash_data(entry, task, reader.buf + reader.start,
+                                   reader.end - reader.start, &taken)) {
+                client_release_task(g_server->user_store, task);
+                task_free(task);
+                break;
+            }
+            reader.start += taken;
+            // Upload data and download bodies run over this socket at the
+            // client's pace, so their response is not subject to the
+            // request timeout
+            bool untimed = task_streams_data(task);
+            
+            // Hand the task to the worker pool with its priority
+            LOG_TRACE("[Client] Pushing task: %s (priority: %s, user: %s)", 
                    command_to_string(task->type), 
                    priority_to_string(task->priority),
                    task->username);
-            queue_push(&g_server->task_queue, task, task->priority);
+            uint64_t seq = next_seq++;
+            task->seq = seq;
+            task_bind(task, entry, timeout_ms);
+            SchedSubmit st = client_submit_task(g_server->user_store, g_server->scheduler,
+                                                task, err, sizeof(err));
+            if (st != SCHED_QUEUED) {
+                task_free(task);
+                if (st == SCHED_CLOSED) break;
+                // Saturated: refuse now rather than after a timeout
+                char out[300];
+                int n = snprintf(out, sizeof(out), "ERR %s\n", err);
+                write(fd, out, (size_t)n);
+                continue;
+            }
             
             // Log the task submission
-            printf("[Client] Task submitted: %s (priority: %s)\n", 
+            LOG_TRACE("[Client] Task submitted: %s (priority: %s)", 
                    command_to_string(task->type), 
                    priority_to_string(task->priority));
 
-            // Find our response queue entry
-            ResponseQueueEntry *entry = NULL;
-            pthread_mutex_lock(&g_server->response_map.mutex);
-            for (size_t i = 0; i < g_server->response_map.size; i++) {
-                ResponseQueueEntry *e = (ResponseQueueEntry *)g_server->response_map.items[i].data;
-                if (e->client_id == client_id) { 
-                    entry = e; 
-                    break; 
-                }
-            }
-            pthread_mutex_unlock(&g_server->response_map.mutex);
-            
-            if (!entry) break;  // Client queue not found, connection lost
-
             // Initialize response to NULL
             Response *resp = NULL;
             
             // Wait for a response with a timeout
             struct timespec ts;
             clock_gettime(CLOCK_REALTIME, &ts);
-            ts.tv_sec += 5;  // 5 second timeout
+            ts.tv_sec += timeout_ms / 1000;
+            ts.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+            if (ts.tv_nsec >= 1000000000L) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
+            }
 
             pthread_mutex_lock(&entry->mutex);
-            
-            // Wait for a response with proper error handling
             int rc = 0;
-            while (entry->queue.size == 0 && rc != ETIMEDOUT) {
-                rc = pthread_cond_timedwait(&entry->response_available, &entry->mutex, &ts);
-                if (rc != 0 && rc != ETIMEDOUT) {
-                    // Handle other errors (like EINTR)
-                    if (rc == EINTR) {
-                        // If we were interrupted by a signal, recalculate the timeout
-                        struct timespec now;
-                        clock_gettime(CLOCK_REALTIME, &now);
-                        if (now.tv_sec >= ts.tv_sec && 
-                            (now.tv_sec > ts.tv_sec || now.tv_nsec >= ts.tv_nsec)) {
-                            rc = ETIMEDOUT;
-                        }
-                    } else {
-                        // For other errors, log and break
-                        perror("pthread_cond_timedwait");
-                        break;
-                    }
+            while (1) {
+                // Replies to requests we gave up on can still turn up; drop them
+                while (!resp && entry->queue.size > 0) {
+                    Response *r = (Response *)queue_pop(&entry->queue);
+                    if (r->seq == seq) resp = r;
+                    else pool_free(g_response_pool, r);
+                }
+                if (resp || entry->queue.closed || rc == ETIMEDOUT) break;
+                if (untimed || timeout_ms == 0) {
+                    pthread_cond_wait(&entry->response_available, &entry->mutex);
+                } else {
+                    rc = pthread_cond_timedwait(&entry->response_available, &entry->mutex, &ts);
                 }
-            }
-            
-            // Get the response if available
-            if (entry->queue.size > 0) {
-                resp = (Response *)queue_pop(&entry->queue);
             }
             pthread_mutex_unlock(&entry->mutex);
             
             // If we timed out, set an appropriate error message
             if (!resp && rc == ETIMEDOUT) {
-                resp = (Response *)calloc(1, sizeof(Response));
+                // Nobody will read the result, so workers skip the task
+                response_map_cancel(entry, seq + 1);
+                resp = (Response *)pool_alloc(g_response_pool);
                 if (resp) {
                     resp->status = RESP_ERR;
                     strncpy(resp->message, "Request timed out", sizeof(resp->message) - 1);
                 }
             }
 
-            if (resp) {
+            if (resp && resp->status == RESP_SENT) {
+                pool_free(g_response_pool, resp);
+            } else if (resp) {
                 char out[1024];
                 snprintf(out, sizeof(out), "%s %s\n", 
                         resp->status==RESP_OK?"OK":"ERR", 
                         resp->message);
                 write(fd, out, strlen(out));
-                free(resp);
+                pool_free(g_response_pool, resp);
             }
         }
         // deregister response queue for this client
-        extern void deregister_client_response_queue(ServerState *server, int client_id);
         close(fd);
         deregister_client_response_queue(g_server, client_id);
+        response_map_put(entry);
     }
     return NULL;
 }
@@ -32,6 +32,7 @@ int download_file(ClientState* client, const char* filename);
 int receive_file_data(ClientState* client, const char* filename);
 int delete_file(ClientState* client, const char* filename);
 int list_files(ClientState* client);
+int show_stats(ClientState* client);
 void interactive_mode(ClientState* client);
 void cleanup_client(ClientState* client);
 
@@ -63,7 +64,8 @@ int connect_to_server(const char* host, int port) {
 }
 
 int send_command(ClientState* client, const char* command) {
-    if (!client->logged_in && strncmp(command, "SIGNUP", 6) != 0 && strncmp(command, "LOGIN", 5) != 0) {
+    if (!client->logged_in && strncmp(command, "SIGNUP", 6) != 0 && strncmp(command, "LOGIN", 5) != 0 &&
+        strncmp(command, "STATS", 5) != 0) {
         printf("Error: You must login first\n");
         return -1;
     }
@@ -153,64 +155,68 @@ int upload_file(ClientState* client, const char* filename) {
         return -1;
     }
 
-    // Create temporary file for upload
-    char tmpfile[256];
-    snprintf(tmpfile, sizeof(tmpfile), "/tmp/upload_%s_%ld", filename, (long)time(NULL));
-    
-    // Copy file to temp location (in real implementation, this would be the actual file data)
     int src_fd = open(filename, O_RDONLY);
     if (src_fd < 0) {
         perror("open source file");
         return -1;
     }
+
+    // Store under the file's own name, without any local directories
+    const char *remote_name = strrchr(filename, '/');
+    remote_name = remote_name ? remote_name + 1 : filename;
+
+    // Announce the upload; the server answers READY before taking the data
+    char command[512];
+    snprintf(command, sizeof(command), "UPLOAD %s %s %zu\n", 
+             client->username, remote_name, (size_t)file_stat.st_size);
     
-    int tmp_fd = open(tmpfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (tmp_fd < 0) {
-        perror("open temp file");
+    if (send_command(client, command) < 0) {
+        close(src_fd);
+        return -1;
+    }
+
+    char response[1024];
+    if (receive_response(client, response, sizeof(response)) < 0) {
+        close(src_fd);
+        return -1;
+    }
+    if (strncmp(response, "READY", 5) != 0) {
+        printf("Upload response: %s", response);
         close(src_fd);
         return -1;
     }
 
+    // Stream the file straight from disk onto the connection
     char buffer[BUFFER_SIZE];
-    ssize_t bytes_read, bytes_written;
-    size_t total_size = 0;
-    
-    while ((bytes_read = read(src_fd, buffer, sizeof(buffer))) > 0) {
-        bytes_written = write(tmp_fd, buffer, bytes_read);
-        if (bytes_written != bytes_read) {
-            perror("write to temp file");
-            close(src_fd);
-            close(tmp_fd);
-            unlink(tmpfile);
-            return -1;
+    ssize_t bytes_read;
+    size_t total_sent = 0;
+    while (total_sent < (size_t)file_stat.st_size &&
+           (bytes_read = read(src_fd, buffer, sizeof(buffer))) > 0) {
+        ssize_t off = 0;
+        while (off < bytes_read) {
+            ssize_t n = write(client->socket_fd, buffer + off, bytes_read - off);
+            if (n <= 0) {
+                perror("write");
+                close(src_fd);
+                return -1;
+            }
+            off += n;
         }
-        total_size += bytes_written;
+        total_sent += bytes_read;
     }
-    
     close(src_fd);
-    close(tmp_fd);
 
-    // Send upload command
-    char command[512];
-    snprintf(command, sizeof(command), "UPLOAD %s %s %zu %s\n", 
-             client->username, filename, total_size, tmpfile);
-    
-    if (send_command(client, command) < 0) {
-        unlink(tmpfile);
+    if (total_sent != (size_t)file_stat.st_size) {
+        printf("Error: File '%s' changed while uploading\n", filename);
         return -1;
     }
 
-    char response[1024];
     if (receive_response(client, response, sizeof(response)) < 0) {
-        unlink(tmpfile);
         return -1;
     }
 
     printf("Upload response: %s", response);
     
-    // Clean up temp file
-    unlink(tmpfile);
-    
     return (strncmp(response, "OK", 2) == 0) ? 0 : -1;
 }
 
@@ -226,10 +232,26 @@ int download_file(ClientState* client, const char* filename) {
     return receive_file_data(client, filename);
 }
 
+// Read one '\n'-terminated line a byte at a time, so nothing past it
+// (such as file data) is consumed from the socket
+static int read_line(int fd, char* line, size_t size) {
+    size_t pos = 0;
+    while (pos < size - 1) {
+        char c;
+        ssize_t n = read(fd, &c, 1);
+        if (n <= 0) return -1;
+        line[pos++] = c;
+        if (c == '\n') break;
+    }
+    line[pos] = '\0';
+    return (int)pos;
+}
+
 int receive_file_data(ClientState* client, const char* filename) {
     // First receive the response message
     char response[1024];
-    if (receive_response(client, response, sizeof(response)) < 0) {
+    if (read_line(client->socket_fd, response, sizeof(response)) < 0) {
+        printf("Server disconnected\n");
         return -1;
     }
     
@@ -240,21 +262,17 @@ int receive_file_data(ClientState* client, const char* filename) {
         return -1;
     }
     
-    // Now receive the file data header
-    char buffer[1024];
-    ssize_t bytes_received = recv(client->socket_fd, buffer, sizeof(buffer) - 1, 0);
-    if (bytes_received <= 0) {
+    // Now receive the file data header: "FILE_DATA filename size\n"
+    char header[1024];
+    if (read_line(client->socket_fd, header, sizeof(header)) < 0) {
         printf("Failed to receive file data header\n");
         return -1;
     }
     
-    buffer[bytes_received] = '\0';
-    
-    // Parse file header: "FILE_DATA filename size\n"
     char received_filename[256];
     long file_size;
-    if (sscanf(buffer, "FILE_DATA %255s %ld", received_filename, &file_size) != 2) {
-        printf("Invalid file data header: %s\n", buffer);
+    if (sscanf(header, "FILE_DATA %255s %ld", received_filename, &file_size) != 2) {
+        printf("Invalid file data header: %s\n", header);
         return -1;
     }
     
@@ -269,34 +287,26 @@ int receive_file_data(ClientState* client, const char* filename) {
         return -1;
     }
     
-    // Calculate remaining data to receive (subtract header size)
-    long header_size = strlen(buffer);
-    long remaining_bytes = file_size;
-    
-    // Write any remaining data from the first buffer
-    if (bytes_received > header_size) {
-        ssize_t data_bytes = bytes_received - header_size;
-        write(output_fd, buffer + header_size, data_bytes);
-        remaining_bytes -= data_bytes;
-    }
-    
-    // Receive remaining file data
+    // Receive exactly file_size bytes of file data
     char data_buffer[8192];
+    long remaining_bytes = file_size;
     while (remaining_bytes > 0) {
-        size_t buffer_size = sizeof(data_buffer);
-        ssize_t to_read = (remaining_bytes > (long)buffer_size) ? buffer_size : (size_t)remaining_bytes;
-        
-        printf("Waiting to receive %ld more bytes...\n", remaining_bytes);
+        size_t to_read = (remaining_bytes > (long)sizeof(data_buffer)) ? sizeof(data_buffer) : (size_t)remaining_bytes;
         ssize_t bytes_read = recv(client->socket_fd, data_buffer, to_read, 0);
         
         if (bytes_read <= 0) {
-            printf("Failed to receive file data (bytes_read: %ld)\n", bytes_read);
+            printf("Failed to receive file data (%ld bytes missing)\n", remaining_bytes);
             close(output_fd);
+            unlink(output_filename);
             return -1;
         }
         
-        printf("Received %ld bytes\n", bytes_read);
-        write(output_fd, data_buffer, bytes_read);
+        if (write(output_fd, data_buffer, bytes_read) != bytes_read) {
+            perror("Failed to write output file");
+            close(output_fd);
+            unlink(output_filename);
+            return -1;
+        }
         remaining_bytes -= bytes_read;
     }
     
@@ -323,6 +333,7 @@ int delete_file(ClientState* client, const char* filename) {
     return (strncmp(response, "OK", 2) == 0) ? 0 : -1;
 }
 
+// Print the user's files: "OK list", a line per file, then END
 int list_files(ClientState* client) {
     char command[256];
     snprintf(command, sizeof(command), "LIST %s\n", client->username);
@@ -331,14 +342,59 @@ int list_files(ClientState* client) {
         return -1;
     }
 
+    char line[1024];
+    if (read_line(client->socket_fd, line, sizeof(line)) < 0) {
+        printf("Server disconnected\n");
+        return -1;
+    }
+    if (strcmp(line, "OK list\n") != 0) {
+        printf("List response: %s", line);
+        return -1;
+    }
+
+    int files = 0;
+    while (1) {
+        if (read_line(client->socket_fd, line, sizeof(line)) < 0) {
+            printf("Server disconnected\n");
+            return -1;
+        }
+        if (strcmp(line, "END\n") == 0) break;
+        printf("  %s", line);
+        files++;
+    }
+    printf("%d file%s\n", files, files == 1 ? "" : "s");
+    return 0;
+}
+
+// Print the server's metrics: "OK stats <size>" and then size bytes of text
+int show_stats(ClientState* client) {
+    if (send_command(client, "STATS\n") < 0) {
+        return -1;
+    }
+
     char response[1024];
-    if (receive_response(client, response, sizeof(response)) < 0) {
+    long size;
+    if (read_line(client->socket_fd, response, sizeof(response)) < 0) {
+        printf("Server disconnected\n");
+        return -1;
+    }
+    if (sscanf(response, "OK stats %ld", &size) != 1) {
+        printf("Stats response: %s", response);
         return -1;
     }
 
-    printf("List response: %s", response);
-    
-    return (strncmp(response, "OK", 2) == 0) ? 0 : -1;
+    char buffer[8192];
+    while (size > 0) {
+        size_t to_read = (size > (long)sizeof(buffer)) ? sizeof(buffer) : (size_t)size;
+        ssize_t n = recv(client->socket_fd, buffer, to_read, 0);
+        if (n <= 0) {
+            printf("Failed to receive stats (%ld bytes missing)\n", size);
+            return -1;
+        }
+        fwrite(buffer, 1, (size_t)n, stdout);
+        size -= n;
+    }
+    return 0;
 }
 
 void interactive_mode(ClientState* client) {
@@ -356,6 +412,7 @@ void interactive_mode(ClientState* client) {
     printf("  download <filename>                      - Download file\n");
     printf("  delete <filename>                        - Delete file\n");
     printf("  list                                     - List files\n");
+    printf("  stats                                    - Show server metrics\n");
     printf("  quit                                     - Exit\n\n");
     
     while (1) {
@@ -412,6 +469,8 @@ void interactive_mode(ClientState* client) {
             delete_file(client, arg1);
         } else if (strcmp(command, "list") == 0) {
             list_files(client);
+        } else if (strcmp(command, "stats") == 0) {
+            show_stats(client);
         } else {
             printf("Unknown command: %s\n", command);
         }
@@ -0,0 +1,149 @@
+#include "compress.h"
+#include <stdint.h>
+#include <string.h>
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5     // the block always ends with this many literals
+#define LZ4_MFLIMIT 12          // no match may start in the last 12 bytes
+#define LZ4_MAX_DISTANCE 65535
+#define LZ4_HASH_BITS 12
+#define LZ4_SKIP_TRIGGER 6      // search faster through data that doesn't match
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+// Write a length continuation (the part above 15) as 255-runs
+static unsigned char *put_length(unsigned char *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+// Emit one sequence; match_len 0 means the final literals-only sequence
+static unsigned char *put_sequence(unsigned char *op, unsigned char *oend,
+                                   const unsigned char *lit, size_t lit_len,
+                                   size_t offset, size_t match_len) {
+    size_t need = 1 + lit_len / 255 + 1 + lit_len + 2 + match_len / 255 + 1;
+    if ((size_t)(oend - op) < need) return NULL;
+
+    unsigned char *token = op++;
+    size_t ml = match_len ? match_len - LZ4_MIN_MATCH : 0;
+    *token = (unsigned char)(((lit_len < 15 ? lit_len : 15) << 4) | (ml < 15 ? ml : 15));
+    if (lit_len >= 15) op = put_length(op, lit_len - 15);
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (match_len) {
+        *op++ = (unsigned char)offset;
+        *op++ = (unsigned char)(offset >> 8);
+        if (ml >= 15) op = put_length(op, ml - 15);
+    }
+    return op;
+}
+
+size_t lz4_compress(const unsigned char *src, size_t n, unsigned char *dst, size_t cap) {
+    uint32_t table[1 << LZ4_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    unsigned char *op = dst;
+    unsigned char *oend = dst + cap;
+    size_t anchor = 0;
+    size_t ip = 1;
+
+    if (n > LZ4_MFLIMIT) {
+        size_t limit = n - LZ4_MFLIMIT;
+        size_t match_end_limit = n - LZ4_LAST_LITERALS;
+        size_t misses = 0;
+        table[hash4(read32(src))] = 0;
+
+        while (ip < limit) {
+            uint32_t seq = read32(src + ip);
+            uint32_t h = hash4(seq);
+            size_t ref = table[h];
+            table[h] = (uint32_t)ip;
+
+            if (ip - ref > LZ4_MAX_DISTANCE || read32(src + ref) != seq) {
+                ip += 1 + (misses++ >> LZ4_SKIP_TRIGGER);
+                continue;
+            }
+            misses = 0;
+
+            size_t mlen = LZ4_MIN_MATCH;
+            while (ip + mlen < match_end_limit && src[ref + mlen] == src[ip + mlen]) mlen++;
+            while (ip > anchor && ref > 0 && src[ip - 1] == src[ref - 1]) {
+                ip--;
+                ref--;
+                mlen++;
+            }
+
+            op = put_sequence(op, oend, src + anchor, ip - anchor, ip - ref, mlen);
+            if (!op) return 0;
+            ip += mlen;
+            anchor = ip;
+            if (ip - 2 < limit) table[hash4(read32(src + ip - 2))] = (uint32_t)(ip - 2);
+        }
+    }
+
+    op = put_sequence(op, oend, src + anchor, n - anchor, 0, 0);
+    if (!op) return 0;
+    return (size_t)(op - dst);
+}
+
+ssize_t lz4_decompress(const unsigned char *src, size_t n, unsigned char *dst, size_t cap) {
+    size_t ip = 0, op = 0;
+
+    while (ip < n) {
+        unsigned token = src[ip++];
+
+        size_t lit_len = token >> 4;
+        if (lit_len == 15) {
+            unsigned char b;
+            do {
+                if (ip >= n) return -1;
+                b = src[ip++];
+                lit_len += b;
+            } while (b == 255);
+        }
+        if (lit_len > n - ip || lit_len > cap - op) return -1;
+        memcpy(dst + op, src + ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+        if (ip == n) break; // the last sequence has no match
+
+        if (n - ip < 2) return -1;
+        size_t offset = (size_t)src[ip] | ((size_t)src[ip + 1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op) return -1;
+
+        size_t match_len = token & 15;
+        if (match_len == 15) {
+            unsigned char b;
+            do {
+                if (ip >= n) return -1;
+                b = src[ip++];
+                match_len += b;
+            } while (b == 255);
+        }
+        match_len += LZ4_MIN_MATCH;
+        if (match_len > cap - op) return -1;
+
+        const unsigned char *m = dst + op - offset;
+        if (offset >= match_len) {
+            memcpy(dst + op, m, match_len);
+        } else {
+            // Overlapping copy repeats the last offset bytes
+            for (size_t i = 0; i < match_len; i++) dst[op + i] = m[i];
+        }
+        op += match_len;
+    }
+    return (ssize_t)op;
+}
@@ -1,4 +1,6 @@
 #include "config.h"
+#include "log.h"
+#include "crypto.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,6 +15,23 @@ static struct {
     bool use_persistent_storage;
     char storage_path[MAX_PATH_LENGTH];
     char database_file[MAX_PATH_LENGTH];
+    bool use_reactor;
+    int io_threads;
+    int log_level;
+    int file_codec;
+    bool compress_files;
+    size_t user_quota_bytes;
+    unsigned queue_aging_ms;
+    unsigned queue_capacity[PRIORITY_COUNT];
+    unsigned queue_target_ms;
+    unsigned queue_interval_ms;
+    size_t queue_quantum_bytes;
+    unsigned queue_max_user_flows;
+    int worker_threads;
+    int pipeline_depth;
+    unsigned request_timeout_ms;
+    char metrics_file[MAX_PATH_LENGTH];
+    unsigned metrics_interval_ms;
 } config;
 
 // Forward declarations
@@ -61,6 +80,80 @@ void config_init(const char *config_file) {
                 strncpy(config.database_file, value, sizeof(config.database_file) - 1);
                 config.database_file[sizeof(config.database_file) - 1] = '\0';
             }
+            else if (strcmp(key, "connection_mode") == 0) {
+                config.use_reactor = (strcmp(value, "reactor") == 0);
+            }
+            else if (strcmp(key, "io_threads") == 0) {
+                int n = atoi(value);
+                if (n > 0) config.io_threads = n;
+            }
+            else if (strcmp(key, "log_level") == 0) {
+                int level = log_level_from_string(value);
+                if (level >= 0) config.log_level = level;
+                else fprintf(stderr, "Warning: Unknown log_level '%s'\n", value);
+            }
+            else if (strcmp(key, "file_codec") == 0) {
+                int codec = codec_from_name(value);
+                if (codec >= 0) config.file_codec = codec;
+                else fprintf(stderr, "Warning: Unknown file_codec '%s'\n", value);
+            }
+            else if (strcmp(key, "file_compression") == 0) {
+                if (strcmp(value, "lz4") == 0) config.compress_files = true;
+                else if (strcmp(value, "none") == 0) config.compress_files = false;
+                else fprintf(stderr, "Warning: Unknown file_compression '%s'\n", value);
+            }
+            else if (strcmp(key, "user_quota_mb") == 0) {
+                long mb = atol(value);
+                if (mb > 0) config.user_quota_bytes = (size_t)mb << 20;
+            }
+            else if (strcmp(key, "worker_threads") == 0) {
+                int n = atoi(value);
+                if (n > 0) config.worker_threads = n;
+            }
+            else if (strcmp(key, "pipeline_depth") == 0) {
+                int n = atoi(value);
+                if (n > 0) config.pipeline_depth = n;
+            }
+            else if (strcmp(key, "request_timeout_ms") == 0) {
+                int ms = atoi(value);
+                if (ms >= 0) config.request_timeout_ms = (unsigned)ms;
+            }
+            else if (strcmp(key, "metrics_file") == 0) {
+                strncpy(config.metrics_file, value, sizeof(config.metrics_file) - 1);
+                config.metrics_file[sizeof(config.metrics_file) - 1] = '\0';
+            }
+            else if (strcmp(key, "metrics_interval_ms") == 0) {
+                int ms = atoi(value);
+                if (ms >= 0) config.metrics_interval_ms = (unsigned)ms;
+            }
+            else if (strcmp(key, "queue_aging_ms") == 0) {
+                int ms = atoi(value);
+                if (ms >= 0) config.queue_aging_ms = (unsigned)ms;
+            }
+            else if (strcmp(key, "queue_capacity_high") == 0 ||
+                     strcmp(key, "queue_capacity_normal") == 0 ||
+                     strcmp(key, "queue_capacity_low") == 0) {
+                TaskPriority level = key[15] == 'h' ? PRIORITY_HIGH
+                                   : key[15] == 'n' ? PRIORITY_NORMAL : PRIORITY_LOW;
+                int n = atoi(value);
+                if (n >= 0) config.queue_capacity[level] = (unsigned)n;
+            }
+            else if (strcmp(key, "queue_quantum_kb") == 0) {
+                long kb = atol(value);
+                if (kb > 0) config.queue_quantum_bytes = (size_t)kb << 10;
+            }
+            else if (strcmp(key, "queue_max_user_flows") == 0) {
+                int n = atoi(value);
+                if (n > 0) config.queue_max_user_flows = (unsigned)n;
+            }
+            else if (strcmp(key, "queue_target_ms") == 0) {
+                int ms = atoi(value);
+                if (ms >= 0) config.queue_target_ms = (unsigned)ms;
+            }
+            else if (strcmp(key, "queue_interval_ms") == 0) {
+                int ms = atoi(value);
+                if (ms > 0) config.queue_interval_ms = (unsigned)ms;
+            }
         }
     }
     
@@ -87,6 +180,75 @@ const char *config_get_database_file(void) {
     return config.database_file;
 }
 
+bool config_use_reactor(void) {
+    return config.use_reactor;
+}
+
+int config_get_io_threads(void) {
+    return config.io_threads;
+}
+
+int config_get_log_level(void) {
+    return config.log_level;
+}
+
+int config_get_file_codec(void) {
+    return config.file_codec;
+}
+
+bool config_compress_files(void) {
+    return config.compress_files;
+}
+
+size_t config_get_user_quota_bytes(void) {
+    return config.user_quota_bytes;
+}
+
+int config_get_worker_threads(void) {
+    return config.worker_threads;
+}
+
+int config_get_pipeline_depth(void) {
+    return config.pipeline_depth;
+}
+
+unsigned config_get_queue_aging_ms(void) {
+    return config.queue_aging_ms;
+}
+
+unsigned config_get_queue_capacity(TaskPriority priority) {
+    if (priority < 0 || priority >= PRIORITY_COUNT) return 0;
+    return config.queue_capacity[priority];
+}
+
+size_t config_get_queue_quantum_bytes(void) {
+    return config.queue_quantum_bytes;
+}
+
+unsigned config_get_queue_max_user_flows(void) {
+    return config.queue_max_user_flows;
+}
+
+unsigned config_get_queue_target_ms(void) {
+    return config.queue_target_ms;
+}
+
+unsigned config_get_queue_interval_ms(void) {
+    return config.queue_interval_ms;
+}
+
+unsigned config_get_request_timeout_ms(void) {
+    return config.request_timeout_ms;
+}
+
+const char *config_get_metrics_file(void) {
+    return config.metrics_file;
+}
+
+unsigned config_get_metrics_interval_ms(void) {
+    return config.metrics_interval_ms;
+}
+
 // Helper function to trim whitespace from a string
 static void trim_whitespace(char *str) {
     if (!str) return;
@@ -123,4 +285,23 @@ static void set_default_config(void) {
     config.use_persistent_storage = true; // Default to persistent storage
     strncpy(config.storage_path, "./storage", sizeof(config.storage_path));
     strncpy(config.database_file, "users.db", sizeof(config.database_file));
+    config.use_reactor = false; // Default to one client per thread
+    config.io_threads = 2;
+    config.log_level = LOG_LEVEL_INFO;
+    config.file_codec = CODEC_CHACHA20;
+    config.compress_files = true;
+    config.user_quota_bytes = (size_t)100 << 20;
+    config.queue_aging_ms = 500;
+    config.queue_capacity[PRIORITY_HIGH] = 1024;
+    config.queue_capacity[PRIORITY_NORMAL] = 1024;
+    config.queue_capacity[PRIORITY_LOW] = 256;
+    config.queue_target_ms = 100;
+    config.queue_quantum_bytes = (size_t)64 << 10;
+    config.queue_max_user_flows = 4096;
+    config.queue_interval_ms = 500;
+    config.worker_threads = 4;
+    config.pipeline_depth = 32;
+    config.request_timeout_ms = 5000;
+    config.metrics_file[0] = '\0';
+    config.metrics_interval_ms = 10000;
 }
@@ -1,26 +1,502 @@
+#define _GNU_SOURCE
 #include "crypto.h"
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/random.h>
 
-// Simple XOR-based encoding/decoding with a fixed key
-// In a real application, use a proper encryption library like OpenSSL
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRYPTO_X86 1
+#endif
 
-// Simple XOR cipher with a fixed key
-static void xor_cipher(const unsigned char *input, unsigned char *output, size_t len, const char *key) {
-    size_t key_len = strlen(key);
-    for (size_t i = 0; i < len; i++) {
-        output[i] = input[i] ^ key[i % key_len];
+// ---- legacy XOR codec ----
+
+// Simple XOR-based encoding/decoding with a fixed key. Kept so files written
+// before ChaCha20 existed still read back.
+static const char xor_key[] = "MySecretKey123";  // In a real app, use a secure key management system
+
+// The key repeated over one whole block, so kernels never compute i % key_len
+// and can load key bytes with plain vector loads
+static _Alignas(64) unsigned char key_stream[CRYPTO_XOR_BLOCK];
+
+typedef void (*XorKernel)(unsigned char *buf, const unsigned char *ks, size_t len);
+
+static void xor_scalar(unsigned char *buf, const unsigned char *ks, size_t len) {
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t a, b;
+        memcpy(&a, buf + i, 8);
+        memcpy(&b, ks + i, 8);
+        a ^= b;
+        memcpy(buf + i, &a, 8);
+    }
+    for (; i < len; i++) buf[i] ^= ks[i];
+}
+
+#ifdef CRYPTO_X86
+__attribute__((target("sse2")))
+static void xor_sse2(unsigned char *buf, const unsigned char *ks, size_t len) {
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64) {
+        __m128i a0 = _mm_loadu_si128((const __m128i *)(buf + i));
+        __m128i a1 = _mm_loadu_si128((const __m128i *)(buf + i + 16));
+        __m128i a2 = _mm_loadu_si128((const __m128i *)(buf + i + 32));
+        __m128i a3 = _mm_loadu_si128((const __m128i *)(buf + i + 48));
+        a0 = _mm_xor_si128(a0, _mm_loadu_si128((const __m128i *)(ks + i)));
+        a1 = _mm_xor_si128(a1, _mm_loadu_si128((const __m128i *)(ks + i + 16)));
+        a2 = _mm_xor_si128(a2, _mm_loadu_si128((const __m128i *)(ks + i + 32)));
+        a3 = _mm_xor_si128(a3, _mm_loadu_si128((const __m128i *)(ks + i + 48)));
+        _mm_storeu_si128((__m128i *)(buf + i), a0);
+        _mm_storeu_si128((__m128i *)(buf + i + 16), a1);
+        _mm_storeu_si128((__m128i *)(buf + i + 32), a2);
+        _mm_storeu_si128((__m128i *)(buf + i + 48), a3);
+    }
+    for (; i + 16 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(buf + i));
+        a = _mm_xor_si128(a, _mm_loadu_si128((const __m128i *)(ks + i)));
+        _mm_storeu_si128((__m128i *)(buf + i), a);
+    }
+    xor_scalar(buf + i, ks + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void xor_avx2(unsigned char *buf, const unsigned char *ks, size_t len) {
+    size_t i = 0;
+    for (; i + 128 <= len; i += 128) {
+        __m256i a0 = _mm256_loadu_si256((const __m256i *)(buf + i));
+        __m256i a1 = _mm256_loadu_si256((const __m256i *)(buf + i + 32));
+        __m256i a2 = _mm256_loadu_si256((const __m256i *)(buf + i + 64));
+        __m256i a3 = _mm256_loadu_si256((const __m256i *)(buf + i + 96));
+        a0 = _mm256_xor_si256(a0, _mm256_loadu_si256((const __m256i *)(ks + i)));
+        a1 = _mm256_xor_si256(a1, _mm256_loadu_si256((const __m256i *)(ks + i + 32)));
+        a2 = _mm256_xor_si256(a2, _mm256_loadu_si256((const __m256i *)(ks + i + 64)));
+        a3 = _mm256_xor_si256(a3, _mm256_loadu_si256((const __m256i *)(ks + i + 96)));
+        _mm256_storeu_si256((__m256i *)(buf + i), a0);
+        _mm256_storeu_si256((__m256i *)(buf + i + 32), a1);
+        _mm256_storeu_si256((__m256i *)(buf + i + 64), a2);
+        _mm256_storeu_si256((__m256i *)(buf + i + 96), a3);
+    }
+    for (; i + 32 <= len; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(buf + i));
+        a = _mm256_xor_si256(a, _mm256_loadu_si256((const __m256i *)(ks + i)));
+        _mm256_storeu_si256((__m256i *)(buf + i), a);
+    }
+    xor_sse2(buf + i, ks + i, len - i);
+}
+#endif
+
+// ---- ChaCha20 (RFC 8439) ----
+
+// Server key as little-endian words, set by crypto_load_key
+static uint32_t chacha_key[8];
+static bool chacha_key_loaded = false;
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define CHACHA_QR(a, b, c, d) \
+    do { \
+        a += b; d ^= a; d = ROTL32(d, 16); \
+        c += d; b ^= c; b = ROTL32(b, 12); \
+        a += b; d ^= a; d = ROTL32(d, 8); \
+        c += d; b ^= c; b = ROTL32(b, 7); \
+    } while (0)
+
+static uint32_t load32_le(const unsigned char *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// The block counter is 32 bits (256 GiB of key stream); the upper bits of a
+// longer file's block number are folded into the first nonce word, so no
+// block of a file ever repeats another's key stream.
+static void chacha_init_state(uint32_t st[16], const unsigned char nonce[CODEC_NONCE_LEN], uint64_t block) {
+    st[0] = 0x61707865; st[1] = 0x3320646e; st[2] = 0x79622d32; st[3] = 0x6b206574;
+    memcpy(&st[4], chacha_key, sizeof(chacha_key));
+    st[12] = (uint32_t)block;
+    st[13] = load32_le(nonce) ^ (uint32_t)(block >> 32);
+    st[14] = load32_le(nonce + 4);
+    st[15] = load32_le(nonce + 8);
+}
+
+// One 64-byte key stream block for the counter in st[12]
+static void chacha_block(const uint32_t st[16], unsigned char out[64]) {
+    uint32_t x[16];
+    memcpy(x, st, sizeof(x));
+    for (int i = 0; i < 10; i++) {
+        CHACHA_QR(x[0], x[4], x[8],  x[12]);
+        CHACHA_QR(x[1], x[5], x[9],  x[13]);
+        CHACHA_QR(x[2], x[6], x[10], x[14]);
+        CHACHA_QR(x[3], x[7], x[11], x[15]);
+        CHACHA_QR(x[0], x[5], x[10], x[15]);
+        CHACHA_QR(x[1], x[6], x[11], x[12]);
+        CHACHA_QR(x[2], x[7], x[8],  x[13]);
+        CHACHA_QR(x[3], x[4], x[9],  x[14]);
+    }
+    for (int i = 0; i < 16; i++) {
+        uint32_t v = x[i] + st[i];
+        out[4 * i] = (unsigned char)v;
+        out[4 * i + 1] = (unsigned char)(v >> 8);
+        out[4 * i + 2] = (unsigned char)(v >> 16);
+        out[4 * i + 3] = (unsigned char)(v >> 24);
     }
 }
 
+// XOR nblocks whole 64-byte blocks of buf with the key stream starting at
+// the counter in st[12]. Returns how many blocks were done; kernels only
+// handle their full batch width and leave the remainder to the scalar path.
+typedef size_t (*ChachaKernel)(const uint32_t st[16], unsigned char *buf, size_t nblocks);
+
+static size_t chacha_blocks_scalar(const uint32_t st[16], unsigned char *buf, size_t nblocks) {
+    uint32_t s[16];
+    memcpy(s, st, sizeof(s));
+    unsigned char ks[64];
+    for (size_t b = 0; b < nblocks; b++) {
+        chacha_block(s, ks);
+        xor_scalar(buf + 64 * b, ks, 64);
+        s[12]++;
+    }
+    return nblocks;
+}
+
+#ifdef CRYPTO_X86
+#define CHACHA_ROTL_SSE(v, n) _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - (n)))
+#define CHACHA_QR_SSE(a, b, c, d) \
+    do { \
+        a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = CHACHA_ROTL_SSE(d, 16); \
+        c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = CHACHA_ROTL_SSE(b, 12); \
+        a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = CHACHA_ROTL_SSE(d, 8); \
+        c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = CHACHA_ROTL_SSE(b, 7); \
+    } while (0)
+
+// Four blocks at a time: vector x[i] holds word i of each of the four blocks
+__attribute__((target("sse2")))
+static size_t chacha_blocks_sse2(const uint32_t st[16], unsigned char *buf, size_t nblocks) {
+    size_t done = 0;
+    for (; done + 4 <= nblocks; done += 4) {
+        __m128i in[16], x[16];
+        for (int i = 0; i < 16; i++) in[i] = _mm_set1_epi32((int)st[i]);
+        in[12] = _mm_add_epi32(_mm_set1_epi32((int)(st[12] + (uint32_t)done)), _mm_setr_epi32(0, 1, 2, 3));
+        for (int i = 0; i < 16; i++) x[i] = in[i];
+        for (int r = 0; r < 10; r++) {
+            CHACHA_QR_SSE(x[0], x[4], x[8],  x[12]);
+            CHACHA_QR_SSE(x[1], x[5], x[9],  x[13]);
+            CHACHA_QR_SSE(x[2], x[6], x[10], x[14]);
+            CHACHA_QR_SSE(x[3], x[7], x[11], x[15]);
+            CHACHA_QR_SSE(x[0], x[5], x[10], x[15]);
+            CHACHA_QR_SSE(x[1], x[6], x[11], x[12]);
+            CHACHA_QR_SSE(x[2], x[7], x[8],  x[13]);
+            CHACHA_QR_SSE(x[3], x[4], x[9],  x[14]);
+        }
+        for (int i = 0; i < 16; i++) x[i] = _mm_add_epi32(x[i], in[i]);
+
+        // Transpose each group of four words into 16 contiguous bytes per block
+        unsigned char *out = buf + 64 * done;
+        for (int g = 0; g < 4; g++) {
+            __m128i t0 = _mm_unpacklo_epi32(x[4 * g], x[4 * g + 1]);
+            __m128i t1 = _mm_unpacklo_epi32(x[4 * g + 2], x[4 * g + 3]);
+            __m128i t2 = _mm_unpackhi_epi32(x[4 * g], x[4 * g + 1]);
+            __m128i t3 = _mm_unpackhi_epi32(x[4 * g + 2], x[4 * g + 3]);
+            __m128i k[4] = {
+                _mm_unpacklo_epi64(t0, t1), _mm_unpackhi_epi64(t0, t1),
+                _mm_unpacklo_epi64(t2, t3), _mm_unpackhi_epi64(t2, t3)
+            };
+            for (int b = 0; b < 4; b++) {
+                __m128i *p = (__m128i *)(out + 64 * b + 16 * g);
+                _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), k[b]));
+            }
+        }
+    }
+    return done;
+}
+
+#define CHACHA_ROTL_AVX(v, n) _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - (n)))
+#define CHACHA_QR_AVX(a, b, c, d) \
+    do { \
+        a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a); d = _mm256_shuffle_epi8(d, rot16); \
+        c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); b = CHACHA_ROTL_AVX(b, 12); \
+        a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a); d = _mm256_shuffle_epi8(d, rot8); \
+        c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); b = CHACHA_ROTL_AVX(b, 7); \
+    } while (0)
+
+// Eight blocks at a time, same layout as the SSE2 kernel
+__attribute__((target("avx2")))
+static size_t chacha_blocks_avx2(const uint32_t st[16], unsigned char *buf, size_t nblocks) {
+    const __m256i rot16 = _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+                                           2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+    const __m256i rot8 = _mm256_setr_epi8(3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14,
+                                          3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14);
+    size_t done = 0;
+    for (; done + 8 <= nblocks; done += 8) {
+        __m256i in[16], x[16];
+        for (int i = 0; i < 16; i++) in[i] = _mm256_set1_epi32((int)st[i]);
+        in[12] = _mm256_add_epi32(_mm256_set1_epi32((int)(st[12] + (uint32_t)done)),
+                                  _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+        for (int i = 0; i < 16; i++) x[i] = in[i];
+        for (int r = 0; r < 10; r++) {
+            CHACHA_QR_AVX(x[0], x[4], x[8],  x[12]);
+            CHACHA_QR_AVX(x[1], x[5], x[9],  x[13]);
+            CHACHA_QR_AVX(x[2], x[6], x[10], x[14]);
+            CHACHA_QR_AVX(x[3], x[7], x[11], x[15]);
+            CHACHA_QR_AVX(x[0], x[5], x[10], x[15]);
+            CHACHA_QR_AVX(x[1], x[6], x[11], x[12]);
+            CHACHA_QR_AVX(x[2], x[7], x[8],  x[13]);
+            CHACHA_QR_AVX(x[3], x[4], x[9],  x[14]);
+        }
+        for (int i = 0; i < 16; i++) x[i] = _mm256_add_epi32(x[i], in[i]);
+
+        // Transpose each half (words 0-7, then 8-15) into 32 bytes per block.
+        // After the unpacks, 128-bit lane 0 holds blocks 0-3 and lane 1
+        // holds blocks 4-7.
+        unsigned char *out = buf + 64 * done;
+        for (int h = 0; h < 2; h++) {
+            const __m256i *w = &x[8 * h];
+            __m256i t0 = _mm256_unpacklo_epi32(w[0], w[1]);
+            __m256i t1 = _mm256_unpackhi_epi32(w[0], w[1]);
+            __m256i t2 = _mm256_unpacklo_epi32(w[2], w[3]);
+            __m256i t3 = _mm256_unpackhi_epi32(w[2], w[3]);
+            __m256i t4 = _mm256_unpacklo_epi32(w[4], w[5]);
+            __m256i t5 = _mm256_unpackhi_epi32(w[4], w[5]);
+            __m256i t6 = _mm256_unpacklo_epi32(w[6], w[7]);
+            __m256i t7 = _mm256_unpackhi_epi32(w[6], w[7]);
+            __m256i lo[4] = {
+                _mm256_unpacklo_epi64(t0, t2), _mm256_unpackhi_epi64(t0, t2),
+                _mm256_unpacklo_epi64(t1, t3), _mm256_unpackhi_epi64(t1, t3)
+            };
+            __m256i hi[4] = {
+                _mm256_unpacklo_epi64(t4, t6), _mm256_unpackhi_epi64(t4, t6),
+                _mm256_unpacklo_epi64(t5, t7), _mm256_unpackhi_epi64(t5, t7)
+            };
+            for (int b = 0; b < 4; b++) {
+                __m256i k0 = _mm256_permute2x128_si256(lo[b], hi[b], 0x20);
+                __m256i k1 = _mm256_permute2x128_si256(lo[b], hi[b], 0x31);
+                __m256i *p0 = (__m256i *)(out + 64 * b + 32 * h);
+                __m256i *p1 = (__m256i *)(out + 64 * (b + 4) + 32 * h);
+                _mm256_storeu_si256(p0, _mm256_xor_si256(_mm256_loadu_si256(p0), k0));
+                _mm256_storeu_si256(p1, _mm256_xor_si256(_mm256_loadu_si256(p1), k1));
+            }
+        }
+    }
+    return done;
+}
+#endif
+
+// ---- kernel dispatch ----
+
+static XorKernel xor_kernel = xor_scalar;
+static ChachaKernel chacha_kernel = chacha_blocks_scalar;
+static const char *kernel_name = "scalar";
+static pthread_once_t crypto_once = PTHREAD_ONCE_INIT;
+
+static void crypto_setup(void) {
+    size_t key_len = sizeof(xor_key) - 1;
+    for (size_t i = 0; i < CRYPTO_XOR_BLOCK; i++) {
+        key_stream[i] = (unsigned char)xor_key[i % key_len];
+    }
+#ifdef CRYPTO_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        xor_kernel = xor_avx2;
+        chacha_kernel = chacha_blocks_avx2;
+        kernel_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        xor_kernel = xor_sse2;
+        chacha_kernel = chacha_blocks_sse2;
+        kernel_name = "sse2";
+    }
+#endif
+}
+
+const char *crypto_kernel_name(void) {
+    pthread_once(&crypto_once, crypto_setup);
+    return kernel_name;
+}
+
+void encode_in_place(unsigned char *buf, size_t len, size_t offset) {
+    pthread_once(&crypto_once, crypto_setup);
+    size_t pos = offset % CRYPTO_XOR_BLOCK;
+    while (len > 0) {
+        // Never cross a block boundary in one kernel call: the key restarts there
+        size_t n = CRYPTO_XOR_BLOCK - pos;
+        if (n > len) n = len;
+        xor_kernel(buf, key_stream + pos, n);
+        buf += n;
+        len -= n;
+        pos = 0;
+    }
+}
+
+void decode_in_place(unsigned char *buf, size_t len, size_t offset) {
+    // Decoding is the same as encoding with XOR
+    encode_in_place(buf, len, offset);
+}
+
+// Seeking is free: the block number for any offset is offset / 64. The
+// span must not cross a 2^32-block boundary, where the counter would wrap.
+static void chacha_apply_span(const CodecParams *params, unsigned char *buf, size_t len, uint64_t offset) {
+    uint32_t st[16];
+    chacha_init_state(st, params->nonce, offset / 64);
+    unsigned char ks[64];
+
+    // Leading partial block
+    size_t skip = (size_t)(offset % 64);
+    if (skip && len > 0) {
+        size_t n = 64 - skip < len ? 64 - skip : len;
+        chacha_block(st, ks);
+        xor_scalar(buf, ks + skip, n);
+        buf += n;
+        len -= n;
+        st[12]++;
+    }
+
+    size_t nblocks = len / 64;
+    size_t done = chacha_kernel(st, buf, nblocks);
+    if (done < nblocks) {
+        st[12] += (uint32_t)done;
+        chacha_blocks_scalar(st, buf + 64 * done, nblocks - done);
+        st[12] += (uint32_t)(nblocks - done);
+    } else {
+        st[12] += (uint32_t)done;
+    }
+    buf += 64 * nblocks;
+    len -= 64 * nblocks;
+
+    // Trailing partial block
+    if (len > 0) {
+        chacha_block(st, ks);
+        xor_scalar(buf, ks, len);
+    }
+}
+
+static void chacha_apply(const CodecParams *params, unsigned char *buf, size_t len, uint64_t offset) {
+    pthread_once(&crypto_once, crypto_setup);
+    while (len > 0) {
+        uint64_t span_end = ((offset >> 38) + 1) << 38;
+        size_t n = span_end - offset < len ? (size_t)(span_end - offset) : len;
+        chacha_apply_span(params, buf, n, offset);
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+}
+
+// ---- codec registry ----
+
+typedef struct {
+    CodecId id;
+    const char *name;
+    bool needs_key;
+    void (*apply)(const CodecParams *params, unsigned char *buf, size_t len, uint64_t offset);
+} Codec;
+
+static void none_apply(const CodecParams *params, unsigned char *buf, size_t len, uint64_t offset) {
+    (void)params; (void)buf; (void)len; (void)offset;
+}
+
+static void xor_apply(const CodecParams *params, unsigned char *buf, size_t len, uint64_t offset) {
+    (void)params;
+    encode_in_place(buf, len, (size_t)offset);
+}
+
+static const Codec codecs[] = {
+    { CODEC_NONE,     "none",     false, none_apply },
+    { CODEC_XOR,      "xor",      false, xor_apply },
+    { CODEC_CHACHA20, "chacha20", true,  chacha_apply },
+};
+
+static const Codec *codec_lookup(int id) {
+    for (size_t i = 0; i < sizeof(codecs) / sizeof(codecs[0]); i++) {
+        if ((int)codecs[i].id == id) return &codecs[i];
+    }
+    return NULL;
+}
+
+int codec_from_name(const char *name) {
+    for (size_t i = 0; i < sizeof(codecs) / sizeof(codecs[0]); i++) {
+        if (strcmp(codecs[i].name, name) == 0) return (int)codecs[i].id;
+    }
+    return -1;
+}
+
+const char *codec_name(int id) {
+    const Codec *c = codec_lookup(id);
+    return c ? c->name : NULL;
+}
+
+bool codec_init(CodecParams *params, CodecId id, char *err, size_t errlen) {
+    const Codec *c = codec_lookup(id);
+    if (!c) {
+        snprintf(err, errlen, "Unknown codec %d", (int)id);
+        return false;
+    }
+    if (c->needs_key && !chacha_key_loaded) {
+        snprintf(err, errlen, "No key loaded for codec %s", c->name);
+        return false;
+    }
+    memset(params, 0, sizeof(*params));
+    params->id = id;
+    if (id == CODEC_CHACHA20 &&
+        getrandom(params->nonce, sizeof(params->nonce), 0) != (ssize_t)sizeof(params->nonce)) {
+        snprintf(err, errlen, "Failed to generate nonce: %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+void codec_apply(const CodecParams *params, unsigned char *buf, size_t len, uint64_t offset) {
+    const Codec *c = codec_lookup(params->id);
+    if (c) c->apply(params, buf, len, offset);
+}
+
+bool crypto_load_key(const char *key_path, char *err, size_t errlen) {
+    unsigned char key[CODEC_KEY_LEN];
+    int fd = open(key_path, O_RDONLY);
+    if (fd >= 0) {
+        ssize_t n = read(fd, key, sizeof(key));
+        close(fd);
+        if (n != (ssize_t)sizeof(key)) {
+            snprintf(err, errlen, "Key file %s is truncated", key_path);
+            return false;
+        }
+    } else if (errno == ENOENT) {
+        if (getrandom(key, sizeof(key), 0) != (ssize_t)sizeof(key)) {
+            snprintf(err, errlen, "Failed to generate key: %s", strerror(errno));
+            return false;
+        }
+        fd = open(key_path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+        if (fd < 0) {
+            snprintf(err, errlen, "Failed to create key file %s: %s", key_path, strerror(errno));
+            return false;
+        }
+        bool written = write(fd, key, sizeof(key)) == (ssize_t)sizeof(key);
+        if (close(fd) != 0) written = false;
+        if (!written) {
+            unlink(key_path);
+            snprintf(err, errlen, "Failed to write key file %s", key_path);
+            return false;
+        }
+    } else {
+        snprintf(err, errlen, "Failed to open key file %s: %s", key_path, strerror(errno));
+        return false;
+    }
+
+    for (int i = 0; i < 8; i++) chacha_key[i] = load32_le(key + 4 * i);
+    memset(key, 0, sizeof(key));
+    chacha_key_loaded = true;
+    return true;
+}
+
 // Encode data - returns newly allocated buffer that must be freed by caller
 unsigned char *encode_data(const unsigned char *data, size_t len, size_t *out_len) {
-    const char *key = "MySecretKey123";  // In a real app, use a secure key management system
     *out_len = len;
-    unsigned char *encoded = (unsigned char *)malloc(*out_len);
+    unsigned char *encoded = (unsigned char *)malloc(len ? len : 1);
     if (!encoded) return NULL;
-    
-    xor_cipher(data, encoded, len, key);
+
+    memcpy(encoded, data, len);
+    encode_in_place(encoded, len, 0);
     return encoded;
 }
 
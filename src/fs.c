@@ -1,5 +1,8 @@
+#define _GNU_SOURCE
 #include "fs.h"
 #include "crypto.h"
+#include "config.h"
+#include "compress.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -7,256 +10,1000 @@
 #include <sys/stat.h>
 #include <time.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/random.h>
+#include <sys/file.h>
 
 static void build_user_path(UserStore *store, const char *user, const char *rel, char *out, size_t out_len) {
 	snprintf(out, out_len, "%s/%s/%s", user_store_get_root(store), user, rel ? rel : "");
 }
 
-bool fs_upload(UserStore *store, const char *user, const char *dst_relpath, const char *tmp_src, size_t size, char *err, size_t errlen) {
-    (void)size; // Size parameter not currently used but kept for API consistency
-    if (!store || !user || !dst_relpath || !tmp_src) {
-        snprintf(err, errlen, "Invalid parameters");
+// Random lowercase hex id for upload sessions and temp files
+static bool random_id(char id[FS_UPLOAD_ID_LEN + 1], char *err, size_t errlen) {
+    unsigned char rnd[FS_UPLOAD_ID_LEN / 2];
+    if (getrandom(rnd, sizeof(rnd), 0) != (ssize_t)sizeof(rnd)) {
+        snprintf(err, errlen, "Failed to generate upload id: %s", strerror(errno));
         return false;
     }
+    for (size_t i = 0; i < sizeof(rnd); i++) snprintf(id + 2 * i, 3, "%02x", rnd[i]);
+    return true;
+}
+
+// Uploads are written to a hidden sibling, ".<name>.<id>.part", and renamed
+// into place, so a failed or interrupted upload never clobbers the existing
+// file and concurrent uploads of one path don't share a temp file.
+static void build_upload_temp_path(const char *dst, const char *id, char *out, size_t out_len) {
+    const char *slash = strrchr(dst, '/');
+    size_t dir_len = slash ? (size_t)(slash - dst) + 1 : 0;
+    snprintf(out, out_len, "%.*s.%s.%s.part", (int)dir_len, dst, dst + dir_len, id);
+}
+
+// Every stored file starts with a fixed header:
+//   0  magic "FSC1"
+//   4  codec id (CodecId)
+//   5  flags (FS_FLAG_*)
+//   8  chunk size the file was written with, little-endian
+//  12  nonce (CODEC_NONCE_LEN bytes)
+//  24  plaintext size of compressed files (u64, little-endian), else zero
+// Files without the magic predate the header and are legacy XOR.
+//
+// Compressed files hold one LZ4 block per chunk, followed by an index of
+// one little-endian u32 per chunk: its stored length, with FS_CHUNK_RAW set
+// if it was kept uncompressed. Chunks are independent, so any of them can
+// be decoded on its own. The codec runs over the stored bytes.
+#define FS_HEADER_MAGIC "FSC1"
+#define FS_HEADER_SIZE 32
+#define FS_FLAG_COMPRESSED 0x01
+#define FS_MAX_CHUNK (16u << 20) // sanity bound when reading headers
+
+// Where the pieces of a stored file are
+typedef struct {
+    CodecParams codec;
+    bool compressed;
+    uint32_t chunk_size;
+    off_t data_offset;      // start of the stored data
+    uint64_t plain_size;    // bytes a download produces
+    uint64_t stored_size;   // bytes of stored data, not counting the index
+    size_t nchunks;         // index entries (compressed files only)
+} FsLayout;
+
+static void put_le(unsigned char *p, uint64_t v, int bytes) {
+    for (int i = 0; i < bytes; i++) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static uint64_t get_le(const unsigned char *p, int bytes) {
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; i++) v |= (uint64_t)p[i] << (8 * i);
+    return v;
+}
+
+static void header_encode(unsigned char *h, const CodecParams *codec, uint32_t chunk_size,
+                          bool compressed, uint64_t plain_size) {
+    memset(h, 0, FS_HEADER_SIZE);
+    memcpy(h, FS_HEADER_MAGIC, 4);
+    h[4] = (unsigned char)codec->id;
+    h[5] = compressed ? FS_FLAG_COMPRESSED : 0;
+    put_le(h + 8, chunk_size, 4);
+    memcpy(h + 12, codec->nonce, CODEC_NONCE_LEN);
+    if (compressed) put_le(h + 24, plain_size, 8);
+}
+
+static bool pread_all(int fd, unsigned char *buf, size_t len, off_t off) {
+    size_t have = 0;
+    while (have < len) {
+        ssize_t n = pread(fd, buf + have, len - have, off + (off_t)have);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return false;
+        if (n == 0) {
+            // Truncated underneath us
+            errno = EIO;
+            return false;
+        }
+        have += (size_t)n;
+    }
+    return true;
+}
+
+// Work out a file's layout from its header and size. Returns false if the
+// header is present but unusable (unknown codec or flags, bad sizes).
+static bool layout_read(int fd, off_t file_size, FsLayout *lo) {
+    memset(lo, 0, sizeof(*lo));
+    unsigned char h[FS_HEADER_SIZE];
+    ssize_t n = pread(fd, h, sizeof(h), 0);
     
-    char dst[512];
-    build_user_path(store, user, dst_relpath, dst, sizeof(dst));
+    if (n < FS_HEADER_SIZE || memcmp(h, FS_HEADER_MAGIC, 4) != 0) {
+        lo->codec.id = CODEC_XOR;
+        lo->plain_size = lo->stored_size = (uint64_t)file_size;
+        return true;
+    }
     
-    // Create directory if it doesn't exist
+    if (!codec_name(h[4]) || (h[5] & ~FS_FLAG_COMPRESSED)) return false;
+    lo->codec.id = (CodecId)h[4];
+    memcpy(lo->codec.nonce, h + 12, CODEC_NONCE_LEN);
+    lo->data_offset = FS_HEADER_SIZE;
+    lo->chunk_size = (uint32_t)get_le(h + 8, 4);
+    uint64_t body = (uint64_t)file_size - FS_HEADER_SIZE;
+    
+    if (!(h[5] & FS_FLAG_COMPRESSED)) {
+        lo->plain_size = lo->stored_size = body;
+        return true;
+    }
+    
+    lo->compressed = true;
+    lo->plain_size = get_le(h + 24, 8);
+    if (lo->chunk_size == 0 || lo->chunk_size > FS_MAX_CHUNK) return false;
+    uint64_t nchunks = (lo->plain_size + lo->chunk_size - 1) / lo->chunk_size;
+    if (nchunks > body / 4) return false;
+    lo->nchunks = (size_t)nchunks;
+    lo->stored_size = body - nchunks * 4;
+    return true;
+}
+
+static bool write_all(int fd, const unsigned char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+static bool make_user_dir(UserStore *store, const char *user, char *err, size_t errlen) {
     char dir_path[512];
     snprintf(dir_path, sizeof(dir_path), "%s/%s", user_store_get_root(store), user);
     if (mkdir(dir_path, 0755) == -1 && errno != EEXIST) {
         snprintf(err, errlen, "Failed to create user directory: %s", strerror(errno));
         return false;
     }
+    return true;
+}
+
+// Read exactly want bytes unless the source ends first; returns bytes read
+static size_t read_full(FsReadFn read_fn, void *read_ctx, unsigned char *buf, size_t want) {
+    size_t have = 0;
+    while (have < want) {
+        ssize_t n = read_fn(read_ctx, buf + have, want - have);
+        if (n <= 0) break;
+        have += (size_t)n;
+    }
+    return have;
+}
+
+// Plaintext length of chunk i in a file of plain_size bytes
+static size_t chunk_plain_len(uint64_t plain_size, size_t i, size_t chunk_size) {
+    uint64_t left = plain_size - (uint64_t)i * chunk_size;
+    return left < chunk_size ? (size_t)left : chunk_size;
+}
+
+// Check one chunk index entry against the chunk's plaintext length
+static bool chunk_entry_valid(uint32_t entry, size_t plain_len, size_t chunk_size) {
+    uint32_t len = entry & ~FS_CHUNK_RAW;
+    if (entry & FS_CHUNK_RAW) return len == plain_len;
+    return len > 0 && len <= LZ4_COMPRESS_BOUND(chunk_size);
+}
+
+// Plaintext size of the stored file at path, 0 if there is none. Files
+// report it in their header, so usage is never computed by reading data.
+static uint64_t stored_file_size(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    struct stat st;
+    FsLayout lo;
+    uint64_t size = 0;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && layout_read(fd, st.st_size, &lo)) {
+        size = lo.plain_size;
+    }
+    close(fd);
+    return size;
+}
+
+// Appends stored chunks to a file being uploaded
+typedef struct {
+    int fd;
+    CodecParams codec;
+    bool compress;
+    uint64_t stored_off;    // stored bytes written so far
+    unsigned char lz_buf[LZ4_COMPRESS_BOUND(FS_IO_CHUNK)];
+} ChunkWriter;
+
+// Compress (if enabled), encode and append one chunk of plaintext; buf is
+// clobbered. Returns the chunk's index entry, or 0 if the write failed.
+static uint32_t chunk_write(ChunkWriter *w, unsigned char *buf, size_t len) {
+    unsigned char *stored = buf;
+    size_t stored_len = len;
+    if (w->compress) {
+        // Only keep the compressed block if it actually saves space
+        size_t z = lz4_compress(buf, len, w->lz_buf, len - 1);
+        if (z > 0) {
+            stored = w->lz_buf;
+            stored_len = z;
+        }
+    }
+    
+    codec_apply(&w->codec, stored, stored_len, w->stored_off);
+    if (!write_all(w->fd, stored, stored_len)) return 0;
+    w->stored_off += stored_len;
+    return stored == buf ? ((uint32_t)len | FS_CHUNK_RAW) : (uint32_t)stored_len;
+}
+
+bool fs_upload(UserStore *store, const char *user, const char *dst_relpath, size_t size,
+               FsReadFn read_fn, void *read_ctx, FsPendingUpload *up, char *err, size_t errlen) {
+    if (!store || !user || !dst_relpath || !read_fn) {
+        snprintf(err, errlen, "Invalid parameters");
+        return false;
+    }
     
-    FILE *in = fopen(tmp_src, "rb");
-    if (!in) { 
-        snprintf(err, errlen, "Failed to open source file: %s", strerror(errno)); 
-        return false; 
+    char id[FS_UPLOAD_ID_LEN + 1];
+    if (!random_id(id, err, errlen)) return false;
+    build_user_path(store, user, dst_relpath, up->dst_path, sizeof(up->dst_path));
+    build_upload_temp_path(up->dst_path, id, up->tmp_path, sizeof(up->tmp_path));
+    const char *tmp = up->tmp_path;
+    
+    // Create directory if it doesn't exist
+    if (!make_user_dir(store, user, err, errlen)) return false;
+    
+    ChunkWriter w = { .compress = config_compress_files() };
+    if (!codec_init(&w.codec, (CodecId)config_get_file_codec(), err, errlen)) {
+        return false;
+    }
+    
+    size_t nchunks = (size + FS_IO_CHUNK - 1) / FS_IO_CHUNK;
+    unsigned char *index = NULL;
+    if (w.compress && nchunks > 0 && !(index = malloc(nchunks * 4))) {
+        snprintf(err, errlen, "Out of memory");
+        return false;
     }
     
-    FILE *out = fopen(dst, "wb");
-    if (!out) { 
-        fclose(in); 
+    int out = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (out < 0) { 
         snprintf(err, errlen, "Failed to create destination file: %s", strerror(errno)); 
+        free(index);
         return false; 
     }
+    w.fd = out;
     
-    unsigned char in_buf[8192];
-    unsigned char *encoded_buf = NULL;
-    size_t total = 0, n;
+    // Stream socket -> buffer -> compress -> encode in place -> file; memory
+    // stays bounded
+    unsigned char in_buf[FS_IO_CHUNK];
+    size_t remaining = size;
+    size_t chunk = 0;
     bool success = true;
     
-    while ((n = fread(in_buf, 1, sizeof(in_buf), in)) > 0) {
-        size_t encoded_len = 0;
-        encoded_buf = encode_data(in_buf, n, &encoded_len);
-        
-        if (!encoded_buf) {
+    unsigned char header[FS_HEADER_SIZE];
+    header_encode(header, &w.codec, FS_IO_CHUNK, w.compress, size);
+    if (!write_all(out, header, sizeof(header))) {
+        success = false;
+        snprintf(err, errlen, "Write failed: %s", strerror(errno));
+    }
+    
+    while (success && remaining > 0) {
+        // Fill the whole chunk first so the file is written in large pieces
+        size_t want = remaining < sizeof(in_buf) ? remaining : sizeof(in_buf);
+        size_t have = read_full(read_fn, read_ctx, in_buf, want);
+        if (have < want) {
             success = false;
-            snprintf(err, errlen, "Failed to encode data");
+            snprintf(err, errlen, "Connection lost after %zu of %zu bytes", size - remaining + have, size);
             break;
         }
         
-        if (fwrite(encoded_buf, 1, encoded_len, out) != encoded_len) {
+        uint32_t entry = chunk_write(&w, in_buf, have);
+        if (!entry) {
             success = false;
             snprintf(err, errlen, "Write failed: %s", strerror(errno));
-            free(encoded_buf);
             break;
         }
-        
-        free(encoded_buf);
-        encoded_buf = NULL;
-        total += n;
-    }
-    
-    // Cleanup in case of error
-    if (encoded_buf) {
-        free(encoded_buf);
+        if (w.compress) put_le(index + 4 * chunk++, entry, 4);
+        remaining -= have;
     }
     
-    // Check for read errors
-    if (ferror(in)) {
+    if (success && w.compress && !write_all(out, index, nchunks * 4)) {
         success = false;
-        snprintf(err, errlen, "Read error: %s", strerror(errno));
+        snprintf(err, errlen, "Write failed: %s", strerror(errno));
     }
+    free(index);
     
-    // Close files
-    fclose(in);
-    
-    if (fclose(out) != 0 && success) {
+    if (close(out) != 0 && success) {
         success = false;
         snprintf(err, errlen, "Failed to close destination file: %s", strerror(errno));
     }
     
-    // Remove destination file on error
+    // Remove partial file on error
     if (!success) {
-        remove(dst);
+        unlink(tmp);
     }
     
     return success;
 }
 
-bool fs_download_path(UserStore *store, const char *user, const char *relpath, char *out_path, size_t out_len, char *err, size_t errlen) {
-    if (!store || !user || !relpath || !out_path || !err) {
-        if (err && errlen > 0) {
-            snprintf(err, errlen, "Invalid parameters");
-        }
+bool fs_upload_commit(FsPendingUpload *up, uint64_t *replaced, char *err, size_t errlen) {
+    *replaced = stored_file_size(up->dst_path);
+    if (rename(up->tmp_path, up->dst_path) != 0) {
+        snprintf(err, errlen, "Failed to store file: %s", strerror(errno));
+        unlink(up->tmp_path);
+        *replaced = 0;
         return false;
     }
+    return true;
+}
+
+// A resumable upload lives in the user's directory as two hidden files:
+//   .<id>.part    the file being built: header, then the committed chunks
+//   .<id>.upload  a "<size> <relpath>\n" line, then one index entry (as in
+//                 the chunk index) per committed chunk
+// Chunk data is written before its entry, so on resume anything in the
+// part file past the recorded entries is an interrupted write and is cut off.
+// A session is flock()ed through its .upload file while it is in use.
+typedef struct {
+    int lock_fd;            // the .upload file, holding the session lock
+    char part_path[512];
+    char meta_path[512];
+    char dst_relpath[256];
+    CodecParams codec;
+    bool compressed;
+    uint64_t size;
+    size_t meta_line;       // length of the text line in the meta file
+    size_t nchunks;         // committed chunks
+    unsigned char *entries; // room for every chunk's entry
+    uint64_t stored_off;    // stored bytes of the committed chunks
+} UploadSession;
+
+static uint64_t session_committed(const UploadSession *s) {
+    uint64_t n = (uint64_t)s->nchunks * FS_IO_CHUNK;
+    return n < s->size ? n : s->size;
+}
+
+static void session_paths(UserStore *store, const char *user, const char *id, UploadSession *s) {
+    char rel[32];
+    snprintf(rel, sizeof(rel), ".%s.part", id);
+    build_user_path(store, user, rel, s->part_path, sizeof(s->part_path));
+    snprintf(rel, sizeof(rel), ".%s.upload", id);
+    build_user_path(store, user, rel, s->meta_path, sizeof(s->meta_path));
+}
+
+// Ids are generated here; anything else must not reach a path
+static bool upload_id_valid(const char *id) {
+    if (strlen(id) != FS_UPLOAD_ID_LEN) return false;
+    for (const char *p = id; *p; p++) {
+        if (!((*p >= '0' && *p <= '9') || (*p >= 'a' && *p <= 'f'))) return false;
+    }
+    return true;
+}
+
+static void session_close(UploadSession *s) {
+    free(s->entries);
+    s->entries = NULL;
+    if (s->lock_fd >= 0) close(s->lock_fd);
+    s->lock_fd = -1;
+}
+
+// Lock the session (LOCK_SH or LOCK_EX) and read its size and path. On
+// success the lock is held until session_close; *meta_size gets the length
+// of the .upload file.
+static bool session_lock(UserStore *store, const char *user, const char *id, UploadSession *s,
+                         int lock, off_t *meta_size, char *err, size_t errlen) {
+    memset(s, 0, sizeof(*s));
+    s->lock_fd = -1;
+    if (!upload_id_valid(id)) {
+        snprintf(err, errlen, "Unknown upload id");
+        return false;
+    }
+    session_paths(store, user, id, s);
     
-    char path[512];
-    build_user_path(store, user, relpath, path, sizeof(path));
-    
-    // Check if file exists and is readable
-    FILE *file = fopen(path, "rb");
-    if (!file) {
-        snprintf(err, errlen, "File not found or inaccessible: %s", strerror(errno));
+    int fd = open(s->meta_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        snprintf(err, errlen, "Unknown upload id");
         return false;
     }
     
-    // Get file size for progress reporting (optional)
-    if (fseek(file, 0, SEEK_END) != 0) {
-        fclose(file);
-        snprintf(err, errlen, "Failed to determine file size: %s", strerror(errno));
+    // A session that ended while we waited has been unlinked
+    struct stat st;
+    int rc;
+    while ((rc = flock(fd, lock)) != 0 && errno == EINTR) {}
+    if (rc != 0 || fstat(fd, &st) != 0 || st.st_nlink == 0) {
+        close(fd);
+        snprintf(err, errlen, "Unknown upload id");
         return false;
     }
+    s->lock_fd = fd;
+    *meta_size = st.st_size;
     
-    long file_size = ftell(file);
-    if (file_size == -1) {
-        fclose(file);
-        snprintf(err, errlen, "Failed to get file size: %s", strerror(errno));
+    char line[300] = {0};
+    unsigned long long size = 0;
+    ssize_t n = pread(fd, line, sizeof(line) - 1, 0);
+    char *nl = n > 0 ? memchr(line, '\n', (size_t)n) : NULL;
+    if (!nl || sscanf(line, "%llu %255s", &size, s->dst_relpath) != 2) {
+        session_close(s);
+        snprintf(err, errlen, "Upload state is corrupt");
         return false;
     }
+    s->size = size;
+    s->meta_line = (size_t)(nl - line) + 1;
+    return true;
+}
+
+// Lock the session and read its committed chunks; see session_lock
+static bool session_load(UserStore *store, const char *user, const char *id, UploadSession *s,
+                         int lock, char *err, size_t errlen) {
+    off_t meta_size;
+    if (!session_lock(store, user, id, s, lock, &meta_size, err, errlen)) return false;
+    
+    size_t total = (size_t)((s->size + FS_IO_CHUNK - 1) / FS_IO_CHUNK);
+    // A partly written trailing entry is dropped
+    s->nchunks = ((size_t)meta_size - s->meta_line) / 4;
+    bool ok = s->nchunks <= total && (s->entries = malloc(total * 4 + 1)) &&
+              pread_all(s->lock_fd, s->entries, s->nchunks * 4, (off_t)s->meta_line);
+    
+    for (size_t i = 0; ok && i < s->nchunks; i++) {
+        uint32_t entry = (uint32_t)get_le(s->entries + 4 * i, 4);
+        ok = chunk_entry_valid(entry, chunk_plain_len(s->size, i, FS_IO_CHUNK), FS_IO_CHUNK);
+        s->stored_off += entry & ~FS_CHUNK_RAW;
+    }
     
-    rewind(file);
+    // The part file's header has the codec; only this build's chunk size is used
+    unsigned char h[FS_HEADER_SIZE];
+    int fd = ok ? open(s->part_path, O_RDONLY) : -1;
+    ok = fd >= 0 && pread_all(fd, h, sizeof(h), 0) &&
+         memcmp(h, FS_HEADER_MAGIC, 4) == 0 && codec_name(h[4]) &&
+         !(h[5] & ~FS_FLAG_COMPRESSED) && get_le(h + 8, 4) == FS_IO_CHUNK;
+    if (fd >= 0) close(fd);
+    
+    if (!ok) {
+        session_close(s);
+        snprintf(err, errlen, "Upload state is corrupt");
+        return false;
+    }
+    s->codec.id = (CodecId)h[4];
+    memcpy(s->codec.nonce, h + 12, CODEC_NONCE_LEN);
+    s->compressed = (h[5] & FS_FLAG_COMPRESSED) != 0;
+    return true;
+}
+
+bool fs_upload_start(UserStore *store, const char *user, const char *dst_relpath, size_t size,
+                     char id[FS_UPLOAD_ID_LEN + 1], char *err, size_t errlen) {
+    if (!store || !user || !dst_relpath || !dst_relpath[0]) {
+        snprintf(err, errlen, "Invalid parameters");
+        return false;
+    }
+    if (!make_user_dir(store, user, err, errlen)) return false;
     
-    // Create temp directory if it doesn't exist
-    const char *temp_dir = "/tmp/os_lab7_downloads";
-    if (mkdir(temp_dir, 0755) == -1 && errno != EEXIST) {
-        fclose(file);
-        snprintf(err, errlen, "Failed to create temp directory: %s", strerror(errno));
+    CodecParams codec;
+    if (!codec_init(&codec, (CodecId)config_get_file_codec(), err, errlen)) {
         return false;
     }
+    bool compress = config_compress_files();
     
-    // Create temp file with a unique name
-    char temp_path[512];
-    time_t now = time(NULL);
-    snprintf(temp_path, sizeof(temp_path), "%s/%s_%s_%ld.tmp", 
-             temp_dir, user, relpath, (long)now);
+    if (!random_id(id, err, errlen)) return false;
     
-    // Ensure the filename is valid by replacing any problematic characters
-    for (char *p = temp_path; *p; p++) {
-        if (*p == '/' || *p == '\\' || *p == ':' || *p == '*' || *p == '?' || 
-            *p == '"' || *p == '<' || *p == '>' || *p == '|') {
-            *p = '_';
-        }
+    UploadSession s;
+    session_paths(store, user, id, &s);
+    
+    unsigned char header[FS_HEADER_SIZE];
+    header_encode(header, &codec, FS_IO_CHUNK, compress, size);
+    char line[300];
+    int line_len = snprintf(line, sizeof(line), "%zu %s\n", size, dst_relpath);
+    
+    int part = open(s.part_path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    int meta = open(s.meta_path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    bool ok = part >= 0 && meta >= 0 &&
+              write_all(part, header, sizeof(header)) &&
+              write_all(meta, (const unsigned char *)line, (size_t)line_len);
+    if (!ok) snprintf(err, errlen, "Failed to create upload: %s", strerror(errno));
+    if (part >= 0 && close(part) != 0) ok = false;
+    if (meta >= 0 && close(meta) != 0) ok = false;
+    
+    if (!ok) {
+        unlink(s.part_path);
+        unlink(s.meta_path);
+    }
+    return ok;
+}
+
+bool fs_upload_status(UserStore *store, const char *user, const char *id,
+                      FsUploadState *state, char *err, size_t errlen) {
+    UploadSession s;
+    if (!session_load(store, user, id, &s, LOCK_SH, err, errlen)) return false;
+    state->committed = session_committed(&s);
+    state->size = s.size;
+    snprintf(state->relpath, sizeof(state->relpath), "%s", s.dst_relpath);
+    session_close(&s);
+    return true;
+}
+
+// Bytes past the committed chunks are an interrupted write, and the key
+// stream at those offsets has been used. Before the tail is written again
+// the committed data is re-encoded under a fresh nonce, in a copy that
+// replaces the part file only once it is complete.
+static bool session_rekey(UploadSession *s, char *err, size_t errlen) {
+    CodecParams fresh;
+    if (!codec_init(&fresh, s->codec.id, err, errlen)) return false;
+    
+    char tmp[540];
+    snprintf(tmp, sizeof(tmp), "%s.rekey", s->part_path);
+    int in = open(s->part_path, O_RDONLY);
+    int out = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    unsigned char header[FS_HEADER_SIZE];
+    header_encode(header, &fresh, FS_IO_CHUNK, s->compressed, s->size);
+    bool ok = in >= 0 && out >= 0 && write_all(out, header, sizeof(header));
+    
+    unsigned char buf[FS_IO_CHUNK];
+    for (uint64_t off = 0; ok && off < s->stored_off; ) {
+        size_t n = s->stored_off - off < sizeof(buf) ? (size_t)(s->stored_off - off) : sizeof(buf);
+        ok = pread_all(in, buf, n, FS_HEADER_SIZE + (off_t)off);
+        if (!ok) break;
+        codec_apply(&s->codec, buf, n, off);
+        codec_apply(&fresh, buf, n, off);
+        ok = write_all(out, buf, n);
+        off += n;
+    }
+    if (!ok) snprintf(err, errlen, "Failed to re-encode upload: %s", strerror(errno));
+    if (in >= 0) close(in);
+    if (out >= 0 && close(out) != 0 && ok) {
+        ok = false;
+        snprintf(err, errlen, "Failed to re-encode upload: %s", strerror(errno));
+    }
+    if (ok && rename(tmp, s->part_path) != 0) {
+        ok = false;
+        snprintf(err, errlen, "Failed to re-encode upload: %s", strerror(errno));
+    }
+    if (!ok) {
+        unlink(tmp);
+        return false;
     }
+    s->codec = fresh;
+    return true;
+}
+
+bool fs_upload_resume(UserStore *store, const char *user, const char *id, size_t offset, size_t length,
+                      FsReadFn read_fn, void *read_ctx, FsUploadState *state, char *err, size_t errlen) {
+    UploadSession s;
+    if (!session_load(store, user, id, &s, LOCK_EX, err, errlen)) return false;
     
-    FILE *temp_file = fopen(temp_path, "wb");
-    if (!temp_file) {
-        fclose(file);
-        snprintf(err, errlen, "Failed to create temporary file: %s", strerror(errno));
+    uint64_t pos = session_committed(&s);
+    state->committed = pos;
+    state->size = s.size;
+    state->replaced = 0;
+    snprintf(state->relpath, sizeof(state->relpath), "%s", s.dst_relpath);
+    if (offset != pos) {
+        snprintf(err, errlen, "Upload is at offset %llu", (unsigned long long)pos);
+        session_close(&s);
+        return false;
+    }
+    if (length > s.size - pos) {
+        snprintf(err, errlen, "Part runs past the end of the file (%llu bytes)", (unsigned long long)s.size);
+        session_close(&s);
         return false;
     }
     
-    bool success = true;
-    unsigned char in_buf[8192];
-    unsigned char *decoded_buf = NULL;
+    struct stat st;
+    if (s.codec.id == CODEC_CHACHA20 && stat(s.part_path, &st) == 0 &&
+        (uint64_t)st.st_size > FS_HEADER_SIZE + s.stored_off && !session_rekey(&s, err, errlen)) {
+        session_close(&s);
+        return false;
+    }
     
-    // Read, decode and write file data
-    while (1) {
-        size_t bytes_read = fread(in_buf, 1, sizeof(in_buf), file);
-        
-        if (bytes_read == 0) {
-            // Check for read errors
-            if (ferror(file)) {
+    // Cut off anything an interrupted part left past the committed state
+    ChunkWriter w = { .codec = s.codec, .compress = s.compressed, .stored_off = s.stored_off };
+    w.fd = open(s.part_path, O_WRONLY);
+    int meta = open(s.meta_path, O_WRONLY);
+    bool success = w.fd >= 0 && meta >= 0 &&
+                   ftruncate(w.fd, FS_HEADER_SIZE + (off_t)s.stored_off) == 0 &&
+                   ftruncate(meta, (off_t)(s.meta_line + s.nchunks * 4)) == 0 &&
+                   lseek(w.fd, 0, SEEK_END) >= 0 && lseek(meta, 0, SEEK_END) >= 0;
+    if (!success) snprintf(err, errlen, "Failed to open upload: %s", strerror(errno));
+    
+    unsigned char in_buf[FS_IO_CHUNK];
+    size_t left = length;
+    while (success && left > 0) {
+        size_t want = chunk_plain_len(s.size, s.nchunks, FS_IO_CHUNK);
+        if (left < want) {
+            // The part ends mid-chunk: consume the tail without committing it
+            if (read_full(read_fn, read_ctx, in_buf, left) < left) {
                 success = false;
-                snprintf(err, errlen, "Error reading from file: %s", strerror(errno));
+                snprintf(err, errlen, "Connection lost at offset %llu", (unsigned long long)pos);
             }
             break;
         }
         
-        // Decode the data
-        size_t decoded_len = 0;
-        decoded_buf = decode_data(in_buf, bytes_read, &decoded_len);
-        
-        if (!decoded_buf) {
+        if (read_full(read_fn, read_ctx, in_buf, want) < want) {
             success = false;
-            snprintf(err, errlen, "Failed to decode data");
+            snprintf(err, errlen, "Connection lost at offset %llu", (unsigned long long)pos);
             break;
         }
-        
-        // Write the decoded data to the temp file
-        if (fwrite(decoded_buf, 1, decoded_len, temp_file) != decoded_len) {
+        uint32_t entry = chunk_write(&w, in_buf, want);
+        unsigned char *e = s.entries + 4 * s.nchunks;
+        if (entry) put_le(e, entry, 4);
+        if (!entry || !write_all(meta, e, 4)) {
             success = false;
-            snprintf(err, errlen, "Failed to write to temporary file: %s", strerror(errno));
-            free(decoded_buf);
+            snprintf(err, errlen, "Write failed: %s", strerror(errno));
             break;
         }
-        
-        free(decoded_buf);
-        decoded_buf = NULL;
+        s.nchunks++;
+        pos += want;
+        left -= want;
     }
     
-    // Cleanup
-    if (decoded_buf) {
-        free(decoded_buf);
+    if (w.fd >= 0) close(w.fd);
+    if (meta >= 0) close(meta);
+    
+    state->committed = session_committed(&s);
+    session_close(&s);
+    return success;
+}
+
+bool fs_upload_finish(UserStore *store, const char *user, const char *id,
+                      FsUploadState *state, char *err, size_t errlen) {
+    UploadSession s;
+    if (!session_load(store, user, id, &s, LOCK_EX, err, errlen)) return false;
+    state->committed = session_committed(&s);
+    state->size = s.size;
+    state->replaced = 0;
+    if (state->committed != s.size) {
+        snprintf(err, errlen, "Upload is at offset %llu", (unsigned long long)state->committed);
+        session_close(&s);
+        return false;
     }
     
-    // Close files
-    if (fclose(temp_file) != 0 && success) {
-        success = false;
-        snprintf(err, errlen, "Error closing temporary file: %s", strerror(errno));
+    // Write the chunk index (compressed files) after the committed chunks;
+    // an index left by an earlier failed attempt is overwritten
+    int part = open(s.part_path, O_WRONLY);
+    bool ok = part >= 0 && ftruncate(part, FS_HEADER_SIZE + (off_t)s.stored_off) == 0 &&
+              lseek(part, 0, SEEK_END) >= 0 &&
+              (!s.compressed || write_all(part, s.entries, s.nchunks * 4));
+    if (!ok) snprintf(err, errlen, "Write failed: %s", strerror(errno));
+    if (part >= 0 && close(part) != 0 && ok) {
+        ok = false;
+        snprintf(err, errlen, "Write failed: %s", strerror(errno));
     }
     
-    fclose(file);
+    if (ok) {
+        char dst[512];
+        build_user_path(store, user, s.dst_relpath, dst, sizeof(dst));
+        state->replaced = stored_file_size(dst);
+        if (rename(s.part_path, dst) != 0) {
+            ok = false;
+            state->replaced = 0;
+            snprintf(err, errlen, "Failed to store file: %s", strerror(errno));
+        }
+    }
+    if (ok) unlink(s.meta_path);
+    session_close(&s);
+    return ok;
+}
+
+bool fs_upload_abort(UserStore *store, const char *user, const char *id, uint64_t *size,
+                     char *err, size_t errlen) {
+    UploadSession s;
+    off_t meta_size;
+    if (!session_lock(store, user, id, &s, LOCK_EX, &meta_size, err, errlen)) return false;
+    *size = s.size;
+    // The state file goes last: while it exists the session can be found
+    unlink(s.part_path);
+    bool ok = unlink(s.meta_path) == 0;
+    if (!ok) snprintf(err, errlen, "Failed to remove upload: %s", strerror(errno));
+    session_close(&s);
+    return ok;
+}
+
+// Load and check the chunk index of a compressed file
+static bool load_chunk_index(FsDownload *dl, const FsLayout *lo) {
+    size_t n = lo->nchunks;
+    unsigned char *raw = malloc(n * 4 + 1);
+    dl->chunk_off = malloc((n + 1) * sizeof(uint64_t));
+    dl->chunk_len = malloc((n + 1) * sizeof(uint32_t));
+    dl->stored = malloc(LZ4_COMPRESS_BOUND(lo->chunk_size));
+    dl->plain = malloc(lo->chunk_size);
+    bool ok = raw && dl->chunk_off && dl->chunk_len && dl->stored && dl->plain &&
+              pread_all(dl->fd, raw, n * 4, lo->data_offset + (off_t)lo->stored_size);
     
-    // If there was an error, clean up the temp file
-    if (!success) {
-        remove(temp_path);
+    uint64_t off = 0;
+    for (size_t i = 0; ok && i < n; i++) {
+        uint32_t v = (uint32_t)get_le(raw + 4 * i, 4);
+        ok = chunk_entry_valid(v, chunk_plain_len(lo->plain_size, i, lo->chunk_size), lo->chunk_size);
+        dl->chunk_off[i] = off;
+        dl->chunk_len[i] = v;
+        off += v & ~FS_CHUNK_RAW;
+    }
+    free(raw);
+    return ok && off == lo->stored_size;
+}
+
+bool fs_download_open(UserStore *store, const char *user, const char *relpath,
+                      FsDownload *dl, char *err, size_t errlen) {
+    if (!store || !user || !relpath || !dl) {
+        snprintf(err, errlen, "Invalid parameters");
+        return false;
+    }
+    
+    char path[512];
+    build_user_path(store, user, relpath, path, sizeof(path));
+    
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        snprintf(err, errlen, "File not found or inaccessible: %s", strerror(errno));
+        return false;
+    }
+    
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        snprintf(err, errlen, "File not found or inaccessible");
         return false;
     }
     
-    // Ensure the temp file is readable by the client
-    chmod(temp_path, 0644);
+    memset(dl, 0, sizeof(*dl));
+    dl->fd = fd;
+    dl->plain_chunk = SIZE_MAX;
+    
+    FsLayout lo;
+    if (!layout_read(fd, st.st_size, &lo) ||
+        (lo.compressed && !load_chunk_index(dl, &lo))) {
+        fs_download_close(dl);
+        snprintf(err, errlen, "Stored file is corrupt or in an unsupported format");
+        return false;
+    }
+    
+    dl->codec = lo.codec;
+    dl->data_offset = lo.data_offset;
+    dl->size = (size_t)lo.plain_size;
+    dl->compressed = lo.compressed;
+    dl->chunk_size = lo.chunk_size;
+    dl->nchunks = lo.nchunks;
+    dl->identity = (dl->codec.id == CODEC_NONE && !dl->compressed);
+    return true;
+}
+
+// Read, decode and decompress chunk c of a compressed file into out, which
+// must hold the chunk's plaintext
+static bool read_chunk(FsDownload *dl, size_t c, unsigned char *out, size_t plain_len) {
+    uint32_t len = dl->chunk_len[c] & ~FS_CHUNK_RAW;
+    bool raw = (dl->chunk_len[c] & FS_CHUNK_RAW) != 0;
+    unsigned char *buf = raw ? out : dl->stored;
+    
+    if (!pread_all(dl->fd, buf, len, dl->data_offset + (off_t)dl->chunk_off[c])) return false;
+    codec_apply(&dl->codec, buf, len, dl->chunk_off[c]);
+    if (raw) return true;
     
-    // Copy the temp file path to the output buffer
-    size_t path_len = strlen(temp_path);
-    if (path_len >= out_len) {
-        remove(temp_path);
-        snprintf(err, errlen, "Temporary file path is too long");
+    if (lz4_decompress(buf, len, out, plain_len) != (ssize_t)plain_len) {
+        errno = EIO;
         return false;
     }
+    return true;
+}
+
+static ssize_t read_compressed(FsDownload *dl, unsigned char *out, size_t len) {
+    size_t c = dl->offset / dl->chunk_size;
+    size_t within = dl->offset % dl->chunk_size;
+    size_t plain_len = chunk_plain_len(dl->size, c, dl->chunk_size);
+    if (len > plain_len - within) len = plain_len - within;
     
-    strncpy(out_path, temp_path, out_len - 1);
-    out_path[out_len - 1] = '\0';
+    if (dl->plain_chunk != c) {
+        if (within == 0 && len == plain_len) {
+            // The caller wants the whole chunk: skip the staging buffer
+            if (!read_chunk(dl, c, out, plain_len)) return -1;
+            dl->offset += len;
+            return (ssize_t)len;
+        }
+        dl->plain_chunk = SIZE_MAX;
+        if (!read_chunk(dl, c, dl->plain, plain_len)) return -1;
+        dl->plain_chunk = c;
+    }
+    memcpy(out, dl->plain + within, len);
+    dl->offset += len;
+    return (ssize_t)len;
+}
+
+ssize_t fs_download_read(FsDownload *dl, void *buf, size_t len) {
+    size_t left = dl->size - dl->offset;
+    if (left == 0) return 0;
     
+    if (len > left) len = left;
+    
+    unsigned char *out = (unsigned char *)buf;
+    if (dl->compressed) return read_compressed(dl, out, len);
+    
+    if (!pread_all(dl->fd, out, len, dl->data_offset + (off_t)dl->offset)) return -1;
+    codec_apply(&dl->codec, out, len, dl->offset);
+    
+    dl->offset += len;
+    return (ssize_t)len;
+}
+
+bool fs_download_seek(FsDownload *dl, size_t offset) {
+    if (offset > dl->size) return false;
+    dl->offset = offset;
     return true;
 }
 
-bool fs_delete(UserStore *store, const char *user, const char *relpath, char *err, size_t errlen) {
+void fs_download_close(FsDownload *dl) {
+    if (!dl) return;
+    if (dl->fd >= 0) {
+        close(dl->fd);
+        dl->fd = -1;
+    }
+    free(dl->chunk_off);
+    free(dl->chunk_len);
+    free(dl->stored);
+    free(dl->plain);
+    dl->chunk_off = NULL;
+    dl->chunk_len = NULL;
+    dl->stored = NULL;
+    dl->plain = NULL;
+}
+
+bool fs_delete(UserStore *store, const char *user, const char *relpath, uint64_t *freed,
+               char *err, size_t errlen) {
 	char path[512];
 	build_user_path(store, user, relpath, path, sizeof(path));
+	*freed = stored_file_size(path);
 	if (remove(path) != 0) { snprintf(err, errlen, "remove failed"); return false; }
 	return true;
 }
 
-bool fs_list(UserStore *store, const char *user, char *buf, size_t buflen, char *err, size_t errlen) {
-	char path[512];
-	build_user_path(store, user, NULL, path, sizeof(path));
-	DIR *d = opendir(path);
-	if (!d) { snprintf(err, errlen, "opendir failed"); return false; }
-	struct dirent *de;
-	size_t used = 0;
-	while ((de = readdir(d))) {
-		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
-		int w = snprintf(buf + used, buflen - used, "%s\n", de->d_name);
-		if (w < 0 || (size_t)w >= buflen - used) break;
-		used += (size_t)w;
-	}
-	closedir(d);
-	return true;
+bool fs_list_parse_fields(const char *spec, unsigned *fields) {
+    static const struct { const char *name; unsigned bit; } columns[] = {
+        { "name", 0 }, { "size", FS_LIST_SIZE }, { "mtime", FS_LIST_MTIME }, { "codec", FS_LIST_CODEC },
+    };
+    *fields = 0;
+    while (*spec) {
+        size_t len = strcspn(spec, ",");
+        size_t i = 0;
+        while (i < sizeof(columns) / sizeof(columns[0]) &&
+               !(strlen(columns[i].name) == len && strncmp(spec, columns[i].name, len) == 0)) {
+            i++;
+        }
+        if (i == sizeof(columns) / sizeof(columns[0])) return false;
+        *fields |= columns[i].bit;
+        spec += len;
+        if (*spec == ',') spec++;
+    }
+    return true;
+}
+
+bool fs_list_open(UserStore *store, const char *user, uint64_t cursor, unsigned fields,
+                  FsList *ls, char *err, size_t errlen) {
+    char path[512];
+    build_user_path(store, user, NULL, path, sizeof(path));
+    ls->fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (ls->fd < 0) {
+        snprintf(err, errlen, "opendir failed");
+        return false;
+    }
+    if (cursor && lseek(ls->fd, (off_t)cursor, SEEK_SET) < 0) {
+        snprintf(err, errlen, "Invalid cursor %llu", (unsigned long long)cursor);
+        close(ls->fd);
+        ls->fd = -1;
+        return false;
+    }
+    ls->fields = fields;
+    ls->cursor = cursor;
+    ls->pos = ls->len = 0;
+    ls->eof = false;
+    return true;
+}
+
+// Names the server keeps in a user's directory for itself: upload temp
+// files (".<name>.<id>.part") and resumable sessions (".<id>.part",
+// ".<id>.upload" and ".<id>.part.rekey"), where <id> is 16 hex digits
+static bool list_hidden(const char *name) {
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return true;
+    if (name[0] != '.') return false;
+    static const char *const suffixes[] = { ".part", ".upload", ".part.rekey" };
+    size_t len = strlen(name);
+    for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+        size_t n = strlen(suffixes[i]);
+        if (len < 1 + FS_UPLOAD_ID_LEN + n || strcmp(name + len - n, suffixes[i]) != 0) continue;
+        size_t id = len - n - FS_UPLOAD_ID_LEN;
+        char hex[FS_UPLOAD_ID_LEN + 1];
+        memcpy(hex, name + id, FS_UPLOAD_ID_LEN);
+        hex[FS_UPLOAD_ID_LEN] = '\0';
+        // Either the whole stem is the id, or ".<name>." comes before it
+        if (upload_id_valid(hex) && (id == 1 || (id > 2 && name[id - 1] == '.'))) return true;
+    }
+    return false;
+}
+
+// The next entry to list, left in the batch; reads another batch when this
+// one is used up. NULL at the end of the directory, or on error (errno set).
+static struct dirent64 *list_peek(FsList *ls) {
+    while (1) {
+        while (ls->pos < ls->len) {
+            struct dirent64 *de = (struct dirent64 *)(ls->batch + ls->pos);
+            if (!list_hidden(de->d_name)) return de;
+            ls->pos += de->d_reclen;
+            ls->cursor = (uint64_t)de->d_off;
+        }
+        if (ls->eof) {
+            errno = 0;
+            return NULL;
+        }
+        ssize_t n = getdents64(ls->fd, ls->batch, sizeof(ls->batch));
+        if (n < 0) return NULL;
+        ls->pos = 0;
+        ls->len = (size_t)n;
+        ls->eof = (n == 0);
+    }
+}
+
+// Format one entry with its columns. Returns the line's length, 0 if the
+// file went away since the directory was read.
+static size_t list_format(FsList *ls, const char *name, char *out) {
+    struct stat st;
+    FsLayout lo;
+    bool have_stat = false, have_layout = false;
+    if (ls->fields & (FS_LIST_SIZE | FS_LIST_CODEC)) {
+        int fd = openat(ls->fd, name, O_RDONLY | O_CLOEXEC);
+        if (fd < 0 && errno == ENOENT) return 0;
+        if (fd >= 0) {
+            have_stat = fstat(fd, &st) == 0;
+            have_layout = have_stat && S_ISREG(st.st_mode) && layout_read(fd, st.st_size, &lo);
+            close(fd);
+        }
+    } else if (ls->fields & FS_LIST_MTIME) {
+        if (fstatat(ls->fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0 && errno == ENOENT) return 0;
+        have_stat = true;
+    }
+
+    // Names are at most 255 bytes, so every column fits in FS_LIST_LINE_MAX
+    size_t n = (size_t)snprintf(out, FS_LIST_LINE_MAX, "%s", name);
+    if (ls->fields & FS_LIST_SIZE) {
+        n += have_layout ? (size_t)snprintf(out + n, FS_LIST_LINE_MAX - n, " %llu",
+                                            (unsigned long long)lo.plain_size)
+                         : (size_t)snprintf(out + n, FS_LIST_LINE_MAX - n, " -");
+    }
+    if (ls->fields & FS_LIST_MTIME) {
+        n += have_stat ? (size_t)snprintf(out + n, FS_LIST_LINE_MAX - n, " %lld", (long long)st.st_mtime)
+                       : (size_t)snprintf(out + n, FS_LIST_LINE_MAX - n, " -");
+    }
+    if (ls->fields & FS_LIST_CODEC) {
+        if (have_layout) {
+            double ratio = lo.stored_size ? (double)lo.plain_size / (double)lo.stored_size : 1.0;
+            n += (size_t)snprintf(out + n, FS_LIST_LINE_MAX - n, " %s %s %.2fx", codec_name(lo.codec.id),
+                                  lo.compressed ? "lz4" : "none", ratio);
+        } else {
+            n += (size_t)snprintf(out + n, FS_LIST_LINE_MAX - n, " unknown - -");
+        }
+    }
+    out[n++] = '\n';
+    return n;
+}
+
+ssize_t fs_list_read(FsList *ls, char *buf, size_t len, size_t max, size_t *count) {
+    char line[FS_LIST_LINE_MAX + 1];
+    size_t used = 0;
+    *count = 0;
+    while (*count < max) {
+        struct dirent64 *de = list_peek(ls);
+        if (!de) {
+            if (errno) return -1;
+            break;
+        }
+        size_t n = list_format(ls, de->d_name, line);
+        if (used + n > len) break; // stays in the batch for the next call
+        memcpy(buf + used, line, n);
+        used += n;
+        if (n > 0) (*count)++;
+        ls->pos += de->d_reclen;
+        ls->cursor = (uint64_t)de->d_off;
+    }
+    return (ssize_t)used;
+}
+
+bool fs_list_more(FsList *ls, bool *more) {
+    *more = list_peek(ls) != NULL;
+    return *more || errno == 0;
+}
+
+void fs_list_close(FsList *ls) {
+    if (ls && ls->fd >= 0) {
+        close(ls->fd);
+        ls->fd = -1;
+    }
 }
 
 
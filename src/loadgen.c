@@ -0,0 +1,790 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+// Load generator for the file server. Every connection runs on its own
+// thread and speaks the text protocol, one request at a time. In closed
+// loop a connection sends its next request when the last one is answered
+// (after an optional think time); in open loop requests arrive at a fixed
+// mean rate as a Poisson process, and latency counts from when a request
+// was due, not from when it could be sent, so a stalled server is not
+// hidden by the generator waiting on it.
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1u << HIST_SUB_BITS)
+#define HIST_MAX_MSB 40
+#define HIST_BUCKETS ((HIST_MAX_MSB - HIST_SUB_BITS + 2) * HIST_SUB)
+#define MAX_FILES 8                 // per connection, so LIST replies stay small
+#define READ_BUF 65536
+#define LINE_MAX_LEN 1024
+
+typedef enum { OP_SIGNUP, OP_LOGIN, OP_UPLOAD, OP_DOWNLOAD, OP_LIST, OP_DELETE, OP_COUNT } Op;
+
+static const char *op_names[OP_COUNT] = { "SIGNUP", "LOGIN", "UPLOAD", "DOWNLOAD", "LIST", "DELETE" };
+
+typedef enum { SIZE_FIXED, SIZE_UNIFORM, SIZE_LOGNORMAL } SizeKind;
+
+typedef struct {
+    SizeKind kind;
+    double a, b;                    // fixed: a; uniform: a..b; lognormal: median a, sigma b
+} SizeDist;
+
+// Log-linear latency histogram in microseconds, 16 buckets per power of two
+typedef struct {
+    uint64_t buckets[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum_us;
+    uint64_t max_us;
+} Hist;
+
+typedef struct {
+    Hist lat[OP_COUNT];             // answered OK
+    uint64_t errors[OP_COUNT];      // answered ERR, other than busy
+    uint64_t busy[OP_COUNT];        // refused by admission control
+    uint64_t bytes[OP_COUNT];       // file data moved
+    uint64_t io_errors;             // connection lost mid-request
+} Stats;
+
+typedef struct {
+    int fd;
+    char buf[READ_BUF];
+    size_t start, end;
+} Reader;
+
+typedef struct {
+    int id;
+    pthread_t thread;
+    uint64_t rng;
+    Reader r;
+    char user[64];
+    int nfiles;                     // f0 .. f<nfiles-1> exist
+    unsigned signups;
+    Stats stats;
+} Conn;
+
+static struct {
+    const char *host;
+    const char *port;
+    int connections;
+    double duration_s;
+    double warmup_s;
+    unsigned weights[OP_COUNT];
+    char mix[128];
+    SizeDist sizes;
+    char sizes_spec[64];
+    size_t max_size;
+    double think_ms;                // closed loop: mean think time
+    double rate;                    // open loop: requests per second (0: closed loop)
+    uint64_t seed;
+    const char *priority;
+    const char *label;
+    const char *csv;
+    const char *json;
+} cfg = {
+    .host = "127.0.0.1",
+    .port = "9090",
+    .connections = 16,
+    .duration_s = 10,
+    .warmup_s = 1,
+    .weights = { 0, 40, 20, 25, 10, 5 },
+    .mix = "login=40,upload=20,download=25,list=10,delete=5",
+    .sizes = { SIZE_LOGNORMAL, 16384, 1.0 },
+    .sizes_spec = "lognormal:16k:1.0",
+    .max_size = 8u << 20,
+    .seed = 1,
+    .priority = "NORMAL",
+    .label = "run",
+};
+
+static uint64_t g_start_ns;         // setup done, load starts
+static uint64_t g_measure_ns;       // warmup over
+static uint64_t g_end_ns;
+static unsigned char *g_payload;    // upload data, max_size random bytes
+static unsigned g_run;              // keeps SIGNUP names unique across runs
+static pthread_barrier_t g_ready;   // waited twice: setup done, then start
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns) {
+    struct timespec ts = { (time_t)(ns / 1000000000ull), (long)(ns % 1000000000ull) };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) { }
+}
+
+// xorshift64*
+static uint64_t rng_next(uint64_t *s) {
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 2685821657736338717ull;
+}
+
+// Uniform in (0, 1)
+static double rng_unit(uint64_t *s) {
+    return ((double)(rng_next(s) >> 11) + 0.5) / 9007199254740992.0;
+}
+
+static double rng_exp(uint64_t *s, double mean) {
+    return -mean * log(rng_unit(s));
+}
+
+static size_t sample_size(uint64_t *s) {
+    double v;
+    switch (cfg.sizes.kind) {
+    case SIZE_UNIFORM:
+        v = cfg.sizes.a + (cfg.sizes.b - cfg.sizes.a) * rng_unit(s);
+        break;
+    case SIZE_LOGNORMAL: {
+        double z = sqrt(-2.0 * log(rng_unit(s))) * cos(2.0 * M_PI * rng_unit(s));
+        v = cfg.sizes.a * exp(cfg.sizes.b * z);
+        break;
+    }
+    default:
+        v = cfg.sizes.a;
+        break;
+    }
+    if (v < 1) v = 1;
+    if (v > (double)cfg.max_size) v = (double)cfg.max_size;
+    return (size_t)v;
+}
+
+static size_t hist_index(uint64_t us) {
+    if (us < HIST_SUB) return (size_t)us;
+    unsigned msb = 63u - (unsigned)__builtin_clzll(us);
+    if (msb > HIST_MAX_MSB) return HIST_BUCKETS - 1;
+    return (size_t)(msb - HIST_SUB_BITS + 1) * HIST_SUB +
+           (size_t)((us >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+static uint64_t hist_highest(size_t i) {
+    size_t next = i + 1;
+    if (next < 2 * HIST_SUB) return i;
+    unsigned msb = (unsigned)(next / HIST_SUB) + HIST_SUB_BITS - 1;
+    return ((uint64_t)(HIST_SUB + next % HIST_SUB) << (msb - HIST_SUB_BITS)) - 1;
+}
+
+static void hist_record(Hist *h, uint64_t us) {
+    h->buckets[hist_index(us)]++;
+    h->count++;
+    h->sum_us += us;
+    if (us > h->max_us) h->max_us = us;
+}
+
+static void hist_merge(Hist *into, const Hist *h) {
+    for (size_t i = 0; i < HIST_BUCKETS; i++) into->buckets[i] += h->buckets[i];
+    into->count += h->count;
+    into->sum_us += h->sum_us;
+    if (h->max_us > into->max_us) into->max_us = h->max_us;
+}
+
+// Milliseconds below which a fraction q of the values fall (to bucket precision)
+static double hist_quantile_ms(const Hist *h, double q) {
+    if (h->count == 0) return 0;
+    double exact = q * (double)h->count;
+    uint64_t rank = (uint64_t)exact;
+    if (rank == 0 || (double)rank < exact) rank++;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            uint64_t us = hist_highest(i);
+            return (double)(us < h->max_us ? us : h->max_us) / 1000.0;
+        }
+    }
+    return (double)h->max_us / 1000.0;
+}
+
+static bool send_all(int fd, const void *data, size_t len) {
+    const char *p = (const char *)data;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+static bool reader_fill(Reader *r) {
+    if (r->start == r->end) r->start = r->end = 0;
+    if (r->end == sizeof(r->buf)) {
+        memmove(r->buf, r->buf + r->start, r->end - r->start);
+        r->end -= r->start;
+        r->start = 0;
+    }
+    ssize_t n;
+    do {
+        n = recv(r->fd, r->buf + r->end, sizeof(r->buf) - r->end, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) return false;
+    r->end += (size_t)n;
+    return true;
+}
+
+// One line without its '\n'; false if the connection broke
+static bool read_line(Reader *r, char *line, size_t size) {
+    for (;;) {
+        char *nl = memchr(r->buf + r->start, '\n', r->end - r->start);
+        if (nl) {
+            size_t len = (size_t)(nl - (r->buf + r->start));
+            size_t copy = len < size - 1 ? len : size - 1;
+            memcpy(line, r->buf + r->start, copy);
+            line[copy] = '\0';
+            r->start += len + 1;
+            return true;
+        }
+        if (r->end - r->start >= sizeof(r->buf) - 1) return false; // no line this long
+        if (!reader_fill(r)) return false;
+    }
+}
+
+static bool skip_bytes(Reader *r, size_t n) {
+    while (n > 0) {
+        if (r->start == r->end && !reader_fill(r)) return false;
+        size_t take = r->end - r->start < n ? r->end - r->start : n;
+        r->start += take;
+        n -= take;
+    }
+    return true;
+}
+
+static int connect_server(void) {
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *res;
+    if (getaddrinfo(cfg.host, cfg.port, &hints, &res) != 0) return -1;
+    int fd = -1;
+    for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd >= 0) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+typedef enum { RES_OK, RES_ERR, RES_BUSY, RES_IO } Result;
+
+static Result classify(const char *line) {
+    if (strncmp(line, "OK", 2) == 0) return RES_OK;
+    if (strncmp(line, "ERR busy", 8) == 0) return RES_BUSY;
+    return RES_ERR;
+}
+
+// One request line, one reply line
+static Result simple_request(Conn *c, const char *cmd) {
+    char line[LINE_MAX_LEN];
+    if (!send_all(c->r.fd, cmd, strlen(cmd)) || !read_line(&c->r, line, sizeof(line))) return RES_IO;
+    return classify(line);
+}
+
+static Result do_upload(Conn *c, int file, size_t size) {
+    char cmd[256], line[LINE_MAX_LEN];
+    snprintf(cmd, sizeof(cmd), "UPLOAD %s f%d %zu\n", c->user, file, size);
+    if (!send_all(c->r.fd, cmd, strlen(cmd)) || !read_line(&c->r, line, sizeof(line))) return RES_IO;
+    if (strcmp(line, "READY") != 0) return classify(line);
+    if (!send_all(c->r.fd, g_payload, size) || !read_line(&c->r, line, sizeof(line))) return RES_IO;
+    return classify(line);
+}
+
+static Result do_download(Conn *c, int file, uint64_t *bytes) {
+    char cmd[256], line[LINE_MAX_LEN];
+    snprintf(cmd, sizeof(cmd), "DOWNLOAD %s f%d\n", c->user, file);
+    if (!send_all(c->r.fd, cmd, strlen(cmd)) || !read_line(&c->r, line, sizeof(line))) return RES_IO;
+    Result res = classify(line);
+    if (res != RES_OK) return res;
+    char name[256];
+    size_t size;
+    if (!read_line(&c->r, line, sizeof(line)) ||
+        sscanf(line, "FILE_DATA %255s %zu", name, &size) != 2 || !skip_bytes(&c->r, size)) {
+        return RES_IO;
+    }
+    *bytes = size;
+    return RES_OK;
+}
+
+// LIST answers "OK list", one line per file, then END or MORE <cursor>
+static Result do_list(Conn *c) {
+    char cmd[128], line[LINE_MAX_LEN];
+    snprintf(cmd, sizeof(cmd), "LIST %s\n", c->user);
+    if (!send_all(c->r.fd, cmd, strlen(cmd)) || !read_line(&c->r, line, sizeof(line))) return RES_IO;
+    Result res = classify(line);
+    if (res != RES_OK) return res;
+    // One line per file, then END (no limit is asked for, so never MORE)
+    do {
+        if (!read_line(&c->r, line, sizeof(line))) return RES_IO;
+    } while (strcmp(line, "END") != 0);
+    return RES_OK;
+}
+
+static Op pick_op(Conn *c) {
+    unsigned total = 0;
+    for (int i = 0; i < OP_COUNT; i++) total += cfg.weights[i];
+    unsigned x = (unsigned)(rng_next(&c->rng) % total);
+    for (int i = 0; i < OP_COUNT; i++) {
+        if (x < cfg.weights[i]) return (Op)i;
+        x -= cfg.weights[i];
+    }
+    return OP_LOGIN;
+}
+
+// Run one request of kind op; *actual is what was really sent (a download
+// or delete with no file to work on uploads one instead)
+static Result run_op(Conn *c, Op op, Op *actual, uint64_t *bytes) {
+    char cmd[256];
+    *bytes = 0;
+    if ((op == OP_DOWNLOAD || op == OP_DELETE) && c->nfiles == 0) op = OP_UPLOAD;
+    *actual = op;
+    switch (op) {
+    case OP_SIGNUP:
+        snprintf(cmd, sizeof(cmd), "SIGNUP %s_%x_%u pw %s\n", c->user, g_run, c->signups++, cfg.priority);
+        return simple_request(c, cmd);
+    case OP_LOGIN:
+        snprintf(cmd, sizeof(cmd), "LOGIN %s pw\n", c->user);
+        return simple_request(c, cmd);
+    case OP_UPLOAD: {
+        // New files until MAX_FILES, then overwrite one, so quota use stays bounded
+        int file = c->nfiles < MAX_FILES ? c->nfiles : (int)(rng_next(&c->rng) % MAX_FILES);
+        size_t size = sample_size(&c->rng);
+        Result res = do_upload(c, file, size);
+        if (res == RES_OK) {
+            *bytes = size;
+            if (file == c->nfiles) c->nfiles++;
+        }
+        return res;
+    }
+    case OP_DOWNLOAD:
+        return do_download(c, (int)(rng_next(&c->rng) % (uint64_t)c->nfiles), bytes);
+    case OP_LIST:
+        return do_list(c);
+    case OP_DELETE: {
+        // Always the newest, so the rest stay f0 .. f<nfiles-1>
+        snprintf(cmd, sizeof(cmd), "DELETE %s f%d\n", c->user, c->nfiles - 1);
+        Result res = simple_request(c, cmd);
+        if (res == RES_OK) c->nfiles--;
+        return res;
+    }
+    default:
+        return RES_ERR;
+    }
+}
+
+// Connect, create the connection's user (it may exist from an earlier run
+// with the same seed) and log in. Not measured.
+static bool conn_setup(Conn *c) {
+    char cmd[256];
+    c->r.fd = connect_server();
+    c->r.start = c->r.end = 0;
+    if (c->r.fd < 0) return false;
+    snprintf(cmd, sizeof(cmd), "SIGNUP %s pw %s\n", c->user, cfg.priority);
+    if (simple_request(c, cmd) != RES_IO) {
+        snprintf(cmd, sizeof(cmd), "LOGIN %s pw\n", c->user);
+        if (simple_request(c, cmd) == RES_OK) return true;
+    }
+    close(c->r.fd);
+    c->r.fd = -1;
+    return false;
+}
+
+static void *conn_main(void *arg) {
+    Conn *c = (Conn *)arg;
+    bool up = conn_setup(c);
+    // Downloads need something to fetch from the start
+    if (up && cfg.weights[OP_DOWNLOAD] > 0 && do_upload(c, 0, sample_size(&c->rng)) == RES_OK) c->nfiles = 1;
+    pthread_barrier_wait(&g_ready);
+    pthread_barrier_wait(&g_ready);
+    if (!up) {
+        fprintf(stderr, "loadgen: connection %d could not log in\n", c->id);
+        return NULL;
+    }
+
+    double interval_ns = cfg.rate > 0 ? 1e9 * cfg.connections / cfg.rate : 0;
+    uint64_t due = g_start_ns;
+    if (interval_ns > 0) due += (uint64_t)rng_exp(&c->rng, interval_ns);
+    for (;;) {
+        if (interval_ns > 0) {
+            if (due >= g_end_ns) break;
+            if (due > now_ns()) sleep_until(due);
+        } else {
+            due = now_ns();
+            if (due >= g_end_ns) break;
+        }
+
+        Op op = pick_op(c), actual;
+        uint64_t bytes;
+        Result res = run_op(c, op, &actual, &bytes);
+        uint64_t done = now_ns();
+        if (due >= g_measure_ns) {
+            switch (res) {
+            case RES_OK:
+                hist_record(&c->stats.lat[actual], (done - due) / 1000);
+                c->stats.bytes[actual] += bytes;
+                break;
+            case RES_BUSY: c->stats.busy[actual]++; break;
+            case RES_ERR: c->stats.errors[actual]++; break;
+            case RES_IO: c->stats.io_errors++; break;
+            }
+        }
+        if (res == RES_IO) {
+            // The stream is out of step or gone; start over on a new connection
+            close(c->r.fd);
+            c->r.fd = -1;
+            if (now_ns() >= g_end_ns || !conn_setup(c)) return NULL;
+        }
+
+        if (interval_ns > 0) {
+            due += (uint64_t)rng_exp(&c->rng, interval_ns);
+        } else if (cfg.think_ms > 0) {
+            sleep_until(now_ns() + (uint64_t)(rng_exp(&c->rng, cfg.think_ms) * 1e6));
+        }
+    }
+    close(c->r.fd);
+    return NULL;
+}
+
+// "64k", "8m", "1g" or plain bytes
+static bool parse_size(const char *s, double *out) {
+    char *end;
+    double v = strtod(s, &end);
+    if (end == s || v < 0) return false;
+    switch (*end) {
+    case 'k': case 'K': v *= 1024; end++; break;
+    case 'm': case 'M': v *= 1024 * 1024; end++; break;
+    case 'g': case 'G': v *= 1024.0 * 1024 * 1024; end++; break;
+    default: break;
+    }
+    if (*end != '\0' && *end != ':') return false;
+    *out = v;
+    return true;
+}
+
+// fixed:SIZE, uniform:MIN:MAX or lognormal:MEDIAN:SIGMA
+static bool parse_sizes(const char *spec) {
+    char kind[16];
+    const char *colon = strchr(spec, ':');
+    if (!colon || (size_t)(colon - spec) >= sizeof(kind)) return false;
+    memcpy(kind, spec, (size_t)(colon - spec));
+    kind[colon - spec] = '\0';
+    const char *rest = colon + 1;
+    const char *second = strchr(rest, ':');
+    if (strcmp(kind, "fixed") == 0) {
+        cfg.sizes.kind = SIZE_FIXED;
+        if (!parse_size(rest, &cfg.sizes.a) || second) return false;
+    } else if (strcmp(kind, "uniform") == 0) {
+        cfg.sizes.kind = SIZE_UNIFORM;
+        if (!second || !parse_size(rest, &cfg.sizes.a) || !parse_size(second + 1, &cfg.sizes.b) ||
+            cfg.sizes.b < cfg.sizes.a) return false;
+    } else if (strcmp(kind, "lognormal") == 0) {
+        cfg.sizes.kind = SIZE_LOGNORMAL;
+        char *end;
+        if (!second || !parse_size(rest, &cfg.sizes.a)) return false;
+        cfg.sizes.b = strtod(second + 1, &end);
+        if (*end != '\0' || cfg.sizes.b < 0) return false;
+    } else {
+        return false;
+    }
+    snprintf(cfg.sizes_spec, sizeof(cfg.sizes_spec), "%s", spec);
+    return true;
+}
+
+// Comma-separated name=weight; commands left out get weight 0
+static bool parse_mix(const char *spec) {
+    unsigned weights[OP_COUNT] = {0}, total = 0;
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", spec);
+    for (char *save, *tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(tok, '=');
+        if (!eq) return false;
+        *eq = '\0';
+        int op = -1;
+        for (int i = 0; i < OP_COUNT; i++) {
+            if (strcasecmp(tok, op_names[i]) == 0) op = i;
+        }
+        char *end;
+        long w = strtol(eq + 1, &end, 10);
+        if (op < 0 || *end != '\0' || w < 0) return false;
+        weights[op] = (unsigned)w;
+        total += (unsigned)w;
+    }
+    if (total == 0) return false;
+    memcpy(cfg.weights, weights, sizeof(weights));
+    snprintf(cfg.mix, sizeof(cfg.mix), "%s", spec);
+    return true;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -H, --host HOST          server address (127.0.0.1)\n"
+        "  -p, --port PORT          server port (9090)\n"
+        "  -c, --connections N      concurrent connections, one thread each (16)\n"
+        "  -d, --duration SEC       measured time (10)\n"
+        "  -w, --warmup SEC         load before measuring starts (1)\n"
+        "  -m, --mix SPEC           command weights, e.g. login=40,upload=20,download=25,list=10,delete=5\n"
+        "                           (commands: signup login upload download list delete)\n"
+        "  -s, --sizes DIST         upload sizes: fixed:SIZE, uniform:MIN:MAX or lognormal:MEDIAN:SIGMA\n"
+        "                           (lognormal:16k:1.0); sizes take k, m, g suffixes\n"
+        "      --max-size SIZE      cap on lognormal sizes (8m; non-HIGH users are refused above 10m)\n"
+        "  -r, --rate N             open loop: N requests per second in total (default closed loop)\n"
+        "  -t, --think MS           closed loop: mean think time between requests (0)\n"
+        "      --priority LEVEL     priority the test users sign up with (NORMAL)\n"
+        "      --seed N             random seed; users are named after it (1)\n"
+        "  -l, --label NAME         run name written to the reports (run)\n"
+        "      --csv FILE           append one row per command to FILE ('-' for stdout)\n"
+        "      --json FILE          write the report as JSON to FILE ('-' for stdout)\n",
+        prog);
+}
+
+static bool parse_args(int argc, char **argv) {
+    static const struct option opts[] = {
+        { "host", required_argument, NULL, 'H' },
+        { "port", required_argument, NULL, 'p' },
+        { "connections", required_argument, NULL, 'c' },
+        { "duration", required_argument, NULL, 'd' },
+        { "warmup", required_argument, NULL, 'w' },
+        { "mix", required_argument, NULL, 'm' },
+        { "sizes", required_argument, NULL, 's' },
+        { "max-size", required_argument, NULL, 'M' },
+        { "rate", required_argument, NULL, 'r' },
+        { "think", required_argument, NULL, 't' },
+        { "priority", required_argument, NULL, 'P' },
+        { "seed", required_argument, NULL, 'S' },
+        { "label", required_argument, NULL, 'l' },
+        { "csv", required_argument, NULL, 'C' },
+        { "json", required_argument, NULL, 'J' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+    int ch;
+    double v;
+    while ((ch = getopt_long(argc, argv, "H:p:c:d:w:m:s:r:t:l:h", opts, NULL)) != -1) {
+        switch (ch) {
+        case 'H': cfg.host = optarg; break;
+        case 'p': cfg.port = optarg; break;
+        case 'c': cfg.connections = atoi(optarg); if (cfg.connections < 1) return false; break;
+        case 'd': cfg.duration_s = atof(optarg); if (cfg.duration_s <= 0) return false; break;
+        case 'w': cfg.warmup_s = atof(optarg); if (cfg.warmup_s < 0) return false; break;
+        case 'm': if (!parse_mix(optarg)) return false; break;
+        case 's': if (!parse_sizes(optarg)) return false; break;
+        case 'M': if (!parse_size(optarg, &v) || v < 1) return false; cfg.max_size = (size_t)v; break;
+        case 'r': cfg.rate = atof(optarg); if (cfg.rate < 0) return false; break;
+        case 't': cfg.think_ms = atof(optarg); if (cfg.think_ms < 0) return false; break;
+        case 'P': cfg.priority = optarg; break;
+        case 'S': cfg.seed = strtoull(optarg, NULL, 10); break;
+        case 'l': cfg.label = optarg; break;
+        case 'C': cfg.csv = optarg; break;
+        case 'J': cfg.json = optarg; break;
+        default: return false;
+        }
+    }
+    return optind == argc;
+}
+
+typedef struct {
+    uint64_t ok, errors, busy, bytes;
+    double rps, mib_s, mean_ms, p50, p90, p99, p999, max_ms;
+} Row;
+
+static Row make_row(const Hist *h, uint64_t errors, uint64_t busy, uint64_t bytes) {
+    Row row = {
+        .ok = h->count, .errors = errors, .busy = busy, .bytes = bytes,
+        .rps = (double)h->count / cfg.duration_s,
+        .mib_s = (double)bytes / cfg.duration_s / (1024.0 * 1024.0),
+        .mean_ms = h->count ? (double)h->sum_us / (double)h->count / 1000.0 : 0,
+        .p50 = hist_quantile_ms(h, 0.5),
+        .p90 = hist_quantile_ms(h, 0.9),
+        .p99 = hist_quantile_ms(h, 0.99),
+        .p999 = hist_quantile_ms(h, 0.999),
+        .max_ms = (double)h->max_us / 1000.0,
+    };
+    return row;
+}
+
+static FILE *open_report(const char *path, const char *mode, bool *fresh) {
+    if (strcmp(path, "-") == 0) {
+        *fresh = true;
+        return stdout;
+    }
+    struct stat st;
+    *fresh = stat(path, &st) != 0 || st.st_size == 0;
+    FILE *f = fopen(path, mode);
+    if (!f) perror(path);
+    return f;
+}
+
+static void close_report(FILE *f) {
+    if (f && f != stdout) fclose(f);
+}
+
+static const char *mode_name(void) {
+    return cfg.rate > 0 ? "open" : "closed";
+}
+
+static void write_csv(const Row rows[OP_COUNT + 1], uint64_t io_errors) {
+    bool fresh;
+    FILE *f = open_report(cfg.csv, "a", &fresh);
+    if (!f) return;
+    if (fresh) {
+        fprintf(f, "label,mode,connections,rate,think_ms,sizes,mix,seed,duration_s,op,ok,errors,busy,"
+                   "io_errors,throughput_rps,mib_per_s,mean_ms,p50_ms,p90_ms,p99_ms,p999_ms,max_ms\n");
+    }
+    for (int i = 0; i <= OP_COUNT; i++) {
+        const Row *r = &rows[i];
+        if (i < OP_COUNT && cfg.weights[i] == 0 && r->ok + r->errors + r->busy == 0) continue;
+        fprintf(f, "%s,%s,%d,%.1f,%.1f,%s,\"%s\",%llu,%.1f,%s,%llu,%llu,%llu,%llu,"
+                   "%.1f,%.2f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+                cfg.label, mode_name(), cfg.connections, cfg.rate, cfg.think_ms, cfg.sizes_spec,
+                cfg.mix, (unsigned long long)cfg.seed, cfg.duration_s,
+                i < OP_COUNT ? op_names[i] : "ALL", (unsigned long long)r->ok,
+                (unsigned long long)r->errors, (unsigned long long)r->busy,
+                (unsigned long long)(i < OP_COUNT ? 0 : io_errors), r->rps, r->mib_s,
+                r->mean_ms, r->p50, r->p90, r->p99, r->p999, r->max_ms);
+    }
+    close_report(f);
+}
+
+static void write_json_row(FILE *f, const Row *r) {
+    fprintf(f, "{\"ok\": %llu, \"errors\": %llu, \"busy\": %llu, \"bytes\": %llu, "
+               "\"throughput_rps\": %.1f, \"mib_per_s\": %.2f, \"mean_ms\": %.3f, "
+               "\"p50_ms\": %.3f, \"p90_ms\": %.3f, \"p99_ms\": %.3f, \"p999_ms\": %.3f, \"max_ms\": %.3f}",
+            (unsigned long long)r->ok, (unsigned long long)r->errors, (unsigned long long)r->busy,
+            (unsigned long long)r->bytes, r->rps, r->mib_s, r->mean_ms,
+            r->p50, r->p90, r->p99, r->p999, r->max_ms);
+}
+
+static void write_json(const Row rows[OP_COUNT + 1], uint64_t io_errors) {
+    bool fresh;
+    FILE *f = open_report(cfg.json, "w", &fresh);
+    if (!f) return;
+    fprintf(f, "{\n  \"label\": \"%s\",\n  \"mode\": \"%s\",\n  \"connections\": %d,\n"
+               "  \"rate\": %.1f,\n  \"think_ms\": %.1f,\n  \"sizes\": \"%s\",\n  \"mix\": \"%s\",\n"
+               "  \"seed\": %llu,\n  \"duration_s\": %.1f,\n  \"warmup_s\": %.1f,\n"
+               "  \"io_errors\": %llu,\n  \"total\": ",
+            cfg.label, mode_name(), cfg.connections, cfg.rate, cfg.think_ms, cfg.sizes_spec, cfg.mix,
+            (unsigned long long)cfg.seed, cfg.duration_s, cfg.warmup_s, (unsigned long long)io_errors);
+    write_json_row(f, &rows[OP_COUNT]);
+    fprintf(f, ",\n  \"ops\": {");
+    bool first = true;
+    for (int i = 0; i < OP_COUNT; i++) {
+        const Row *r = &rows[i];
+        if (cfg.weights[i] == 0 && r->ok + r->errors + r->busy == 0) continue;
+        fprintf(f, "%s\n    \"%s\": ", first ? "" : ",", op_names[i]);
+        write_json_row(f, r);
+        first = false;
+    }
+    fprintf(f, "\n  }\n}\n");
+    close_report(f);
+}
+
+int main(int argc, char **argv) {
+    if (!parse_args(argc, argv)) {
+        usage(argv[0]);
+        return 2;
+    }
+    // --max-size only caps the lognormal tail; the others give their own bounds
+    if (cfg.sizes.kind == SIZE_FIXED) cfg.max_size = (size_t)cfg.sizes.a > 0 ? (size_t)cfg.sizes.a : 1;
+    if (cfg.sizes.kind == SIZE_UNIFORM) cfg.max_size = (size_t)cfg.sizes.b > 0 ? (size_t)cfg.sizes.b : 1;
+    g_run = (unsigned)time(NULL) ^ ((unsigned)getpid() << 16);
+
+    uint64_t rng = cfg.seed * 0x9e3779b97f4a7c15ull + 1;
+    g_payload = (unsigned char *)malloc(cfg.max_size);
+    Conn *conns = (Conn *)calloc((size_t)cfg.connections, sizeof(Conn));
+    if (!g_payload || !conns) {
+        fprintf(stderr, "loadgen: out of memory\n");
+        return 1;
+    }
+    // Incompressible, so LZ4 on the server does real work
+    for (size_t i = 0; i < cfg.max_size; i += 8) {
+        uint64_t x = rng_next(&rng);
+        memcpy(g_payload + i, &x, cfg.max_size - i < 8 ? cfg.max_size - i : 8);
+    }
+
+    pthread_barrier_init(&g_ready, NULL, (unsigned)cfg.connections + 1);
+    for (int i = 0; i < cfg.connections; i++) {
+        Conn *c = &conns[i];
+        c->id = i;
+        c->rng = (cfg.seed + 1) * 0x9e3779b97f4a7c15ull ^ (uint64_t)(i + 1) * 0xbf58476d1ce4e5b9ull;
+        if (c->rng == 0) c->rng = 1;
+        c->r.fd = -1;
+        snprintf(c->user, sizeof(c->user), "lg%llux%d", (unsigned long long)cfg.seed, i);
+        if (pthread_create(&c->thread, NULL, conn_main, c) != 0) {
+            fprintf(stderr, "loadgen: failed to start connection %d\n", i);
+            return 1;
+        }
+    }
+    // Once every connection is logged in, the clock starts
+    pthread_barrier_wait(&g_ready);
+    g_start_ns = now_ns();
+    g_measure_ns = g_start_ns + (uint64_t)(cfg.warmup_s * 1e9);
+    g_end_ns = g_measure_ns + (uint64_t)(cfg.duration_s * 1e9);
+    pthread_barrier_wait(&g_ready);
+    for (int i = 0; i < cfg.connections; i++) pthread_join(conns[i].thread, NULL);
+
+    Hist *all = (Hist *)calloc(OP_COUNT + 1, sizeof(Hist));
+    if (!all) return 1;
+    uint64_t errors[OP_COUNT + 1] = {0}, busy[OP_COUNT + 1] = {0}, bytes[OP_COUNT + 1] = {0};
+    uint64_t io_errors = 0;
+    for (int i = 0; i < cfg.connections; i++) {
+        const Stats *s = &conns[i].stats;
+        for (int op = 0; op < OP_COUNT; op++) {
+            hist_merge(&all[op], &s->lat[op]);
+            hist_merge(&all[OP_COUNT], &s->lat[op]);
+            errors[op] += s->errors[op];
+            busy[op] += s->busy[op];
+            bytes[op] += s->bytes[op];
+            errors[OP_COUNT] += s->errors[op];
+            busy[OP_COUNT] += s->busy[op];
+            bytes[OP_COUNT] += s->bytes[op];
+        }
+        io_errors += s->io_errors;
+    }
+    Row rows[OP_COUNT + 1];
+    for (int i = 0; i <= OP_COUNT; i++) rows[i] = make_row(&all[i], errors[i], busy[i], bytes[i]);
+
+    printf("%s: %s loop, %d connections, %.1f s, sizes %s\n", cfg.label, mode_name(),
+           cfg.connections, cfg.duration_s, cfg.sizes_spec);
+    printf("%-9s %9s %7s %7s %10s %9s %9s %9s %9s %9s %9s\n", "op", "ok", "errors", "busy",
+           "req/s", "MiB/s", "p50 ms", "p90 ms", "p99 ms", "p99.9 ms", "max ms");
+    for (int i = 0; i <= OP_COUNT; i++) {
+        const Row *r = &rows[i];
+        if (i < OP_COUNT && cfg.weights[i] == 0 && r->ok + r->errors + r->busy == 0) continue;
+        printf("%-9s %9llu %7llu %7llu %10.1f %9.2f %9.3f %9.3f %9.3f %9.3f %9.3f\n",
+               i < OP_COUNT ? op_names[i] : "ALL", (unsigned long long)r->ok,
+               (unsigned long long)r->errors, (unsigned long long)r->busy, r->rps, r->mib_s,
+               r->p50, r->p90, r->p99, r->p999, r->max_ms);
+    }
+    if (io_errors) printf("%llu requests lost to connection errors\n", (unsigned long long)io_errors);
+    fflush(stdout);
+
+    if (cfg.csv) write_csv(rows, io_errors);
+    if (cfg.json) write_json(rows, io_errors);
+
+    free(all);
+    free(conns);
+    free(g_payload);
+    pthread_barrier_destroy(&g_ready);
+    return 0;
+}
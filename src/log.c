@@ -0,0 +1,230 @@
+#define _POSIX_C_SOURCE 200809L
+#include "log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+
+#define LOG_RING_SLOTS 1024         // per thread, power of two
+#define LOG_MSG_MAX 232
+#define LOG_FLUSH_INTERVAL_MS 20
+
+typedef struct {
+    int level;
+    struct timespec ts;
+    unsigned long thread_id;
+    char msg[LOG_MSG_MAX];
+} LogRecord;
+
+// Single-producer/single-consumer ring: the owning thread advances head,
+// the flusher advances tail. No locks on either side.
+typedef struct LogRing {
+    LogRecord slots[LOG_RING_SLOTS];
+    atomic_size_t head;
+    atomic_size_t tail;
+    atomic_size_t dropped;
+    atomic_bool abandoned;          // owning thread exited
+    struct LogRing *next;
+} LogRing;
+
+atomic_int log_runtime_level = LOG_LEVEL_INFO;
+
+static struct {
+    pthread_mutex_t rings_mutex;    // guards the ring list, not the rings
+    LogRing *rings;
+    pthread_t flusher;
+    pthread_mutex_t wake_mutex;
+    pthread_cond_t wake;
+    atomic_bool running;
+    pthread_key_t ring_key;
+    bool key_created;
+} logger = {
+    .rings_mutex = PTHREAD_MUTEX_INITIALIZER,
+    .wake_mutex = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+};
+
+static _Thread_local LogRing *tls_ring = NULL;
+
+static const char *level_names[] = { "TRACE", "DEBUG", "INFO", "WARN", "ERROR" };
+
+static void write_record(const LogRecord *r) {
+    struct tm tm;
+    localtime_r(&r->ts.tv_sec, &tm);
+    FILE *out = r->level >= LOG_LEVEL_WARN ? stderr : stdout;
+    fprintf(out, "%02d:%02d:%02d.%06ld %-5s [%lu] %s\n",
+            tm.tm_hour, tm.tm_min, tm.tm_sec, r->ts.tv_nsec / 1000,
+            level_names[r->level], r->thread_id, r->msg);
+}
+
+// The ring outlives its thread until the flusher has drained it
+static void ring_release(void *arg) {
+    LogRing *ring = (LogRing *)arg;
+    atomic_store(&ring->abandoned, true);
+}
+
+static LogRing *ring_for_thread(void) {
+    if (tls_ring) return tls_ring;
+    LogRing *ring = (LogRing *)calloc(1, sizeof(LogRing));
+    if (!ring) return NULL;
+    pthread_mutex_lock(&logger.rings_mutex);
+    ring->next = logger.rings;
+    logger.rings = ring;
+    if (logger.key_created) pthread_setspecific(logger.ring_key, ring);
+    pthread_mutex_unlock(&logger.rings_mutex);
+    tls_ring = ring;
+    return ring;
+}
+
+// Drain every ring once; returns the number of records written
+static size_t drain_rings(void) {
+    size_t written = 0;
+    pthread_mutex_lock(&logger.rings_mutex);
+    LogRing **pp = &logger.rings;
+    while (*pp) {
+        LogRing *ring = *pp;
+        bool abandoned = atomic_load_explicit(&ring->abandoned, memory_order_acquire);
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        while (tail != head) {
+            write_record(&ring->slots[tail & (LOG_RING_SLOTS - 1)]);
+            tail++;
+            written++;
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+        size_t dropped = atomic_exchange(&ring->dropped, 0);
+        if (dropped) {
+            fprintf(stderr, "[log] dropped %zu messages (ring full)\n", dropped);
+        }
+
+        if (abandoned) {
+            *pp = ring->next;
+            free(ring);
+        } else {
+            pp = &ring->next;
+        }
+    }
+    pthread_mutex_unlock(&logger.rings_mutex);
+    if (written) {
+        fflush(stdout);
+        fflush(stderr);
+    }
+    return written;
+}
+
+static void *flusher_main(void *arg) {
+    (void)arg;
+    while (atomic_load(&logger.running)) {
+        if (drain_rings() == 0) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += LOG_FLUSH_INTERVAL_MS * 1000000L;
+            if (ts.tv_nsec >= 1000000000L) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000L;
+            }
+            pthread_mutex_lock(&logger.wake_mutex);
+            if (atomic_load(&logger.running)) {
+                pthread_cond_timedwait(&logger.wake, &logger.wake_mutex, &ts);
+            }
+            pthread_mutex_unlock(&logger.wake_mutex);
+        }
+    }
+    drain_rings();
+    return NULL;
+}
+
+void log_init(int level) {
+    log_set_level(level);
+    if (atomic_load(&logger.running)) return;
+    if (!logger.key_created && pthread_key_create(&logger.ring_key, ring_release) == 0) {
+        logger.key_created = true;
+    }
+    atomic_store(&logger.running, true);
+    if (pthread_create(&logger.flusher, NULL, flusher_main, NULL) != 0) {
+        atomic_store(&logger.running, false);
+        fprintf(stderr, "[log] failed to start flusher, logging synchronously\n");
+    }
+}
+
+void log_shutdown(void) {
+    if (!atomic_load(&logger.running)) return;
+    pthread_mutex_lock(&logger.wake_mutex);
+    atomic_store(&logger.running, false);
+    pthread_cond_signal(&logger.wake);
+    pthread_mutex_unlock(&logger.wake_mutex);
+    pthread_join(logger.flusher, NULL);
+
+    // Threads still alive keep logging synchronously from now on
+    pthread_mutex_lock(&logger.rings_mutex);
+    LogRing *ring = logger.rings;
+    logger.rings = NULL;
+    pthread_mutex_unlock(&logger.rings_mutex);
+    while (ring) {
+        LogRing *next = ring->next;
+        free(ring);
+        ring = next;
+    }
+    tls_ring = NULL;
+    if (logger.key_created) {
+        pthread_setspecific(logger.ring_key, NULL);
+        pthread_key_delete(logger.ring_key);
+        logger.key_created = false;
+    }
+}
+
+void log_set_level(int level) {
+    if (level < LOG_LEVEL_TRACE) level = LOG_LEVEL_TRACE;
+    if (level > LOG_LEVEL_OFF) level = LOG_LEVEL_OFF;
+    atomic_store(&log_runtime_level, level);
+}
+
+int log_level_from_string(const char *name) {
+    static const char *names[] = { "trace", "debug", "info", "warn", "error", "off" };
+    for (int i = 0; i <= LOG_LEVEL_OFF; i++) {
+        if (strcasecmp(name, names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+void log_write(int level, const char *fmt, ...) {
+    if (level < LOG_LEVEL_TRACE || level >= LOG_LEVEL_OFF) return;
+
+    LogRecord local;
+    LogRecord *r = &local;
+    LogRing *ring = NULL;
+    size_t head = 0;
+
+    if (atomic_load_explicit(&logger.running, memory_order_relaxed)) {
+        ring = tls_ring ? tls_ring : ring_for_thread();
+    }
+    if (ring) {
+        head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (head - tail >= LOG_RING_SLOTS) {
+            atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+            return;
+        }
+        r = &ring->slots[head & (LOG_RING_SLOTS - 1)];
+    }
+
+    r->level = level;
+    clock_gettime(CLOCK_REALTIME, &r->ts);
+    r->thread_id = (unsigned long)pthread_self();
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(r->msg, sizeof(r->msg), fmt, ap);
+    va_end(ap);
+
+    if (ring) {
+        atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    } else {
+        write_record(r);
+        fflush(level >= LOG_LEVEL_WARN ? stderr : stdout);
+    }
+}
@@ -4,6 +4,12 @@
 #include "user.h"
 #include "config.h"
 #include "queue.h"
+#include "scheduler.h"
+#include "reactor.h"
+#include "crypto.h"
+#include "log.h"
+#include "pool.h"
+#include "metrics.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,6 +17,7 @@
 #include <unistd.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <libgen.h>
 
 ServerState *g_server = NULL;
@@ -33,77 +40,72 @@ static int tcp_listen(unsigned short port) {
 	struct sockaddr_in addr; memset(&addr,0,sizeof(addr));
 	addr.sin_family = AF_INET; addr.sin_port = htons(port); addr.sin_addr.s_addr = htonl(INADDR_ANY);
 	bind(fd, (struct sockaddr*)&addr, sizeof(addr));
-	listen(fd, 64);
+	listen(fd, SOMAXCONN);
 	return fd;
 }
 
 static ResponseQueueEntry *register_client_response_queue(ServerState *server, int client_id) {
-    ResponseQueueEntry *e = (ResponseQueueEntry *)calloc(1, sizeof(ResponseQueueEntry));
-    if (!e) return NULL;
-    
-    e->client_id = client_id;
-    queue_init(&e->queue);
-    pthread_mutex_init(&e->mutex, NULL);
-    pthread_cond_init(&e->response_available, NULL);
-    
-    // Add to response map (queue_push handles its own locking)
-    bool success = queue_push(&server->response_map, e, PRIORITY_NORMAL);
-    
-    if (!success) {
-        pthread_cond_destroy(&e->response_available);
-        pthread_mutex_destroy(&e->mutex);
-        queue_destroy(&e->queue);
-        free(e);
-        return NULL;
-    }
-    
-    return e;
+    return response_map_register(server->response_map, client_id);
 }
 
-// remove entry from response map
+// remove entry from response map; workers still holding it keep it alive
 void deregister_client_response_queue(ServerState *server, int client_id) {
-    pthread_mutex_lock(&server->response_map.mutex);
-    
-    // Search through the priority queue items
-    ResponseQueueEntry *found = NULL;
-    size_t found_idx = 0;
-    for (size_t i = 0; i < server->response_map.size; i++) {
-        ResponseQueueEntry *e = (ResponseQueueEntry *)server->response_map.items[i].data;
-        if (e->client_id == client_id) {
-            found = e;
-            found_idx = i;
-            break;
-        }
-    }
-    
-    if (found) {
-        // Remove from queue by replacing with last element and reducing size
-        if (found_idx < server->response_map.size - 1) {
-            server->response_map.items[found_idx] = server->response_map.items[server->response_map.size - 1];
-        }
-        server->response_map.size--;
-        pthread_mutex_unlock(&server->response_map.mutex);
-        
-        // Clean up the entry
-        pthread_mutex_lock(&found->mutex);
-        queue_close(&found->queue);
-        pthread_cond_broadcast(&found->response_available);  // Wake up any waiting threads
-        pthread_mutex_unlock(&found->mutex);
-        
-        // Destroy resources
-        queue_destroy(&found->queue);
-        pthread_cond_destroy(&found->response_available);
-        pthread_mutex_destroy(&found->mutex);
-        free(found);
-    } else {
-        pthread_mutex_unlock(&server->response_map.mutex);
-    }
+    response_map_remove(server->response_map, client_id);
+}
+
+// Connection and task queue gauges, read when metrics are rendered
+static void collect_server(void *ctx, MetricsText *out) {
+	ServerState *server = (ServerState *)ctx;
+	SchedulerStats st;
+	scheduler_stats(server->scheduler, &st);
+	metrics_printf(out, "# HELP fileserver_connections Connected clients\n"
+	                    "# TYPE fileserver_connections gauge\n"
+	                    "fileserver_connections %zu\n", response_map_size(server->response_map));
+	metrics_printf(out, "# HELP fileserver_workers Worker threads\n"
+	                    "# TYPE fileserver_workers gauge\n"
+	                    "fileserver_workers %d\n", st.workers);
+	metrics_printf(out, "# HELP fileserver_queued_tasks Tasks waiting for a worker\n"
+	                    "# TYPE fileserver_queued_tasks gauge\n"
+	                    "fileserver_queued_tasks %zu\n", st.queued);
+	metrics_printf(out, "# HELP fileserver_admission_limit Tasks admission control lets queue (0: unbounded)\n"
+	                    "# TYPE fileserver_admission_limit gauge\n"
+	                    "fileserver_admission_limit %zu\n", st.limit);
+	metrics_printf(out, "# HELP fileserver_tasks_refused_total Requests refused by admission control\n"
+	                    "# TYPE fileserver_tasks_refused_total counter\n"
+	                    "fileserver_tasks_refused_total %zu\n", st.refused);
+}
+
+// Per-user queue state. Only written to the metrics file: STATS is open to
+// any connection and shouldn't tell who else uses the server.
+static void collect_users(void *ctx, MetricsText *out) {
+	Scheduler *scheduler = (Scheduler *)ctx;
+	size_t n = scheduler_user_stats(scheduler, NULL, 0);
+	QueueFlowStats *users = n ? (QueueFlowStats *)malloc(n * sizeof(QueueFlowStats)) : NULL;
+	if (!users) return;
+	size_t found = scheduler_user_stats(scheduler, users, n);
+	if (found < n) n = found;
+	static const struct { const char *name, *type, *help; } series[] = {
+		{ "fileserver_user_queued_tasks", "gauge", "Tasks a user has waiting, by priority" },
+		{ "fileserver_user_served_tasks_total", "counter", "Tasks of a user handed to workers, by priority" },
+		{ "fileserver_user_served_bytes_total", "counter", "Bytes a user was charged for, by priority" },
+	};
+	for (int k = 0; k < 3; k++) {
+		metrics_printf(out, "# HELP %s %s\n# TYPE %s %s\n", series[k].name, series[k].help,
+		               series[k].name, series[k].type);
+		for (size_t i = 0; i < n; i++) {
+			uint64_t v = k == 0 ? users[i].queued : k == 1 ? users[i].served : users[i].served_bytes;
+			metrics_printf(out, "%s{user=", series[k].name);
+			metrics_print_label(out, users[i].key);
+			metrics_printf(out, ",priority=\"%s\"} %llu\n", priority_to_string(users[i].priority),
+			               (unsigned long long)v);
+		}
+	}
+	free(users);
 }
 
 int main(int argc, char **argv) {
 	unsigned short port = 9090;
 	int client_threads = 4;
-	int worker_threads = 4;
 	// Parse command line arguments
 	char *config_file = "config.ini";
 	if (argc > 1) port = (unsigned short)atoi(argv[1]);
@@ -111,6 +113,8 @@ int main(int argc, char **argv) {
 	
 	// Initialize configuration
 	config_init(config_file);
+	log_init(config_get_log_level());
+	int worker_threads = config_get_worker_threads();
 	
 	// Get storage path from config
 	const char *storage_path = config_get_storage_path();
@@ -119,6 +123,7 @@ int main(int argc, char **argv) {
 	ServerState *server = (ServerState *)calloc(1, sizeof(ServerState));
 	if (!server) {
 		fprintf(stderr, "Failed to allocate server state\n");
+		log_shutdown();
 		return 1;
 	}
 	
@@ -126,26 +131,91 @@ int main(int argc, char **argv) {
 	if (!server->user_store) {
 		fprintf(stderr, "Failed to create user store\n");
 		free(server);
+		log_shutdown();
 		return 1;
 	}
 	
-	queue_init(&server->task_queue);
-	queue_init(&server->response_map);
+	// The ChaCha20 key lives next to the stored files
+	char key_path[600], key_err[256];
+	snprintf(key_path, sizeof(key_path), "%s/.codec_key", storage_path);
+	if (!crypto_load_key(key_path, key_err, sizeof(key_err))) {
+		if (config_get_file_codec() == CODEC_CHACHA20) {
+			fprintf(stderr, "%s\n", key_err);
+			user_store_destroy(server->user_store);
+			free(server);
+			log_shutdown();
+			return 1;
+		}
+		LOG_WARN("%s; ChaCha20-encoded files can't be read", key_err);
+	}
+	
+	server->response_map = response_map_create();
+	if (!server->response_map) {
+		fprintf(stderr, "Failed to create response map\n");
+		user_store_destroy(server->user_store);
+		free(server);
+		log_shutdown();
+		return 1;
+	}
+	if (!pools_init()) {
+		fprintf(stderr, "Failed to create object pools\n");
+		response_map_destroy(server->response_map);
+		user_store_destroy(server->user_store);
+		free(server);
+		log_shutdown();
+		return 1;
+	}
+	server->scheduler = scheduler_create(worker_threads, config_get_queue_aging_ms());
+	if (!server->scheduler) {
+		fprintf(stderr, "Failed to create task scheduler\n");
+		pools_destroy();
+		response_map_destroy(server->response_map);
+		user_store_destroy(server->user_store);
+		free(server);
+		log_shutdown();
+		return 1;
+	}
+	unsigned capacity[PRIORITY_COUNT];
+	for (int p = 0; p < PRIORITY_COUNT; p++) capacity[p] = config_get_queue_capacity((TaskPriority)p);
+	scheduler_set_admission(server->scheduler, capacity, config_get_queue_target_ms(),
+	                        config_get_queue_interval_ms());
+	scheduler_set_quantum(server->scheduler, config_get_queue_quantum_bytes());
+	scheduler_set_max_flows(server->scheduler, config_get_queue_max_user_flows());
+	metrics_add_collector(collect_server, server, false);
+	metrics_add_collector(collect_users, server->scheduler, true);
+	if (metrics_start_dump(config_get_metrics_file(), config_get_metrics_interval_ms())) {
+		LOG_INFO("Writing metrics to %s every %u ms", config_get_metrics_file(),
+		         config_get_metrics_interval_ms());
+	}
 	server->running = 1;
 	g_server = server;
 	signal(SIGINT, on_sigint);
+	// Peers may vanish mid-write; report EPIPE instead of killing the server
+	signal(SIGPIPE, SIG_IGN);
 
     int lfd = tcp_listen(port);
     server->listen_fd = lfd;
-    printf("Server listening on %u\n", port);
+    LOG_INFO("Server listening on %u", port);
+    LOG_INFO("File codec: %s (%s kernels)", codec_name(config_get_file_codec()), crypto_kernel_name());
 
 	// launch worker threads
 	pthread_t *wts = calloc((size_t)worker_threads, sizeof(pthread_t));
-	WorkerPoolArg wpa = { .task_queue=&server->task_queue, .resp_queues=&server->response_map, .user_store=server->user_store };
-	for (int i=0;i<worker_threads;i++) pthread_create(&wts[i], NULL, worker_thread_main, &wpa);
+	WorkerPoolArg *wpas = calloc((size_t)worker_threads, sizeof(WorkerPoolArg));
+	for (int i=0;i<worker_threads;i++) {
+		wpas[i] = (WorkerPoolArg){ .scheduler=server->scheduler, .worker_id=i, .resp_queues=server->response_map, .user_store=server->user_store };
+		pthread_create(&wts[i], NULL, worker_thread_main, &wpas[i]);
+	}
+
+	// Either a blocking client thread pool or the epoll reactor serves connections
+	Reactor *reactor = NULL;
+	if (config_use_reactor()) {
+		reactor = reactor_create(server, config_get_io_threads());
+		if (!reactor) fprintf(stderr, "Failed to start reactor, falling back to client threads\n");
+	}
+	if (reactor) client_threads = 0;
 
 	Queue client_queue; queue_init(&client_queue);
-	pthread_t *cts = calloc((size_t)client_threads, sizeof(pthread_t));
+	pthread_t *cts = calloc((size_t)(client_threads > 0 ? client_threads : 1), sizeof(pthread_t));
 	ClientThreadArg cta = { .client_queue=&client_queue };
 	for (int i=0;i<client_threads;i++) pthread_create(&cts[i], NULL, client_thread_main, &cta);
 
@@ -156,52 +226,64 @@ int main(int argc, char **argv) {
         if (cfd < 0) {
             if (!server->running) break; else continue;
         }
-		printf("[Main] Accepted connection (fd=%d, client_id=%d)\n", cfd, next_client_id);
-		fflush(stdout);
+		// Replies are small and, on pipelined connections, back to back;
+		// don't let Nagle hold one back waiting for the previous one's ACK
+		int nodelay = 1;
+		setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+		LOG_DEBUG("[Main] Accepted connection (fd=%d, client_id=%d)", cfd, next_client_id);
 		cta.client_id = next_client_id;
-		register_client_response_queue(server, next_client_id);
-		ClientInfo *ci = (ClientInfo *)calloc(1, sizeof(ClientInfo));
+		ResponseQueueEntry *entry = register_client_response_queue(server, next_client_id);
+		if (reactor) {
+			if (!entry || !reactor_add_client(reactor, cfd, next_client_id, entry)) {
+				if (entry) deregister_client_response_queue(server, next_client_id);
+				close(cfd);
+			}
+			next_client_id++;
+			continue;
+		}
+		ClientInfo *ci = (ClientInfo *)pool_alloc(g_client_info_pool);
+		if (!ci) {
+			deregister_client_response_queue(server, next_client_id++);
+			close(cfd);
+			continue;
+		}
 		ci->socket_fd = cfd; ci->client_id = next_client_id;
 		next_client_id++;
-		printf("[Main] About to push to client_queue at %p\n", (void*)&client_queue);
-		fflush(stdout);
+		LOG_TRACE("[Main] About to push to client_queue at %p", (void*)&client_queue);
 		queue_push(&client_queue, ci, PRIORITY_NORMAL);
-		printf("[Main] Pushed client to queue (client_id=%d)\n", next_client_id - 1);
-		fflush(stdout);
+		LOG_TRACE("[Main] Pushed client to queue (client_id=%d)", next_client_id - 1);
 	}
 
 	// Shutdown sequence: close queues to wake up waiting threads
 	queue_close(&client_queue);
-	queue_close(&server->task_queue);
-	queue_close(&server->response_map);
+	scheduler_close(server->scheduler);
 	for (int i=0;i<client_threads;i++) pthread_join(cts[i], NULL);
 	free(cts);
 	for (int i=0;i<worker_threads;i++) pthread_join(wts[i], NULL);
 	free(wts);
+	free(wpas);
+	// Workers have answered everything they dequeued; now drop connections
+	reactor_destroy(reactor);
+	// Last metrics dump, while the scheduler and response map still exist
+	metrics_stop_dump();
 	
 	// Clean up configuration
 	// Note: config_cleanup() would be called here if we had one
 	
 	// Clean up remaining response queue entries
-	pthread_mutex_lock(&server->response_map.mutex);
-	for (size_t i = 0; i < server->response_map.size; i++) {
-		ResponseQueueEntry *e = (ResponseQueueEntry *)server->response_map.items[i].data;
-		if (e) {
-			queue_destroy(&e->queue);
-			pthread_cond_destroy(&e->response_available);
-			pthread_mutex_destroy(&e->mutex);
-			free(e);
-		}
-	}
-	pthread_mutex_unlock(&server->response_map.mutex);
+	response_map_destroy(server->response_map);
 	
 	// Destroy queues
 	queue_destroy(&client_queue);
-	queue_destroy(&server->task_queue);
-	queue_destroy(&server->response_map);
+	scheduler_destroy(server->scheduler);
+	
+	// Every thread is gone and the response map has returned its leftovers
+	pools_destroy();
 	
 	user_store_destroy(server->user_store);
 	free(server);
+	metrics_shutdown();
+	log_shutdown();
 	return 0;
 }
 
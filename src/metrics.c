@@ -0,0 +1,412 @@
+#define _POSIX_C_SOURCE 200809L
+#include "metrics.h"
+#include "log.h"
+#include <stdatomic.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1u << HIST_SUB_BITS)
+// Values past 2^41 us (25 days) all land in the last bucket
+#define HIST_MAX_MSB 40
+#define HIST_BUCKETS ((HIST_MAX_MSB - HIST_SUB_BITS + 2) * HIST_SUB)
+#define METRICS_MAX_COLLECTORS 8
+
+typedef struct {
+    _Atomic uint64_t buckets[HIST_BUCKETS];
+    _Atomic uint64_t sum_ns;
+    _Atomic uint64_t max_ns;
+} Histogram;
+
+// Written by its thread only; kept after the thread exits so totals stay whole
+typedef struct MetricsShard {
+    _Atomic uint64_t counters[METRIC_COUNTER_COUNT];
+    Histogram hists[METRIC_HISTOGRAM_COUNT];
+    struct MetricsShard *next;
+} MetricsShard;
+
+typedef struct {
+    uint64_t buckets[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+} HistSnapshot;
+
+typedef struct {
+    MetricsCollect collect;
+    void *ctx;
+    bool file_only;
+} Collector;
+
+static struct {
+    pthread_mutex_t mutex;          // guards the shard list and the collectors
+    MetricsShard *shards;
+    Collector collectors[METRICS_MAX_COLLECTORS];
+    size_t ncollectors;
+    // Dump thread
+    pthread_t dumper;
+    pthread_mutex_t wake_mutex;
+    pthread_cond_t wake;
+    bool running;                   // under wake_mutex
+    bool started;
+    char path[512];
+    unsigned interval_ms;
+} registry = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .wake_mutex = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+};
+
+static _Thread_local MetricsShard *tls_shard = NULL;
+
+// Prometheus histogram buckets, in seconds; the fine buckets are folded into these
+static const struct {
+    uint64_t us;
+    const char *le;
+} le_bounds[] = {
+    {100, "0.0001"}, {250, "0.00025"}, {500, "0.0005"},
+    {1000, "0.001"}, {2500, "0.0025"}, {5000, "0.005"},
+    {10000, "0.01"}, {25000, "0.025"}, {50000, "0.05"},
+    {100000, "0.1"}, {250000, "0.25"}, {500000, "0.5"},
+    {1000000, "1"}, {2500000, "2.5"}, {5000000, "5"}, {10000000, "10"},
+};
+
+static const struct {
+    double q;
+    const char *label;
+} quantiles[] = { {0.5, "0.5"}, {0.9, "0.9"}, {0.99, "0.99"}, {0.999, "0.999"} };
+
+// Only the owning thread writes a shard, so a plain load and store will do
+// where a read-modify-write would lock the bus
+static inline void bump(_Atomic uint64_t *a, uint64_t n) {
+    atomic_store_explicit(a, atomic_load_explicit(a, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static size_t bucket_index(uint64_t us) {
+    if (us < HIST_SUB) return (size_t)us;
+    unsigned msb = 63u - (unsigned)__builtin_clzll(us);
+    if (msb > HIST_MAX_MSB) return HIST_BUCKETS - 1;
+    return (size_t)(msb - HIST_SUB_BITS + 1) * HIST_SUB +
+           (size_t)((us >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+static uint64_t bucket_lowest(size_t i) {
+    if (i < 2 * HIST_SUB) return i;
+    unsigned msb = (unsigned)(i / HIST_SUB) + HIST_SUB_BITS - 1;
+    return (uint64_t)(HIST_SUB + i % HIST_SUB) << (msb - HIST_SUB_BITS);
+}
+
+static uint64_t bucket_highest(size_t i) {
+    return bucket_lowest(i + 1) - 1;
+}
+
+static MetricsShard *shard_for_thread(void) {
+    if (tls_shard) return tls_shard;
+    MetricsShard *shard = (MetricsShard *)calloc(1, sizeof(MetricsShard));
+    if (!shard) return NULL;
+    pthread_mutex_lock(&registry.mutex);
+    shard->next = registry.shards;
+    registry.shards = shard;
+    pthread_mutex_unlock(&registry.mutex);
+    tls_shard = shard;
+    return shard;
+}
+
+void metrics_add(MetricCounter counter, uint64_t n) {
+    MetricsShard *shard = shard_for_thread();
+    if (shard) bump(&shard->counters[counter], n);
+}
+
+void metrics_observe(MetricHistogram hist, uint64_t ns) {
+    MetricsShard *shard = shard_for_thread();
+    if (!shard) return;
+    Histogram *h = &shard->hists[hist];
+    bump(&h->buckets[bucket_index(ns / 1000)], 1);
+    bump(&h->sum_ns, ns);
+    if (ns > atomic_load_explicit(&h->max_ns, memory_order_relaxed)) {
+        atomic_store_explicit(&h->max_ns, ns, memory_order_relaxed);
+    }
+}
+
+bool metrics_add_collector(MetricsCollect collect, void *ctx, bool file_only) {
+    pthread_mutex_lock(&registry.mutex);
+    bool ok = registry.ncollectors < METRICS_MAX_COLLECTORS;
+    if (ok) registry.collectors[registry.ncollectors++] = (Collector){ collect, ctx, file_only };
+    pthread_mutex_unlock(&registry.mutex);
+    return ok;
+}
+
+void metrics_text_init(MetricsText *text) {
+    memset(text, 0, sizeof(*text));
+}
+
+void metrics_text_free(MetricsText *text) {
+    free(text->data);
+    metrics_text_init(text);
+}
+
+static bool text_reserve(MetricsText *text, size_t extra) {
+    if (text->failed) return false;
+    if (text->len + extra < text->cap) return true;
+    size_t cap = text->cap ? text->cap : 4096;
+    while (text->len + extra >= cap) cap *= 2;
+    char *data = (char *)realloc(text->data, cap);
+    if (!data) {
+        text->failed = true;
+        return false;
+    }
+    text->data = data;
+    text->cap = cap;
+    return true;
+}
+
+void metrics_printf(MetricsText *text, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (n < 0 || !text_reserve(text, (size_t)n + 1)) return;
+    va_start(ap, fmt);
+    vsnprintf(text->data + text->len, text->cap - text->len, fmt, ap);
+    va_end(ap);
+    text->len += (size_t)n;
+}
+
+void metrics_print_label(MetricsText *text, const char *value) {
+    if (!text_reserve(text, 2 * strlen(value) + 3)) return;
+    char *p = text->data + text->len;
+    *p++ = '"';
+    for (; *value; value++) {
+        if (*value == '\\' || *value == '"' || *value == '\n') {
+            *p++ = '\\';
+            *p++ = *value == '\n' ? 'n' : *value;
+        } else {
+            *p++ = *value;
+        }
+    }
+    *p++ = '"';
+    *p = '\0';
+    text->len = (size_t)(p - text->data);
+}
+
+// Sum every shard; counters into counters[], histograms into hists[]
+static void snapshot(uint64_t counters[METRIC_COUNTER_COUNT], HistSnapshot *hists) {
+    memset(counters, 0, METRIC_COUNTER_COUNT * sizeof(uint64_t));
+    memset(hists, 0, METRIC_HISTOGRAM_COUNT * sizeof(HistSnapshot));
+    pthread_mutex_lock(&registry.mutex);
+    for (MetricsShard *shard = registry.shards; shard; shard = shard->next) {
+        for (int c = 0; c < METRIC_COUNTER_COUNT; c++) {
+            counters[c] += atomic_load_explicit(&shard->counters[c], memory_order_relaxed);
+        }
+        for (int h = 0; h < METRIC_HISTOGRAM_COUNT; h++) {
+            Histogram *src = &shard->hists[h];
+            HistSnapshot *dst = &hists[h];
+            for (size_t i = 0; i < HIST_BUCKETS; i++) {
+                uint64_t n = atomic_load_explicit(&src->buckets[i], memory_order_relaxed);
+                dst->buckets[i] += n;
+                dst->count += n;
+            }
+            dst->sum_ns += atomic_load_explicit(&src->sum_ns, memory_order_relaxed);
+            uint64_t max = atomic_load_explicit(&src->max_ns, memory_order_relaxed);
+            if (max > dst->max_ns) dst->max_ns = max;
+        }
+    }
+    pthread_mutex_unlock(&registry.mutex);
+}
+
+// labels is "" or the series' own labels, `name="value"`; le and quantile go after them
+static void render_histogram(MetricsText *out, const char *name, const char *labels,
+                             const HistSnapshot *h) {
+    char set[96], lead[96];
+    snprintf(set, sizeof(set), labels[0] ? "{%s}" : "%s", labels);
+    snprintf(lead, sizeof(lead), labels[0] ? "%s," : "%s", labels);
+    size_t nbounds = sizeof(le_bounds) / sizeof(le_bounds[0]);
+    size_t j = 0;
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        if (h->buckets[i] == 0) continue;
+        for (; j < nbounds && le_bounds[j].us < bucket_highest(i); j++) {
+            metrics_printf(out, "%s_bucket{%sle=\"%s\"} %llu\n", name, lead, le_bounds[j].le,
+                           (unsigned long long)cumulative);
+        }
+        cumulative += h->buckets[i];
+    }
+    for (; j < nbounds; j++) {
+        metrics_printf(out, "%s_bucket{%sle=\"%s\"} %llu\n", name, lead, le_bounds[j].le,
+                       (unsigned long long)cumulative);
+    }
+    metrics_printf(out, "%s_bucket{%sle=\"+Inf\"} %llu\n", name, lead, (unsigned long long)h->count);
+    metrics_printf(out, "%s_sum%s %.6f\n", name, set, (double)h->sum_ns / 1e9);
+    metrics_printf(out, "%s_count%s %llu\n", name, set, (unsigned long long)h->count);
+}
+
+// Quantiles read off the fine buckets: the top of the bucket the rank falls
+// in, capped at the largest value seen. Quantile 1 is that largest value.
+static void render_quantiles(MetricsText *out, const char *name, const char *labels,
+                             const HistSnapshot *h) {
+    char lead[96];
+    snprintf(lead, sizeof(lead), labels[0] ? "%s," : "%s", labels);
+    size_t i = 0;
+    uint64_t cumulative = 0;
+    for (size_t k = 0; k < sizeof(quantiles) / sizeof(quantiles[0]); k++) {
+        double exact = quantiles[k].q * (double)h->count;
+        uint64_t rank = (uint64_t)exact;
+        if (rank == 0 || (double)rank < exact) rank++;
+        while (i < HIST_BUCKETS && cumulative + h->buckets[i] < rank) cumulative += h->buckets[i++];
+        uint64_t ns = i < HIST_BUCKETS ? bucket_highest(i) * 1000 + 999 : h->max_ns;
+        if (ns > h->max_ns) ns = h->max_ns;
+        metrics_printf(out, "%s{%squantile=\"%s\"} %.6f\n", name, lead, quantiles[k].label,
+                       (double)ns / 1e9);
+    }
+    metrics_printf(out, "%s{%squantile=\"1\"} %.6f\n", name, lead, (double)h->max_ns / 1e9);
+}
+
+bool metrics_render(MetricsText *out, bool file) {
+    uint64_t counters[METRIC_COUNTER_COUNT];
+    HistSnapshot *hists = (HistSnapshot *)malloc(METRIC_HISTOGRAM_COUNT * sizeof(HistSnapshot));
+    if (!hists) return false;
+    snapshot(counters, hists);
+
+    metrics_printf(out, "# HELP fileserver_upload_bytes_total File data received from clients\n"
+                        "# TYPE fileserver_upload_bytes_total counter\n"
+                        "fileserver_upload_bytes_total %llu\n",
+                   (unsigned long long)counters[METRIC_UPLOAD_BYTES]);
+    metrics_printf(out, "# HELP fileserver_download_bytes_total File data sent to clients\n"
+                        "# TYPE fileserver_download_bytes_total counter\n"
+                        "fileserver_download_bytes_total %llu\n",
+                   (unsigned long long)counters[METRIC_DOWNLOAD_BYTES]);
+    metrics_printf(out, "# HELP fileserver_worker_busy_seconds_total Time workers spent running tasks\n"
+                        "# TYPE fileserver_worker_busy_seconds_total counter\n"
+                        "fileserver_worker_busy_seconds_total %.6f\n",
+                   (double)counters[METRIC_WORKER_BUSY_NS] / 1e9);
+    metrics_printf(out, "# HELP fileserver_tasks_dropped_total Tasks cancelled or expired before they ran\n"
+                        "# TYPE fileserver_tasks_dropped_total counter\n"
+                        "fileserver_tasks_dropped_total %llu\n",
+                   (unsigned long long)counters[METRIC_TASKS_DROPPED]);
+
+    metrics_printf(out, "# HELP fileserver_queue_wait_seconds Time tasks waited for a worker\n"
+                        "# TYPE fileserver_queue_wait_seconds histogram\n");
+    render_histogram(out, "fileserver_queue_wait_seconds", "", &hists[METRIC_QUEUE_WAIT]);
+    metrics_printf(out, "# HELP fileserver_service_seconds Time a worker spent on a request, by command\n"
+                        "# TYPE fileserver_service_seconds histogram\n");
+    for (int c = 0; c < CMD_COUNT; c++) {
+        const HistSnapshot *h = &hists[METRIC_SERVICE + c];
+        if (h->count == 0) continue;
+        char labels[48];
+        snprintf(labels, sizeof(labels), "command=\"%s\"", command_to_string((CommandType)c));
+        render_histogram(out, "fileserver_service_seconds", labels, h);
+    }
+
+    metrics_printf(out, "# HELP fileserver_queue_wait_quantile_seconds Queue wait quantiles since start\n"
+                        "# TYPE fileserver_queue_wait_quantile_seconds gauge\n");
+    render_quantiles(out, "fileserver_queue_wait_quantile_seconds", "", &hists[METRIC_QUEUE_WAIT]);
+    metrics_printf(out, "# HELP fileserver_service_quantile_seconds Service time quantiles since start, by command\n"
+                        "# TYPE fileserver_service_quantile_seconds gauge\n");
+    for (int c = 0; c < CMD_COUNT; c++) {
+        const HistSnapshot *h = &hists[METRIC_SERVICE + c];
+        if (h->count == 0) continue;
+        char labels[48];
+        snprintf(labels, sizeof(labels), "command=\"%s\"", command_to_string((CommandType)c));
+        render_quantiles(out, "fileserver_service_quantile_seconds", labels, h);
+    }
+    free(hists);
+
+    Collector collectors[METRICS_MAX_COLLECTORS];
+    pthread_mutex_lock(&registry.mutex);
+    size_t ncollectors = registry.ncollectors;
+    memcpy(collectors, registry.collectors, ncollectors * sizeof(Collector));
+    pthread_mutex_unlock(&registry.mutex);
+    for (size_t i = 0; i < ncollectors; i++) {
+        if (file || !collectors[i].file_only) collectors[i].collect(collectors[i].ctx, out);
+    }
+    return !out->failed;
+}
+
+static bool write_file(const char *path) {
+    MetricsText text;
+    metrics_text_init(&text);
+    if (!metrics_render(&text, true)) {
+        metrics_text_free(&text);
+        return false;
+    }
+    char tmp[600];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *f = fopen(tmp, "w");
+    bool ok = f && fwrite(text.data, 1, text.len, f) == text.len;
+    if (f && fclose(f) != 0) ok = false;
+    ok = ok && rename(tmp, path) == 0;
+    if (!ok) remove(tmp);
+    metrics_text_free(&text);
+    return ok;
+}
+
+static void *dumper_main(void *arg) {
+    (void)arg;
+    bool failing = false;
+    pthread_mutex_lock(&registry.wake_mutex);
+    for (;;) {
+        bool running = registry.running;
+        pthread_mutex_unlock(&registry.wake_mutex);
+        bool ok = write_file(registry.path);
+        // Warn once per run of failures rather than every interval
+        if (!ok && !failing) LOG_WARN("[Metrics] Failed to write %s", registry.path);
+        failing = !ok;
+        pthread_mutex_lock(&registry.wake_mutex);
+        if (!running) break;
+
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += registry.interval_ms / 1000;
+        ts.tv_nsec += (long)(registry.interval_ms % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        // One more write after a stop, so the file ends with the final totals
+        if (registry.running) pthread_cond_timedwait(&registry.wake, &registry.wake_mutex, &ts);
+    }
+    pthread_mutex_unlock(&registry.wake_mutex);
+    return NULL;
+}
+
+bool metrics_start_dump(const char *path, unsigned interval_ms) {
+    if (registry.started || !path[0] || interval_ms == 0) return false;
+    snprintf(registry.path, sizeof(registry.path), "%s", path);
+    registry.interval_ms = interval_ms;
+    registry.running = true;
+    if (pthread_create(&registry.dumper, NULL, dumper_main, NULL) != 0) {
+        registry.running = false;
+        return false;
+    }
+    registry.started = true;
+    return true;
+}
+
+void metrics_stop_dump(void) {
+    if (!registry.started) return;
+    pthread_mutex_lock(&registry.wake_mutex);
+    registry.running = false;
+    pthread_cond_signal(&registry.wake);
+    pthread_mutex_unlock(&registry.wake_mutex);
+    pthread_join(registry.dumper, NULL);
+    registry.started = false;
+}
+
+void metrics_shutdown(void) {
+    metrics_stop_dump();
+    pthread_mutex_lock(&registry.mutex);
+    MetricsShard *shard = registry.shards;
+    registry.shards = NULL;
+    registry.ncollectors = 0;
+    pthread_mutex_unlock(&registry.mutex);
+    while (shard) {
+        MetricsShard *next = shard->next;
+        free(shard);
+        shard = next;
+    }
+    tls_shard = NULL;
+}
@@ -0,0 +1,615 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "queue.h"
+#include "crypto.h"
+#include "fs.h"
+#include "user.h"
+#include "config.h"
+#include "log.h"
+
+// Microbenchmarks for the server's hot primitives, linked against the same
+// modules the server is built from. Every case runs a number of warmup
+// repetitions, then measured ones, and prints one line of statistics over
+// the measured repetitions. Cases and columns always come out in the same
+// order and nothing else goes to stdout, so the output of two commits can
+// be compared with diff (or column by column with a script).
+
+#define MAX_REPS 100
+#define MAX_THREADS 64
+#define MAX_SWEEP 16
+#define LOCK_USERS 1024
+
+static struct {
+    int reps;
+    int warmup;
+    double scale;                   // work per repetition, 1.0 by default
+    int threads[MAX_SWEEP];
+    int nthreads;
+    const char *filter;             // run only cases whose name contains this
+    const char *dir;                // parent of the scratch directory
+    bool list;
+} cfg = { .reps = 5, .warmup = 1, .scale = 1.0, .threads = { 1, 2, 4, 8 }, .nthreads = 4,
+          .dir = "/tmp" };
+
+static char scratch[512];           // storage root for the fs and user store cases
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t xorshift(uint64_t *s) {
+    uint64_t x = *s;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *s = x;
+}
+
+static size_t scaled(size_t n) {
+    double v = (double)n * cfg.scale;
+    return v < 1 ? 1 : (size_t)v;
+}
+
+// ---- Harness ----
+
+// One repetition of a case; returns the measured value in the case's unit
+typedef double (*BenchFn)(void *arg);
+
+static bool selected(const char *name) {
+    return !cfg.filter || strstr(name, cfg.filter);
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Run fn warmup + reps times and print the statistics of the measured runs
+static void run_case(const char *name, const char *unit, BenchFn fn, void *arg) {
+    if (cfg.list) {
+        printf("%s\n", name);
+        return;
+    }
+    double v[MAX_REPS];
+    for (int i = 0; i < cfg.warmup; i++) fn(arg);
+    for (int i = 0; i < cfg.reps; i++) v[i] = fn(arg);
+    qsort(v, (size_t)cfg.reps, sizeof(v[0]), cmp_double);
+
+    double sum = 0, sq = 0;
+    for (int i = 0; i < cfg.reps; i++) sum += v[i];
+    double mean = sum / cfg.reps;
+    for (int i = 0; i < cfg.reps; i++) sq += (v[i] - mean) * (v[i] - mean);
+    double sd = cfg.reps > 1 ? sqrt(sq / (cfg.reps - 1)) : 0;
+    int n = cfg.reps;
+    double median = n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+    printf("%-52s %-6s %14.1f %14.1f %7.2f %14.1f %14.1f\n", name, unit, median, mean,
+           mean > 0 ? 100 * sd / mean : 0, v[0], v[n - 1]);
+    fflush(stdout);
+}
+
+// Threads of a case start together at a barrier and note when they began
+// and ended; the case took from the first start to the last end. Timing
+// from the main thread would count however long it takes to be scheduled.
+typedef struct {
+    pthread_barrier_t start;
+    atomic_uint_fast64_t begin;
+    atomic_uint_fast64_t end;
+} Gate;
+
+static void gate_enter(Gate *gate) {
+    pthread_barrier_wait(&gate->start);
+    uint_fast64_t expected = 0;
+    atomic_compare_exchange_strong(&gate->begin, &expected, now_ns());
+}
+
+static void gate_leave(Gate *gate) {
+    uint_fast64_t t = now_ns(), seen = atomic_load(&gate->end);
+    while (seen < t && !atomic_compare_exchange_weak(&gate->end, &seen, t)) {}
+}
+
+// Run n threads of fn, which call gate_enter and gate_leave around their
+// work; returns the time the work took in nanoseconds
+static uint64_t run_threads(int n, void *(*fn)(void *), void **args, Gate *gate) {
+    pthread_t tids[MAX_THREADS * 2];
+    pthread_barrier_init(&gate->start, NULL, (unsigned)n);
+    atomic_init(&gate->begin, 0);
+    atomic_init(&gate->end, 0);
+    for (int i = 0; i < n; i++) pthread_create(&tids[i], NULL, fn, args[i]);
+    for (int i = 0; i < n; i++) pthread_join(tids[i], NULL);
+    pthread_barrier_destroy(&gate->start);
+    return atomic_load(&gate->end) - atomic_load(&gate->begin);
+}
+
+// ---- queue_push / queue_pop ----
+
+// As many producers as consumers; with keyed set every producer pushes
+// into a flow of its own, so pops go through deficit round robin.
+typedef struct {
+    Queue *q;
+    Gate *gate;
+    size_t items;                   // producers: how many to push
+    bool keyed;
+    bool producer;
+    char key[16];
+    atomic_size_t *popped;
+    atomic_int *live_producers;
+} QueueArg;
+
+typedef struct {
+    int threads;
+    bool keyed;
+} QueueCase;
+
+static void *queue_thread(void *p) {
+    QueueArg *a = p;
+    gate_enter(a->gate);
+    if (a->producer) {
+        static char item;
+        for (size_t i = 0; i < a->items; i++) {
+            TaskPriority prio = (TaskPriority)(i % PRIORITY_COUNT);
+            if (a->keyed) queue_push_bounded(a->q, &item, prio, 0, a->key, 1);
+            else queue_push(a->q, &item, prio);
+        }
+        // The last producer out closes the queue so consumers drain and stop
+        if (atomic_fetch_sub(a->live_producers, 1) == 1) queue_close(a->q);
+    } else {
+        size_t n = 0;
+        while (queue_pop(a->q)) n++;
+        atomic_fetch_add(a->popped, n);
+    }
+    gate_leave(a->gate);
+    return NULL;
+}
+
+static double bench_queue(void *p) {
+    const QueueCase *c = p;
+    Queue q;
+    queue_init(&q);
+    Gate gate;
+    atomic_size_t popped = 0;
+    atomic_int live = c->threads;
+    size_t per = scaled(400000) / (size_t)c->threads;
+
+    QueueArg args[MAX_THREADS * 2];
+    void *argp[MAX_THREADS * 2];
+    for (int i = 0; i < 2 * c->threads; i++) {
+        args[i] = (QueueArg){ .q = &q, .gate = &gate, .items = per, .keyed = c->keyed,
+                              .producer = i < c->threads, .popped = &popped,
+                              .live_producers = &live };
+        snprintf(args[i].key, sizeof(args[i].key), "p%d", i);
+        argp[i] = &args[i];
+    }
+    uint64_t ns = run_threads(2 * c->threads, queue_thread, argp, &gate);
+    queue_destroy(&q);
+    if (popped != per * (size_t)c->threads) {
+        fprintf(stderr, "queue: %zu of %zu items popped\n", (size_t)popped, per * (size_t)c->threads);
+        exit(1);
+    }
+    return (double)popped * 1e9 / (double)ns;
+}
+
+// ---- Codecs ----
+
+typedef struct {
+    int codec;                      // -1: encode_data, which allocates a copy per call
+    size_t chunk;
+    unsigned char *buf;
+    size_t total;
+} CodecCase;
+
+static double bench_codec(void *p) {
+    const CodecCase *c = p;
+    size_t rounds = (c->total + c->chunk - 1) / c->chunk;
+    CodecParams params = { 0 };
+    char err[256];
+    if (c->codec >= 0 && !codec_init(&params, (CodecId)c->codec, err, sizeof(err))) {
+        fprintf(stderr, "%s\n", err);
+        exit(1);
+    }
+    uint64_t t0 = now_ns();
+    for (size_t r = 0; r < rounds; r++) {
+        if (c->codec < 0) {
+            size_t out_len;
+            unsigned char *out = encode_data(c->buf, c->chunk, &out_len);
+            if (!out) exit(1);
+            free(out);
+        } else {
+            codec_apply(&params, c->buf, c->chunk, (uint64_t)r * c->chunk);
+        }
+    }
+    uint64_t ns = now_ns() - t0;
+    return (double)(rounds * c->chunk) / (1 << 20) * 1e9 / (double)ns;
+}
+
+// ---- fs_upload / fs_download ----
+
+typedef struct {
+    UserStore *store;
+    const unsigned char *data;
+    size_t size;
+    bool download;
+} FsCase;
+
+typedef struct {
+    const unsigned char *data;
+    size_t off, size;
+} MemReader;
+
+static ssize_t mem_read(void *ctx, void *buf, size_t len) {
+    MemReader *m = ctx;
+    size_t n = m->size - m->off < len ? m->size - m->off : len;
+    memcpy(buf, m->data + m->off, n);
+    m->off += n;
+    return (ssize_t)n;
+}
+
+static void fs_put(const FsCase *c) {
+    MemReader m = { c->data, 0, c->size };
+    FsPendingUpload up;
+    uint64_t replaced;
+    char err[256];
+    if (!fs_upload(c->store, "bench", "file.bin", c->size, mem_read, &m, &up, err, sizeof(err)) ||
+        !fs_upload_commit(&up, &replaced, err, sizeof(err))) {
+        fprintf(stderr, "fs_upload: %s\n", err);
+        exit(1);
+    }
+}
+
+static double bench_fs(void *p) {
+    const FsCase *c = p;
+    if (!c->download) {
+        uint64_t t0 = now_ns();
+        fs_put(c);
+        return (double)c->size / (1 << 20) * 1e9 / (double)(now_ns() - t0);
+    }
+    static unsigned char buf[FS_IO_CHUNK];
+    FsDownload dl;
+    char err[256];
+    uint64_t t0 = now_ns();
+    if (!fs_download_open(c->store, "bench", "file.bin", &dl, err, sizeof(err))) {
+        fprintf(stderr, "fs_download_open: %s\n", err);
+        exit(1);
+    }
+    size_t got = 0;
+    ssize_t n;
+    while ((n = fs_download_read(&dl, buf, sizeof(buf))) > 0) got += (size_t)n;
+    fs_download_close(&dl);
+    uint64_t ns = now_ns() - t0;
+    if (n < 0 || got != c->size) {
+        fprintf(stderr, "fs_download_read: short read\n");
+        exit(1);
+    }
+    return (double)got / (1 << 20) * 1e9 / (double)ns;
+}
+
+// ---- user_store_lock_user ----
+
+typedef struct {
+    UserStore *store;
+    int threads;
+    UserLockMode mode;
+} LockCase;
+
+typedef struct {
+    const LockCase *c;
+    Gate *gate;
+    size_t ops;
+    uint64_t seed;
+} LockArg;
+
+static void user_name(char *out, size_t len, size_t i) {
+    snprintf(out, len, "bench%04zu", i);
+}
+
+static void *lock_thread(void *p) {
+    LockArg *a = p;
+    char names[64][16];
+    for (size_t i = 0; i < 64; i++) user_name(names[i], sizeof(names[i]), (a->seed * 131 + i * 17) % LOCK_USERS);
+    gate_enter(a->gate);
+    for (size_t i = 0; i < a->ops; i++) {
+        User *u = user_store_lock_user(a->c->store, names[xorshift(&a->seed) & 63], a->c->mode);
+        if (!u) abort();
+        user_store_unlock_user(u);
+    }
+    gate_leave(a->gate);
+    return NULL;
+}
+
+// Mean time one thread takes per lock and unlock, all threads running
+static double bench_lock(void *p) {
+    const LockCase *c = p;
+    Gate gate;
+    LockArg args[MAX_THREADS];
+    void *argp[MAX_THREADS];
+    size_t per = scaled(500000);
+    for (int i = 0; i < c->threads; i++) {
+        args[i] = (LockArg){ .c = c, .gate = &gate, .ops = per, .seed = 0x9e3779b97f4a7c15ull + (uint64_t)i };
+        argp[i] = &args[i];
+    }
+    uint64_t ns = run_threads(c->threads, lock_thread, argp, &gate);
+    return (double)ns / (double)per;
+}
+
+// First lock of each user by a store just opened over the database, so
+// every lookup goes to SQLite (persistent storage only)
+static double bench_lock_cold(void *p) {
+    (void)p;
+    UserStore *store = user_store_create(scratch);
+    if (!store) exit(1);
+    char name[16];
+    uint64_t t0 = now_ns();
+    for (size_t i = 0; i < LOCK_USERS; i++) {
+        user_name(name, sizeof(name), i);
+        User *u = user_store_lock_user(store, name, USER_LOCK_SHARED);
+        if (!u) abort();
+        user_store_unlock_user(u);
+    }
+    uint64_t ns = now_ns() - t0;
+    user_store_destroy(store);
+    return (double)ns / LOCK_USERS;
+}
+
+// ---- Setup ----
+
+// Point the config module at the scratch directory with the given settings
+static void configure(bool persistent, const char *codec, bool compress) {
+    char path[600];
+    snprintf(path, sizeof(path), "%s/bench.ini", scratch);
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        exit(1);
+    }
+    fprintf(f, "use_persistent_storage=%d\nstorage_path=%s\ndatabase_file=bench.db\n"
+               "file_codec=%s\nfile_compression=%s\nuser_quota_mb=1048576\n",
+            persistent, scratch, codec, compress ? "lz4" : "none");
+    fclose(f);
+    config_init(path);
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void)st; (void)flag; (void)ftw;
+    return remove(path);
+}
+
+static void scratch_clear(void) {
+    nftw(scratch, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    mkdir(scratch, 0700);
+}
+
+// Text-like test data: words from a small vocabulary, so LZ4 finds about
+// as much to squeeze out as in ordinary documents
+static void fill_text(unsigned char *buf, size_t len) {
+    static const char *words[] = { "the ", "server ", "stores ", "files ", "for ", "each ", "user ",
+                                   "in ", "chunks ", "of ", "data ", "0x3f ", "and ", "answers ",
+                                   "requests\n", "quickly " };
+    uint64_t s = 42;
+    size_t off = 0;
+    while (off < len) {
+        const char *w = words[xorshift(&s) % 16];
+        size_t n = strlen(w);
+        if (n > len - off) n = len - off;
+        memcpy(buf + off, w, n);
+        off += n;
+    }
+}
+
+static void run_queue_cases(void) {
+    char name[128];
+    for (int keyed = 0; keyed <= 1; keyed++) {
+        for (int t = 0; t < cfg.nthreads; t++) {
+            QueueCase c = { cfg.threads[t], keyed };
+            snprintf(name, sizeof(name), "queue/%s/threads=%d", keyed ? "push_pop_keyed" : "push_pop",
+                     c.threads);
+            if (selected(name)) run_case(name, "ops/s", bench_queue, &c);
+        }
+    }
+}
+
+static void run_codec_cases(void) {
+    static const size_t chunks[] = { 512, 4096, 65536, 1 << 20 };
+    static const int codecs[] = { -1, CODEC_XOR, CODEC_CHACHA20 };
+    size_t total = scaled(64u << 20);
+    unsigned char *buf = malloc(1 << 20);
+    if (!buf) exit(1);
+    fill_text(buf, 1 << 20);
+    char name[128];
+    for (size_t k = 0; k < sizeof(codecs) / sizeof(codecs[0]); k++) {
+        for (size_t i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++) {
+            CodecCase c = { codecs[k], chunks[i], buf, total < chunks[i] ? chunks[i] : total };
+            snprintf(name, sizeof(name), "codec/%s/chunk=%zu",
+                     c.codec < 0 ? "encode_data" : codec_name(c.codec), c.chunk);
+            if (selected(name)) run_case(name, "MiB/s", bench_codec, &c);
+        }
+    }
+    free(buf);
+}
+
+static void run_fs_cases(void) {
+    static const struct { const char *codec; bool compress; } modes[] = {
+        { "none", false }, { "xor", false }, { "chacha20", false }, { "chacha20", true },
+    };
+    size_t size = scaled(32u << 20);
+    unsigned char *data = malloc(size);
+    if (!data) exit(1);
+    fill_text(data, size);
+    for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+        char mode[32];
+        snprintf(mode, sizeof(mode), "%s%s", modes[m].codec, modes[m].compress ? "+lz4" : "");
+        char up[128], down[128];
+        snprintf(up, sizeof(up), "fs/upload/%s", mode);
+        snprintf(down, sizeof(down), "fs/download/%s", mode);
+        if (!selected(up) && !selected(down)) continue;
+        if (cfg.list) {
+            run_case(up, NULL, NULL, NULL);
+            run_case(down, NULL, NULL, NULL);
+            continue;
+        }
+        scratch_clear();
+        configure(false, modes[m].codec, modes[m].compress);
+        UserStore *store = user_store_create(scratch);
+        if (!store || !user_store_signup(store, "bench", "bench", config_get_user_quota_bytes(),
+                                         PRIORITY_NORMAL)) {
+            fprintf(stderr, "Failed to create the benchmark user\n");
+            exit(1);
+        }
+        FsCase c = { store, data, size, false };
+        // Downloads read the file the uploads left behind
+        if (selected(up)) run_case(up, "MiB/s", bench_fs, &c);
+        else fs_put(&c);
+        c.download = true;
+        if (selected(down)) run_case(down, "MiB/s", bench_fs, &c);
+        user_store_destroy(store);
+    }
+    free(data);
+}
+
+static void run_lock_cases(void) {
+    char name[128];
+    for (int persistent = 0; persistent <= 1; persistent++) {
+        const char *storage = persistent ? "persistent" : "memory";
+        char prefix[64];
+        snprintf(prefix, sizeof(prefix), "user_store/lock_user/%s/", storage);
+        bool any = false;
+        for (int mode = 0; mode <= 1; mode++) {
+            for (int t = 0; t < cfg.nthreads; t++) {
+                snprintf(name, sizeof(name), "%s%s/threads=%d", prefix, mode ? "exclusive" : "shared",
+                         cfg.threads[t]);
+                any |= selected(name);
+            }
+        }
+        char cold[128];
+        snprintf(cold, sizeof(cold), "user_store/lock_user_cold/%s", storage);
+        bool want_cold = persistent && selected(cold);
+        if (!any && !want_cold) continue;
+
+        UserStore *store = NULL;
+        if (!cfg.list) {
+            scratch_clear();
+            configure(persistent, "xor", false);
+            store = user_store_create(scratch);
+            if (!store) exit(1);
+            for (size_t i = 0; i < LOCK_USERS; i++) {
+                user_name(name, sizeof(name), i);
+                if (!user_store_signup(store, name, "pw", config_get_user_quota_bytes(), PRIORITY_NORMAL)) {
+                    fprintf(stderr, "Failed to sign up %s\n", name);
+                    exit(1);
+                }
+            }
+        }
+        for (int mode = 0; mode <= 1; mode++) {
+            for (int t = 0; t < cfg.nthreads; t++) {
+                LockCase c = { store, cfg.threads[t], mode ? USER_LOCK_EXCLUSIVE : USER_LOCK_SHARED };
+                snprintf(name, sizeof(name), "%s%s/threads=%d", prefix, mode ? "exclusive" : "shared",
+                         c.threads);
+                if (selected(name)) run_case(name, "ns/op", bench_lock, &c);
+            }
+        }
+        // Usage is flushed and the database closed before the cold store opens it
+        user_store_destroy(store);
+        if (want_cold) run_case(cold, "ns/op", bench_lock_cold, NULL);
+    }
+}
+
+// ---- Main ----
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -r, --reps N             measured repetitions per case (5)\n"
+        "  -w, --warmup N           repetitions run first and discarded (1)\n"
+        "  -t, --threads LIST       thread counts to sweep, e.g. 1,2,4,8 (1,2,4,8)\n"
+        "  -s, --scale X            work per repetition relative to the default (1.0)\n"
+        "  -f, --filter TEXT        run only cases whose name contains TEXT\n"
+        "  -d, --dir DIR            where the scratch directory is made (/tmp)\n"
+        "  -l, --list               print the case names and exit\n"
+        "Output: one line per case with the median, mean, relative standard\n"
+        "deviation (%%), minimum and maximum over the measured repetitions.\n",
+        prog);
+}
+
+static bool parse_threads(char *spec) {
+    cfg.nthreads = 0;
+    for (char *tok = strtok(spec, ","); tok; tok = strtok(NULL, ",")) {
+        int n = atoi(tok);
+        if (n < 1 || n > MAX_THREADS || cfg.nthreads == MAX_SWEEP) return false;
+        cfg.threads[cfg.nthreads++] = n;
+    }
+    return cfg.nthreads > 0;
+}
+
+static bool parse_args(int argc, char **argv) {
+    static const struct option opts[] = {
+        { "reps", required_argument, NULL, 'r' },
+        { "warmup", required_argument, NULL, 'w' },
+        { "threads", required_argument, NULL, 't' },
+        { "scale", required_argument, NULL, 's' },
+        { "filter", required_argument, NULL, 'f' },
+        { "dir", required_argument, NULL, 'd' },
+        { "list", no_argument, NULL, 'l' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+    int ch;
+    while ((ch = getopt_long(argc, argv, "r:w:t:s:f:d:lh", opts, NULL)) != -1) {
+        switch (ch) {
+        case 'r': cfg.reps = atoi(optarg); if (cfg.reps < 1 || cfg.reps > MAX_REPS) return false; break;
+        case 'w': cfg.warmup = atoi(optarg); if (cfg.warmup < 0) return false; break;
+        case 't': if (!parse_threads(optarg)) return false; break;
+        case 's': cfg.scale = atof(optarg); if (cfg.scale <= 0) return false; break;
+        case 'f': cfg.filter = optarg; break;
+        case 'd': cfg.dir = optarg; break;
+        case 'l': cfg.list = true; break;
+        default: return false;
+        }
+    }
+    return optind == argc;
+}
+
+int main(int argc, char **argv) {
+    if (!parse_args(argc, argv)) {
+        usage(argv[0]);
+        return 2;
+    }
+    if (!cfg.list) {
+        snprintf(scratch, sizeof(scratch), "%s/microbench.XXXXXX", cfg.dir);
+        if (!mkdtemp(scratch)) {
+            perror(scratch);
+            return 1;
+        }
+        log_set_level(LOG_LEVEL_WARN);
+        char key_path[600], err[256];
+        snprintf(key_path, sizeof(key_path), "%s/.codec_key", scratch);
+        if (!crypto_load_key(key_path, err, sizeof(err))) {
+            fprintf(stderr, "%s\n", err);
+            return 1;
+        }
+        printf("# microbench reps=%d warmup=%d scale=%g kernels=%s\n", cfg.reps, cfg.warmup, cfg.scale,
+               crypto_kernel_name());
+        printf("%-52s %-6s %14s %14s %7s %14s %14s\n", "# case", "unit", "median", "mean", "rsd%",
+               "min", "max");
+    }
+    run_queue_cases();
+    run_codec_cases();
+    run_fs_cases();
+    run_lock_cases();
+    if (!cfg.list) {
+        nftw(scratch, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    }
+    return 0;
+}
@@ -0,0 +1,87 @@
+#define _GNU_SOURCE
+#include "net.h"
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+
+static bool wait_for(int fd, short events, int timeout_ms) {
+    struct pollfd pfd = { .fd = fd, .events = events };
+    while (1) {
+        int rc = poll(&pfd, 1, timeout_ms);
+        if (rc > 0) return true;
+        if (rc == 0) return false;
+        if (errno != EINTR) return false;
+    }
+}
+
+bool net_write_all(int fd, const void *buf, size_t len) {
+    const char *p = (const char *)buf;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n > 0) {
+            p += n;
+            len -= (size_t)n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!wait_for(fd, POLLOUT, NET_IO_TIMEOUT_MS)) return false;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool net_sendfile(int fd, int in_fd, off_t *offset, size_t len) {
+    while (len > 0) {
+        ssize_t n = sendfile(fd, in_fd, offset, len);
+        if (n > 0) {
+            len -= (size_t)n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (!wait_for(fd, POLLOUT, NET_IO_TIMEOUT_MS)) return false;
+        } else {
+            return false; // error, or the file shrank underneath us
+        }
+    }
+    return true;
+}
+
+void net_reader_init(NetReader *r, int fd) {
+    r->fd = fd;
+    r->start = r->end = 0;
+    r->eof = false;
+}
+
+bool net_reader_fill(NetReader *r) {
+    if (r->start > 0) {
+        memmove(r->buf, r->buf + r->start, r->end - r->start);
+        r->end -= r->start;
+        r->start = 0;
+    }
+    if (r->eof || r->end == NET_READER_SIZE) return false;
+    while (1) {
+        ssize_t n = read(r->fd, r->buf + r->end, NET_READER_SIZE - r->end);
+        if (n > 0) {
+            r->end += (size_t)n;
+            return true;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        r->eof = true;
+        return false;
+    }
+}
+
+ssize_t net_read(int fd, void *buf, size_t len, int timeout_ms) {
+    while (1) {
+        ssize_t n = read(fd, buf, len);
+        if (n >= 0) return n;
+        if (errno == EINTR) continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+        if (!wait_for(fd, POLLIN, timeout_ms)) return -1;
+    }
+}
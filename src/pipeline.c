@@ -0,0 +1,160 @@
+#include "pipeline.h"
+#include "pool.h"
+#include "wire.h"
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+void pipeline_init(Pipeline *p) {
+    memset(p, 0, sizeof(*p));
+    p->ordered = true;
+    p->depth = 1;
+}
+
+void pipeline_clear(Pipeline *p) {
+    for (size_t i = 0; i < PIPELINE_MAX_DEPTH; i++) {
+        pool_free(g_response_pool, p->held[i]);
+        p->held[i] = NULL;
+    }
+    p->held_count = 0;
+}
+
+bool pipeline_is_command(const char *line, bool *ordered) {
+    if (strncmp(line, "PIPELINE", 8) != 0 || (line[8] != '\0' && line[8] != ' ')) return false;
+    char mode[16] = {0};
+    sscanf(line + 8, "%15s", mode);
+    *ordered = strcasecmp(mode, "ordered") == 0;
+    return true;
+}
+
+bool pipeline_enable(Pipeline *p, bool ordered, unsigned depth, char *err, size_t errlen) {
+    if (p->tagged) {
+        snprintf(err, errlen, "Already pipelined");
+        return false;
+    }
+    if (p->inflight > 0) {
+        snprintf(err, errlen, "Requests still in flight");
+        return false;
+    }
+    if (depth < 1) depth = 1;
+    if (depth > PIPELINE_MAX_DEPTH) depth = PIPELINE_MAX_DEPTH;
+    p->tagged = true;
+    p->ordered = ordered;
+    p->depth = depth;
+    p->held_head = 0;
+    return true;
+}
+
+bool pipeline_set_binary(Pipeline *p, const char *tag, char *err, size_t errlen) {
+    if (p->inflight > 0) {
+        snprintf(err, errlen, "Requests still in flight");
+        return false;
+    }
+    char msg[32];
+    snprintf(msg, sizeof(msg), "binary %d", WIRE_VERSION);
+    if (!pipeline_reply(p, tag, RESP_OK, msg)) {
+        snprintf(err, errlen, "Out of memory");
+        return false;
+    }
+    p->binary = true;
+    return true;
+}
+
+bool pipeline_has_room(const Pipeline *p) {
+    return !p->streaming && p->inflight < p->depth;
+}
+
+bool pipeline_can_start(const Pipeline *p, const Task *task) {
+    if (!pipeline_has_room(p)) return false;
+    return !task_streams_data(task) || p->inflight == 0;
+}
+
+bool pipeline_split_tag(const char *line, char tag[REQUEST_TAG_LEN], const char **command) {
+    size_t n = 0;
+    while (line[n] >= '0' && line[n] <= '9') n++;
+    // At most 19 digits, so every id fits in 64 bits
+    if (n == 0 || n > 19 || line[n] != ' ') return false;
+    memcpy(tag, line, n + 1);
+    tag[n + 1] = '\0';
+    *command = line + n + 1;
+    return true;
+}
+
+void pipeline_submit(Pipeline *p, Task *task, const char *tag) {
+    task->seq = p->next_seq++;
+    snprintf(task->tag, sizeof(task->tag), "%s", tag);
+    p->inflight++;
+    if (task_streams_data(task)) p->streaming = true;
+}
+
+bool pipeline_reply(Pipeline *p, const char *tag, ResponseStatus status, const char *msg) {
+    Response *r = (Response *)pool_alloc(g_response_pool);
+    if (!r) return false;
+    r->status = status;
+    snprintf(r->message, sizeof(r->message), "%s", msg);
+    snprintf(r->tag, sizeof(r->tag), "%s", tag);
+    r->binary = p->binary;
+    r->seq = p->next_seq++;
+    p->inflight++;
+    pipeline_complete(p, r);
+    return true;
+}
+
+bool pipeline_refuse(Pipeline *p, const Task *task, const char *msg) {
+    Response *r = (Response *)pool_alloc(g_response_pool);
+    if (!r) return false;
+    r->status = RESP_ERR;
+    snprintf(r->message, sizeof(r->message), "%s", msg);
+    memcpy(r->tag, task->tag, sizeof(r->tag));
+    r->binary = task->binary;
+    r->seq = task->seq;
+    pipeline_complete(p, r);
+    return true;
+}
+
+void pipeline_complete(Pipeline *p, Response *r) {
+    if (p->ordered) {
+        p->held[r->seq % PIPELINE_MAX_DEPTH] = r;
+    } else {
+        p->held[(p->held_head + p->held_count) % PIPELINE_MAX_DEPTH] = r;
+    }
+    p->held_count++;
+}
+
+Response *pipeline_next(Pipeline *p) {
+    Response *r;
+    if (p->ordered) {
+        size_t slot = p->next_reply % PIPELINE_MAX_DEPTH;
+        r = p->held[slot];
+        if (!r) return NULL;
+        p->held[slot] = NULL;
+        p->next_reply++;
+    } else {
+        if (p->held_count == 0) return NULL;
+        r = p->held[p->held_head];
+        p->held[p->held_head] = NULL;
+        p->held_head = (p->held_head + 1) % PIPELINE_MAX_DEPTH;
+    }
+    p->held_count--;
+    p->inflight--;
+    // Only a data-phase request was in flight, and this is its reply
+    p->streaming = false;
+    return r;
+}
+
+size_t pipeline_format(const Response *r, char *buf, size_t len) {
+    if (r->status == RESP_SENT) return 0;
+    if (r->binary) {
+        return wire_format_reply(r->status == RESP_OK ? WIRE_OP_OK : WIRE_OP_ERR,
+                                 wire_tag_id(r->tag), r->message, buf, len);
+    }
+    int n = snprintf(buf, len, "%s%s %s\n", r->tag,
+                     r->status == RESP_OK ? "OK" : "ERR", r->message);
+    if (n < 0) return 0;
+    if ((size_t)n >= len) {
+        // Truncated: still end with the newline
+        n = (int)len - 1;
+        buf[n - 1] = '\n';
+    }
+    return (size_t)n;
+}
@@ -0,0 +1,246 @@
+#define _POSIX_C_SOURCE 200809L
+#include "pool.h"
+#include "types.h"
+#include "log.h"
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define POOL_SLAB_SIZE (64 * 1024)  // power of two; slabs are aligned to it
+#define POOL_OBJ_ALIGN 16
+#define POOL_CACHE_LINE 64
+
+Pool *g_task_pool = NULL;
+Pool *g_response_pool = NULL;
+Pool *g_client_info_pool = NULL;
+
+#ifndef POOL_USE_MALLOC
+
+typedef struct FreeObj {
+    struct FreeObj *next;
+} FreeObj;
+
+typedef struct PoolCache PoolCache;
+
+// Start of every slab; objects follow at POOL_SLAB_HEADER. Masking an
+// object's address finds its slab, and from it the owning cache.
+typedef struct Slab {
+    PoolCache *owner;
+    struct Slab *next;
+} Slab;
+
+#define POOL_SLAB_HEADER ((sizeof(Slab) + POOL_CACHE_LINE - 1) & ~(size_t)(POOL_CACHE_LINE - 1))
+
+struct PoolCache {
+    // Owner thread only
+    FreeObj *local;
+    Slab *slabs;
+    size_t nslabs;
+    size_t allocs;
+    size_t reused;              // allocations served from a free list
+    PoolCache *next;            // pool's cache list, under caches_mutex
+    atomic_bool abandoned;      // owning thread exited
+    // Pushed by other threads; on its own line so they don't bounce the
+    // owner's fields
+    _Alignas(POOL_CACHE_LINE) _Atomic(FreeObj *) remote;
+};
+
+struct Pool {
+    char name[32];
+    size_t obj_size;            // rounded up to POOL_OBJ_ALIGN
+    size_t per_slab;
+    pthread_key_t key;          // the calling thread's PoolCache
+    pthread_mutex_t caches_mutex;
+    PoolCache *caches;
+};
+
+// Thread-exit destructor for the pool key: the cache stays with its slabs
+// until another thread adopts it
+static void cache_abandon(void *arg) {
+    PoolCache *c = (PoolCache *)arg;
+    atomic_store(&c->abandoned, true);
+}
+
+static PoolCache *cache_get(Pool *pool) {
+    PoolCache *c = pthread_getspecific(pool->key);
+    if (c) return c;
+
+    pthread_mutex_lock(&pool->caches_mutex);
+    for (c = pool->caches; c; c = c->next) {
+        bool expected = true;
+        if (atomic_compare_exchange_strong(&c->abandoned, &expected, false)) break;
+    }
+    if (!c) {
+        size_t size = (sizeof(PoolCache) + POOL_CACHE_LINE - 1) & ~(size_t)(POOL_CACHE_LINE - 1);
+        c = (PoolCache *)aligned_alloc(POOL_CACHE_LINE, size);
+        if (c) {
+            memset(c, 0, size);
+            c->next = pool->caches;
+            pool->caches = c;
+        }
+    }
+    pthread_mutex_unlock(&pool->caches_mutex);
+    if (c) pthread_setspecific(pool->key, c);
+    return c;
+}
+
+// Carve a new slab into c's local free list
+static bool slab_add(Pool *pool, PoolCache *c) {
+    Slab *s = (Slab *)aligned_alloc(POOL_SLAB_SIZE, POOL_SLAB_SIZE);
+    if (!s) return false;
+    s->owner = c;
+    s->next = c->slabs;
+    c->slabs = s;
+    c->nslabs++;
+
+    char *base = (char *)s + POOL_SLAB_HEADER;
+    for (size_t i = pool->per_slab; i-- > 0; ) {
+        FreeObj *o = (FreeObj *)(base + i * pool->obj_size);
+        o->next = c->local;
+        c->local = o;
+    }
+    return true;
+}
+
+static size_t list_len(const FreeObj *o) {
+    size_t n = 0;
+    for (; o; o = o->next) n++;
+    return n;
+}
+
+Pool *pool_create(const char *name, size_t obj_size) {
+    obj_size = (obj_size + POOL_OBJ_ALIGN - 1) & ~(size_t)(POOL_OBJ_ALIGN - 1);
+    if (obj_size < sizeof(FreeObj)) obj_size = POOL_OBJ_ALIGN;
+    if (obj_size > POOL_SLAB_SIZE - POOL_SLAB_HEADER) return NULL;
+
+    Pool *pool = (Pool *)calloc(1, sizeof(Pool));
+    if (!pool) return NULL;
+    if (pthread_key_create(&pool->key, cache_abandon) != 0) {
+        free(pool);
+        return NULL;
+    }
+    strncpy(pool->name, name, sizeof(pool->name) - 1);
+    pool->obj_size = obj_size;
+    pool->per_slab = (POOL_SLAB_SIZE - POOL_SLAB_HEADER) / obj_size;
+    pthread_mutex_init(&pool->caches_mutex, NULL);
+    return pool;
+}
+
+void pool_destroy(Pool *pool) {
+    if (!pool) return;
+
+    size_t allocs = 0, reused = 0, slabs = 0, free_objs = 0, ncaches = 0;
+    PoolCache *c = pool->caches;
+    while (c) {
+        PoolCache *next = c->next;
+        allocs += c->allocs;
+        reused += c->reused;
+        slabs += c->nslabs;
+        free_objs += list_len(c->local) + list_len(atomic_load(&c->remote));
+        ncaches++;
+        while (c->slabs) {
+            Slab *s = c->slabs;
+            c->slabs = s->next;
+            free(s);
+        }
+        free(c);
+        c = next;
+    }
+
+    size_t in_use = slabs * pool->per_slab - free_objs;
+    LOG_INFO("[Pool] %s: %zu allocations, %.1f%% from free lists, %zu thread caches, "
+             "%zu slabs (%zu KiB), %zu objects still in use",
+             pool->name, allocs, allocs ? 100.0 * (double)reused / (double)allocs : 0.0,
+             ncaches, slabs, slabs * (POOL_SLAB_SIZE / 1024), in_use);
+
+    pthread_key_delete(pool->key);
+    pthread_mutex_destroy(&pool->caches_mutex);
+    free(pool);
+}
+
+void *pool_alloc(Pool *pool) {
+    PoolCache *c = cache_get(pool);
+    if (!c) return NULL;
+
+    FreeObj *o = c->local;
+    if (!o) {
+        // Take back everything other threads have freed so far
+        o = atomic_exchange_explicit(&c->remote, NULL, memory_order_acquire);
+    }
+    if (o) {
+        c->reused++;
+    } else {
+        if (!slab_add(pool, c)) return NULL;
+        o = c->local;
+    }
+    c->local = o->next;
+    c->allocs++;
+    memset(o, 0, pool->obj_size);
+    return o;
+}
+
+void pool_free(Pool *pool, void *obj) {
+    if (!obj) return;
+    FreeObj *o = (FreeObj *)obj;
+    PoolCache *c = ((Slab *)((uintptr_t)obj & ~(uintptr_t)(POOL_SLAB_SIZE - 1)))->owner;
+
+    if (c == pthread_getspecific(pool->key)) {
+        o->next = c->local;
+        c->local = o;
+        return;
+    }
+
+    // Only the owner ever takes the list, and always all of it, so a plain
+    // push can't suffer ABA
+    FreeObj *head = atomic_load_explicit(&c->remote, memory_order_relaxed);
+    do {
+        o->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&c->remote, &head, o,
+                                                    memory_order_release, memory_order_relaxed));
+}
+
+#else // POOL_USE_MALLOC
+
+struct Pool {
+    size_t obj_size;
+};
+
+Pool *pool_create(const char *name, size_t obj_size) {
+    (void)name;
+    Pool *pool = (Pool *)calloc(1, sizeof(Pool));
+    if (pool) pool->obj_size = obj_size;
+    return pool;
+}
+
+void pool_destroy(Pool *pool) {
+    free(pool);
+}
+
+void *pool_alloc(Pool *pool) {
+    return calloc(1, pool->obj_size);
+}
+
+void pool_free(Pool *pool, void *obj) {
+    (void)pool;
+    free(obj);
+}
+
+#endif // POOL_USE_MALLOC
+
+bool pools_init(void) {
+    g_task_pool = pool_create("task", sizeof(Task));
+    g_response_pool = pool_create("response", sizeof(Response));
+    g_client_info_pool = pool_create("client_info", sizeof(ClientInfo));
+    if (g_task_pool && g_response_pool && g_client_info_pool) return true;
+    pools_destroy();
+    return false;
+}
+
+void pools_destroy(void) {
+    pool_destroy(g_task_pool);
+    pool_destroy(g_response_pool);
+    pool_destroy(g_client_info_pool);
+    g_task_pool = g_response_pool = g_client_info_pool = NULL;
+}
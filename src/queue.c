@@ -1,76 +1,259 @@
 #include "queue.h"
 #include "types.h"
-#include "task.h"
+#include "log.h"
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <stdio.h>
 #include <time.h>
-#include <assert.h>
-
-// Helper function to swap two priority items
-static void swap_items(PriorityItem *a, PriorityItem *b) {
-    PriorityItem temp = *a;
-    *a = *b;
-    *b = temp;
-}
-
-// Helper function to maintain heap property using task_compare_priority
-static void heapify_up(Queue *q, size_t index) {
-    while (index > 0) {
-        size_t parent = (index - 1) / 2;
-        Task *parent_task = (Task *)q->items[parent].data;
-        Task *current_task = (Task *)q->items[index].data;
-        
-        // Use task_compare_priority for consistent comparison
-        if (task_compare_priority(&parent_task, &current_task) >= 0) {
-            break;
+
+#define QUEUE_MIN_BUCKETS 64
+
+enum { FLOW_IDLE, FLOW_NEW, FLOW_OLD };
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Double a full ring, unwrapping it so the oldest item lands at index 0
+static bool ring_grow(PriorityRing *r) {
+    size_t new_capacity = r->capacity ? r->capacity * 2 : 16;
+    PriorityItem *items = (PriorityItem *)malloc(new_capacity * sizeof(PriorityItem));
+    if (!items) return false;
+    for (size_t i = 0; i < r->count; i++) {
+        items[i] = r->items[(r->head + i) & (r->capacity - 1)];
+    }
+    free(r->items);
+    r->items = items;
+    r->head = 0;
+    r->capacity = new_capacity;
+    return true;
+}
+
+static void list_push(FlowList *l, QueueFlow *f) {
+    f->next = NULL;
+    if (l->tail) l->tail->next = f;
+    else l->head = f;
+    l->tail = f;
+}
+
+static QueueFlow *list_pop(FlowList *l) {
+    QueueFlow *f = l->head;
+    l->head = f->next;
+    if (!l->head) l->tail = NULL;
+    f->next = NULL;
+    return f;
+}
+
+// FNV-1a over the key, mixed with the level
+static size_t flow_hash(const char *key, TaskPriority priority) {
+    uint64_t h = 1469598103934665603ull ^ (uint64_t)priority;
+    for (const unsigned char *p = (const unsigned char *)key; *p; p++) {
+        h = (h ^ *p) * 1099511628211ull;
+    }
+    return (size_t)h;
+}
+
+static bool buckets_grow(Queue *q) {
+    size_t n = q->nbuckets ? q->nbuckets * 2 : QUEUE_MIN_BUCKETS;
+    QueueFlow **buckets = (QueueFlow **)calloc(n, sizeof(QueueFlow *));
+    if (!buckets) return false;
+    for (size_t i = 0; i < q->nbuckets; i++) {
+        QueueFlow *f = q->buckets[i];
+        while (f) {
+            QueueFlow *next = f->hash_next;
+            size_t b = flow_hash(f->key, f->priority) & (n - 1);
+            f->hash_next = buckets[b];
+            buckets[b] = f;
+            f = next;
+        }
+    }
+    free(q->buckets);
+    q->buckets = buckets;
+    q->nbuckets = n;
+    return true;
+}
+
+// The flow for key in a level. Flows are created on demand, up to
+// max_flows, and freed by flow_release once they have nothing queued or
+// owed, so memory follows the senders with work in the queue rather than
+// every key ever seen. NULL if there is none and none can be made.
+static QueueFlow *find_flow(Queue *q, TaskPriority priority, const char *key, bool create) {
+    if (q->nbuckets) {
+        QueueFlow *f = q->buckets[flow_hash(key, priority) & (q->nbuckets - 1)];
+        for (; f; f = f->hash_next) {
+            if (f->priority == priority && strcmp(f->key, key) == 0) return f;
+        }
+    }
+    if (!create || q->nflows >= q->max_flows) return NULL;
+    if (q->nflows >= q->nbuckets && !buckets_grow(q)) return NULL;
+
+    QueueFlow *f = (QueueFlow *)calloc(1, sizeof(QueueFlow));
+    if (!f) return NULL;
+    snprintf(f->key, sizeof(f->key), "%s", key);
+    f->priority = priority;
+    size_t b = flow_hash(f->key, priority) & (q->nbuckets - 1);
+    f->hash_next = q->buckets[b];
+    q->buckets[b] = f;
+    q->nflows++;
+    return f;
+}
+
+// Free an idle keyed flow unless it is in debt: a debt from a large item
+// must outlive the idle spell, or a sender could shed it by pausing.
+static void flow_release(Queue *q, QueueFlow *f) {
+    if (f->state != FLOW_IDLE || f->ring.count || f->deficit < 0 ||
+        f == &q->levels[f->priority].shared) {
+        return;
+    }
+    QueueFlow **p = &q->buckets[flow_hash(f->key, f->priority) & (q->nbuckets - 1)];
+    while (*p != f) p = &(*p)->hash_next;
+    *p = f->hash_next;
+    q->nflows--;
+    free(f->ring.items);
+    free(f);
+}
+
+// Every flow with items is in debt after a whole round. Grant the rounds
+// the least indebted one needs all at once rather than a quantum a pass.
+static void catch_up(Queue *q, PriorityLevel *l) {
+    int64_t best = INT64_MIN;
+    for (int i = 0; i < 2; i++) {
+        for (QueueFlow *f = i ? l->new_flows.head : l->old_flows.head; f; f = f->next) {
+            if (f->ring.count && f->deficit > best) best = f->deficit;
+        }
+    }
+    if (best > 0) return;
+    int64_t grant = (-best / (int64_t)q->quantum + 1) * (int64_t)q->quantum;
+    for (int i = 0; i < 2; i++) {
+        for (QueueFlow *f = i ? l->new_flows.head : l->old_flows.head; f; f = f->next) {
+            if (f->ring.count) f->deficit += grant;
         }
-        swap_items(&q->items[parent], &q->items[index]);
-        index = parent;
     }
 }
 
-// Helper function to maintain heap property (downward) using task_compare_priority
-static void heapify_down(Queue *q, size_t index) {
-    while (1) {
-        size_t left = 2 * index + 1;
-        size_t right = 2 * index + 2;
-        size_t largest = index;
+// Rotate the level's lists until the flow at the front may hand out its
+// next item, and return it; the level must not be empty. New flows go
+// first. A flow out of credit gets another quantum at the back of the old
+// flows. A drained new flow goes round once more as an old one, so it
+// can't jump the queue again straight away; a drained old flow goes idle.
+static QueueFlow *next_flow(Queue *q, PriorityLevel *l) {
+    size_t passed = 0;
+    for (;;) {
+        FlowList *list = l->new_flows.head ? &l->new_flows : &l->old_flows;
+        QueueFlow *f = list->head;
+        if (f->ring.count > 0 && f->deficit > 0) return f;
 
-        if (left < q->size) {
-            Task *left_task = (Task *)q->items[left].data;
-            Task *largest_task = (Task *)q->items[largest].data;
-            if (task_compare_priority(&left_task, &largest_task) > 0) {
-                largest = left;
-            }
+        list_pop(list);
+        if (f->ring.count == 0 && list == &l->old_flows) {
+            f->state = FLOW_IDLE;
+            l->active--;
+            flow_release(q, f);
+            continue;
         }
-        
-        if (right < q->size) {
-            Task *right_task = (Task *)q->items[right].data;
-            Task *largest_task = (Task *)q->items[largest].data;
-            if (task_compare_priority(&right_task, &largest_task) > 0) {
-                largest = right;
-            }
+        if (f->ring.count > 0) f->deficit += (int64_t)q->quantum;
+        f->state = FLOW_OLD;
+        list_push(&l->old_flows, f);
+        if (++passed >= l->active) {
+            catch_up(q, l);
+            passed = 0;
         }
-        
-        if (largest == index) {
-            break;
+    }
+}
+
+// When the item a non-empty level would hand out next was pushed
+static uint64_t level_next_enqueued(Queue *q, PriorityLevel *l) {
+    QueueFlow *f = next_flow(q, l);
+    return f->ring.items[f->ring.head].enqueued_ns;
+}
+
+// Level whose next item goes next, or -1 if the queue is empty. Without
+// aging that is the highest non-empty level. With aging, each level ranks
+// as its priority plus one per aging period its next item has waited
+// (capped at HIGH), and equal ranks go to the longer waiter.
+static int next_level(Queue *q) {
+    int best = -1;
+    int nonempty = 0;
+    for (int p = PRIORITY_COUNT - 1; p >= 0; p--) {
+        if (!q->levels[p].count) continue;
+        if (best < 0) best = p;
+        nonempty++;
+    }
+    if (nonempty < 2 || q->aging_ns == 0) return best;
+
+    uint64_t now = now_ns();
+    uint64_t best_rank = 0, best_enqueued = 0;
+    best = -1;
+    for (int p = PRIORITY_COUNT - 1; p >= 0; p--) {
+        PriorityLevel *l = &q->levels[p];
+        if (!l->count) continue;
+        uint64_t enqueued = level_next_enqueued(q, l);
+        uint64_t rank = (uint64_t)p + (now - enqueued) / q->aging_ns;
+        if (rank > PRIORITY_HIGH) rank = PRIORITY_HIGH;
+        if (best < 0 || rank > best_rank || (rank == best_rank && enqueued < best_enqueued)) {
+            best = p;
+            best_rank = rank;
+            best_enqueued = enqueued;
         }
-        
-        swap_items(&q->items[index], &q->items[largest]);
-        index = largest;
     }
+    return best;
+}
+
+// Remove and return the next item; the queue must not be empty
+static void *pop_locked(Queue *q) {
+    PriorityLevel *l = &q->levels[next_level(q)];
+    QueueFlow *f = next_flow(q, l);
+    PriorityRing *r = &f->ring;
+    PriorityItem *item = &r->items[r->head];
+    f->deficit -= (int64_t)item->cost;
+    f->served++;
+    f->served_bytes += item->cost;
+    r->head = (r->head + 1) & (r->capacity - 1);
+    r->count--;
+    l->count--;
+    q->size--;
+    return item->data;
 }
 
 void queue_init(Queue *q) {
-    q->items = NULL;
+    memset(q->levels, 0, sizeof(q->levels));
+    for (int p = 0; p < PRIORITY_COUNT; p++) q->levels[p].shared.priority = (TaskPriority)p;
+    q->buckets = NULL;
+    q->nbuckets = q->nflows = 0;
+    q->max_flows = QUEUE_DEFAULT_MAX_FLOWS;
+    q->quantum = QUEUE_DEFAULT_QUANTUM;
     q->size = 0;
-    q->capacity = 0;
+    q->aging_ns = 0;
     q->closed = false;
     pthread_mutex_init(&q->mutex, NULL);
     pthread_cond_init(&q->not_empty, NULL);
 }
 
+void queue_set_aging(Queue *q, unsigned aging_ms) {
+    pthread_mutex_lock(&q->mutex);
+    q->aging_ns = (uint64_t)aging_ms * 1000000ull;
+    pthread_mutex_unlock(&q->mutex);
+}
+
+void queue_set_quantum(Queue *q, size_t quantum) {
+    pthread_mutex_lock(&q->mutex);
+    q->quantum = quantum ? quantum : QUEUE_DEFAULT_QUANTUM;
+    pthread_mutex_unlock(&q->mutex);
+}
+
+void queue_set_max_flows(Queue *q, size_t max_flows) {
+    pthread_mutex_lock(&q->mutex);
+    q->max_flows = max_flows ? max_flows : QUEUE_DEFAULT_MAX_FLOWS;
+    pthread_mutex_unlock(&q->mutex);
+}
+
+void queue_set_limits(Queue *q, const unsigned limits[PRIORITY_COUNT]) {
+    pthread_mutex_lock(&q->mutex);
+    for (int p = 0; p < PRIORITY_COUNT; p++) q->levels[p].limit = limits[p];
+    pthread_mutex_unlock(&q->mutex);
+}
+
 void queue_close(Queue *q) {
     pthread_mutex_lock(&q->mutex);
     q->closed = true;
@@ -79,95 +262,152 @@ void queue_close(Queue *q) {
 }
 
 void queue_destroy(Queue *q) {
-    if (q->items) {
-        free(q->items);
-        q->items = NULL;
+    for (int p = 0; p < PRIORITY_COUNT; p++) {
+        free(q->levels[p].shared.ring.items);
+    }
+    for (size_t i = 0; i < q->nbuckets; i++) {
+        QueueFlow *f = q->buckets[i];
+        while (f) {
+            QueueFlow *next = f->hash_next;
+            free(f->ring.items);
+            free(f);
+            f = next;
+        }
     }
+    free(q->buckets);
+    q->buckets = NULL;
+    q->nbuckets = q->nflows = 0;
+    memset(q->levels, 0, sizeof(q->levels));
     q->size = 0;
-    q->capacity = 0;
     pthread_mutex_destroy(&q->mutex);
     pthread_cond_destroy(&q->not_empty);
 }
 
 bool queue_push(Queue *q, void *item, TaskPriority priority) {
-    printf("[queue_push] Attempting to lock mutex %p (queue=%p)...\n", 
-           (void*)&q->mutex, (void*)q);
-    fflush(stdout);
+    return queue_push_bounded(q, item, priority, 0, NULL, 0) == QUEUE_PUSHED;
+}
+
+QueuePush queue_push_bounded(Queue *q, void *item, TaskPriority priority, size_t max_size,
+                             const char *key, size_t cost) {
+    if (priority < 0 || priority >= PRIORITY_COUNT) priority = PRIORITY_NORMAL;
+
     pthread_mutex_lock(&q->mutex);
-    printf("[queue_push] Mutex %p locked!\n", (void*)&q->mutex);
-    fflush(stdout);
-    
+    LOG_TRACE("[queue_push] queue=%p size=%zu", (void*)q, q->size);
+
     if (q->closed) {
         pthread_mutex_unlock(&q->mutex);
-        return false;
-    }
-    
-    // Resize the array if needed
-    if (q->size >= q->capacity) {
-        size_t new_capacity = (q->capacity == 0) ? 16 : q->capacity * 2;
-        PriorityItem *new_items = (PriorityItem *)realloc(q->items, new_capacity * sizeof(PriorityItem));
-        if (!new_items) {
-            pthread_mutex_unlock(&q->mutex);
-            return false;
-        }
-        q->items = new_items;
-        q->capacity = new_capacity;
+        return QUEUE_CLOSED;
+    }
+
+    PriorityLevel *l = &q->levels[priority];
+    if ((l->limit && l->count >= l->limit) || (max_size && q->size >= max_size)) {
+        pthread_mutex_unlock(&q->mutex);
+        return QUEUE_FULL;
+    }
+    QueueFlow *f = key ? find_flow(q, priority, key, true) : NULL;
+    if (!f) f = &l->shared;
+    PriorityRing *r = &f->ring;
+    if (r->count == r->capacity && !ring_grow(r)) {
+        pthread_mutex_unlock(&q->mutex);
+        return QUEUE_CLOSED;
     }
-    
-    // Add the new item
-    q->items[q->size].data = item;
-    q->items[q->size].priority = priority;
+    PriorityItem *slot = &r->items[(r->head + r->count) & (r->capacity - 1)];
+    slot->data = item;
+    slot->enqueued_ns = now_ns();
+    slot->cost = cost;
+    r->count++;
+    l->count++;
     q->size++;
-    
-    // Maintain heap property
-    heapify_up(q, q->size - 1);
-    
+    if (f->state == FLOW_IDLE) {
+        // A debt from a large item outlives an idle spell
+        if (f->deficit >= 0) f->deficit = (int64_t)q->quantum;
+        f->state = FLOW_NEW;
+        list_push(&l->new_flows, f);
+        l->active++;
+    }
+
     // Signal that the queue is not empty
     pthread_cond_signal(&q->not_empty);
     pthread_mutex_unlock(&q->mutex);
-    return true;
+    return QUEUE_PUSHED;
+}
+
+void queue_charge(Queue *q, TaskPriority priority, const char *key, int64_t extra) {
+    if (priority < 0 || priority >= PRIORITY_COUNT) priority = PRIORITY_NORMAL;
+    pthread_mutex_lock(&q->mutex);
+    QueueFlow *f = key ? find_flow(q, priority, key, extra > 0) : &q->levels[priority].shared;
+    if (f) {
+        f->deficit -= extra;
+        f->served_bytes += (uint64_t)extra;
+        flow_release(q, f);
+    }
+    pthread_mutex_unlock(&q->mutex);
 }
 
 void *queue_pop(Queue *q) {
-    printf("[queue_pop] Thread %lu attempting to lock mutex %p (queue=%p)...\n", 
-           (unsigned long)pthread_self(), (void*)&q->mutex, (void*)q);
-    fflush(stdout);
     pthread_mutex_lock(&q->mutex);
-    printf("[queue_pop] Thread %lu mutex %p locked! size=%zu, closed=%d\n", 
-           (unsigned long)pthread_self(), (void*)&q->mutex, q->size, q->closed);
-    fflush(stdout);
-    
+    LOG_TRACE("[queue_pop] queue=%p size=%zu closed=%d", (void*)q, q->size, q->closed);
+
     // Wait until there's an item or the queue is closed
     while (q->size == 0 && !q->closed) {
-        printf("[queue_pop] Thread %lu waiting on condition variable...\n", (unsigned long)pthread_self());
-        fflush(stdout);
         pthread_cond_wait(&q->not_empty, &q->mutex);
-        printf("[queue_pop] Thread %lu woke up from condition variable! size=%zu\n", 
-               (unsigned long)pthread_self(), q->size);
-        fflush(stdout);
     }
-    
+
     // If queue is empty and closed, return NULL
     if (q->size == 0) {
         pthread_mutex_unlock(&q->mutex);
         return NULL;
     }
-    
-    // Get the highest priority item (at index 0)
-    void *data = q->items[0].data;
-    
-    // Move the last item to the root
-    q->items[0] = q->items[--q->size];
-    
-    // Maintain heap property
-    if (q->size > 0) {
-        heapify_down(q, 0);
-    }
-    
+
+    void *data = pop_locked(q);
+
     pthread_mutex_unlock(&q->mutex);
     return data;
 }
 
+size_t queue_try_pop_batch(Queue *q, void **items, size_t max, unsigned shares) {
+    pthread_mutex_lock(&q->mutex);
+    size_t n = q->size / (shares ? shares : 1) + 1;
+    if (n > q->size) n = q->size;
+    if (n > max) n = max;
+    for (size_t i = 0; i < n; i++) {
+        items[i] = pop_locked(q);
+    }
+    pthread_mutex_unlock(&q->mutex);
+    return n;
+}
+
+uint64_t queue_oldest_ns(Queue *q) {
+    pthread_mutex_lock(&q->mutex);
+    uint64_t oldest = 0;
+    for (int p = 0; p < PRIORITY_COUNT; p++) {
+        PriorityLevel *l = &q->levels[p];
+        if (!l->count) continue;
+        uint64_t t = level_next_enqueued(q, l);
+        if (oldest == 0 || t < oldest) oldest = t;
+    }
+    pthread_mutex_unlock(&q->mutex);
+    return oldest;
+}
+
+size_t queue_flow_stats(Queue *q, QueueFlowStats *out, size_t max) {
+    pthread_mutex_lock(&q->mutex);
+    size_t n = 0;
+    for (size_t i = 0; i < q->nbuckets; i++) {
+        for (const QueueFlow *f = q->buckets[i]; f; f = f->hash_next, n++) {
+            if (n >= max) continue;
+            QueueFlowStats *st = &out[n];
+            memcpy(st->key, f->key, sizeof(st->key));
+            st->priority = f->priority;
+            st->queued = f->ring.count;
+            st->served = f->served;
+            st->served_bytes = f->served_bytes;
+        }
+    }
+    pthread_mutex_unlock(&q->mutex);
+    return n;
+}
+
 unsigned queue_size(Queue *q) {
     pthread_mutex_lock(&q->mutex);
     unsigned size = (unsigned)q->size;
@@ -177,7 +417,12 @@ unsigned queue_size(Queue *q) {
 
 void *queue_peek(Queue *q) {
     pthread_mutex_lock(&q->mutex);
-    void *data = (q->size > 0) ? q->items[0].data : NULL;
+    void *data = NULL;
+    int level = next_level(q);
+    if (level >= 0) {
+        QueueFlow *f = next_flow(q, &q->levels[level]);
+        data = f->ring.items[f->ring.head].data;
+    }
     pthread_mutex_unlock(&q->mutex);
     return data;
 }
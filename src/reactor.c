@@ -0,0 +1,637 @@
+#define _GNU_SOURCE
+#include "reactor.h"
+#include "server.h"
+#include "client.h"
+#include "task.h"
+#include "log.h"
+#include "pool.h"
+#include "pipeline.h"
+#include "config.h"
+#include "wire.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#define REACTOR_MAX_EVENTS 256
+#define CONN_RBUF_SIZE 4096
+// Longest formatted reply: tag, status and a full Response message
+#define CONN_REPLY_MAX (REQUEST_TAG_LEN + 8 + sizeof(((Response *)0)->message))
+#define CONN_WBUF_SIZE (4 * CONN_REPLY_MAX)
+#define CONN_TABLE_INITIAL 256
+
+// Per-connection state. The pipeline tracks requests in flight: one at a
+// time on a classic connection, up to pipeline_depth after PIPELINE. Input
+// is read while it has room and parsed in place, as text lines or, after
+// BINARY, frames. Replies are written as the pipeline hands them out.
+typedef struct Connection {
+    int fd;
+    int client_id;
+    Pipeline pipe;
+    bool peer_closed;           // EOF/hangup seen, close once idle
+    bool closing;               // QUIT seen, close once replies are out
+    bool in_epoll;
+    uint32_t events;            // current epoll interest set
+    ResponseQueueEntry *entry;
+    char rbuf[CONN_RBUF_SIZE + 1]; // one spare byte to terminate a line
+    size_t roff;                // first unparsed byte
+    size_t rlen;                // end of buffered input
+    char wbuf[CONN_WBUF_SIZE];
+    size_t wlen;
+    size_t woff;
+    struct Connection *next;    // hash chain / graveyard link
+} Connection;
+
+typedef struct {
+    int fd;
+    int client_id;
+    ResponseQueueEntry *entry;
+} PendingClient;
+
+typedef struct IoThread {
+    pthread_t thread;
+    Reactor *reactor;
+    int epfd;
+    int wakefd;
+
+    // Filled by other threads, drained by the I/O thread on wakeup
+    pthread_mutex_t pending_mutex;
+    PendingClient *incoming;
+    size_t n_incoming, cap_incoming;
+    int *ready;                 // client ids with a queued response
+    size_t n_ready, cap_ready;
+
+    // Connections owned by this thread, keyed by client_id
+    Connection **table;
+    size_t table_size;
+    size_t conn_count;
+    Connection *graveyard;      // closed during this epoll batch
+} IoThread;
+
+struct Reactor {
+    ServerState *server;
+    IoThread *threads;
+    int nthreads;
+    unsigned next_thread;
+    atomic_int running;
+};
+
+static void conn_run(IoThread *io, Connection *c);
+
+static void io_wake(IoThread *io) {
+    uint64_t one = 1;
+    ssize_t n = write(io->wakefd, &one, sizeof(one));
+    (void)n; // counter saturation still leaves the fd readable
+}
+
+// Called by workers (with the entry mutex held) after queueing a response
+static void reactor_notify(void *ctx, int client_id) {
+    IoThread *io = (IoThread *)ctx;
+    pthread_mutex_lock(&io->pending_mutex);
+    if (io->n_ready == io->cap_ready) {
+        size_t cap = io->cap_ready ? io->cap_ready * 2 : 64;
+        int *r = (int *)realloc(io->ready, cap * sizeof(int));
+        if (!r) {
+            pthread_mutex_unlock(&io->pending_mutex);
+            return;
+        }
+        io->ready = r;
+        io->cap_ready = cap;
+    }
+    io->ready[io->n_ready++] = client_id;
+    pthread_mutex_unlock(&io->pending_mutex);
+    io_wake(io);
+}
+
+// ---- connection table ----
+
+static Connection *table_find(IoThread *io, int client_id) {
+    Connection *c = io->table[(unsigned)client_id & (io->table_size - 1)];
+    while (c && c->client_id != client_id) c = c->next;
+    return c;
+}
+
+static void table_grow(IoThread *io) {
+    size_t size = io->table_size * 2;
+    Connection **t = (Connection **)calloc(size, sizeof(Connection *));
+    if (!t) return; // keep the old table, chains just get longer
+    for (size_t i = 0; i < io->table_size; i++) {
+        Connection *c = io->table[i];
+        while (c) {
+            Connection *next = c->next;
+            size_t b = (unsigned)c->client_id & (size - 1);
+            c->next = t[b];
+            t[b] = c;
+            c = next;
+        }
+    }
+    free(io->table);
+    io->table = t;
+    io->table_size = size;
+}
+
+static void table_insert(IoThread *io, Connection *c) {
+    if (io->conn_count >= io->table_size) table_grow(io);
+    size_t b = (unsigned)c->client_id & (io->table_size - 1);
+    c->next = io->table[b];
+    io->table[b] = c;
+    io->conn_count++;
+}
+
+static void table_remove(IoThread *io, Connection *c) {
+    Connection **pp = &io->table[(unsigned)c->client_id & (io->table_size - 1)];
+    while (*pp && *pp != c) pp = &(*pp)->next;
+    if (*pp) {
+        *pp = c->next;
+        io->conn_count--;
+    }
+}
+
+// ---- connection lifecycle ----
+
+static void conn_set_events(IoThread *io, Connection *c, uint32_t events) {
+    if (c->fd < 0 || !c->in_epoll || c->events == events) return;
+    struct epoll_event ev = { .events = events, .data.ptr = c };
+    if (epoll_ctl(io->epfd, EPOLL_CTL_MOD, c->fd, &ev) == 0) {
+        c->events = events;
+    }
+}
+
+// Stop watching the socket; used when the peer is gone but a task is in flight
+static void conn_unwatch(IoThread *io, Connection *c) {
+    if (c->in_epoll) {
+        epoll_ctl(io->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+        c->in_epoll = false;
+    }
+}
+
+// The peer is gone with tasks still in flight: stop watching the socket
+// and have workers skip the tasks, or abort a transfer at its next check
+static void conn_abandon(IoThread *io, Connection *c) {
+    response_map_cancel(c->entry, UINT64_MAX);
+    conn_unwatch(io, c);
+}
+
+static void conn_close(IoThread *io, Connection *c) {
+    if (c->fd < 0) return;
+    conn_unwatch(io, c);
+
+    pthread_mutex_lock(&c->entry->mutex);
+    c->entry->notify = NULL;
+    c->entry->notify_ctx = NULL;
+    pthread_mutex_unlock(&c->entry->mutex);
+
+    close(c->fd);
+    c->fd = -1;
+    deregister_client_response_queue(io->reactor->server, c->client_id);
+    c->entry = NULL;
+
+    // Events for this connection may still be pending in the current batch,
+    // so the memory is released only after the batch is handled.
+    table_remove(io, c);
+    c->next = io->graveyard;
+    io->graveyard = c;
+}
+
+// Write what is left of wbuf; EPOLLOUT is watched while it can't finish
+static void conn_flush(IoThread *io, Connection *c) {
+    while (c->woff < c->wlen) {
+        ssize_t n = send(c->fd, c->wbuf + c->woff, c->wlen - c->woff, MSG_NOSIGNAL);
+        if (n > 0) {
+            c->woff += (size_t)n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        } else {
+            conn_close(io, c);
+            return;
+        }
+    }
+    c->wlen = c->woff = 0;
+}
+
+static bool conn_write_pending(const Connection *c) {
+    return c->woff < c->wlen;
+}
+
+// Queue a reply the connection makes itself, in order with worker replies
+static void conn_reply(IoThread *io, Connection *c, const char *tag, const char *msg) {
+    if (!pipeline_reply(&c->pipe, tag, RESP_ERR, msg)) conn_close(io, c);
+}
+
+// Write replies as the pipeline hands them out, packing as many as fit into
+// wbuf so a burst of replies goes out in one send. Returns true if any was
+// taken.
+static bool conn_write_replies(IoThread *io, Connection *c) {
+    bool progress = false;
+    while (c->fd >= 0 && !conn_write_pending(c)) {
+        c->wlen = c->woff = 0;
+        Response *resp;
+        while (c->wlen + CONN_REPLY_MAX <= sizeof(c->wbuf) &&
+               (resp = pipeline_next(&c->pipe)) != NULL) {
+            progress = true;
+            // Nobody is left to read replies once the peer is gone
+            if (!c->peer_closed) {
+                c->wlen += pipeline_format(resp, c->wbuf + c->wlen, CONN_REPLY_MAX);
+            }
+            pool_free(g_response_pool, resp);
+        }
+        if (c->wlen == 0) break;
+        conn_flush(io, c);
+    }
+    return progress;
+}
+
+// Handle a text line. Returns the task it asks for, or NULL once it has been
+// answered here; *quit is set when the client is done.
+static Task *conn_line(IoThread *io, Connection *c, char *line, char tag[REQUEST_TAG_LEN], bool *quit) {
+    const char *cmd = line;
+    bool ordered = false;
+    char err[64];
+    if (c->pipe.tagged && !pipeline_split_tag(line, tag, &cmd)) {
+        conn_reply(io, c, "", "Missing request id");
+        return NULL;
+    }
+    if (pipeline_is_command(cmd, &ordered)) {
+        if (pipeline_enable(&c->pipe, ordered, (unsigned)config_get_pipeline_depth(), err, sizeof(err))) {
+            char msg[64];
+            snprintf(msg, sizeof(msg), "pipelined %s %u", ordered ? "ordered" : "unordered", c->pipe.depth);
+            if (!pipeline_reply(&c->pipe, "", RESP_OK, msg)) conn_close(io, c);
+        } else {
+            conn_reply(io, c, tag, err);
+        }
+        return NULL;
+    }
+    if (wire_is_command(cmd)) {
+        if (!pipeline_set_binary(&c->pipe, tag, err, sizeof(err))) conn_reply(io, c, tag, err);
+        return NULL;
+    }
+    ParseResult pr = PARSE_IGNORED;
+    Task *task = client_parse_command(cmd, (ClientInfo){c->client_id, c->fd}, &pr);
+    if (pr == PARSE_QUIT) *quit = true;
+    if (pr == PARSE_NOMEM) conn_reply(io, c, tag, "Failed to allocate task");
+    // Classic connections ignore unknown commands; a pipelined client is
+    // owed a reply for every id
+    if (pr == PARSE_IGNORED && tag[0]) conn_reply(io, c, tag, "Unknown command");
+    if (pr == PARSE_INVALID) conn_reply(io, c, tag, "Malformed request");
+    return task;
+}
+
+// Handle a binary request frame, like conn_line()
+static Task *conn_frame(IoThread *io, Connection *c, const WireRequest *req,
+                        char tag[REQUEST_TAG_LEN], bool *quit) {
+    ParseResult pr = PARSE_IGNORED;
+    wire_tag(req->hdr.id, tag);
+    Task *task = client_parse_frame(req, (ClientInfo){c->client_id, c->fd}, &pr);
+    if (pr == PARSE_QUIT) *quit = true;
+    if (pr == PARSE_NOMEM) conn_reply(io, c, tag, "Failed to allocate task");
+    if (pr == PARSE_IGNORED) conn_reply(io, c, tag, "Unknown command");
+    if (pr == PARSE_INVALID) conn_reply(io, c, tag, "Malformed request");
+    return task;
+}
+
+// Parse complete requests from the read buffer and start them while the
+// pipeline has room. Returns true if any request was consumed.
+static bool conn_process_input(IoThread *io, Connection *c) {
+    bool progress = false;
+
+    while (c->fd >= 0 && !c->closing && pipeline_has_room(&c->pipe)) {
+        WireRequest req;
+        WireScan scan = wire_scan(c->rbuf + c->roff, c->rlen - c->roff,
+                                  c->pipe.binary, c->peer_closed, &req);
+        if (scan == WIRE_NEED_MORE) break;
+        if (scan == WIRE_BAD_FRAME) {
+            // Frame boundaries are lost; answer once and hang up
+            c->roff = c->rlen;
+            c->closing = true;
+            conn_reply(io, c, "", "Bad frame");
+            return true;
+        }
+
+        char tag[REQUEST_TAG_LEN] = "";
+        bool quit = false;
+        Task *task;
+        if (scan == WIRE_FRAME) {
+            task = conn_frame(io, c, &req, tag, &quit);
+        } else {
+            task = conn_line(io, c, req.line, tag, &quit);
+            wire_restore(&req);
+        }
+        if (c->fd < 0) {
+            task_free(task);
+            return true;
+        }
+        // A data-phase command waits, still unread, for the socket to be its own
+        if (task && (!pipeline_can_start(&c->pipe, task) || conn_write_pending(c))) {
+            task_free(task);
+            break;
+        }
+
+        c->roff += req.consumed;
+        progress = true;
+        if (quit) {
+            c->closing = true;
+            break;
+        }
+        if (!task) continue;
+
+        char err[256];
+        if (!client_admit_task(io->reactor->server->user_store, task, err, sizeof(err))) {
+            task_free(task);
+            conn_reply(io, c, tag, err);
+            continue;
+        }
+
+        // Bytes read past an upload request already belong to its data
+        // phase; the worker consumes them before reading the socket itself.
+        size_t taken;
+        if (!client_stash_data(c->entry, task, c->rbuf + c->roff, c->rlen - c->roff, &taken)) {
+            task_free(task);
+            conn_close(io, c);
+            return true;
+        }
+        c->roff += taken;
+
+        pipeline_submit(&c->pipe, task, tag);
+        task_bind(task, c->entry, config_get_request_timeout_ms());
+        SchedSubmit st = client_submit_task(io->reactor->server->user_store,
+                                            io->reactor->server->scheduler, task, err, sizeof(err));
+        if (st != SCHED_QUEUED) {
+            // Saturated: answer at once instead of queueing more work
+            bool answered = st == SCHED_BUSY && pipeline_refuse(&c->pipe, task, err);
+            task_free(task);
+            if (!answered) {
+                conn_close(io, c);
+                return true;
+            }
+        }
+    }
+    return progress;
+}
+
+// Move the connection forward after any event: write finished replies,
+// start the commands they made room for, then decide what to watch next.
+static void conn_run(IoThread *io, Connection *c) {
+    bool progress = true;
+    while (progress && c->fd >= 0) {
+        conn_flush(io, c);
+        if (c->fd < 0) return;
+        progress = conn_write_replies(io, c);
+        if (c->fd < 0) return;
+        if (conn_process_input(io, c)) progress = true;
+    }
+    if (c->fd < 0) return;
+
+    bool idle = c->pipe.inflight == 0;
+    if (c->peer_closed) {
+        // Replies in flight are dropped when they arrive; a data-phase
+        // task may still be using the socket, so it stays open until then
+        if (idle) conn_close(io, c);
+        else conn_abandon(io, c);
+        return;
+    }
+    if (c->closing && idle && !conn_write_pending(c)) {
+        conn_close(io, c);
+        return;
+    }
+
+    uint32_t events = 0;
+    if (conn_write_pending(c)) events |= EPOLLOUT;
+    // A data-phase task reads the socket itself
+    if (!c->closing && !c->pipe.streaming && c->rlen - c->roff < CONN_RBUF_SIZE) events |= EPOLLIN;
+    conn_set_events(io, c, events);
+}
+
+static void conn_on_readable(IoThread *io, Connection *c) {
+    if (c->roff > 0) {
+        c->rlen -= c->roff;
+        memmove(c->rbuf, c->rbuf + c->roff, c->rlen);
+        c->roff = 0;
+    }
+    while (c->rlen < CONN_RBUF_SIZE) {
+        size_t want = CONN_RBUF_SIZE - c->rlen;
+        ssize_t n = read(c->fd, c->rbuf + c->rlen, want);
+        if (n > 0) {
+            c->rlen += (size_t)n;
+            // A short read emptied the socket; epoll is level-triggered, so
+            // asking again would only return EAGAIN
+            if ((size_t)n < want) break;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            c->peer_closed = true;
+            break;
+        }
+    }
+    conn_run(io, c);
+}
+
+static void conn_on_response(IoThread *io, int client_id) {
+    Connection *c = table_find(io, client_id);
+    if (!c || c->fd < 0) return;
+
+    pthread_mutex_lock(&c->entry->mutex);
+    Response *resp;
+    while (c->entry->queue.size > 0 && (resp = (Response *)queue_pop(&c->entry->queue)) != NULL) {
+        pipeline_complete(&c->pipe, resp);
+    }
+    pthread_mutex_unlock(&c->entry->mutex);
+    conn_run(io, c);
+}
+
+static void conn_adopt(IoThread *io, const PendingClient *p) {
+    Connection *c = (Connection *)calloc(1, sizeof(Connection));
+    if (!c) {
+        close(p->fd);
+        deregister_client_response_queue(io->reactor->server, p->client_id);
+        return;
+    }
+    c->fd = p->fd;
+    c->client_id = p->client_id;
+    c->entry = p->entry;
+    pipeline_init(&c->pipe);
+
+    int flags = fcntl(c->fd, F_GETFL, 0);
+    fcntl(c->fd, F_SETFL, flags | O_NONBLOCK);
+
+    pthread_mutex_lock(&c->entry->mutex);
+    c->entry->notify = reactor_notify;
+    c->entry->notify_ctx = io;
+    pthread_mutex_unlock(&c->entry->mutex);
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+    if (epoll_ctl(io->epfd, EPOLL_CTL_ADD, c->fd, &ev) != 0) {
+        perror("epoll_ctl");
+        table_insert(io, c);
+        conn_close(io, c);
+        return;
+    }
+    c->in_epoll = true;
+    c->events = EPOLLIN;
+    table_insert(io, c);
+}
+
+static void io_drain_pending(IoThread *io) {
+    // One read takes the whole counter
+    uint64_t count;
+    ssize_t rn = read(io->wakefd, &count, sizeof(count));
+    (void)rn; // EAGAIN: another drain already took it
+
+    pthread_mutex_lock(&io->pending_mutex);
+    PendingClient *incoming = io->incoming;
+    size_t n_incoming = io->n_incoming;
+    int *ready = io->ready;
+    size_t n_ready = io->n_ready;
+    io->incoming = NULL;
+    io->n_incoming = io->cap_incoming = 0;
+    io->ready = NULL;
+    io->n_ready = io->cap_ready = 0;
+    pthread_mutex_unlock(&io->pending_mutex);
+
+    for (size_t i = 0; i < n_incoming; i++) conn_adopt(io, &incoming[i]);
+    for (size_t i = 0; i < n_ready; i++) conn_on_response(io, ready[i]);
+    free(incoming);
+    free(ready);
+}
+
+static void io_bury_dead(IoThread *io) {
+    while (io->graveyard) {
+        Connection *c = io->graveyard;
+        io->graveyard = c->next;
+        pipeline_clear(&c->pipe);
+        free(c);
+    }
+}
+
+static void *io_thread_main(void *arg) {
+    IoThread *io = (IoThread *)arg;
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    while (atomic_load(&io->reactor->running)) {
+        int n = epoll_wait(io->epfd, events, REACTOR_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            Connection *c = (Connection *)events[i].data.ptr;
+            if (!c) {
+                io_drain_pending(io);
+                continue;
+            }
+            if (c->fd < 0) continue;
+
+            uint32_t ev = events[i].events;
+            if (ev & (EPOLLHUP | EPOLLERR)) c->peer_closed = true;
+            if (c->pipe.streaming) {
+                // The in-flight task may be reading the socket itself (an
+                // upload's data phase), so leave its bytes alone
+                if (c->peer_closed) conn_abandon(io, c);
+            } else if (ev & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                conn_on_readable(io, c);
+            } else if (ev & EPOLLOUT) {
+                conn_run(io, c);
+            }
+        }
+        io_bury_dead(io);
+    }
+
+    // Shutdown: drop connections that were never adopted, then close ours
+    io_drain_pending(io);
+    for (size_t i = 0; i < io->table_size; i++) {
+        while (io->table[i]) conn_close(io, io->table[i]);
+    }
+    io_bury_dead(io);
+    return NULL;
+}
+
+Reactor *reactor_create(ServerState *server, int io_threads) {
+    if (io_threads < 1) io_threads = 1;
+    Reactor *r = (Reactor *)calloc(1, sizeof(Reactor));
+    if (!r) return NULL;
+    r->threads = (IoThread *)calloc((size_t)io_threads, sizeof(IoThread));
+    if (!r->threads) {
+        free(r);
+        return NULL;
+    }
+    r->server = server;
+    atomic_init(&r->running, 1);
+
+    for (int i = 0; i < io_threads; i++) {
+        IoThread *io = &r->threads[i];
+        io->reactor = r;
+        io->table_size = CONN_TABLE_INITIAL;
+        io->table = (Connection **)calloc(io->table_size, sizeof(Connection *));
+        io->epfd = epoll_create1(EPOLL_CLOEXEC);
+        io->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        pthread_mutex_init(&io->pending_mutex, NULL);
+
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+        if (!io->table || io->epfd < 0 || io->wakefd < 0 ||
+            epoll_ctl(io->epfd, EPOLL_CTL_ADD, io->wakefd, &ev) != 0 ||
+            pthread_create(&io->thread, NULL, io_thread_main, io) != 0) {
+            perror("reactor_create");
+            r->nthreads = i + 1; // tear down what was set up so far
+            atomic_store(&r->running, 0);
+            io->thread = 0;
+            reactor_destroy(r);
+            return NULL;
+        }
+        r->nthreads = i + 1;
+    }
+
+    LOG_INFO("[Reactor] Started %d I/O threads", io_threads);
+    return r;
+}
+
+bool reactor_add_client(Reactor *reactor, int fd, int client_id, ResponseQueueEntry *entry) {
+    if (!reactor || !entry) return false;
+    IoThread *io = &reactor->threads[reactor->next_thread++ % (unsigned)reactor->nthreads];
+
+    pthread_mutex_lock(&io->pending_mutex);
+    if (io->n_incoming == io->cap_incoming) {
+        size_t cap = io->cap_incoming ? io->cap_incoming * 2 : 16;
+        PendingClient *p = (PendingClient *)realloc(io->incoming, cap * sizeof(PendingClient));
+        if (!p) {
+            pthread_mutex_unlock(&io->pending_mutex);
+            return false;
+        }
+        io->incoming = p;
+        io->cap_incoming = cap;
+    }
+    io->incoming[io->n_incoming++] = (PendingClient){ fd, client_id, entry };
+    pthread_mutex_unlock(&io->pending_mutex);
+    io_wake(io);
+    return true;
+}
+
+void reactor_destroy(Reactor *reactor) {
+    if (!reactor) return;
+    atomic_store(&reactor->running, 0);
+    for (int i = 0; i < reactor->nthreads; i++) {
+        IoThread *io = &reactor->threads[i];
+        if (io->thread) {
+            io_wake(io);
+            pthread_join(io->thread, NULL);
+        }
+        if (io->epfd >= 0) close(io->epfd);
+        if (io->wakefd >= 0) close(io->wakefd);
+        pthread_mutex_destroy(&io->pending_mutex);
+        free(io->incoming);
+        free(io->ready);
+        free(io->table);
+    }
+    free(reactor->threads);
+    free(reactor);
+}
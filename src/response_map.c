@@ -0,0 +1,190 @@
+#include "response_map.h"
+#include "pool.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define RESPONSE_MAP_SHARDS 64          // power of two
+#define RESPONSE_MAP_SHARD_BITS 6
+#define RESPONSE_MAP_INITIAL_BUCKETS 16 // per shard, power of two
+
+typedef struct {
+    pthread_mutex_t mutex;
+    ResponseQueueEntry **buckets;
+    size_t nbuckets;
+    size_t count;
+} ResponseMapShard;
+
+struct ResponseMap {
+    ResponseMapShard shards[RESPONSE_MAP_SHARDS];
+    atomic_size_t size;
+};
+
+// Client ids are handed out sequentially, so the low bits spread clients
+// evenly across shards and the remaining bits across buckets.
+static ResponseMapShard *shard_for(ResponseMap *map, int client_id) {
+    return &map->shards[(unsigned)client_id & (RESPONSE_MAP_SHARDS - 1)];
+}
+
+static size_t bucket_for(const ResponseMapShard *shard, int client_id) {
+    return ((unsigned)client_id >> RESPONSE_MAP_SHARD_BITS) & (shard->nbuckets - 1);
+}
+
+static void entry_free(ResponseQueueEntry *e) {
+    // Responses nobody collected are owned by the entry
+    queue_close(&e->queue);
+    void *r;
+    while ((r = queue_pop(&e->queue)) != NULL) pool_free(g_response_pool, r);
+    queue_destroy(&e->queue);
+    free(e->stash);
+    pthread_cond_destroy(&e->response_available);
+    pthread_mutex_destroy(&e->mutex);
+    free(e);
+}
+
+static void shard_grow(ResponseMapShard *shard) {
+    size_t nbuckets = shard->nbuckets * 2;
+    ResponseQueueEntry **b = (ResponseQueueEntry **)calloc(nbuckets, sizeof(*b));
+    if (!b) return; // keep the old table, chains just get longer
+    size_t old = shard->nbuckets;
+    ResponseQueueEntry **old_b = shard->buckets;
+    shard->buckets = b;
+    shard->nbuckets = nbuckets;
+    for (size_t i = 0; i < old; i++) {
+        ResponseQueueEntry *e = old_b[i];
+        while (e) {
+            ResponseQueueEntry *next = e->next;
+            size_t idx = bucket_for(shard, e->client_id);
+            e->next = b[idx];
+            b[idx] = e;
+            e = next;
+        }
+    }
+    free(old_b);
+}
+
+ResponseMap *response_map_create(void) {
+    ResponseMap *map = (ResponseMap *)calloc(1, sizeof(ResponseMap));
+    if (!map) return NULL;
+    for (size_t i = 0; i < RESPONSE_MAP_SHARDS; i++) {
+        ResponseMapShard *shard = &map->shards[i];
+        shard->nbuckets = RESPONSE_MAP_INITIAL_BUCKETS;
+        shard->buckets = (ResponseQueueEntry **)calloc(shard->nbuckets, sizeof(ResponseQueueEntry *));
+        if (!shard->buckets) {
+            for (size_t j = 0; j < i; j++) {
+                free(map->shards[j].buckets);
+                pthread_mutex_destroy(&map->shards[j].mutex);
+            }
+            free(map);
+            return NULL;
+        }
+        pthread_mutex_init(&shard->mutex, NULL);
+    }
+    atomic_init(&map->size, 0);
+    return map;
+}
+
+void response_map_destroy(ResponseMap *map) {
+    if (!map) return;
+    for (size_t i = 0; i < RESPONSE_MAP_SHARDS; i++) {
+        ResponseMapShard *shard = &map->shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        for (size_t b = 0; b < shard->nbuckets; b++) {
+            ResponseQueueEntry *e = shard->buckets[b];
+            while (e) {
+                ResponseQueueEntry *next = e->next;
+                response_map_put(e);
+                e = next;
+            }
+        }
+        free(shard->buckets);
+        pthread_mutex_unlock(&shard->mutex);
+        pthread_mutex_destroy(&shard->mutex);
+    }
+    free(map);
+}
+
+ResponseQueueEntry *response_map_register(ResponseMap *map, int client_id) {
+    ResponseQueueEntry *e = (ResponseQueueEntry *)calloc(1, sizeof(ResponseQueueEntry));
+    if (!e) return NULL;
+
+    e->client_id = client_id;
+    queue_init(&e->queue);
+    pthread_mutex_init(&e->mutex, NULL);
+    pthread_cond_init(&e->response_available, NULL);
+    atomic_init(&e->refs, 1); // the map's reference
+    atomic_init(&e->cancel_before, 0);
+
+    ResponseMapShard *shard = shard_for(map, client_id);
+    pthread_mutex_lock(&shard->mutex);
+    if (shard->count >= shard->nbuckets) shard_grow(shard);
+    size_t idx = bucket_for(shard, client_id);
+    e->next = shard->buckets[idx];
+    shard->buckets[idx] = e;
+    shard->count++;
+    pthread_mutex_unlock(&shard->mutex);
+
+    atomic_fetch_add(&map->size, 1);
+    return e;
+}
+
+ResponseQueueEntry *response_map_get(ResponseMap *map, int client_id) {
+    ResponseMapShard *shard = shard_for(map, client_id);
+    pthread_mutex_lock(&shard->mutex);
+    ResponseQueueEntry *e = shard->buckets[bucket_for(shard, client_id)];
+    while (e && e->client_id != client_id) e = e->next;
+    if (e) atomic_fetch_add(&e->refs, 1);
+    pthread_mutex_unlock(&shard->mutex);
+    return e;
+}
+
+ResponseQueueEntry *response_map_ref(ResponseQueueEntry *entry) {
+    atomic_fetch_add(&entry->refs, 1);
+    return entry;
+}
+
+void response_map_cancel(ResponseQueueEntry *entry, uint64_t before) {
+    uint64_t cur = atomic_load(&entry->cancel_before);
+    while (cur < before && !atomic_compare_exchange_weak(&entry->cancel_before, &cur, before)) {}
+}
+
+bool response_map_cancelled(ResponseQueueEntry *entry, uint64_t seq) {
+    return seq < atomic_load_explicit(&entry->cancel_before, memory_order_relaxed);
+}
+
+void response_map_put(ResponseQueueEntry *entry) {
+    if (entry && atomic_fetch_sub(&entry->refs, 1) == 1) {
+        entry_free(entry);
+    }
+}
+
+bool response_map_remove(ResponseMap *map, int client_id) {
+    ResponseMapShard *shard = shard_for(map, client_id);
+    pthread_mutex_lock(&shard->mutex);
+    ResponseQueueEntry **pp = &shard->buckets[bucket_for(shard, client_id)];
+    while (*pp && (*pp)->client_id != client_id) pp = &(*pp)->next;
+    ResponseQueueEntry *e = *pp;
+    if (e) {
+        *pp = e->next;
+        shard->count--;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+    if (!e) return false;
+
+    atomic_fetch_sub(&map->size, 1);
+    response_map_cancel(e, UINT64_MAX);
+
+    // Late responses from workers still holding a reference are refused
+    pthread_mutex_lock(&e->mutex);
+    queue_close(&e->queue);
+    e->notify = NULL;
+    e->notify_ctx = NULL;
+    pthread_cond_broadcast(&e->response_available);
+    pthread_mutex_unlock(&e->mutex);
+
+    response_map_put(e);
+    return true;
+}
+
+size_t response_map_size(ResponseMap *map) {
+    return atomic_load(&map->size);
+}
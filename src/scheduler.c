@@ -0,0 +1,394 @@
+#include "scheduler.h"
+#include "queue.h"
+#include "log.h"
+#include "metrics.h"
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+#define DEQUE_SIZE 64          // power of two, > SCHED_BATCH_MAX
+#define SCHED_BATCH_MAX 8      // most tasks a worker moves out of the injection queue at once
+#define SCHED_CACHE_LINE 64
+
+// Chase-Lev deque, with sequentially consistent top/bottom accesses in
+// place of fences (which ThreadSanitizer can't follow). Only the owner
+// pushes and takes at the bottom; thieves take from the top. The owner
+// refills it only when it is empty, with at most SCHED_BATCH_MAX tasks, so
+// the fixed ring never wraps onto live slots.
+typedef struct {
+    _Alignas(SCHED_CACHE_LINE) _Atomic int64_t top;
+    _Alignas(SCHED_CACHE_LINE) _Atomic int64_t bottom;
+    _Atomic(Task *) slots[DEQUE_SIZE];
+    // Owner only
+    unsigned rng;
+    size_t injected;           // tasks taken from the injection queue
+    size_t batches;
+    size_t stolen;             // tasks taken from other workers
+} WorkerDeque;
+
+struct Scheduler {
+    Queue inject;
+    int nworkers;
+    WorkerDeque *deques;
+    atomic_bool closed;
+    atomic_int idle;           // workers parked or about to park
+    atomic_int searching;      // woken workers that haven't found a task yet
+    pthread_mutex_t park_mutex;
+    pthread_cond_t park_cond;
+    int wakeups;               // signals not yet claimed, under park_mutex
+    // Admission control, see scheduler_set_admission()
+    size_t max_queued;         // sum of the level capacities; 0: unbounded
+    size_t min_queued;         // the adaptive limit never goes below this
+    uint64_t target_ns;        // 0: no adaptive limit
+    uint64_t interval_ns;
+    atomic_size_t limit;       // adaptive limit on queued tasks; 0: none
+    _Atomic uint64_t above_since;  // when waits went over target (0: they are under)
+    _Atomic uint64_t next_adjust;  // earliest time the limit may change again
+    _Atomic uint64_t sojourn_ns;   // wait of the last task handed out
+    atomic_size_t refused;
+};
+
+// Data bytes a task is expected to move: an upload's declared size, or a
+// ranged download's length (a whole-file download is charged afterwards)
+static size_t task_data_bytes(const Task *task) {
+    if (task_reads_data(task) || task->type == CMD_DOWNLOAD) return task->size;
+    return 0;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void deque_push(WorkerDeque *d, Task *task) {
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    atomic_store_explicit(&d->slots[b & (DEQUE_SIZE - 1)], task, memory_order_relaxed);
+    atomic_store(&d->bottom, b + 1);
+}
+
+static Task *deque_take(WorkerDeque *d) {
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    // Sequentially consistent store then load: a thief either sees the
+    // lowered bottom or we see its raised top
+    atomic_store(&d->bottom, b);
+    int64_t t = atomic_load(&d->top);
+
+    Task *task = NULL;
+    if (t <= b) {
+        task = atomic_load_explicit(&d->slots[b & (DEQUE_SIZE - 1)], memory_order_relaxed);
+        if (t != b) return task;
+        // Last task: race the thieves for it
+        if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                                                     memory_order_seq_cst, memory_order_relaxed)) {
+            task = NULL;
+        }
+    }
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_release);
+    return task;
+}
+
+// NULL if the deque is empty or another thread won the race for its top
+static Task *deque_steal(WorkerDeque *d) {
+    int64_t t = atomic_load(&d->top);
+    int64_t b = atomic_load(&d->bottom);
+    if (t >= b) return NULL;
+
+    Task *task = atomic_load_explicit(&d->slots[t & (DEQUE_SIZE - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed)) {
+        return NULL;
+    }
+    return task;
+}
+
+static bool deque_empty(WorkerDeque *d) {
+    return atomic_load_explicit(&d->top, memory_order_acquire) >=
+           atomic_load_explicit(&d->bottom, memory_order_acquire);
+}
+
+// Wake one parked worker, unless none is parked or a woken one is still
+// searching: that one wakes the next when it finds a task, so a burst of
+// submits wakes workers one at a time instead of all at once. The caller
+// has already published its work (a deque push or queue_push) when it
+// checks; park() and a searcher giving up do the reverse, so one of the two
+// always sees the other.
+static void wake_one(Scheduler *s) {
+    if (atomic_load(&s->idle) == 0 || atomic_load(&s->searching) > 0) return;
+
+    pthread_mutex_lock(&s->park_mutex);
+    if (atomic_load(&s->searching) == 0 && s->wakeups < atomic_load(&s->idle)) {
+        s->wakeups++;
+        atomic_fetch_add(&s->searching, 1);
+        pthread_cond_signal(&s->park_cond);
+    }
+    pthread_mutex_unlock(&s->park_mutex);
+}
+
+static bool has_work(Scheduler *s) {
+    if (queue_size(&s->inject) > 0) return true;
+    for (int i = 0; i < s->nworkers; i++) {
+        if (!deque_empty(&s->deques[i])) return true;
+    }
+    return false;
+}
+
+// Sleep until there may be work. False once closed with nothing left.
+// *woken is set if a wake_one() signal was claimed, which makes the caller
+// a searcher.
+static bool park(Scheduler *s, bool *woken) {
+    bool open = true;
+    pthread_mutex_lock(&s->park_mutex);
+    atomic_fetch_add(&s->idle, 1);
+    while (s->wakeups == 0) {
+        if (has_work(s)) break;
+        if (atomic_load(&s->closed)) {
+            open = false;
+            break;
+        }
+        pthread_cond_wait(&s->park_cond, &s->park_mutex);
+    }
+    *woken = s->wakeups > 0;
+    if (*woken) s->wakeups--;
+    atomic_fetch_sub(&s->idle, 1);
+    pthread_mutex_unlock(&s->park_mutex);
+    return open;
+}
+
+// Move a share of the injection queue into d, highest priority first.
+// The first task is returned; the rest go at the bottom in reverse order so
+// the owner keeps taking them in priority order.
+static Task *take_injected(Scheduler *s, WorkerDeque *d) {
+    Task *batch[SCHED_BATCH_MAX];
+    size_t n = queue_try_pop_batch(&s->inject, (void **)batch, SCHED_BATCH_MAX,
+                                   (unsigned)s->nworkers);
+    if (n == 0) return NULL;
+
+    for (size_t i = n; i-- > 1; ) deque_push(d, batch[i]);
+    d->injected += n;
+    d->batches++;
+    // Let an idle worker steal what this one can't start yet
+    if (n > 1) wake_one(s);
+    return batch[0];
+}
+
+static Task *steal_any(Scheduler *s, int worker) {
+    WorkerDeque *self = &s->deques[worker];
+    self->rng = self->rng * 1103515245u + 12345u;
+    int start = (int)((self->rng >> 16) % (unsigned)s->nworkers);
+
+    for (int i = 0; i < s->nworkers; i++) {
+        int victim = (start + i) % s->nworkers;
+        if (victim == worker) continue;
+        Task *task = deque_steal(&s->deques[victim]);
+        if (task) {
+            self->stolen++;
+            if (!deque_empty(&s->deques[victim])) wake_one(s);
+            return task;
+        }
+    }
+    return NULL;
+}
+
+// Feed a measured queue wait into the adaptive limit: that of each task
+// handed to a worker, and at each submit that of the oldest queued task,
+// so a queue stuck behind busy workers is noticed before it drains.
+// Several threads may call this at once; next_adjust makes sure only one
+// of them changes the limit per interval.
+static void admission_observe(Scheduler *s, uint64_t sojourn, uint64_t now) {
+    atomic_store_explicit(&s->sojourn_ns, sojourn, memory_order_relaxed);
+    uint64_t next = atomic_load(&s->next_adjust);
+
+    if (sojourn < s->target_ns) {
+        atomic_store(&s->above_since, 0);
+        // Out of overload, at least an interval after the last cut: lift
+        // the limit, as CoDel leaves its dropping state
+        if (atomic_load(&s->limit) == s->max_queued || now < next) return;
+        if (atomic_compare_exchange_strong(&s->next_adjust, &next, now)) {
+            atomic_store(&s->limit, s->max_queued);
+            LOG_DEBUG("[Scheduler] Queue waits back under target, admitting up to capacity");
+        }
+        return;
+    }
+
+    uint64_t since = atomic_load(&s->above_since);
+    if (since == 0) {
+        atomic_compare_exchange_strong(&s->above_since, &since, now);
+        return;
+    }
+    // A standing queue: waits have been too long for a whole interval
+    if (now - since < s->interval_ns || now < next ||
+        !atomic_compare_exchange_strong(&s->next_adjust, &next, now + s->interval_ns)) {
+        return;
+    }
+    size_t limit = atomic_load(&s->limit);
+    size_t queued = queue_size(&s->inject);
+    if (limit == 0 || queued < limit) limit = queued;
+    limit /= 2;
+    if (limit < s->min_queued) limit = s->min_queued;
+    atomic_store(&s->limit, limit);
+    LOG_DEBUG("[Scheduler] Tasks waited %llu ms, admitting at most %zu",
+              (unsigned long long)(sojourn / 1000000), limit);
+}
+
+Scheduler *scheduler_create(int nworkers, unsigned aging_ms) {
+    if (nworkers < 1) nworkers = 1;
+    Scheduler *s = (Scheduler *)calloc(1, sizeof(Scheduler));
+    if (!s) return NULL;
+    s->deques = (WorkerDeque *)aligned_alloc(SCHED_CACHE_LINE, (size_t)nworkers * sizeof(WorkerDeque));
+    if (!s->deques) {
+        free(s);
+        return NULL;
+    }
+    for (int i = 0; i < nworkers; i++) {
+        WorkerDeque *d = &s->deques[i];
+        atomic_init(&d->top, 0);
+        atomic_init(&d->bottom, 0);
+        for (int j = 0; j < DEQUE_SIZE; j++) atomic_init(&d->slots[j], NULL);
+        d->rng = 0x9e3779b9u * (unsigned)(i + 1);
+        d->injected = d->batches = d->stolen = 0;
+    }
+    s->nworkers = nworkers;
+    queue_init(&s->inject);
+    queue_set_aging(&s->inject, aging_ms);
+    atomic_init(&s->closed, false);
+    atomic_init(&s->idle, 0);
+    atomic_init(&s->searching, 0);
+    s->min_queued = (size_t)nworkers;
+    atomic_init(&s->limit, 0);
+    atomic_init(&s->above_since, 0);
+    atomic_init(&s->next_adjust, 0);
+    atomic_init(&s->sojourn_ns, 0);
+    atomic_init(&s->refused, 0);
+    pthread_mutex_init(&s->park_mutex, NULL);
+    pthread_cond_init(&s->park_cond, NULL);
+    return s;
+}
+
+void scheduler_destroy(Scheduler *s) {
+    if (!s) return;
+    for (int i = 0; i < s->nworkers; i++) {
+        WorkerDeque *d = &s->deques[i];
+        LOG_INFO("[Scheduler] worker %d: %zu tasks from the injection queue in %zu batches, %zu stolen",
+                 i, d->injected, d->batches, d->stolen);
+    }
+    QueueFlowStats users[64];
+    size_t nusers = scheduler_user_stats(s, users, sizeof(users) / sizeof(users[0]));
+    for (size_t i = 0; i < nusers && i < sizeof(users) / sizeof(users[0]); i++) {
+        LOG_DEBUG("[Scheduler] user '%s' (%s): %llu tasks, %llu bytes",
+                  users[i].key, priority_to_string(users[i].priority),
+                  (unsigned long long)users[i].served, (unsigned long long)users[i].served_bytes);
+    }
+    size_t refused = atomic_load(&s->refused);
+    if (refused > 0) LOG_INFO("[Scheduler] %zu tasks refused by admission control", refused);
+    queue_destroy(&s->inject);
+    pthread_mutex_destroy(&s->park_mutex);
+    pthread_cond_destroy(&s->park_cond);
+    free(s->deques);
+    free(s);
+}
+
+void scheduler_set_admission(Scheduler *s, const unsigned capacity[PRIORITY_COUNT],
+                             unsigned target_ms, unsigned interval_ms) {
+    queue_set_limits(&s->inject, capacity);
+    s->max_queued = 0;
+    for (int p = 0; p < PRIORITY_COUNT; p++) {
+        // One unbounded level leaves the queue unbounded
+        if (capacity[p] == 0) {
+            s->max_queued = 0;
+            break;
+        }
+        s->max_queued += capacity[p];
+    }
+    s->target_ns = (uint64_t)target_ms * 1000000ull;
+    s->interval_ns = (uint64_t)(interval_ms ? interval_ms : 1) * 1000000ull;
+    atomic_store(&s->limit, s->max_queued);
+}
+
+SchedSubmit scheduler_submit(Scheduler *s, Task *task, unsigned *retry_after_ms) {
+    task->enqueue_ns = now_ns();
+    if (s->target_ns) {
+        uint64_t oldest = queue_oldest_ns(&s->inject);
+        uint64_t waited = oldest && oldest < task->enqueue_ns ? task->enqueue_ns - oldest : 0;
+        admission_observe(s, waited, task->enqueue_ns);
+    }
+    // Lower priorities get a smaller share of the adaptive limit
+    size_t max = atomic_load(&s->limit);
+    if (max) {
+        max = max * (size_t)(task->priority + 2) / (PRIORITY_HIGH + 2);
+        if (max == 0) max = 1;
+    }
+    QueuePush pushed = queue_push_bounded(&s->inject, task, task->priority, max,
+                                          task->own_flow ? task->username : NULL,
+                                          SCHED_REQUEST_COST + task_data_bytes(task));
+    if (pushed == QUEUE_FULL) {
+        atomic_fetch_add_explicit(&s->refused, 1, memory_order_relaxed);
+        // Back off for about as long as queued tasks are waiting
+        uint64_t wait = atomic_load_explicit(&s->sojourn_ns, memory_order_relaxed);
+        if (wait < s->interval_ns) wait = s->interval_ns;
+        if (retry_after_ms) *retry_after_ms = (unsigned)((wait + 999999) / 1000000);
+        return SCHED_BUSY;
+    }
+    if (pushed == QUEUE_CLOSED) return SCHED_CLOSED;
+    wake_one(s);
+    return SCHED_QUEUED;
+}
+
+void scheduler_set_quantum(Scheduler *s, size_t quantum) {
+    queue_set_quantum(&s->inject, quantum);
+}
+
+void scheduler_set_max_flows(Scheduler *s, size_t max_flows) {
+    queue_set_max_flows(&s->inject, max_flows);
+}
+
+void scheduler_charge(Scheduler *s, const Task *task, size_t bytes) {
+    int64_t extra = (int64_t)bytes - (int64_t)task_data_bytes(task);
+    if (extra != 0) {
+        queue_charge(&s->inject, task->priority, task->own_flow ? task->username : NULL, extra);
+    }
+}
+
+size_t scheduler_user_stats(Scheduler *s, QueueFlowStats *out, size_t max) {
+    return queue_flow_stats(&s->inject, out, max);
+}
+
+void scheduler_stats(Scheduler *s, SchedulerStats *out) {
+    out->queued = queue_size(&s->inject);
+    out->limit = atomic_load(&s->limit);
+    out->refused = atomic_load_explicit(&s->refused, memory_order_relaxed);
+    out->workers = s->nworkers;
+}
+
+void scheduler_close(Scheduler *s) {
+    atomic_store(&s->closed, true);
+    queue_close(&s->inject);
+    pthread_mutex_lock(&s->park_mutex);
+    pthread_cond_broadcast(&s->park_cond);
+    pthread_mutex_unlock(&s->park_mutex);
+}
+
+Task *scheduler_next(Scheduler *s, int worker) {
+    WorkerDeque *d = &s->deques[worker];
+    bool searching = false;
+    for (;;) {
+        Task *task = deque_take(d);
+        if (!task) task = take_injected(s, d);
+        if (!task) task = steal_any(s, worker);
+        if (searching) {
+            searching = false;
+            // The last searcher to find work hands the search on
+            if (atomic_fetch_sub(&s->searching, 1) == 1 && task) wake_one(s);
+        }
+        if (task) {
+            task->start_ns = now_ns();
+            uint64_t waited = task->start_ns - task->enqueue_ns;
+            metrics_observe(METRIC_QUEUE_WAIT, waited);
+            if (s->target_ns) admission_observe(s, waited, task->start_ns);
+            return task;
+        }
+        if (!park(s, &searching)) return NULL;
+    }
+}
@@ -1,13 +1,15 @@
 #include "types.h"
+#include "pool.h"
+#include "response_map.h"
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <stdio.h>
 
 Task* task_create(CommandType type, ClientInfo client, const char *username, 
-                 const char *password, const char *path, const char *tmpfile, 
+                 const char *password, const char *path,
                  size_t size, TaskPriority priority) {
-    Task *task = (Task*)calloc(1, sizeof(Task));
+    Task *task = (Task*)pool_alloc(g_task_pool);
     if (!task) return NULL;
     
     task->type = type;
@@ -15,39 +17,45 @@ Task* task_create(CommandType type, ClientInfo client, const char *username,
     task->size = size;
     task->priority = priority;
     
-    // Initialize enqueue time to current time
-    clock_gettime(CLOCK_REALTIME, &task->enqueue_time);
-    
     // Copy strings safely
     if (username) strncpy(task->username, username, sizeof(task->username) - 1);
     if (password) strncpy(task->password, password, sizeof(task->password) - 1);
     if (path) strncpy(task->path, path, sizeof(task->path) - 1);
-    if (tmpfile) strncpy(task->tmpfile, tmpfile, sizeof(task->tmpfile) - 1);
     
     return task;
 }
 
 void task_free(Task *task) {
-    if (task) {
-        free(task);
-    }
+    if (task) response_map_put(task->conn);
+    pool_free(g_task_pool, task);
 }
 
-int task_compare_priority(const void *a, const void *b) {
-    const Task *task_a = *(const Task **)a;
-    const Task *task_b = *(const Task **)b;
-    
-    // First compare by priority
-    if (task_a->priority > task_b->priority) return -1;
-    if (task_a->priority < task_b->priority) return 1;
-    
-    // If priorities are equal, compare by enqueue time (FIFO)
-    if (task_a->enqueue_time.tv_sec < task_b->enqueue_time.tv_sec) return -1;
-    if (task_a->enqueue_time.tv_sec > task_b->enqueue_time.tv_sec) return 1;
-    if (task_a->enqueue_time.tv_nsec < task_b->enqueue_time.tv_nsec) return -1;
-    if (task_a->enqueue_time.tv_nsec > task_b->enqueue_time.tv_nsec) return 1;
-    
-    return 0; // Equal priority and enqueue time
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void task_bind(Task *task, ResponseQueueEntry *conn, unsigned timeout_ms) {
+    task->conn = response_map_ref(conn);
+    task->deadline_ns = timeout_ms ? now_ns() + (uint64_t)timeout_ms * 1000000ull : 0;
+}
+
+bool task_cancelled(const Task *task) {
+    return task->conn && response_map_cancelled(task->conn, task->seq);
+}
+
+bool task_expired(const Task *task) {
+    return task->deadline_ns && now_ns() > task->deadline_ns;
+}
+
+bool task_reads_data(const Task *task) {
+    return task->type == CMD_UPLOAD || task->type == CMD_UPLOAD_RESUME;
+}
+
+bool task_streams_data(const Task *task) {
+    return task_reads_data(task) || task->type == CMD_DOWNLOAD || task->type == CMD_LIST ||
+           task->type == CMD_STATS;
 }
 
 const char *command_to_string(CommandType type) {
@@ -60,12 +68,15 @@ const char *command_to_string(CommandType type) {
         case CMD_SIGNUP: return "SIGNUP";
         case CMD_LOGIN: return "LOGIN";
         case CMD_QUIT: return "QUIT";
+        case CMD_UPLOAD_START: return "UPLOAD_START";
+        case CMD_UPLOAD_STATUS: return "UPLOAD_STATUS";
+        case CMD_UPLOAD_RESUME: return "UPLOAD_RESUME";
+        case CMD_STATS: return "STATS";
+        case CMD_UPLOAD_ABORT: return "UPLOAD_ABORT";
         default: return "INVALID";
     }
 }
 
 void task_destroy(Task *task) {
-    if (task) {
-        free(task);
-    }
+    task_free(task);
 }
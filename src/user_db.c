@@ -1,19 +1,46 @@
+#define _POSIX_C_SOURCE 200809L
 #include "user.h"
 #include "config.h"
 #include <sqlite3.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <errno.h>
 
-// In-memory user storage for non-persistent mode
-typedef struct InMemoryUser {
-    char name[64];
-    char pass[64];
-    size_t quota_bytes;
-    struct InMemoryUser *next;
-} InMemoryUser;
+// Resident user records: a sharded hash table that answers every lookup
+// without SQL. In persistent mode it caches rows loaded on first use and
+// written through on signup; in memory mode it is the whole store.
+#define USER_CACHE_SHARDS 64          // power of two
+#define USER_CACHE_SHARD_BITS 6
+#define USER_CACHE_INITIAL_BUCKETS 16 // per shard, power of two
+#define USER_FILE_LOCKS 16            // per-file lock stripes, power of two
+
+typedef struct CachedUser {
+    User user;                  // handed out by user_store_lock_user; first,
+                                // so a User * converts back to its entry
+    pthread_rwlock_t lock;      // per-user lock
+    pthread_rwlock_t file_locks[USER_FILE_LOCKS]; // striped by path hash
+    // Quota accounting: guards user.used_bytes and the fields below
+    pthread_mutex_t quota_mutex;
+    atomic_bool authenticated;  // logged in or signed up since it became resident
+    size_t reserved_bytes;      // admitted uploads that haven't finished
+    bool dirty;                 // used_bytes changed since the last flush
+    struct CachedUser *dirty_next;
+    uint32_t hash;
+    struct CachedUser *next;    // bucket chain
+} CachedUser;
+
+// Records are never removed while the store lives, so a pointer taken under
+// the read lock stays valid after it is dropped.
+typedef struct {
+    pthread_rwlock_t lock;
+    CachedUser **buckets;
+    size_t nbuckets;
+    size_t count;
+} UserCacheShard;
 
 // User store implementation
 typedef enum {
@@ -28,28 +55,336 @@ typedef enum {
     "  username TEXT UNIQUE NOT NULL,\n" \
     "  password TEXT NOT NULL,\n" \
     "  quota_bytes INTEGER DEFAULT 104857600,\n" \
+    "  used_bytes INTEGER NOT NULL DEFAULT 0,\n" \
     "  created_at TIMESTAMP DEFAULT CURRENT_TIMESTAMP\n" \
     ");"
 
+#define INSERT_USER_SQL "INSERT INTO users (username, password, quota_bytes) VALUES (?, ?, ?);"
+#define LOAD_USER_SQL "SELECT password, quota_bytes, used_bytes FROM users WHERE username = ?;"
+#define UPDATE_USAGE_SQL "UPDATE users SET used_bytes = ? WHERE username = ?;"
+// Databases created before usage was tracked
+#define ADD_USAGE_COLUMN_SQL "ALTER TABLE users ADD COLUMN used_bytes INTEGER NOT NULL DEFAULT 0;"
+
+// Changed usage counters are written back in one transaction this often
+#define USAGE_FLUSH_INTERVAL_MS 1000
+
+// How long a connection waits on a lock (a WAL checkpoint or another
+// writer process) before giving up
+#define DB_BUSY_TIMEOUT_MS 2000
+
+// A read-only connection owned by one thread, with its statement prepared
+// once. In WAL mode any number of these read while the writer commits.
+typedef struct ReaderConn {
+    sqlite3 *db;
+    sqlite3_stmt *load_stmt;
+    UserStore *store;
+    struct ReaderConn *prev, *next;
+} ReaderConn;
+
 // Complete definition of UserStore (declared as opaque in user.h)
 struct UserStore {
     char storage_root[256];
     StorageType storage_type;
-    union {
-        struct {
-            sqlite3 *db;
-            pthread_mutex_t db_mutex;
-        } persistent;
-        struct {
-            InMemoryUser *users;
-            pthread_mutex_t users_mutex;
-        } memory;
-    } storage;
+    UserCacheShard cache[USER_CACHE_SHARDS];
+    struct {
+        char db_path[512];
+        sqlite3 *db;                // the single writer, used under db_mutex
+        pthread_mutex_t db_mutex;
+        sqlite3_stmt *insert_stmt;
+        pthread_key_t reader_key;   // the calling thread's ReaderConn
+        ReaderConn *readers;        // all open readers, closed on destroy
+        pthread_mutex_t readers_mutex;
+        sqlite3_stmt *usage_stmt;   // writer statement, used by the flusher
+        pthread_t flusher;
+        pthread_mutex_t flush_mutex;
+        pthread_cond_t flush_cond;
+        CachedUser *dirty;          // users whose usage awaits a flush
+        bool stopping;
+    } persistent;                   // unused in memory mode
 };
 
 // Forward declarations
 static int execute_sql(sqlite3 *db, const char *sql, int (*callback)(void*,int,char**,char**), void *arg);
 
+// FNV-1a over the user name
+static uint32_t name_hash(const char *name) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        h ^= *p;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static UserCacheShard *shard_for(UserStore *store, uint32_t hash) {
+    return &store->cache[hash & (USER_CACHE_SHARDS - 1)];
+}
+
+static size_t bucket_for(const UserCacheShard *shard, uint32_t hash) {
+    return (hash >> USER_CACHE_SHARD_BITS) & (shard->nbuckets - 1);
+}
+
+// Caller holds the shard lock
+static CachedUser *shard_find(const UserCacheShard *shard, const char *name, uint32_t hash) {
+    CachedUser *e = shard->buckets[bucket_for(shard, hash)];
+    while (e && (e->hash != hash || strcmp(e->user.name, name) != 0)) e = e->next;
+    return e;
+}
+
+static void shard_grow(UserCacheShard *shard) {
+    size_t nbuckets = shard->nbuckets * 2;
+    CachedUser **b = (CachedUser **)calloc(nbuckets, sizeof(*b));
+    if (!b) return; // keep the old table, chains just get longer
+    size_t old = shard->nbuckets;
+    CachedUser **old_b = shard->buckets;
+    shard->buckets = b;
+    shard->nbuckets = nbuckets;
+    for (size_t i = 0; i < old; i++) {
+        CachedUser *e = old_b[i];
+        while (e) {
+            CachedUser *next = e->next;
+            size_t idx = bucket_for(shard, e->hash);
+            e->next = b[idx];
+            b[idx] = e;
+            e = next;
+        }
+    }
+    free(old_b);
+}
+
+static bool cache_init(UserStore *store) {
+    for (size_t i = 0; i < USER_CACHE_SHARDS; i++) {
+        UserCacheShard *shard = &store->cache[i];
+        shard->nbuckets = USER_CACHE_INITIAL_BUCKETS;
+        shard->buckets = (CachedUser **)calloc(shard->nbuckets, sizeof(CachedUser *));
+        if (!shard->buckets) {
+            for (size_t j = 0; j < i; j++) {
+                free(store->cache[j].buckets);
+                pthread_rwlock_destroy(&store->cache[j].lock);
+            }
+            return false;
+        }
+        pthread_rwlock_init(&shard->lock, NULL);
+    }
+    return true;
+}
+
+static void entry_locks_init(CachedUser *e) {
+    pthread_rwlock_init(&e->lock, NULL);
+    for (size_t i = 0; i < USER_FILE_LOCKS; i++) pthread_rwlock_init(&e->file_locks[i], NULL);
+    pthread_mutex_init(&e->quota_mutex, NULL);
+}
+
+static void entry_locks_destroy(CachedUser *e) {
+    pthread_rwlock_destroy(&e->lock);
+    for (size_t i = 0; i < USER_FILE_LOCKS; i++) pthread_rwlock_destroy(&e->file_locks[i]);
+    pthread_mutex_destroy(&e->quota_mutex);
+}
+
+static void cache_destroy(UserStore *store) {
+    for (size_t i = 0; i < USER_CACHE_SHARDS; i++) {
+        UserCacheShard *shard = &store->cache[i];
+        for (size_t b = 0; b < shard->nbuckets; b++) {
+            CachedUser *e = shard->buckets[b];
+            while (e) {
+                CachedUser *next = e->next;
+                entry_locks_destroy(e);
+                free(e);
+                e = next;
+            }
+        }
+        free(shard->buckets);
+        pthread_rwlock_destroy(&shard->lock);
+    }
+}
+
+// The resident record for name, or NULL if it isn't cached
+static User *cache_find(UserStore *store, const char *name) {
+    uint32_t hash = name_hash(name);
+    UserCacheShard *shard = shard_for(store, hash);
+    pthread_rwlock_rdlock(&shard->lock);
+    CachedUser *e = shard_find(shard, name, hash);
+    pthread_rwlock_unlock(&shard->lock);
+    return e ? &e->user : NULL;
+}
+
+// Make a record resident. If name already is, returns that record and sets
+// *inserted to false. NULL on allocation failure.
+static User *cache_insert(UserStore *store, const char *name, const char *pass,
+                          size_t quota_bytes, size_t used_bytes, bool *inserted) {
+    uint32_t hash = name_hash(name);
+    UserCacheShard *shard = shard_for(store, hash);
+    *inserted = false;
+    
+    CachedUser *e = (CachedUser *)calloc(1, sizeof(CachedUser));
+    if (!e) return NULL;
+    strncpy(e->user.name, name, sizeof(e->user.name) - 1);
+    strncpy(e->user.pass, pass, sizeof(e->user.pass) - 1);
+    e->user.quota_bytes = quota_bytes;
+    e->user.used_bytes = used_bytes;
+    e->hash = hash;
+    
+    pthread_rwlock_wrlock(&shard->lock);
+    CachedUser *existing = shard_find(shard, name, hash);
+    if (existing) {
+        pthread_rwlock_unlock(&shard->lock);
+        free(e);
+        return &existing->user;
+    }
+    entry_locks_init(e);
+    if (shard->count >= shard->nbuckets) shard_grow(shard);
+    size_t idx = bucket_for(shard, hash);
+    e->next = shard->buckets[idx];
+    shard->buckets[idx] = e;
+    shard->count++;
+    pthread_rwlock_unlock(&shard->lock);
+    *inserted = true;
+    return &e->user;
+}
+
+static void reader_close(ReaderConn *r) {
+    sqlite3_finalize(r->load_stmt);
+    sqlite3_close(r->db);
+    free(r);
+}
+
+// Thread-exit destructor for reader_key
+static void reader_release(void *arg) {
+    ReaderConn *r = (ReaderConn *)arg;
+    UserStore *store = r->store;
+    pthread_mutex_lock(&store->persistent.readers_mutex);
+    if (r->prev) r->prev->next = r->next;
+    else store->persistent.readers = r->next;
+    if (r->next) r->next->prev = r->prev;
+    pthread_mutex_unlock(&store->persistent.readers_mutex);
+    reader_close(r);
+}
+
+// The calling thread's read connection, opened on first use
+static ReaderConn *reader_get(UserStore *store) {
+    ReaderConn *r = pthread_getspecific(store->persistent.reader_key);
+    if (r) return r;
+    
+    r = (ReaderConn *)calloc(1, sizeof(ReaderConn));
+    if (!r) return NULL;
+    r->store = store;
+    if (sqlite3_open_v2(store->persistent.db_path, &r->db,
+                        SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK ||
+        sqlite3_busy_timeout(r->db, DB_BUSY_TIMEOUT_MS) != SQLITE_OK ||
+        sqlite3_prepare_v2(r->db, LOAD_USER_SQL, -1, &r->load_stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Failed to open database reader: %s\n", sqlite3_errmsg(r->db));
+        reader_close(r);
+        return NULL;
+    }
+    
+    pthread_mutex_lock(&store->persistent.readers_mutex);
+    r->next = store->persistent.readers;
+    if (r->next) r->next->prev = r;
+    store->persistent.readers = r;
+    pthread_mutex_unlock(&store->persistent.readers_mutex);
+    pthread_setspecific(store->persistent.reader_key, r);
+    return r;
+}
+
+// Ready a cached statement for its next use
+static void stmt_done(sqlite3_stmt *stmt) {
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+}
+
+// The resident record for name. Only the first lookup of a persistent user
+// reads the database; after that it is a hash probe under a shard read lock.
+static User *user_lookup(UserStore *store, const char *name) {
+    User *u = cache_find(store, name);
+    if (u || store->storage_type != STORAGE_PERSISTENT) return u;
+    
+    ReaderConn *r = reader_get(store);
+    if (!r) return NULL;
+    
+    sqlite3_stmt *stmt = r->load_stmt;
+    sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char *pass = (const char *)sqlite3_column_text(stmt, 0);
+        bool inserted;
+        u = cache_insert(store, name, pass ? pass : "",
+                         (size_t)sqlite3_column_int64(stmt, 1),
+                         (size_t)sqlite3_column_int64(stmt, 2), &inserted);
+    }
+    stmt_done(stmt);
+    return u;
+}
+
+// Write the usage of every dirty user back to the database in one
+// transaction. Counters keep changing meanwhile; whatever a user is marked
+// dirty for after its value is taken goes out with the next batch.
+static void usage_flush(UserStore *store) {
+    pthread_mutex_lock(&store->persistent.flush_mutex);
+    CachedUser *e = store->persistent.dirty;
+    store->persistent.dirty = NULL;
+    pthread_mutex_unlock(&store->persistent.flush_mutex);
+    if (!e) return;
+    
+    pthread_mutex_lock(&store->persistent.db_mutex);
+    sqlite3 *db = store->persistent.db;
+    sqlite3_stmt *stmt = store->persistent.usage_stmt;
+    execute_sql(db, "BEGIN;", NULL, NULL);
+    while (e) {
+        pthread_mutex_lock(&e->quota_mutex);
+        CachedUser *next = e->dirty_next;
+        size_t used = e->user.used_bytes;
+        e->dirty = false;
+        pthread_mutex_unlock(&e->quota_mutex);
+        
+        sqlite3_bind_int64(stmt, 1, (sqlite3_int64)used);
+        sqlite3_bind_text(stmt, 2, e->user.name, -1, SQLITE_STATIC);
+        if (sqlite3_step(stmt) != SQLITE_DONE) {
+            fprintf(stderr, "Failed to store usage of '%s': %s\n", e->user.name, sqlite3_errmsg(db));
+        }
+        stmt_done(stmt);
+        e = next;
+    }
+    execute_sql(db, "COMMIT;", NULL, NULL);
+    pthread_mutex_unlock(&store->persistent.db_mutex);
+}
+
+static void *usage_flusher_main(void *arg) {
+    UserStore *store = (UserStore *)arg;
+    pthread_mutex_lock(&store->persistent.flush_mutex);
+    while (!store->persistent.stopping) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += (long)USAGE_FLUSH_INTERVAL_MS * 1000000L;
+        ts.tv_sec += ts.tv_nsec / 1000000000L;
+        ts.tv_nsec %= 1000000000L;
+        pthread_cond_timedwait(&store->persistent.flush_cond, &store->persistent.flush_mutex, &ts);
+        
+        pthread_mutex_unlock(&store->persistent.flush_mutex);
+        usage_flush(store);
+        pthread_mutex_lock(&store->persistent.flush_mutex);
+    }
+    pthread_mutex_unlock(&store->persistent.flush_mutex);
+    return NULL;
+}
+
+// Caller holds e->quota_mutex
+static void usage_mark_dirty(UserStore *store, CachedUser *e) {
+    if (store->storage_type != STORAGE_PERSISTENT || e->dirty) return;
+    e->dirty = true;
+    pthread_mutex_lock(&store->persistent.flush_mutex);
+    e->dirty_next = store->persistent.dirty;
+    store->persistent.dirty = e;
+    pthread_mutex_unlock(&store->persistent.flush_mutex);
+}
+
+// Add the used_bytes column to databases created before it existed
+static bool usage_column_ensure(sqlite3 *db) {
+    sqlite3_stmt *probe = NULL;
+    bool present = sqlite3_prepare_v2(db, "SELECT used_bytes FROM users LIMIT 0;", -1,
+                                      &probe, NULL) == SQLITE_OK;
+    sqlite3_finalize(probe);
+    return present || execute_sql(db, ADD_USAGE_COLUMN_SQL, NULL, NULL) == SQLITE_OK;
+}
+
 UserStore* user_store_create(const char *root) {
     UserStore *store = (UserStore *)calloc(1, sizeof(UserStore));
     if (!store) return NULL;
@@ -64,36 +399,59 @@ UserStore* user_store_create(const char *root) {
         mkdir(store->storage_root, 0777);
     }
     
+    if (!cache_init(store)) {
+        free(store);
+        return NULL;
+    }
+    
     if (store->storage_type == STORAGE_PERSISTENT) {
-        // Initialize SQLite database for persistent storage
-        char db_path[512];
-        snprintf(db_path, sizeof(db_path), "%s/%s", 
-                store->storage_root, config_get_database_file());
-        
-        if (sqlite3_open(db_path, &store->storage.persistent.db) != SQLITE_OK) {
+        // Initialize SQLite database for persistent storage. One writer
+        // connection takes every write; reads go through per-thread
+        // read-only connections, which WAL lets run alongside it.
+        snprintf(store->persistent.db_path, sizeof(store->persistent.db_path),
+                 "%s/%s", store->storage_root, config_get_database_file());
+        
+        if (sqlite3_open_v2(store->persistent.db_path, &store->persistent.db,
+                            SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX,
+                            NULL) != SQLITE_OK) {
             fprintf(stderr, "Failed to open database: %s\n", 
-                   sqlite3_errmsg(store->storage.persistent.db));
+                   sqlite3_errmsg(store->persistent.db));
+            sqlite3_close(store->persistent.db);
+            cache_destroy(store);
             free(store);
             return NULL;
         }
+        sqlite3_busy_timeout(store->persistent.db, DB_BUSY_TIMEOUT_MS);
         
         // Enable foreign keys
-        execute_sql(store->storage.persistent.db, "PRAGMA foreign_keys = ON;", NULL, NULL);
+        execute_sql(store->persistent.db, "PRAGMA foreign_keys = ON;", NULL, NULL);
+        // WAL keeps readers off the writer's lock; with it, NORMAL only
+        // syncs at checkpoints and still never corrupts the database
+        execute_sql(store->persistent.db, "PRAGMA journal_mode = WAL;", NULL, NULL);
+        execute_sql(store->persistent.db, "PRAGMA synchronous = NORMAL;", NULL, NULL);
         
         // Create users table if it doesn't exist
-        if (execute_sql(store->storage.persistent.db, CREATE_TABLE_SQL, NULL, NULL) != SQLITE_OK) {
+        if (execute_sql(store->persistent.db, CREATE_TABLE_SQL, NULL, NULL) != SQLITE_OK ||
+            !usage_column_ensure(store->persistent.db) ||
+            sqlite3_prepare_v2(store->persistent.db, INSERT_USER_SQL, -1,
+                               &store->persistent.insert_stmt, NULL) != SQLITE_OK ||
+            sqlite3_prepare_v2(store->persistent.db, UPDATE_USAGE_SQL, -1,
+                               &store->persistent.usage_stmt, NULL) != SQLITE_OK) {
             fprintf(stderr, "Failed to create users table: %s\n", 
-                   sqlite3_errmsg(store->storage.persistent.db));
-            sqlite3_close(store->storage.persistent.db);
+                   sqlite3_errmsg(store->persistent.db));
+            sqlite3_finalize(store->persistent.insert_stmt);
+            sqlite3_close(store->persistent.db);
+            cache_destroy(store);
             free(store);
             return NULL;
         }
         
-        pthread_mutex_init(&store->storage.persistent.db_mutex, NULL);
-    } else {
-        // Initialize in-memory storage
-        store->storage.memory.users = NULL;
-        pthread_mutex_init(&store->storage.memory.users_mutex, NULL);
+        pthread_mutex_init(&store->persistent.db_mutex, NULL);
+        pthread_mutex_init(&store->persistent.readers_mutex, NULL);
+        pthread_key_create(&store->persistent.reader_key, reader_release);
+        pthread_mutex_init(&store->persistent.flush_mutex, NULL);
+        pthread_cond_init(&store->persistent.flush_cond, NULL);
+        pthread_create(&store->persistent.flusher, NULL, usage_flusher_main, store);
     }
     
     return store;
@@ -103,231 +461,163 @@ void user_store_destroy(UserStore *store) {
     if (!store) return;
     
     if (store->storage_type == STORAGE_PERSISTENT) {
-        pthread_mutex_destroy(&store->storage.persistent.db_mutex);
-        if (store->storage.persistent.db) {
-            sqlite3_close(store->storage.persistent.db);
+        // Stop the flusher, then write out whatever changed since its last run
+        pthread_mutex_lock(&store->persistent.flush_mutex);
+        store->persistent.stopping = true;
+        pthread_cond_signal(&store->persistent.flush_cond);
+        pthread_mutex_unlock(&store->persistent.flush_mutex);
+        pthread_join(store->persistent.flusher, NULL);
+        usage_flush(store);
+        pthread_cond_destroy(&store->persistent.flush_cond);
+        pthread_mutex_destroy(&store->persistent.flush_mutex);
+        
+        // Worker threads have exited by now; close readers of any that didn't
+        pthread_key_delete(store->persistent.reader_key);
+        ReaderConn *r = store->persistent.readers;
+        while (r) {
+            ReaderConn *next = r->next;
+            reader_close(r);
+            r = next;
         }
-    } else {
-        // Free all in-memory users
-        pthread_mutex_lock(&store->storage.memory.users_mutex);
-        InMemoryUser *user = store->storage.memory.users;
-        while (user) {
-            InMemoryUser *next = user->next;
-            free(user);
-            user = next;
+        pthread_mutex_destroy(&store->persistent.readers_mutex);
+        pthread_mutex_destroy(&store->persistent.db_mutex);
+        sqlite3_finalize(store->persistent.insert_stmt);
+        sqlite3_finalize(store->persistent.usage_stmt);
+        if (store->persistent.db) {
+            sqlite3_close(store->persistent.db);
         }
-        pthread_mutex_unlock(&store->storage.memory.users_mutex);
-        pthread_mutex_destroy(&store->storage.memory.users_mutex);
     }
     
+    cache_destroy(store);
     free(store);
 }
 
 bool user_store_signup(UserStore *store, const char *name, const char *pass, size_t quota_bytes, TaskPriority priority) {
     if (!store || !name || !pass) return false;
     (void)priority; // Priority is stored in the User struct after creation
+    // Longer names or passwords wouldn't survive the trip through User
+    if (strlen(name) >= sizeof(((User *)0)->name) || strlen(pass) >= sizeof(((User *)0)->pass)) {
+        return false;
+    }
     
+    bool success;
+    User *u = NULL;
     if (store->storage_type == STORAGE_PERSISTENT) {
-        // Persistent storage using SQLite
-        int rc;
-        
-        pthread_mutex_lock(&store->storage.persistent.db_mutex);
-        
-        // Check if user already exists
-        sqlite3_stmt *stmt;
-        const char *check_sql = "SELECT 1 FROM users WHERE username = ?;";
-        
-        rc = sqlite3_prepare_v2(store->storage.persistent.db, check_sql, -1, &stmt, NULL);
-        if (rc != SQLITE_OK) {
-            pthread_mutex_unlock(&store->storage.persistent.db_mutex);
-            return false;
-        }
-        
-        sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
-        rc = sqlite3_step(stmt);
-        sqlite3_finalize(stmt);
-        
-        if (rc == SQLITE_ROW) {
-            // User already exists
-            pthread_mutex_unlock(&store->storage.persistent.db_mutex);
-            return false;
-        }
-        
-        // Insert new user
-        const char *insert_sql = "INSERT INTO users (username, password, quota_bytes) VALUES (?, ?, ?);";
-        rc = sqlite3_prepare_v2(store->storage.persistent.db, insert_sql, -1, &stmt, NULL);
-        if (rc != SQLITE_OK) {
-            pthread_mutex_unlock(&store->storage.persistent.db_mutex);
-            return false;
-        }
+        // Persistent storage using SQLite; the UNIQUE username rejects
+        // duplicates, so a single INSERT is both the check and the write
+        pthread_mutex_lock(&store->persistent.db_mutex);
         
+        sqlite3_stmt *stmt = store->persistent.insert_stmt;
         sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
         sqlite3_bind_text(stmt, 2, pass, -1, SQLITE_STATIC);
         sqlite3_bind_int64(stmt, 3, quota_bytes);
         
-        rc = sqlite3_step(stmt);
-        sqlite3_finalize(stmt);
-        
-        bool success = (rc == SQLITE_DONE);
-        pthread_mutex_unlock(&store->storage.persistent.db_mutex);
+        success = (sqlite3_step(stmt) == SQLITE_DONE);
+        stmt_done(stmt);
+        pthread_mutex_unlock(&store->persistent.db_mutex);
         
+        // Written through: the new row is resident before anyone looks it
+        // up. If this allocation fails, the first lookup loads it instead.
         if (success) {
-            // Create user directory
-            char path[512];
-            snprintf(path, sizeof(path), "%s/%s", store->storage_root, name);
-            mkdir(path, 0777);
+            bool inserted;
+            u = cache_insert(store, name, pass, quota_bytes, 0, &inserted);
         }
-        
-        return success;
     } else {
-        // In-memory storage
-        pthread_mutex_lock(&store->storage.memory.users_mutex);
-        
-        // Check if user already exists
-        InMemoryUser *user = store->storage.memory.users;
-        while (user) {
-            if (strcmp(user->name, name) == 0) {
-                pthread_mutex_unlock(&store->storage.memory.users_mutex);
-                return false;
-            }
-            user = user->next;
-        }
-        
-        // Create new user
-        InMemoryUser *new_user = (InMemoryUser *)calloc(1, sizeof(InMemoryUser));
-        if (!new_user) {
-            pthread_mutex_unlock(&store->storage.memory.users_mutex);
-            return false;
-        }
-        
-        strncpy(new_user->name, name, sizeof(new_user->name) - 1);
-        strncpy(new_user->pass, pass, sizeof(new_user->pass) - 1);
-        new_user->quota_bytes = quota_bytes;
-        
-        // Add to the beginning of the list
-        new_user->next = store->storage.memory.users;
-        store->storage.memory.users = new_user;
-        
-        pthread_mutex_unlock(&store->storage.memory.users_mutex);
-        
+        // In-memory storage: the cache is the store
+        bool inserted;
+        u = cache_insert(store, name, pass, quota_bytes, 0, &inserted);
+        success = u && inserted;
+    }
+    
+    if (success) {
+        if (u) atomic_store(&((CachedUser *)u)->authenticated, true);
         // Create user directory
         char path[512];
         snprintf(path, sizeof(path), "%s/%s", store->storage_root, name);
         mkdir(path, 0777);
-        
-        return true;
     }
+    
+    return success;
 }
 
 bool user_store_login(UserStore *store, const char *name, const char *pass) {
     if (!store || !name || !pass) return false;
     
-    if (store->storage_type == STORAGE_PERSISTENT) {
-        // Persistent storage using SQLite
-        pthread_mutex_lock(&store->storage.persistent.db_mutex);
-        
-        sqlite3_stmt *stmt;
-        const char *sql = "SELECT password FROM users WHERE username = ?;";
-        bool authenticated = false;
-        
-        if (sqlite3_prepare_v2(store->storage.persistent.db, sql, -1, &stmt, NULL) == SQLITE_OK) {
-            sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
-            
-            if (sqlite3_step(stmt) == SQLITE_ROW) {
-                const char *stored_pass = (const char *)sqlite3_column_text(stmt, 0);
-                if (stored_pass && strcmp(stored_pass, pass) == 0) {
-                    authenticated = true;
-                }
-            }
-            
-            sqlite3_finalize(stmt);
-        }
-        
-        pthread_mutex_unlock(&store->storage.persistent.db_mutex);
-        return authenticated;
-    } else {
-        // In-memory storage
-        pthread_mutex_lock(&store->storage.memory.users_mutex);
-        
-        InMemoryUser *user = store->storage.memory.users;
-        bool authenticated = false;
-        
-        while (user) {
-            if (strcmp(user->name, name) == 0) {
-                if (strcmp(user->pass, pass) == 0) {
-                    authenticated = true;
-                }
-                break;
-            }
-            user = user->next;
-        }
-        
-        pthread_mutex_unlock(&store->storage.memory.users_mutex);
-        return authenticated;
-    }
+    // Passwords never change once a record is resident, so no lock is
+    // needed to compare against it
+    User *u = user_lookup(store, name);
+    if (!u || strcmp(u->pass, pass) != 0) return false;
+    atomic_store(&((CachedUser *)u)->authenticated, true);
+    return true;
 }
 
-User* user_store_lock_user(UserStore *store, const char *name) {
+bool user_store_authenticated(UserStore *store, const char *name) {
+    User *u = store && name ? cache_find(store, name) : NULL;
+    return u && atomic_load(&((CachedUser *)u)->authenticated);
+}
+
+static void rwlock_take(pthread_rwlock_t *lock, UserLockMode mode) {
+    if (mode == USER_LOCK_EXCLUSIVE) pthread_rwlock_wrlock(lock);
+    else pthread_rwlock_rdlock(lock);
+}
+
+User* user_store_lock_user(UserStore *store, const char *name, UserLockMode mode) {
     if (!store || !name) return NULL;
+    User *u = user_lookup(store, name);
+    if (u) rwlock_take(&((CachedUser *)u)->lock, mode);
+    return u;
+}
+
+void user_store_unlock_user(User *user) {
+    if (!user) return;
+    // The record stays resident; only the lock is released
+    pthread_rwlock_unlock(&((CachedUser *)user)->lock);
+}
+
+bool user_store_reserve(UserStore *store, const char *name, size_t bytes, char *err, size_t errlen) {
+    User *u = store && name ? user_lookup(store, name) : NULL;
+    if (!u) {
+        snprintf(err, errlen, "User not found or not logged in");
+        return false;
+    }
     
-    User *user = (User *)calloc(1, sizeof(User));
-    if (!user) return NULL;
+    CachedUser *e = (CachedUser *)u;
+    pthread_mutex_lock(&e->quota_mutex);
+    size_t committed = u->used_bytes + e->reserved_bytes;
+    bool ok = committed <= u->quota_bytes && bytes <= u->quota_bytes - committed;
+    if (ok) e->reserved_bytes += bytes;
+    pthread_mutex_unlock(&e->quota_mutex);
     
-    if (store->storage_type == STORAGE_PERSISTENT) {
-        // Persistent storage using SQLite
-        pthread_mutex_lock(&store->storage.persistent.db_mutex);
-        
-        sqlite3_stmt *stmt;
-        const char *sql = "SELECT username, quota_bytes FROM users WHERE username = ?;";
-        
-        if (sqlite3_prepare_v2(store->storage.persistent.db, sql, -1, &stmt, NULL) == SQLITE_OK) {
-            sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
-            
-            if (sqlite3_step(stmt) == SQLITE_ROW) {
-                const char *username = (const char *)sqlite3_column_text(stmt, 0);
-                if (username) {
-                    strncpy(user->name, username, sizeof(user->name) - 1);
-                    user->quota_bytes = sqlite3_column_int64(stmt, 1);
-                    pthread_mutex_init(&user->mutex, NULL);
-                    sqlite3_finalize(stmt);
-                    pthread_mutex_unlock(&store->storage.persistent.db_mutex);
-                    return user;
-                }
-            }
-            
-            sqlite3_finalize(stmt);
-        }
-        
-        pthread_mutex_unlock(&store->storage.persistent.db_mutex);
-        free(user);
-        return NULL;
-    } else {
-        // In-memory storage
-        pthread_mutex_lock(&store->storage.memory.users_mutex);
-        
-        InMemoryUser *mem_user = store->storage.memory.users;
-        while (mem_user) {
-            if (strcmp(mem_user->name, name) == 0) {
-                strncpy(user->name, mem_user->name, sizeof(user->name) - 1);
-                user->name[sizeof(user->name) - 1] = '\0';
-                user->quota_bytes = mem_user->quota_bytes;
-                pthread_mutex_init(&user->mutex, NULL);
-                pthread_mutex_unlock(&store->storage.memory.users_mutex);
-                return user;
-            }
-            mem_user = mem_user->next;
-        }
-        
-        pthread_mutex_unlock(&store->storage.memory.users_mutex);
-        free(user);
-        return NULL;
+    if (!ok) {
+        snprintf(err, errlen, "Quota exceeded: %zu of %zu bytes in use, %zu more requested",
+                 committed, u->quota_bytes, bytes);
     }
+    return ok;
 }
 
-void user_store_unlock_user(User *user) {
-    if (!user) return;
-    pthread_mutex_destroy(&user->mutex);
-    free(user);
+void user_store_settle(UserStore *store, User *user, size_t reserved, size_t added, size_t removed) {
+    if (!store || !user) return;
+    CachedUser *e = (CachedUser *)user;
+    pthread_mutex_lock(&e->quota_mutex);
+    e->reserved_bytes -= reserved < e->reserved_bytes ? reserved : e->reserved_bytes;
+    if (added != removed) {
+        size_t used = user->used_bytes + added;
+        user->used_bytes = removed < used ? used - removed : 0;
+        usage_mark_dirty(store, e);
+    }
+    pthread_mutex_unlock(&e->quota_mutex);
+}
+
+static pthread_rwlock_t *file_lock_for(User *user, const char *relpath) {
+    return &((CachedUser *)user)->file_locks[name_hash(relpath) & (USER_FILE_LOCKS - 1)];
+}
+
+void user_lock_file(User *user, const char *relpath, UserLockMode mode) {
+    rwlock_take(file_lock_for(user, relpath), mode);
+}
+
+void user_unlock_file(User *user, const char *relpath) {
+    pthread_rwlock_unlock(file_lock_for(user, relpath));
 }
 
 const char* user_store_get_root(UserStore *store) {
@@ -0,0 +1,135 @@
+#include "wire.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void put_be(unsigned char *p, uint64_t v, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) {
+        p[i] = (unsigned char)(v & 0xff);
+        v >>= 8;
+    }
+}
+
+static uint64_t get_be(const unsigned char *p, int bytes) {
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; i++) v = (v << 8) | p[i];
+    return v;
+}
+
+void wire_encode_header(unsigned char *buf, uint8_t op, uint32_t id, uint64_t len) {
+    buf[0] = WIRE_MAGIC;
+    buf[1] = op;
+    buf[2] = buf[3] = 0;
+    put_be(buf + 4, id, 4);
+    put_be(buf + 8, len, 8);
+}
+
+void wire_put_u64(unsigned char *buf, uint64_t v) {
+    put_be(buf, v, 8);
+}
+
+bool wire_decode_header(const unsigned char *buf, WireHeader *h) {
+    if (buf[0] != WIRE_MAGIC) return false;
+    h->op = buf[1];
+    h->id = (uint32_t)get_be(buf + 4, 4);
+    h->len = get_be(buf + 8, 8);
+    return true;
+}
+
+static WireScan scan_line(char *buf, size_t len, bool eof, WireRequest *req) {
+    size_t max = len < WIRE_LINE_MAX - 1 ? len : WIRE_LINE_MAX - 1;
+    char *nl = (char *)memchr(buf, '\n', max);
+    size_t line_len;
+    if (nl) {
+        line_len = (size_t)(nl - buf);
+        req->consumed = line_len + 1;
+    } else if (len >= WIRE_LINE_MAX - 1 || (eof && len > 0)) {
+        // Over-long line, or the unterminated last one
+        line_len = req->consumed = max;
+    } else {
+        return WIRE_NEED_MORE;
+    }
+    req->line = buf;
+    req->term = buf + line_len;
+    req->saved = *req->term;
+    *req->term = '\0';
+    return WIRE_LINE;
+}
+
+WireScan wire_scan(char *buf, size_t len, bool binary, bool eof, WireRequest *req) {
+    if (!binary) return scan_line(buf, len, eof, req);
+
+    if (len < WIRE_HEADER_LEN) return WIRE_NEED_MORE;
+    const unsigned char *p = (const unsigned char *)buf;
+    if (!wire_decode_header(p, &req->hdr) || req->hdr.len > WIRE_MAX_REQUEST) {
+        return WIRE_BAD_FRAME;
+    }
+    if (len - WIRE_HEADER_LEN < req->hdr.len) return WIRE_NEED_MORE;
+    req->body = p + WIRE_HEADER_LEN;
+    req->consumed = WIRE_HEADER_LEN + (size_t)req->hdr.len;
+    req->line = req->term = NULL;
+    return WIRE_FRAME;
+}
+
+void wire_restore(WireRequest *req) {
+    if (req->term) *req->term = req->saved;
+}
+
+bool wire_is_command(const char *line) {
+    return strncmp(line, "BINARY", 6) == 0 && (line[6] == '\0' || line[6] == ' ');
+}
+
+void wire_tag(uint32_t id, char tag[REQUEST_TAG_LEN]) {
+    snprintf(tag, REQUEST_TAG_LEN, "%u ", (unsigned)id);
+}
+
+uint32_t wire_tag_id(const char *tag) {
+    return (uint32_t)strtoul(tag, NULL, 10);
+}
+
+void wire_fields_init(WireFields *f, const WireRequest *req) {
+    f->p = req->body;
+    f->left = (size_t)req->hdr.len;
+}
+
+bool wire_fields_empty(const WireFields *f) {
+    return f->left == 0;
+}
+
+// Take the next field's bytes
+static bool next_field(WireFields *f, const unsigned char **data, size_t *len) {
+    if (f->left < 2) return false;
+    size_t n = (size_t)get_be(f->p, 2);
+    if (f->left - 2 < n) return false;
+    *data = f->p + 2;
+    *len = n;
+    f->p += 2 + n;
+    f->left -= 2 + n;
+    return true;
+}
+
+bool wire_field_str(WireFields *f, char *dst, size_t cap) {
+    const unsigned char *data;
+    size_t n;
+    if (!next_field(f, &data, &n) || n >= cap || memchr(data, '\0', n)) return false;
+    memcpy(dst, data, n);
+    dst[n] = '\0';
+    return true;
+}
+
+bool wire_field_u64(WireFields *f, uint64_t *v) {
+    const unsigned char *data;
+    size_t n;
+    if (!next_field(f, &data, &n) || n != 8) return false;
+    *v = get_be(data, 8);
+    return true;
+}
+
+size_t wire_format_reply(uint8_t op, uint32_t id, const char *msg, char *buf, size_t len) {
+    if (len < WIRE_HEADER_LEN) return 0;
+    size_t n = strlen(msg);
+    if (n > len - WIRE_HEADER_LEN) n = len - WIRE_HEADER_LEN;
+    wire_encode_header((unsigned char *)buf, op, id, n);
+    memcpy(buf + WIRE_HEADER_LEN, msg, n);
+    return WIRE_HEADER_LEN + n;
+}
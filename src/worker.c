@@ -3,101 +3,319 @@
 #include "fs.h"
 #include "user.h"
 #include "priority.h"
+#include "net.h"
+#include "log.h"
+#include "config.h"
+#include "pool.h"
+#include "wire.h"
+#include "client.h"
+#include "metrics.h"
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 #include <time.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <sys/socket.h>
+
+// Long transfers check whether their client is still there this often
+#define CANCEL_CHECK_BYTES (1u << 20)
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
 
 // Forward declarations
-static void send_response(Queue *resp_map, int client_id, ResponseStatus st, const char *msg);
-static void send_file_data(int socket_fd, const char *file_path, const char *filename);
+static void send_response(ResponseMap *resp_map, const Task *t, ResponseStatus st, const char *msg);
 
-static void send_response(Queue *resp_map, int client_id, ResponseStatus st, const char *msg) {
-    printf("[send_response] Creating response for client_id=%d, status=%s\n", 
+// Queue t's reply for its connection. The reply carries the request's seq
+// and tag, so a pipelined connection can route and order it.
+static void send_response(ResponseMap *resp_map, const Task *t, ResponseStatus st, const char *msg) {
+    int client_id = t->client.client_id;
+    LOG_TRACE("[send_response] Creating response for client_id=%d, status=%s", 
            client_id, st == RESP_OK ? "OK" : "ERR");
-    fflush(stdout);
     
-    Response *r = (Response *)calloc(1, sizeof(Response));
+    Response *r = (Response *)pool_alloc(g_response_pool);
     if (!r) return;  // Out of memory
     
     r->client_id = client_id;
     r->status = st;
+    r->seq = t->seq;
+    memcpy(r->tag, t->tag, sizeof(r->tag));
+    r->binary = t->binary;
     strncpy(r->message, msg?msg:"", sizeof(r->message)-1);
     r->message[sizeof(r->message)-1] = '\0';  // Ensure null termination
     
-    ResponseQueueEntry *entry = NULL;
-    
-    // Find the response queue for this client
-    printf("[send_response] Searching for client_id=%d in response map (size=%zu)\n", 
-           client_id, resp_map->size);
-    fflush(stdout);
-    
-    pthread_mutex_lock(&resp_map->mutex);
-    for (size_t i = 0; i < resp_map->size; i++) {
-        ResponseQueueEntry *e = (ResponseQueueEntry *)resp_map->items[i].data;
-        printf("[send_response] Checking entry %zu: client_id=%d\n", i, e->client_id);
-        fflush(stdout);
-        if (e->client_id == client_id) { 
-            entry = e; 
-            break; 
-        }
-    }
-    pthread_mutex_unlock(&resp_map->mutex);
+    // The task holds a reference on its client's channel; a closed one
+    // refuses the reply, so late replies never touch a freed entry
+    ResponseQueueEntry *entry = t->conn ? response_map_ref(t->conn)
+                                        : response_map_get(resp_map, client_id);
     
     if (entry) {
-        printf("[send_response] Found entry for client_id=%d, pushing to queue\n", client_id);
-        fflush(stdout);
+        LOG_TRACE("[send_response] Found entry for client_id=%d, pushing to queue", client_id);
         
         // Lock the entry's mutex before modifying its queue
         pthread_mutex_lock(&entry->mutex);
         
-        // Add the response to the queue
+        // Add the response to the queue; refused once the client deregistered
         bool was_empty = (entry->queue.size == 0);
-        queue_push(&entry->queue, r, PRIORITY_NORMAL);
+        if (!queue_push(&entry->queue, r, PRIORITY_NORMAL)) {
+            pthread_mutex_unlock(&entry->mutex);
+            response_map_put(entry);
+            pool_free(g_response_pool, r);
+            return;
+        }
         
-        printf("[send_response] Response pushed, was_empty=%d, signaling...\n", was_empty);
-        fflush(stdout);
+        LOG_TRACE("[send_response] Response pushed, was_empty=%d, signaling...", was_empty);
         
         // Signal waiting threads if the queue was empty
         if (was_empty) {
             pthread_cond_signal(&entry->response_available);
         }
+        // Reactor-owned clients have nobody blocked on the condvar
+        if (entry->notify) {
+            entry->notify(entry->notify_ctx, client_id);
+        }
         
         pthread_mutex_unlock(&entry->mutex);
-        printf("[send_response] Response delivered successfully\n");
-        fflush(stdout);
+        response_map_put(entry);
+        LOG_TRACE("[send_response] Response delivered successfully");
     } else {
-        printf("[send_response] ERROR: No entry found for client_id=%d!\n", client_id);
-        fflush(stdout);
-        free(r);  // No one is waiting for this response
+        LOG_DEBUG("[send_response] ERROR: No entry found for client_id=%d!", client_id);
+        pool_free(g_response_pool, r);  // No one is waiting for this response
     }
 }
 
-static void send_file_data(int socket_fd, const char *file_path, const char *filename) {
-    FILE *file = fopen(file_path, "rb");
-    if (!file) return;
+// Write the whole DOWNLOAD reply on the socket: status line (tagged on
+// pipelined connections), FILE_DATA header, then length bytes of the body
+// from offset. Files stored as-is go out with sendfile; encoded ones are
+// decoded chunk by chunk into a bounded buffer. Ranged replies also carry the
+// offset and the file's total size. Binary connections get a DATA frame
+// carrying the offset and size instead of the two text lines.
+static bool send_download(int socket_fd, FsDownload *dl, const Task *t,
+                          size_t offset, size_t length) {
+    char header[360];
+    int n;
+    if (t->binary) {
+        unsigned char *h = (unsigned char *)header;
+        wire_encode_header(h, WIRE_OP_DATA, wire_tag_id(t->tag), 16 + (uint64_t)length);
+        wire_put_u64(h + WIRE_HEADER_LEN, offset);
+        wire_put_u64(h + WIRE_HEADER_LEN + 8, dl->size);
+        n = WIRE_HEADER_LEN + 16;
+    } else if (t->ranged) {
+        n = snprintf(header, sizeof(header), "%sOK downloaded\nFILE_DATA %s %zu %zu %zu\n",
+                     t->tag, t->path, length, offset, dl->size);
+    } else {
+        n = snprintf(header, sizeof(header), "%sOK downloaded\nFILE_DATA %s %zu\n", t->tag, t->path, length);
+    }
+    if (!net_write_all(socket_fd, header, (size_t)n)) return false;
     
-    // Get file size
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
+    if (dl->identity) {
+        off_t off = dl->data_offset + (off_t)offset;
+        size_t left = length;
+        while (left > 0) {
+            size_t step = left < CANCEL_CHECK_BYTES ? left : CANCEL_CHECK_BYTES;
+            if (task_cancelled(t) || !net_sendfile(socket_fd, dl->fd, &off, step)) return false;
+            metrics_add(METRIC_DOWNLOAD_BYTES, step);
+            left -= step;
+        }
+        return true;
+    }
     
-    // Send file info header
-    char header[512];
-    snprintf(header, sizeof(header), "FILE_DATA %s %ld\n", filename, file_size);
-    write(socket_fd, header, strlen(header));
+    if (!fs_download_seek(dl, offset)) return false;
+    unsigned char buf[FS_IO_CHUNK];
+    size_t left = length;
+    size_t since_check = 0;
+    while (left > 0) {
+        if (since_check >= CANCEL_CHECK_BYTES) {
+            if (task_cancelled(t)) return false;
+            since_check = 0;
+        }
+        ssize_t got = fs_download_read(dl, buf, left < sizeof(buf) ? left : sizeof(buf));
+        if (got <= 0) return false;
+        if (!net_write_all(socket_fd, buf, (size_t)got)) return false;
+        metrics_add(METRIC_DOWNLOAD_BYTES, (uint64_t)got);
+        left -= (size_t)got;
+        since_check += (size_t)got;
+    }
+    return true;
+}
+
+// STATS is answered like a download of the metrics text: "OK stats <size>"
+// and the text, or a DATA frame at offset 0
+static bool send_stats(const Task *t, const MetricsText *text) {
+    char header[REQUEST_TAG_LEN + 48];
+    int n;
+    if (t->binary) {
+        unsigned char *h = (unsigned char *)header;
+        wire_encode_header(h, WIRE_OP_DATA, wire_tag_id(t->tag), 16 + (uint64_t)text->len);
+        wire_put_u64(h + WIRE_HEADER_LEN, 0);
+        wire_put_u64(h + WIRE_HEADER_LEN + 8, text->len);
+        n = WIRE_HEADER_LEN + 16;
+    } else {
+        n = snprintf(header, sizeof(header), "%sOK stats %zu\n", t->tag, text->len);
+    }
+    return net_write_all(t->client.socket_fd, header, (size_t)n) &&
+           net_write_all(t->client.socket_fd, text->data, text->len);
+}
+
+// LIST writes its entries straight to the socket as they are read, a
+// buffer at a time: "OK list", a line per file, then "MORE <cursor>" if
+// the limit cut the listing short or "END". Binary connections get the
+// lines in DATA frames and then an OK frame, "more <cursor>" or "end".
+// *sent counts the bytes written, for the user's fair share.
+static bool send_listing(const Task *t, FsList *ls, size_t *sent) {
+    char buf[FS_IO_CHUNK];
+    size_t start = t->binary ? WIRE_HEADER_LEN : 0;
+    size_t used = t->binary ? start : (size_t)snprintf(buf, sizeof(buf), "%sOK list\n", t->tag);
+    size_t left = t->size ? t->size : SIZE_MAX;
+    bool done = false;
+    *sent = 0;
+    while (!done) {
+        size_t count = 0;
+        ssize_t n = left ? fs_list_read(ls, buf + used, sizeof(buf) - used, left, &count) : 0;
+        if (n < 0) return false;
+        used += (size_t)n;
+        left -= count;
+        done = (n == 0);
+        if (used > start && (done || sizeof(buf) - used < FS_LIST_LINE_MAX)) {
+            if (t->binary) {
+                wire_encode_header((unsigned char *)buf, WIRE_OP_DATA, wire_tag_id(t->tag), used - start);
+            }
+            if (task_cancelled(t) || !net_write_all(t->client.socket_fd, buf, used)) return false;
+            *sent += used;
+            used = start;
+        }
+    }
     
-    // Send file data in chunks
-    char buffer[8192];
-    size_t bytes_read;
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
-        write(socket_fd, buffer, bytes_read);
+    bool more = false;
+    if (left == 0 && !fs_list_more(ls, &more)) return false;
+    char trailer[REQUEST_TAG_LEN + WIRE_HEADER_LEN + 32];
+    size_t len;
+    if (t->binary) {
+        char msg[32];
+        if (more) snprintf(msg, sizeof(msg), "more %llu", (unsigned long long)ls->cursor);
+        else snprintf(msg, sizeof(msg), "end");
+        len = wire_format_reply(WIRE_OP_OK, wire_tag_id(t->tag), msg, trailer, sizeof(trailer));
+    } else if (more) {
+        len = (size_t)snprintf(trailer, sizeof(trailer), "MORE %llu\n", (unsigned long long)ls->cursor);
+    } else {
+        len = (size_t)snprintf(trailer, sizeof(trailer), "END\n");
     }
+    *sent += len;
+    return net_write_all(t->client.socket_fd, trailer, len);
+}
+
+// Reads the data phase of an upload: first any bytes the connection had
+// already buffered past the command line, then the socket itself.
+typedef struct {
+    int fd;
+    const Task *task;
+    ResponseQueueEntry *entry;
+    size_t consumed;
+    bool broken; // socket error or EOF, the stream can't be resynchronized
+} UploadSource;
+
+static ssize_t upload_read(void *ctx, void *buf, size_t len) {
+    UploadSource *src = (UploadSource *)ctx;
+    ResponseQueueEntry *e = src->entry;
+    ssize_t n;
     
-    fclose(file);
+    if (e && e->stash_off < e->stash_len) {
+        size_t avail = e->stash_len - e->stash_off;
+        n = (ssize_t)(avail < len ? avail : len);
+        memcpy(buf, e->stash + e->stash_off, (size_t)n);
+        e->stash_off += (size_t)n;
+        if (e->stash_off == e->stash_len) {
+            free(e->stash);
+            e->stash = NULL;
+            e->stash_len = e->stash_off = 0;
+        }
+    } else {
+        // The client went away; stop storing a file nobody will ask about
+        n = task_cancelled(src->task) ? -1 : net_read(src->fd, buf, len, NET_IO_TIMEOUT_MS);
+        if (n <= 0) {
+            src->broken = true;
+            return n;
+        }
+    }
+    src->consumed += (size_t)n;
+    return n;
+}
+
+// Binary uploads send their data as one DATA frame; read its header
+static bool receive_data_header(UploadSource *src, size_t size) {
+    unsigned char buf[WIRE_HEADER_LEN];
+    size_t got = 0;
+    while (got < sizeof(buf)) {
+        ssize_t n = upload_read(src, buf + got, sizeof(buf) - got);
+        if (n <= 0) return false;
+        got += (size_t)n;
+    }
+    src->consumed = 0; // the data phase proper starts here
+    WireHeader h;
+    return wire_decode_header(buf, &h) && h.op == WIRE_OP_DATA && h.len == size;
+}
+
+// Send READY, then read the data phase into a temp file of its own for
+// UPLOAD (up) or into its session for UPLOAD_RESUME (state). The file is put
+// in place later, under the path lock, by fs_upload_commit or
+// fs_upload_finish. On failure the rest of the data phase is drained so the
+// next command line is parsed from the right place.
+static bool receive_upload(WorkerPoolArg *wpa, Task *t, FsPendingUpload *up, FsUploadState *state,
+                           char *err, size_t errlen) {
+    char ready[REQUEST_TAG_LEN + WIRE_HEADER_LEN];
+    int n = t->binary
+        ? (int)wire_format_reply(WIRE_OP_READY, wire_tag_id(t->tag), "", ready, sizeof(ready))
+        : snprintf(ready, sizeof(ready), "%sREADY\n", t->tag);
+    if (!net_write_all(t->client.socket_fd, ready, (size_t)n)) {
+        snprintf(err, errlen, "Connection lost");
+        return false;
+    }
+    
+    UploadSource src = {
+        .fd = t->client.socket_fd,
+        .task = t,
+        .entry = t->conn ? response_map_ref(t->conn)
+                         : response_map_get(wpa->resp_queues, t->client.client_id),
+    };
+    if (t->binary && !receive_data_header(&src, t->size)) {
+        // Nothing after a bad frame can be trusted
+        shutdown(t->client.socket_fd, SHUT_RDWR);
+        response_map_put(src.entry);
+        snprintf(err, errlen, "Expected a %zu-byte DATA frame", t->size);
+        return false;
+    }
+    bool ok = t->type == CMD_UPLOAD_RESUME
+        ? fs_upload_resume(wpa->user_store, t->username, t->path, t->offset, t->size,
+                           upload_read, &src, state, err, errlen)
+        : fs_upload(wpa->user_store, t->username, t->path, t->size,
+                    upload_read, &src, up, err, errlen);
+    
+    unsigned char scratch[4096];
+    while (!ok && !src.broken && src.consumed < t->size) {
+        size_t left = t->size - src.consumed;
+        if (upload_read(&src, scratch, left < sizeof(scratch) ? left : sizeof(scratch)) <= 0) break;
+    }
+    metrics_add(METRIC_UPLOAD_BYTES, src.consumed);
+    
+    response_map_put(src.entry);
+    return ok;
+}
+
+// Answer a task without running it. It still gets a reply, which a client
+// that is gone never sees, so pipelines keep count; an upload's quota
+// reservation is released.
+static void drop_task(WorkerPoolArg *wpa, Task *t, const char *why) {
+    LOG_DEBUG("[Worker] Dropping %s for client %d: %s",
+              command_to_string(t->type), t->client.client_id, why);
+    client_release_task(wpa->user_store, t);
+    metrics_add(METRIC_TASKS_DROPPED, 1);
+    send_response(wpa->resp_queues, t, RESP_ERR, why);
 }
 
 // Helper function to get the effective priority of a task
@@ -105,16 +323,24 @@ void *worker_thread_main(void *arg) {
     WorkerPoolArg *wpa = (WorkerPoolArg *)arg;
     
     while (1) {
-        // Get the highest priority task
-        Task *t = (Task *)queue_pop(wpa->task_queue);
+        // Get the next task: own deque, then the injection queue, then stolen
+        Task *t = scheduler_next(wpa->scheduler, wpa->worker_id);
         if (!t) {
             // No more tasks, exit thread
             break;
         }
         
+        // Skip work whose result nobody will read: the client went away or
+        // stopped waiting, or the task sat in the queue past its deadline
+        bool cancelled = task_cancelled(t);
+        if (cancelled || task_expired(t)) {
+            drop_task(wpa, t, cancelled ? "Request cancelled" : "Request timed out");
+            task_free(t);
+            continue;
+        }
+        
         // Log task processing with thread ID for debugging
-        printf("[Worker %lu] Processing task: %s (priority: %s, user: %s)\n",
-               (unsigned long)pthread_self(),
+        LOG_DEBUG("[Worker] Processing task: %s (priority: %s, user: %s)",
                command_to_string(t->type),
                priority_to_string(t->priority),
                t->username[0] ? t->username : "anonymous");
@@ -126,80 +352,70 @@ void *worker_thread_main(void *arg) {
                 bool ok = false;
                 
                 // Signup with the task's priority (default is PRIORITY_NORMAL)
-                ok = user_store_signup(wpa->user_store, t->username, t->password, 100<<20, t->priority);
+                ok = user_store_signup(wpa->user_store, t->username, t->password,
+                                       config_get_user_quota_bytes(), t->priority);
                 
                 if (!ok) {
                     snprintf(err, sizeof(err) - 1, "Signup failed - user may already exist");
                 }
                 
-                send_response(wpa->resp_queues, t->client.client_id, 
+                send_response(wpa->resp_queues, t, 
                             ok ? RESP_OK : RESP_ERR, 
                             ok ? "signed_up" : (err[0] ? err : "signup_failed"));
                 task_completed = true;
 				break;
 			}
 			case CMD_LOGIN: {
-                printf("[Worker] LOGIN: Starting login process for user '%s'\n", t->username);
-                fflush(stdout);
+                LOG_TRACE("[Worker] LOGIN: Starting login process for user '%s'", t->username);
                 
                 bool ok = false;
                 char err[256] = {0};
                 
-                printf("[Worker] LOGIN: Calling user_store_lock_user...\n");
-                fflush(stdout);
-                User *u = user_store_lock_user(wpa->user_store, t->username);
+                LOG_TRACE("[Worker] LOGIN: Calling user_store_lock_user...");
+                User *u = user_store_lock_user(wpa->user_store, t->username, USER_LOCK_SHARED);
                 
-                printf("[Worker] LOGIN: user_store_lock_user returned %p\n", (void*)u);
-                fflush(stdout);
+                LOG_TRACE("[Worker] LOGIN: user_store_lock_user returned %p", (void*)u);
                 
                 if (u) {
-                    printf("[Worker] LOGIN: Calling user_store_login...\n");
-                    fflush(stdout);
+                    LOG_TRACE("[Worker] LOGIN: Calling user_store_login...");
                     ok = user_store_login(wpa->user_store, t->username, t->password);
-                    printf("[Worker] LOGIN: user_store_login returned %d\n", ok);
-                    fflush(stdout);
+                    LOG_TRACE("[Worker] LOGIN: user_store_login returned %d", ok);
                     
                     if (!ok) {
                         snprintf(err, sizeof(err) - 1, "Invalid username or password");
                     }
                     
-                    printf("[Worker] LOGIN: Calling user_store_unlock_user...\n");
-                    fflush(stdout);
+                    LOG_TRACE("[Worker] LOGIN: Calling user_store_unlock_user...");
                     user_store_unlock_user(u);
-                    printf("[Worker] LOGIN: user_store_unlock_user done\n");
-                    fflush(stdout);
+                    LOG_TRACE("[Worker] LOGIN: user_store_unlock_user done");
                 } else {
                     snprintf(err, sizeof(err) - 1, "User not found");
                 }
                 
-                printf("[Worker] Sending LOGIN response: %s (client_id=%d)\n", 
+                LOG_TRACE("[Worker] Sending LOGIN response: %s (client_id=%d)", 
                        ok ? "OK" : "ERR", t->client.client_id);
-                fflush(stdout);
-                send_response(wpa->resp_queues, t->client.client_id, 
+                send_response(wpa->resp_queues, t, 
                             ok ? RESP_OK : RESP_ERR, 
                             ok ? "logged_in" : err);
-                printf("[Worker] LOGIN response sent\n");
-                fflush(stdout);
+                LOG_TRACE("[Worker] LOGIN response sent");
                 task_completed = true;
                 break;
             }
 			case CMD_UPLOAD: {
-                printf("[Worker] UPLOAD: Starting upload for user '%s', file '%s'\n", 
+                LOG_TRACE("[Worker] UPLOAD: Starting upload for user '%s', file '%s'", 
                        t->username, t->path);
-                fflush(stdout);
                 
                 bool ok = false;
                 char err[256] = {0};
+                FsUploadState st = {0};
                 
                 // Validate input parameters
-                if (t->path[0] == '\0' || t->tmpfile[0] == '\0') {
-                    snprintf(err, sizeof(err) - 1, "Invalid file path or temporary file");
+                if (t->path[0] == '\0') {
+                    snprintf(err, sizeof(err) - 1, "Invalid file path");
                 } else {
-                    printf("[Worker] UPLOAD: Calling user_store_lock_user...\n");
-                    fflush(stdout);
-                    User *u = user_store_lock_user(wpa->user_store, t->username);
-                    printf("[Worker] UPLOAD: user_store_lock_user returned %p\n", (void*)u);
-                    fflush(stdout);
+                    LOG_TRACE("[Worker] UPLOAD: Calling user_store_lock_user...");
+                    User *u = user_store_lock_user(wpa->user_store, t->username, USER_LOCK_SHARED);
+                    LOG_TRACE("[Worker] UPLOAD: user_store_lock_user returned %p", (void*)u);
                     
                     if (u) {
                         // Check if user has sufficient priority for large uploads
@@ -208,121 +424,262 @@ void *worker_thread_main(void *arg) {
                                     "File too large (%.2f MB). Upgrade to high priority for larger uploads.", 
                                     (double)t->size / (1024 * 1024));
                         } else {
-                            // Verify the temporary file exists and is accessible
-                            FILE *f = fopen(t->tmpfile, "rb");
-                            if (f) {
-                                fclose(f);
-                                ok = fs_upload(wpa->user_store, t->username, t->path, 
-                                             t->tmpfile, t->size, err, sizeof(err) - 1);
-                                // Clean up temp file after successful upload
-                                if (ok) {
-                                    unlink(t->tmpfile);
-                                }
-                            } else {
-                                snprintf(err, sizeof(err) - 1, "Temporary file not found or inaccessible");
+                            // The data arrives at the client's pace into a temp
+                            // file of its own; only moving it into place locks
+                            // the path, so a slow upload never holds a stripe
+                            FsPendingUpload up;
+                            ok = receive_upload(wpa, t, &up, &st, err, sizeof(err) - 1);
+                            if (ok) {
+                                user_lock_file(u, t->path, USER_LOCK_EXCLUSIVE);
+                                ok = fs_upload_commit(&up, &st.replaced, err, sizeof(err) - 1);
+                                user_unlock_file(u, t->path);
                             }
                         }
+                        // The reservation becomes usage, less the file it replaced
+                        user_store_settle(wpa->user_store, u, t->reserved,
+                                          ok ? t->size : 0, ok ? st.replaced : 0);
                         user_store_unlock_user(u);
                     } else {
                         snprintf(err, sizeof(err) - 1, "User not found or not logged in");
                     }
                 }
                 
-                send_response(wpa->resp_queues, t->client.client_id, 
+                send_response(wpa->resp_queues, t, 
                             ok ? RESP_OK : RESP_ERR, 
                             ok ? "uploaded" : (err[0] ? err : "upload failed"));
                 task_completed = true;
 				break;
 			}
 			case CMD_DOWNLOAD: {
-                char p[512] = {0};
                 bool ok = false;
                 char err[256] = {0};
+                FsDownload dl;
                 
                 // Validate input parameters
                 if (t->path[0] == '\0') {
                     snprintf(err, sizeof(err) - 1, "Invalid file path");
-                    send_response(wpa->resp_queues, t->client.client_id, 
-                                RESP_ERR, err);
                 } else {
-                    User *u = user_store_lock_user(wpa->user_store, t->username);
+                    User *u = user_store_lock_user(wpa->user_store, t->username, USER_LOCK_SHARED);
                     
                     if (u) {
-                        ok = fs_download_path(wpa->user_store, t->username, t->path, 
-                                            p, sizeof(p) - 1, err, sizeof(err) - 1);
-                        
-                        if (ok) {
-                            if (u->priority == PRIORITY_HIGH) {
-                                // For high-priority users, send file data immediately
-                                send_response(wpa->resp_queues, t->client.client_id, 
-                                            RESP_OK, "downloaded");
-                                send_file_data(t->client.socket_fd, p, t->path);
-                                // Clean up temp file
-                                unlink(p);
-                            } else {
-                                // For normal/low priority users, send file path
-                                send_response(wpa->resp_queues, t->client.client_id, 
-                                            RESP_OK, p);
-                            }
-                        } else {
-                            send_response(wpa->resp_queues, t->client.client_id, 
-                                        RESP_ERR, err[0] ? err : "Download failed");
-                        }
+                        user_lock_file(u, t->path, USER_LOCK_SHARED);
+                        ok = fs_download_open(wpa->user_store, t->username, t->path, 
+                                            &dl, err, sizeof(err) - 1);
+                        // The open descriptor keeps the file readable, so the
+                        // file isn't locked while the client drains the data
+                        user_unlock_file(u, t->path);
                         user_store_unlock_user(u);
                     } else {
                         snprintf(err, sizeof(err) - 1, "User not found or not logged in");
-                        send_response(wpa->resp_queues, t->client.client_id, 
-                                    RESP_ERR, err);
                     }
                 }
+                
+                if (ok && t->offset > dl.size) {
+                    snprintf(err, sizeof(err) - 1, "Offset %zu is past the end of the file (%zu bytes)",
+                             t->offset, dl.size);
+                    fs_download_close(&dl);
+                    ok = false;
+                }
+                
+                if (ok) {
+                    // Length 0 (or none given) means to the end of the file
+                    size_t length = dl.size - t->offset;
+                    if (t->size > 0 && t->size < length) length = t->size;
+                    scheduler_charge(wpa->scheduler, t, length);
+                    if (!send_download(t->client.socket_fd, &dl, t, t->offset, length)) {
+                        LOG_WARN("[Worker] DOWNLOAD: Failed to send '%s' to client %d", 
+                               t->path, t->client.client_id);
+                        // The client can't tell where the body stopped
+                        shutdown(t->client.socket_fd, SHUT_RDWR);
+                    }
+                    fs_download_close(&dl);
+                    send_response(wpa->resp_queues, t, RESP_SENT, "");
+                } else {
+                    send_response(wpa->resp_queues, t, 
+                                RESP_ERR, err[0] ? err : "Download failed");
+                }
                 task_completed = true;
 				break;
 			}
+			case CMD_UPLOAD_START: {
+                bool ok = false;
+                char err[256] = {0};
+                char msg[64];
+                char id[FS_UPLOAD_ID_LEN + 1];
+                
+                if (t->path[0] == '\0') {
+                    snprintf(err, sizeof(err) - 1, "Invalid file path");
+                } else {
+                    // Every session gets its own files, so only the user is locked
+                    User *u = user_store_lock_user(wpa->user_store, t->username, USER_LOCK_SHARED);
+                    if (u) {
+                        // Same size rule as UPLOAD, applied to the whole file
+                        if (t->size > (10 * 1024 * 1024) && u->priority < PRIORITY_HIGH) {
+                            snprintf(err, sizeof(err) - 1, 
+                                    "File too large (%.2f MB). Upgrade to high priority for larger uploads.", 
+                                    (double)t->size / (1024 * 1024));
+                        } else {
+                            ok = fs_upload_start(wpa->user_store, t->username, t->path, t->size,
+                                                 id, err, sizeof(err) - 1);
+                        }
+                        // The session's whole size counts as usage from now
+                        // until it is finished or aborted, so parts stored in
+                        // any number of sessions can't go past the quota
+                        user_store_settle(wpa->user_store, u, t->reserved, ok ? t->size : 0, 0);
+                        user_store_unlock_user(u);
+                    } else {
+                        snprintf(err, sizeof(err) - 1, "User not found or not logged in");
+                    }
+                }
+                
+                if (ok) snprintf(msg, sizeof(msg), "upload_id %s", id);
+                send_response(wpa->resp_queues, t, 
+                            ok ? RESP_OK : RESP_ERR, 
+                            ok ? msg : (err[0] ? err : "upload start failed"));
+                task_completed = true;
+                break;
+            }
+			case CMD_UPLOAD_STATUS:
+			case CMD_UPLOAD_RESUME: {
+                bool ok = false;
+                char err[256] = {0};
+                char msg[64];
+                FsUploadState st = {0};
+                
+                // Parts of one upload are serialized by fs on its session
+                // files, so no file stripe is held while a part arrives
+                User *u = user_store_lock_user(wpa->user_store, t->username, USER_LOCK_SHARED);
+                if (u) {
+                    if (t->type == CMD_UPLOAD_STATUS) {
+                        ok = fs_upload_status(wpa->user_store, t->username, t->path,
+                                              &st, err, sizeof(err) - 1);
+                    } else {
+                        ok = receive_upload(wpa, t, NULL, &st, err, sizeof(err) - 1);
+                        if (ok && st.committed == st.size) {
+                            user_lock_file(u, st.relpath, USER_LOCK_EXCLUSIVE);
+                            ok = fs_upload_finish(wpa->user_store, t->username, t->path,
+                                                  &st, err, sizeof(err) - 1);
+                            user_unlock_file(u, st.relpath);
+                        }
+                    }
+                    // The file was charged at UPLOAD_START; only the one it
+                    // replaced is freed
+                    bool done = ok && t->type == CMD_UPLOAD_RESUME && st.committed == st.size;
+                    if (done) user_store_settle(wpa->user_store, u, 0, 0, st.replaced);
+                    user_store_unlock_user(u);
+                } else {
+                    snprintf(err, sizeof(err) - 1, "User not found or not logged in");
+                }
+                
+                if (ok && t->type == CMD_UPLOAD_RESUME && st.committed == st.size) {
+                    snprintf(msg, sizeof(msg), "uploaded");
+                } else {
+                    snprintf(msg, sizeof(msg), "committed %llu %llu",
+                             (unsigned long long)st.committed, (unsigned long long)st.size);
+                }
+                send_response(wpa->resp_queues, t, 
+                            ok ? RESP_OK : RESP_ERR, 
+                            ok ? msg : (err[0] ? err : "upload failed"));
+                task_completed = true;
+                break;
+            }
+			case CMD_UPLOAD_ABORT: {
+                bool ok = false;
+                char err[256] = {0};
+                User *u = user_store_lock_user(wpa->user_store, t->username, USER_LOCK_SHARED);
+                if (u) {
+                    uint64_t size = 0;
+                    ok = fs_upload_abort(wpa->user_store, t->username, t->path, &size,
+                                         err, sizeof(err) - 1);
+                    if (ok) user_store_settle(wpa->user_store, u, 0, 0, size);
+                    user_store_unlock_user(u);
+                } else {
+                    snprintf(err, sizeof(err) - 1, "User not found or not logged in");
+                }
+                send_response(wpa->resp_queues, t, 
+                            ok ? RESP_OK : RESP_ERR, 
+                            ok ? "aborted" : err);
+                task_completed = true;
+                break;
+            }
 			case CMD_DELETE: {
 				bool ok = false;
-                User *u = user_store_lock_user(wpa->user_store, t->username);
+                User *u = user_store_lock_user(wpa->user_store, t->username, USER_LOCK_SHARED);
                 if (u) {
-                    ok = fs_delete(wpa->user_store, t->username, t->path, err, sizeof(err));
+                    uint64_t freed = 0;
+                    user_lock_file(u, t->path, USER_LOCK_EXCLUSIVE);
+                    ok = fs_delete(wpa->user_store, t->username, t->path, &freed, err, sizeof(err));
+                    user_unlock_file(u, t->path);
+                    if (ok) user_store_settle(wpa->user_store, u, 0, 0, freed);
                     user_store_unlock_user(u);
                 } else {
                     snprintf(err, sizeof(err), "User not found");
                 }
-                send_response(wpa->resp_queues, t->client.client_id, 
+                send_response(wpa->resp_queues, t, 
                             ok ? RESP_OK : RESP_ERR, 
                             ok ? "deleted" : err);
                 task_completed = true;
 				break;
 			}
 			case CMD_LIST: {
-				char buf[4096] = {0};  // Increased buffer size for larger directory listings
                 bool ok = false;
-                User *u = user_store_lock_user(wpa->user_store, t->username);
+                FsList ls;
+                User *u = user_store_lock_user(wpa->user_store, t->username, USER_LOCK_SHARED);
                 
                 if (u) {
-                    ok = fs_list(wpa->user_store, t->username, buf, sizeof(buf), err, sizeof(err));
+                    // Like a download, the open directory is all the
+                    // listing needs; the user isn't locked while it streams
+                    ok = fs_list_open(wpa->user_store, t->username, t->offset, t->list_fields,
+                                      &ls, err, sizeof(err));
                     user_store_unlock_user(u);
                 } else {
                     snprintf(err, sizeof(err), "User not found");
                 }
                 
-                send_response(wpa->resp_queues, t->client.client_id, 
-                            ok ? RESP_OK : RESP_ERR, 
-                            ok ? buf : err);
+                if (ok) {
+                    size_t sent = 0;
+                    if (!send_listing(t, &ls, &sent)) {
+                        LOG_WARN("[Worker] LIST: Failed to send the listing to client %d",
+                                 t->client.client_id);
+                        // The client can't tell where the listing stopped
+                        shutdown(t->client.socket_fd, SHUT_RDWR);
+                    }
+                    scheduler_charge(wpa->scheduler, t, sent);
+                    fs_list_close(&ls);
+                    send_response(wpa->resp_queues, t, RESP_SENT, "");
+                } else {
+                    send_response(wpa->resp_queues, t, RESP_ERR, err);
+                }
+                task_completed = true;
+                break;
+            }
+			case CMD_STATS: {
+                MetricsText text;
+                metrics_text_init(&text);
+                if (metrics_render(&text, false)) {
+                    if (!send_stats(t, &text)) shutdown(t->client.socket_fd, SHUT_RDWR);
+                    send_response(wpa->resp_queues, t, RESP_SENT, "");
+                } else {
+                    send_response(wpa->resp_queues, t, RESP_ERR, "Out of memory");
+                }
+                metrics_text_free(&text);
                 task_completed = true;
                 break;
             }
             default: break;
         }
         
+        uint64_t busy = now_ns() - t->start_ns;
+        metrics_observe((MetricHistogram)(METRIC_SERVICE + t->type), busy);
+        metrics_add(METRIC_WORKER_BUSY_NS, busy);
+        
         // Log task completion
         if (task_completed) {
-            printf("[Worker %lu] Completed task: %s for user %s\n",
-                   (unsigned long)pthread_self(),
+            LOG_DEBUG("[Worker] Completed task: %s for user %s",
                    command_to_string(t->type),
                    t->username[0] ? t->username : "anonymous");
         } else {
-            printf("[Worker %lu] Failed to complete task: %s for user %s\n",
-                   (unsigned long)pthread_self(),
+            LOG_WARN("[Worker] Failed to complete task: %s for user %s",
                    command_to_string(t->type),
                    t->username[0] ? t->username : "anonymous");
         }
@@ -332,6 +689,6 @@ void *worker_thread_main(void *arg) {
         t = NULL;
     }
     
-    printf("[Worker %lu] Shutting down\n", (unsigned long)pthread_self());
+    LOG_DEBUG("[Worker] Shutting down");
     return NULL;
 }
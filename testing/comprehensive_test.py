@@ -10,6 +10,7 @@ import time
 import os
 import sys
 import signal
+import struct
 import threading
 from pathlib import Path
 
@@ -73,6 +74,28 @@ def send_command(cmd, timeout=5):
     except Exception as e:
         return f"ERR Connection failed: {e}"
 
+def send_upload(user, name, local_path, timeout=5):
+    """Upload a local file: send the UPLOAD line, wait for READY, stream the data"""
+    try:
+        with open(local_path, 'rb') as f:
+            data = f.read()
+        sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        sock.settimeout(timeout)
+        sock.connect(('127.0.0.1', 9090))
+        sock.sendall(f"UPLOAD {user} {name} {len(data)}\n".encode())
+        reply = sock.recv(4096).decode()
+        if not reply.startswith("READY"):
+            sock.close()
+            return reply.strip()
+        sock.sendall(data)
+        response = sock.recv(4096).decode().strip()
+        sock.close()
+        return response
+    except socket.timeout:
+        return f"ERR Connection failed: timed out"
+    except Exception as e:
+        return f"ERR Connection failed: {e}"
+
 def wait_for_server(max_attempts=20):
     """Wait for server to be ready"""
     for i in range(max_attempts):
@@ -251,7 +274,7 @@ def test_file_upload():
     
     log_info("Testing file upload...")
     file_size = os.path.getsize('/tmp/test_upload_1.txt')
-    response = send_command(f"UPLOAD testuser1 file1.txt {file_size} /tmp/test_upload_1.txt")
+    response = send_upload('testuser1', 'file1.txt', '/tmp/test_upload_1.txt')
     if "OK" in response:
         log_success("File upload successful")
     else:
@@ -259,7 +282,7 @@ def test_file_upload():
     
     log_info("Uploading multiple files...")
     file_size = os.path.getsize('/tmp/test_upload_2.txt')
-    response = send_command(f"UPLOAD testuser1 file2.txt {file_size} /tmp/test_upload_2.txt")
+    response = send_upload('testuser1', 'file2.txt', '/tmp/test_upload_2.txt')
     if "OK" in response:
         log_success("Second file upload successful")
     else:
@@ -267,7 +290,7 @@ def test_file_upload():
     
     log_info("Testing large file upload...")
     file_size = os.path.getsize('/tmp/test_upload_large.txt')
-    response = send_command(f"UPLOAD testuser1 large.txt {file_size} /tmp/test_upload_large.txt")
+    response = send_upload('testuser1', 'large.txt', '/tmp/test_upload_large.txt')
     if "OK" in response:
         log_success("Large file upload successful")
     else:
@@ -310,13 +333,21 @@ def test_file_download():
     if "OK" in response:
         log_success("File download initiated successfully")
         
-        if "/tmp/os_lab7_downloads" in response:
-            log_success("Download temp file path returned")
+        if "FILE_DATA file1.txt" in response:
+            log_success("File data streamed after the response")
         else:
-            log_warning("Download temp file path not found in response")
+            log_warning("FILE_DATA header not found in response")
     else:
         log_fail(f"File download failed: {response}")
     
+    log_info("Testing ranged download...")
+    response = send_command("DOWNLOAD testuser1 file1.txt 8 4")
+    # "This is test file 1 content": bytes 8..11 are "test"
+    if "FILE_DATA file1.txt 4 8 27\ntest" in response:
+        log_success("Ranged download returned the requested bytes")
+    else:
+        log_fail(f"Ranged download failed: {response}")
+    
     log_info("Testing download of non-existent file...")
     response = send_command("DOWNLOAD testuser1 nonexistent.txt")
     if "ERR" in response:
@@ -324,6 +355,312 @@ def test_file_download():
     else:
         log_fail("Non-existent file download should have failed")
 
+def test_resumable_upload():
+    """Test 7b: Resumable Upload (UPLOAD_START / UPLOAD_RESUME)"""
+    log_section("TEST 7b: Resumable Upload")
+    
+    # Data is committed in 64 KiB chunks, so the first part commits one chunk
+    data = os.urandom(150 * 1024)
+    try:
+        sock = socket.create_connection(('127.0.0.1', 9090), timeout=5)
+        reader = sock.makefile('rb')
+        sock.sendall(f"UPLOAD_START testuser1 resumed.bin {len(data)}\n".encode())
+        reply = reader.readline().decode().strip()
+        if not reply.startswith("OK upload_id "):
+            log_fail(f"Upload start failed: {reply}")
+            return
+        upload_id = reply.split()[2]
+        log_success(f"Upload started: {upload_id}")
+        
+        sock.sendall(f"UPLOAD_RESUME testuser1 {upload_id} 0 100000\n".encode())
+        reader.readline()  # READY
+        sock.sendall(data[:100000])
+        reply = reader.readline().decode().strip()
+        if reply == f"OK committed 65536 {len(data)}":
+            log_success("First part committed up to the chunk boundary")
+        else:
+            log_fail(f"Unexpected reply to first part: {reply}")
+        sock.close()
+        
+        # Simulate a reconnect: ask where to resume, then send the rest
+        sock = socket.create_connection(('127.0.0.1', 9090), timeout=5)
+        reader = sock.makefile('rb')
+        sock.sendall(f"UPLOAD_STATUS testuser1 {upload_id}\n".encode())
+        committed = int(reader.readline().decode().split()[2])
+        sock.sendall(f"UPLOAD_RESUME testuser1 {upload_id} {committed} {len(data) - committed}\n".encode())
+        reader.readline()  # READY
+        sock.sendall(data[committed:])
+        reply = reader.readline().decode().strip()
+        if reply == "OK uploaded":
+            log_success("Upload resumed and completed")
+        else:
+            log_fail(f"Resume failed: {reply}")
+        
+        sock.sendall(b"DOWNLOAD testuser1 resumed.bin\n")
+        reader.readline()
+        size = int(reader.readline().decode().split()[2])
+        if reader.read(size) == data:
+            log_success("Resumed file downloads intact")
+        else:
+            log_fail("Resumed file content mismatch")
+        sock.close()
+    except Exception as e:
+        log_fail(f"Resumable upload failed: {e}")
+
+def test_quota():
+    """Test 7c: Quota admission"""
+    log_section("TEST 7c: Quota")
+    
+    # The declared size alone is over the default 100 MiB quota, so the
+    # server must refuse before READY and no data is sent
+    log_info("Testing over-quota upload rejection...")
+    try:
+        sock = socket.create_connection(('127.0.0.1', 9090), timeout=5)
+        reader = sock.makefile('rb')
+        sock.sendall(f"UPLOAD testuser1 huge.bin {200 << 20}\n".encode())
+        reply = reader.readline().decode().strip()
+        if reply.startswith("ERR Quota exceeded"):
+            log_success("Over-quota upload refused before any data moved")
+        else:
+            log_fail(f"Unexpected reply to over-quota upload: {reply}")
+        
+        sock.sendall(b"LIST testuser1\n")
+        if reader.readline().decode().startswith("OK"):
+            log_success("Connection still usable after the refusal")
+        else:
+            log_fail("Connection out of sync after over-quota refusal")
+        sock.close()
+        
+        # An unfinished resumable upload holds its whole size until it is
+        # aborted, so sessions can't be stacked past the quota
+        log_info("Testing quota held by resumable uploads...")
+        sock = socket.create_connection(('127.0.0.1', 9090), timeout=5)
+        reader = sock.makefile('rb')
+        sock.sendall(b"SIGNUP quotauser password123\n")
+        reader.readline()
+        ids, reply = [], ""
+        for i in range(11):
+            sock.sendall(f"UPLOAD_START quotauser held{i}.bin {10 << 20}\n".encode())
+            reply = reader.readline().decode().strip()
+            if not reply.startswith("OK upload_id"):
+                break
+            ids.append(reply.split()[2])
+        if len(ids) == 10 and reply.startswith("ERR Quota exceeded"):
+            log_success("Sessions refused once their sizes fill the quota")
+        else:
+            log_fail(f"{len(ids)} sessions started, then: {reply}")
+        
+        sock.sendall(f"UPLOAD_ABORT quotauser {ids[0]}\n".encode())
+        reply = reader.readline().decode().strip()
+        sock.sendall(f"UPLOAD_START quotauser held0.bin {10 << 20}\n".encode())
+        again = reader.readline().decode().strip()
+        if reply == "OK aborted" and again.startswith("OK upload_id"):
+            log_success("Aborting a session gives its quota back")
+            ids[0] = again.split()[2]
+        else:
+            log_fail(f"Abort did not release the session: {reply} / {again}")
+        for upload_id in ids:
+            sock.sendall(f"UPLOAD_ABORT quotauser {upload_id}\n".encode())
+            reader.readline()
+        sock.close()
+    except Exception as e:
+        log_fail(f"Quota test failed: {e}")
+
+def test_pipelining():
+    """Test 7d: Pipelined requests with ids"""
+    log_section("TEST 7d: Pipelining")
+    
+    try:
+        sock = socket.create_connection(('127.0.0.1', 9090), timeout=5)
+        reader = sock.makefile('rb')
+        sock.sendall(b"PIPELINE ordered\n")
+        reply = reader.readline().decode().strip()
+        if reply.startswith("OK pipelined ordered"):
+            log_success(f"Pipelined mode enabled: {reply}")
+        else:
+            log_fail(f"PIPELINE refused: {reply}")
+            return
+        
+        # Many requests in flight at once; ordered replies come back by id
+        sock.sendall(b"".join(f"{i} LOGIN testuser1 password123\n".encode() for i in range(1, 17)))
+        ids = [reader.readline().decode().split()[0] for _ in range(16)]
+        if ids == [str(i) for i in range(1, 17)]:
+            log_success("16 pipelined requests answered in order")
+        else:
+            log_fail(f"Pipelined replies out of order: {ids}")
+        
+        # A data-phase command waits for earlier replies, then gets a tagged READY
+        data = os.urandom(10000)
+        sock.sendall(f"20 LOGIN testuser1 password123\n21 UPLOAD testuser1 piped.bin {len(data)}\n".encode())
+        first = reader.readline().decode().strip()
+        ready = reader.readline().decode().strip()
+        sock.sendall(data)
+        done = reader.readline().decode().strip()
+        if first.startswith("20 OK") and ready == "21 READY" and done == "21 OK uploaded":
+            log_success("Upload inside a pipeline runs with tagged replies")
+        else:
+            log_fail(f"Pipelined upload failed: {first!r} {ready!r} {done!r}")
+        sock.close()
+    except Exception as e:
+        log_fail(f"Pipelining test failed: {e}")
+
+def binary_frame(op, request_id, *fields):
+    """Build a binary protocol frame; ints become 8-byte fields"""
+    body = b""
+    for field in fields:
+        data = struct.pack(">Q", field) if isinstance(field, int) else field.encode()
+        body += struct.pack(">H", len(data)) + data
+    return struct.pack(">BBHIQ", 0xFB, op, 0, request_id, len(body)) + body
+
+def read_binary_frame(reader):
+    """Read one frame; returns (op, id, body)"""
+    magic, op, _, request_id, length = struct.unpack(">BBHIQ", reader.read(16))
+    return op, request_id, reader.read(length)
+
+def test_binary_protocol():
+    """Test 7e: Negotiated binary protocol"""
+    log_section("TEST 7e: Binary Protocol")
+    
+    OK, READY, DATA = 0x80, 0x82, 0x20
+    try:
+        sock = socket.create_connection(('127.0.0.1', 9090), timeout=5)
+        reader = sock.makefile('rb')
+        sock.sendall(b"BINARY\n")
+        reply = reader.readline().decode().strip()
+        if reply != "OK binary 1":
+            log_fail(f"BINARY refused: {reply}")
+            return
+        log_success("Binary protocol negotiated")
+        
+        sock.sendall(binary_frame(2, 41, "testuser1", "password123"))
+        if read_binary_frame(reader) == (OK, 41, b"logged_in"):
+            log_success("Binary LOGIN answered with its request id")
+        else:
+            log_fail("Binary LOGIN failed")
+        
+        data = os.urandom(50000)
+        sock.sendall(binary_frame(3, 42, "testuser1", "binary.bin", len(data)))
+        ready = read_binary_frame(reader)
+        sock.sendall(struct.pack(">BBHIQ", 0xFB, DATA, 0, 42, len(data)) + data)
+        done = read_binary_frame(reader)
+        if ready[:2] == (READY, 42) and done == (OK, 42, b"uploaded"):
+            log_success("Binary UPLOAD with a DATA frame")
+        else:
+            log_fail(f"Binary UPLOAD failed: {ready} {done}")
+        
+        sock.sendall(binary_frame(4, 43, "testuser1", "binary.bin"))
+        op, request_id, body = read_binary_frame(reader)
+        if op == DATA and request_id == 43 and body[16:] == data:
+            log_success("Binary DOWNLOAD returned the file in a DATA frame")
+        else:
+            log_fail("Binary DOWNLOAD returned wrong data")
+        sock.close()
+    except Exception as e:
+        log_fail(f"Binary protocol test failed: {e}")
+
+def test_stats():
+    """Test 7f: Metrics"""
+    log_section("TEST 7f: Metrics (STATS)")
+    
+    try:
+        sock = socket.create_connection(('127.0.0.1', 9090), timeout=5)
+        reader = sock.makefile('rb')
+        sock.sendall(b"STATS\n")
+        header = reader.readline().decode().strip()
+        if not header.startswith("OK stats "):
+            log_fail(f"STATS refused: {header}")
+            return
+        text = reader.read(int(header.split()[2])).decode()
+        if 'fileserver_service_seconds_count{command="LOGIN"}' in text and \
+           "fileserver_queue_wait_seconds_bucket" in text:
+            log_success("STATS reports queue waits and per-command service times")
+        else:
+            log_fail("STATS is missing latency histograms")
+        if "fileserver_upload_bytes_total" in text and "fileserver_connections" in text:
+            log_success("STATS reports bytes moved and connections")
+        else:
+            log_fail("STATS is missing counters or gauges")
+        
+        # The connection is still in step after the metrics text
+        sock.sendall(b"LOGIN testuser1 password123\n")
+        if reader.readline().decode().strip() == "OK logged_in":
+            log_success("Requests after STATS are answered normally")
+        else:
+            log_fail("Connection out of step after STATS")
+        reader.close()
+        sock.close()
+    except Exception as e:
+        log_fail(f"STATS test failed: {e}")
+
+def read_listing(reader):
+    """Read a LIST reply: the header, the entry lines and the MORE/END trailer"""
+    header = reader.readline().decode().strip()
+    lines = []
+    if header != "OK list":
+        return header, lines, None
+    while True:
+        line = reader.readline().decode().strip()
+        if line == "END" or line.startswith("MORE "):
+            return header, lines, line
+        lines.append(line)
+
+def test_list_pages():
+    """Test 7g: Paginated listing"""
+    log_section("TEST 7g: Paginated listing (LIST cursor/limit)")
+    
+    try:
+        sock = socket.create_connection(('127.0.0.1', 9090), timeout=5)
+        reader = sock.makefile('rb')
+        sock.sendall(b"LIST testuser1 0 0 name\n")
+        header, full, trailer = read_listing(reader)
+        if header == "OK list" and trailer == "END" and "file1.txt" in full:
+            log_success(f"Names-only listing of {len(full)} files ends with END")
+        else:
+            log_fail(f"Unexpected listing: {header} {full} {trailer}")
+        
+        # One file per page, following the cursors
+        pages, cursor, seen = 0, 0, []
+        while pages <= len(full):
+            sock.sendall(f"LIST testuser1 {cursor} 1 name\n".encode())
+            header, lines, trailer = read_listing(reader)
+            pages += 1
+            seen += lines
+            if trailer is None or not trailer.startswith("MORE "):
+                break
+            cursor = int(trailer.split()[1])
+        if sorted(seen) == sorted(full) and pages == len(full):
+            log_success(f"{pages} one-file pages cover the listing exactly once")
+        else:
+            log_fail(f"Pages returned {seen}, expected {full}")
+        
+        sock.sendall(b"LIST testuser1 0 0 size,mtime\n")
+        header, lines, trailer = read_listing(reader)
+        entry = next((l.split() for l in lines if l.startswith("file1.txt ")), None)
+        if entry and len(entry) == 3 and entry[1].isdigit() and abs(int(entry[2]) - time.time()) < 3600:
+            log_success("size and mtime columns are reported")
+        else:
+            log_fail(f"Unexpected size,mtime listing: {lines}")
+
+        # Uploaded dotfiles are listed like any other file
+        response = send_upload("testuser1", ".profile", "/tmp/test_upload_1.txt")
+        sock.sendall(b"LIST testuser1 0 0 name\n")
+        header, lines, trailer = read_listing(reader)
+        if "OK" in response and ".profile" in lines:
+            log_success("Dotfiles show up in the listing")
+        else:
+            log_fail(f"Dotfile missing from listing: {response} {lines}")
+        send_command("DELETE testuser1 .profile")
+
+        sock.sendall(b"LIST testuser1 0 0 owner\n")
+        if reader.readline().decode().strip() == "ERR Malformed request":
+            log_success("Unknown columns are refused")
+        else:
+            log_fail("Unknown LIST column accepted")
+        reader.close()
+        sock.close()
+    except Exception as e:
+        log_fail(f"Paginated listing test failed: {e}")
+
 def test_file_deletion():
     """Test 8: File Deletion"""
     log_section("TEST 8: File Deletion (DELETE)")
@@ -384,9 +721,9 @@ def test_concurrent_operations():
     file_size = os.path.getsize('/tmp/test_concurrent.txt')
     
     threads = []
-    t1 = threading.Thread(target=lambda: send_command(f"UPLOAD testuser1 concurrent1.txt {file_size} /tmp/test_concurrent.txt"))
+    t1 = threading.Thread(target=lambda: send_upload('testuser1', 'concurrent1.txt', '/tmp/test_concurrent.txt'))
     t2 = threading.Thread(target=lambda: send_command("LIST testuser1"))
-    t3 = threading.Thread(target=lambda: send_command(f"UPLOAD testuser1 concurrent2.txt {file_size} /tmp/test_concurrent.txt"))
+    t3 = threading.Thread(target=lambda: send_upload('testuser1', 'concurrent2.txt', '/tmp/test_concurrent.txt'))
     
     threads = [t1, t2, t3]
     for t in threads:
@@ -409,7 +746,7 @@ def test_encoding_decoding():
     file_size = os.path.getsize('/tmp/test_encoding.txt')
     
     log_info("Uploading file (should be encoded)...")
-    response = send_command(f"UPLOAD testuser1 encoded_test.txt {file_size} /tmp/test_encoding.txt")
+    response = send_upload('testuser1', 'encoded_test.txt', '/tmp/test_encoding.txt')
     if "OK" in response:
         log_success("File uploaded for encoding test")
     else:
@@ -446,7 +783,7 @@ def test_priority_system():
     # Submit tasks in mixed order
     threads = []
     threads.append(threading.Thread(target=lambda: send_command("LIST testuser1")))  # LOW
-    threads.append(threading.Thread(target=lambda: send_command("UPLOAD testuser1 p1.txt 10 /tmp/test_encoding.txt")))  # NORMAL
+    threads.append(threading.Thread(target=lambda: send_upload('testuser1', 'p1.txt', '/tmp/test_encoding.txt')))  # NORMAL
     threads.append(threading.Thread(target=lambda: send_command("SIGNUP priority_user1 pass")))  # HIGH
     threads.append(threading.Thread(target=lambda: send_command("LIST testuser2")))  # LOW
     threads.append(threading.Thread(target=lambda: send_command("LOGIN testuser1 password123")))  # HIGH
@@ -781,6 +1118,12 @@ def main():
         test_file_upload()
         test_file_listing()
         test_file_download()
+        test_resumable_upload()
+        test_quota()
+        test_pipelining()
+        test_binary_protocol()
+        test_stats()
+        test_list_pages()
         test_file_deletion()
         test_concurrent_operations()
         test_encoding_decoding()
@@ -78,6 +78,13 @@ send_command() {
     echo "$cmd" | nc -w 2 127.0.0.1 9090 2>/dev/null || echo "ERR Connection failed"
 }
 
+# Helper function to upload a local file: the data follows the server's READY
+send_upload() {
+    local user="$1" name="$2" file="$3"
+    local size=$(stat -f%z "$file" 2>/dev/null || stat -c%s "$file")
+    { echo "UPLOAD $user $name $size"; sleep 0.2; cat "$file"; } | nc -w 2 127.0.0.1 9090 2>/dev/null | grep -v '^READY' || echo "ERR Connection failed"
+}
+
 # Helper function to wait for server
 wait_for_server() {
     local max_attempts=10
@@ -241,7 +248,7 @@ log_success "Test files created"
 
 log_info "Testing file upload..."
 file_size=$(stat -f%z /tmp/test_upload_1.txt 2>/dev/null || stat -c%s /tmp/test_upload_1.txt)
-response=$(send_command "UPLOAD testuser1 file1.txt $file_size /tmp/test_upload_1.txt")
+response=$(send_upload testuser1 file1.txt /tmp/test_upload_1.txt)
 if echo "$response" | grep -q "OK"; then
     log_success "File upload successful"
 else
@@ -250,7 +257,7 @@ fi
 
 log_info "Uploading multiple files..."
 file_size=$(stat -f%z /tmp/test_upload_2.txt 2>/dev/null || stat -c%s /tmp/test_upload_2.txt)
-response=$(send_command "UPLOAD testuser1 file2.txt $file_size /tmp/test_upload_2.txt")
+response=$(send_upload testuser1 file2.txt /tmp/test_upload_2.txt)
 if echo "$response" | grep -q "OK"; then
     log_success "Second file upload successful"
 else
@@ -259,7 +266,7 @@ fi
 
 log_info "Testing large file upload..."
 file_size=$(stat -f%z /tmp/test_upload_large.txt 2>/dev/null || stat -c%s /tmp/test_upload_large.txt)
-response=$(send_command "UPLOAD testuser1 large.txt $file_size /tmp/test_upload_large.txt")
+response=$(send_upload testuser1 large.txt /tmp/test_upload_large.txt)
 if echo "$response" | grep -q "OK"; then
     log_success "Large file upload successful"
 else
@@ -310,11 +317,11 @@ response=$(send_command "DOWNLOAD testuser1 file1.txt")
 if echo "$response" | grep -q "OK"; then
     log_success "File download initiated successfully"
     
-    # Check if temp file was created (path should be in response)
-    if echo "$response" | grep -q "/tmp/os_lab7_downloads"; then
-        log_success "Download temp file path returned"
+    # The file is streamed on the connection right after the response
+    if echo "$response" | grep -q "^FILE_DATA file1.txt"; then
+        log_success "File data streamed after the response"
     else
-        log_warning "Download temp file path not found in response"
+        log_warning "FILE_DATA header not found in response"
     fi
 else
     log_fail "File download failed: $response"
@@ -392,11 +399,11 @@ echo "Test content for concurrent ops" > /tmp/test_concurrent.txt
 file_size=$(stat -f%z /tmp/test_concurrent.txt 2>/dev/null || stat -c%s /tmp/test_concurrent.txt)
 
 PIDS=""
-(send_command "UPLOAD testuser1 concurrent1.txt $file_size /tmp/test_concurrent.txt" > /dev/null 2>&1) &
+(send_upload testuser1 concurrent1.txt /tmp/test_concurrent.txt > /dev/null 2>&1) &
 PIDS="$PIDS $!"
 (send_command "LIST testuser1" > /dev/null 2>&1) &
 PIDS="$PIDS $!"
-(send_command "UPLOAD testuser1 concurrent2.txt $file_size /tmp/test_concurrent.txt" > /dev/null 2>&1) &
+(send_upload testuser1 concurrent2.txt /tmp/test_concurrent.txt > /dev/null 2>&1) &
 PIDS="$PIDS $!"
 
 for pid in $PIDS; do
@@ -414,7 +421,7 @@ echo "ENCODING_TEST_CONTENT_12345" > /tmp/test_encoding.txt
 file_size=$(stat -f%z /tmp/test_encoding.txt 2>/dev/null || stat -c%s /tmp/test_encoding.txt)
 
 log_info "Uploading file (should be encoded)..."
-response=$(send_command "UPLOAD testuser1 encoded_test.txt $file_size /tmp/test_encoding.txt")
+response=$(send_upload testuser1 encoded_test.txt /tmp/test_encoding.txt)
 if echo "$response" | grep -q "OK"; then
     log_success "File uploaded for encoding test"
 else
@@ -441,18 +448,12 @@ response=$(send_command "DOWNLOAD testuser1 encoded_test.txt")
 if echo "$response" | grep -q "OK"; then
     log_success "File downloaded for decoding test"
     
-    # Extract temp file path from response
-    temp_path=$(echo "$response" | grep -oP '/tmp/os_lab7_downloads/[^ ]+' | head -1)
-    
-    if [ ! -z "$temp_path" ] && [ -f "$temp_path" ]; then
-        decoded_content=$(cat "$temp_path")
-        if [ "$decoded_content" = "ENCODING_TEST_CONTENT_12345" ]; then
-            log_success "File correctly decoded (content matches original)"
-        else
-            log_fail "File decoding failed (content doesn't match)"
-        fi
+    # The body follows the "OK downloaded" and FILE_DATA lines
+    decoded_content=$(echo "$response" | sed -n '3p')
+    if [ "$decoded_content" = "ENCODING_TEST_CONTENT_12345" ]; then
+        log_success "File correctly decoded (content matches original)"
     else
-        log_warning "Could not verify decoding (temp file not found)"
+        log_fail "File decoding failed (content doesn't match)"
     fi
 else
     log_fail "File download for decoding test failed"
@@ -468,7 +469,7 @@ log_info "Submitting tasks with different priorities rapidly..."
 
 # Submit tasks in mixed order - server logs should show priority ordering
 (send_command "LIST testuser1" > /dev/null 2>&1) &        # LOW priority
-(send_command "UPLOAD testuser1 p1.txt 10 /tmp/test_encoding.txt" > /dev/null 2>&1) &  # NORMAL
+(send_upload testuser1 p1.txt /tmp/test_encoding.txt > /dev/null 2>&1) &  # NORMAL
 (send_command "SIGNUP priority_user1 pass" > /dev/null 2>&1) &  # HIGH priority
 (send_command "LIST testuser2" > /dev/null 2>&1) &        # LOW priority
 (send_command "LOGIN testuser1 password123" > /dev/null 2>&1) &  # HIGH priority
@@ -579,7 +580,7 @@ else
 fi
 
 log_info "Testing operations without login..."
-response=$(send_command "UPLOAD testuser99 file.txt 10 /tmp/test.txt")
+response=$(send_upload testuser99 file.txt /tmp/test.txt)
 if echo "$response" | grep -q "ERR"; then
     log_success "Operation without proper auth rejected"
 else